@@ -0,0 +1,37 @@
+--[[
+	pepper - SCM statistics report generator
+	Copyright (C) 2010-present Jonas Gehring
+
+	Released under the GNU General Public License, version 3.
+	Please see the COPYING file in the source distribution for license
+	terms and conditions, or see http://www.gnu.org/licenses/.
+
+	file: benchmark_caches.lua
+	Compares the revision caches on the history of a repository
+--]]
+
+
+-- Describes the report
+function describe(self)
+	local r = {}
+	r.title = "Cache benchmark"
+	r.description = "Compares write and read throughput of the revision caches"
+	r.options = {
+		{"-bARG, --branch=ARG", "Select branch"}
+	}
+	return r
+end
+
+-- Main script function
+function run(self)
+	local repo = self:repository()
+	local branch = self:getopt("b,branch", repo:default_branch())
+	local results = pepper.internal.benchmark_caches(repo, branch)
+
+	print(string.format("%-10s %-10s %10s %10s %14s %12s", "Cache", "Phase", "Revisions",
+		"Time (s)", "Revisions/s", "Size (KiB)"))
+	for _, r in ipairs(results) do
+		print(string.format("%-10s %-10s %10d %10.2f %14.1f %12.1f", r.cache, r.phase, r.revisions,
+			r.seconds, r.rate, r.size / 1024))
+	end
+end
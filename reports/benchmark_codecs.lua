@@ -0,0 +1,37 @@
+--[[
+	pepper - SCM statistics report generator
+	Copyright (C) 2010-present Jonas Gehring
+
+	Released under the GNU General Public License, version 3.
+	Please see the COPYING file in the source distribution for license
+	terms and conditions, or see http://www.gnu.org/licenses/.
+
+	file: benchmark_codecs.lua
+	Compares the compression codecs on the data of the revision cache
+--]]
+
+
+-- Describes the report
+function describe(self)
+	local r = {}
+	r.title = "Codec benchmark"
+	r.description = "Compares compression ratio and speed of the cache codecs"
+	return r
+end
+
+-- Main script function
+function run(self)
+	local repo = self:repository()
+	local results = pepper.internal.benchmark_codecs(repo)
+
+	print(string.format("%-8s %-10s %8s %12s %12s %7s %14s %14s", "Codec", "Column", "Records",
+		"Raw (KiB)", "Size (KiB)", "Ratio", "Comp. (MB/s)", "Decomp. (MB/s)"))
+	for _, r in ipairs(results) do
+		local compress = "-"
+		if r.compress > 0 then
+			compress = string.format("%.1f", r.compress)
+		end
+		print(string.format("%-8s %-10s %8d %12.1f %12.1f %7.2f %14s %14.1f", r.codec, r.column, r.records,
+			r.raw / 1024, r.compressed / 1024, r.ratio, compress, r.decompress))
+	end
+end
@@ -16,7 +16,7 @@ function describe(self)
 	local r = {}
 	r.title = "Cache check"
 	r.description = "Checks and cleans up the revision cache"
-	r.options = {{"-f,--force", "Force clearing of cache if necessary"}}
+	r.options = {{"-f,--force", "Force clearing of cache if its version is unknown"}}
 	return r
 end
 
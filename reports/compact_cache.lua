@@ -0,0 +1,28 @@
+--[[
+	pepper - SCM statistics report generator
+	Copyright (C) 2010-present Jonas Gehring
+
+	Released under the GNU General Public License, version 3.
+	Please see the COPYING file in the source distribution for license
+	terms and conditions, or see http://www.gnu.org/licenses/.
+
+	file: compact_cache.lua
+	Rewrites the revision cache in iteration order
+--]]
+
+
+-- Describes the report
+function describe(self)
+	local r = {}
+	r.title = "Cache compaction"
+	r.description = "Rewrites the revision cache in the iteration order of a branch"
+	r.options = {{"-bARG, --branch=ARG", "Select branch"}}
+	return r
+end
+
+-- Main script function
+function run(self)
+	local repo = self:repository()
+	local branch = self:getopt("b,branch", repo:default_branch())
+	pepper.internal.compact_cache(repo, branch)
+end
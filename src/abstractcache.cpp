@@ -13,77 +13,360 @@
 
 #include "main.h"
 
+#include <algorithm>
+
 #include "bstream.h"
 #include "diffstat.h"
 #include "logger.h"
 #include "options.h"
 #include "revision.h"
+#include "revisioniterator.h"
+#include "revisionlru.h"
 #include "strlib.h"
 #include "utils.h"
 
+#include "syslib/datetime.h"
 #include "syslib/fs.h"
+#include "syslib/parallel.h"
 
 #include "abstractcache.h"
 
+// Number of cached revisions that will be decoded at once
+#define DECODE_WINDOW 256
+// Minimum number of records per decoding thread
+#define DECODE_MIN_CHUNK 16
+
+
+// Decodes a contiguous range of records
+class RecordDecoderThread : public sys::parallel::Thread
+{
+public:
+	RecordDecoderThread(AbstractCache::RecordDecoder *decoder, std::vector<Revision *> *revs, size_t begin, size_t end)
+		: m_decoder(decoder), m_revs(revs), m_begin(begin), m_end(end)
+	{
+	}
+
+	std::string error() const
+	{
+		return m_error;
+	}
+
+protected:
+	void run()
+	{
+		try {
+			for (size_t i = m_begin; i < m_end; i++) {
+				(*m_revs)[i] = m_decoder->decode(i);
+			}
+		} catch (const std::exception &ex) {
+			m_error = ex.what();
+		}
+	}
+
+private:
+	AbstractCache::RecordDecoder *m_decoder;
+	std::vector<Revision *> *m_revs;
+	size_t m_begin, m_end;
+	std::string m_error;
+};
+
 
 // Constructor
-AbstractCache::AbstractCache(Backend *backend, const Options &options)
-	: Backend(options), m_backend(backend)
+AbstractCache::Stats::Stats()
+	: hits(0), misses(0), memoryHits(0), bytesRead(0), bytesWritten(0),
+	  decodeTime(0), indexTime(0), writes(0), writeTime(0)
+{
+}
+
+// Returns the counters by name, with times in milliseconds
+std::map<std::string, double> AbstractCache::Stats::values() const
 {
+	std::map<std::string, double> v;
+	v["hits"] = hits;
+	v["misses"] = misses;
+	v["memory_hits"] = memoryHits;
+	uint64_t requests = hits + misses + memoryHits;
+	v["hit_rate"] = (requests > 0 ? double(hits + memoryHits) / requests : 0.0);
+	v["bytes_read"] = bytesRead;
+	v["bytes_written"] = bytesWritten;
+	v["decode_time"] = decodeTime / 1000.0;
+	v["index_time"] = indexTime / 1000.0;
+	v["writes"] = writes;
+	v["write_time"] = writeTime / 1000.0;
+	v["write_latency"] = (writes > 0 ? writeTime / (1000.0 * writes) : 0.0);
+	return v;
+}
 
+
+// Constructor
+AbstractCache::AbstractCache(Backend *backend, const Options &options)
+	: Backend(options), m_backend(backend), m_stats(std::make_shared<Stats>())
+{
+	size_t budget = options.cacheMemory();
+	if (budget > 0) {
+		m_lru = std::make_shared<RevisionLru>(budget);
+	}
 }
 
 // Destructor
 AbstractCache::~AbstractCache()
 {
-
+	if (m_lru) {
+		PDEBUG << "Cache: " << m_lru->hits() << " hits and " << m_lru->misses() << " misses for decoded revisions, "
+			<< m_lru->count() << " revisions (" << m_lru->size() << " bytes) in memory" << endl;
+	}
+	std::map<std::string, double> v = m_stats->values();
+	if (v["hits"] + v["misses"] + v["memory_hits"] + v["writes"] > 0) {
+		Logger::info() << "Cache: " << v["hits"] << " hits, " << v["misses"] << " misses, " << v["memory_hits"] << " served from memory ("
+			<< str::printf("%.1f", 100.0 * v["hit_rate"]) << "% hit rate)" << endl;
+		Logger::info() << "Cache: Read " << str::printf("%.1f", v["bytes_read"] / 1024.0) << " KiB, decoding took "
+			<< str::printf("%.1f", v["decode_time"]) << " ms, loading the index " << str::printf("%.1f", v["index_time"]) << " ms" << endl;
+		Logger::info() << "Cache: Wrote " << str::printf("%.1f", v["bytes_written"] / 1024.0) << " KiB in " << v["writes"]
+			<< " writes (" << str::printf("%.2f", v["write_latency"]) << " ms average latency)" << endl;
+	}
+	for (std::map<std::string, Revision *>::iterator it = m_decoded.begin(); it != m_decoded.end(); ++it) {
+		delete it->second;
+	}
 }
 
 // Returns a diffstat for the specified revision
 DiffstatPtr AbstractCache::diffstat(const std::string &id)
 {
+	if (m_lru) {
+		DiffstatPtr stat = m_lru->diffstat(id);
+		if (stat) {
+			PTRACE << "Memory hit: " << id << endl;
+			++m_stats->memoryHits;
+			return stat;
+		}
+	}
+
 	if (!lookup(id)) {
 		PTRACE << "Cache miss: " << id << endl;
+		++m_stats->misses;
 		return m_backend->diffstat(id);
 	}
 
 	PTRACE << "Cache hit: " << id << endl;
+	++m_stats->hits;
 	Revision *r = get(id);
 	DiffstatPtr stat = r->diffstat();
 	delete r;
 	return stat;
 }
 
-// Tells the wrapped backend to pre-fetch revisions that are not cached yet
+// Tells the wrapped backend to pre-fetch revisions that are not cached yet.
+// Cached revisions will be decoded in batches once they are requested.
 void AbstractCache::prefetch(const std::vector<std::string> &ids)
 {
+	// Revisions that are still in memory won't be decoded again
+	std::vector<std::string> stored;
+	for (size_t i = 0; i < ids.size(); i++) {
+		if (!m_lru || !m_lru->contains(ids[i])) {
+			stored.push_back(ids[i]);
+		}
+	}
+
+	std::vector<bool> cached = lookupMany(stored);
 	std::vector<std::string> missing;
-	for (unsigned int i = 0; i < ids.size(); i++) {
-		if (!lookup(ids[i])) {
-			missing.push_back(ids[i]);
+	for (unsigned int i = 0; i < stored.size(); i++) {
+		if (!cached[i]) {
+			missing.push_back(stored[i]);
+		} else if (m_prefetchedSet.insert(stored[i]).second) {
+			m_prefetched.push_back(stored[i]);
 		}
 	}
 
-	PDEBUG << "Cache: " << (ids.size() - missing.size()) << " of " << ids.size() << " revisions already cached, prefetching " << missing.size() << endl;
+	PDEBUG << "Cache: " << (ids.size() - stored.size()) << " of " << ids.size() << " revisions in memory, "
+		<< (stored.size() - missing.size()) << " already cached, prefetching " << missing.size() << endl;
 	if (!missing.empty()) {
+		m_fetching.insert(missing.begin(), missing.end());
 		m_backend->prefetch(missing);
 	}
 }
 
-// Returns the revision data for the given ID
+// Returns the revision data for the given ID. Recently used revisions are
+// kept in memory in decoded form.
 Revision *AbstractCache::revision(const std::string &id)
 {
+	if (!m_lru) {
+		return retrieve(id);
+	}
+
+	// Revisions that are being prefetched by the backend must be consumed
+	if (m_fetching.find(id) == m_fetching.end()) {
+		Revision *r = m_lru->get(id);
+		if (r != NULL) {
+			PTRACE << "Memory hit: " << id << endl;
+			++m_stats->memoryHits;
+			return r;
+		}
+	}
+	return m_lru->put(retrieve(id));
+}
+
+// Loads the revision data for the given ID from the cache or the backend
+Revision *AbstractCache::retrieve(const std::string &id)
+{
+	std::map<std::string, Revision *>::iterator it = m_decoded.find(id);
+	if (it == m_decoded.end() && m_prefetchedSet.find(id) != m_prefetchedSet.end()) {
+		// Decode the next prefetched revisions at once. Revisions that have
+		// been skipped will be loaded separately if requested later on.
+		while (m_prefetched.front() != id) {
+			m_prefetchedSet.erase(m_prefetched.front());
+			m_prefetched.pop_front();
+		}
+		std::vector<std::string> window;
+		while (!m_prefetched.empty() && window.size() < DECODE_WINDOW) {
+			window.push_back(m_prefetched.front());
+			m_prefetchedSet.erase(m_prefetched.front());
+			m_prefetched.pop_front();
+		}
+
+		PTRACE << "Decoding " << window.size() << " cached revisions" << endl;
+		std::vector<Revision *> revs = getMany(window);
+		for (size_t i = 0; i < window.size(); i++) {
+			m_decoded[window[i]] = revs[i];
+		}
+		it = m_decoded.find(id);
+	}
+	if (it != m_decoded.end()) {
+		PTRACE << "Cache hit: " << id << endl;
+		++m_stats->hits;
+		Revision *r = it->second;
+		m_decoded.erase(it);
+		return r;
+	}
+
+	// Revisions that are being prefetched by the backend are always taken
+	// from there, even if another process has cached them in the meantime.
+	// Otherwise, the backend may keep waiting for them to be consumed.
+	if (m_fetching.erase(id) > 0) {
+		PTRACE << "Cache miss: " << id << endl;
+		++m_stats->misses;
+		Revision *r = m_backend->revision(id);
+		if (!lookup(id)) {
+			put(id, *r);
+		}
+		return r;
+	}
+
 	if (!lookup(id)) {
 		PTRACE << "Cache miss: " << id << endl;
+		++m_stats->misses;
 		Revision *r = m_backend->revision(id);
 		put(id, *r);
 		return r;
 	}
 
 	PTRACE << "Cache hit: " << id << endl;
+	++m_stats->hits;
 	return get(id);
 }
 
+// Fetches all revisions of the given branches (or the main branch) that are
+// not cached yet, without decoding the cached ones. There's no report
+// consuming the revisions, so the backend can prefetch at full speed.
+// Revisions are written to the cache as they arrive, so an interrupted
+// warm-up will continue where it stopped when being run again.
+void AbstractCache::warm(const std::vector<std::string> &branches)
+{
+	sys::datetime::Watch watch;
+	std::vector<std::string> names = branches;
+	if (names.empty()) {
+		names.push_back(mainBranch());
+	}
+
+	// Revisions shared by several branches are fetched once
+	Logger::status() << "Reading history... " << ::flush;
+	std::vector<std::string> ids;
+	std::set<std::string> seen;
+	for (size_t i = 0; i < names.size(); i++) {
+		RevisionIterator it(this, names[i], -1, -1, RevisionIterator::Flags(0));
+		while (!it.atEnd()) {
+			std::string id = it.next();
+			if (seen.insert(id).second) {
+				ids.push_back(id);
+			}
+		}
+	}
+	Logger::status() << "done" << endl;
+
+	std::vector<bool> cached = lookupMany(ids);
+	std::vector<std::string> missing;
+	for (size_t i = 0; i < ids.size(); i++) {
+		if (!cached[i]) {
+			missing.push_back(ids[i]);
+		}
+	}
+	Logger::info() << "Cache: " << ids.size() << " revisions, "
+		<< (ids.size() - missing.size()) << " already cached" << endl;
+	if (missing.empty()) {
+		Logger::status() << "Cache: All " << ids.size() << " revisions are cached" << endl;
+		return;
+	}
+
+	sys::datetime::Watch fetchWatch;
+	m_backend->prefetch(missing);
+	int progress = -1;
+	for (size_t i = 0; i < missing.size(); i++) {
+		Revision *r = m_backend->revision(missing[i]);
+		++m_stats->misses;
+		try {
+			// Another process may have cached the revision in the meantime
+			if (!lookup(missing[i])) {
+				put(missing[i], *r);
+			}
+		} catch (...) {
+			delete r;
+			throw;
+		}
+		delete r;
+
+		if (progress != int(100.0f * (i + 1) / missing.size())) {
+			progress = int(100.0f * (i + 1) / missing.size());
+			Logger::status() << "\r\033[0K";
+			Logger::status() << "Fetching revisions... " << progress << "%" << ::flush;
+		}
+	}
+	Logger::status() << "\r\033[0K";
+	Logger::status() << "Fetching revisions... done" << endl;
+	m_backend->finalize();
+	flush();
+
+	float secs = std::max(fetchWatch.elapsed(), 0.001f);
+	Logger::status() << "Cache: Fetched " << missing.size() << " of " << ids.size() << " revisions in "
+		<< str::printf("%.1f", secs) << " s (" << str::printf("%.1f", missing.size() / secs) << " revisions/s), "
+		<< watch.elapsedMSecs() << " ms in total" << endl;
+}
+
+// Checks whether the given revisions are cached
+std::vector<bool> AbstractCache::lookupMany(const std::vector<std::string> &ids)
+{
+	std::vector<bool> cached(ids.size());
+	for (size_t i = 0; i < ids.size(); i++) {
+		cached[i] = lookup(ids[i]);
+	}
+	return cached;
+}
+
+// Loads the given revisions from the cache, in the order of the given IDs
+std::vector<Revision *> AbstractCache::getMany(const std::vector<std::string> &ids)
+{
+	std::vector<Revision *> revs;
+	try {
+		for (size_t i = 0; i < ids.size(); i++) {
+			revs.push_back(get(ids[i]));
+		}
+	} catch (...) {
+		for (size_t i = 0; i < revs.size(); i++) {
+			delete revs[i];
+		}
+		throw;
+	}
+	return revs;
+}
+
 // Returns the full path for a cache file for the given backend
 std::string AbstractCache::cacheFile(Backend *backend, const std::string &name)
 {
@@ -98,6 +381,50 @@ std::string AbstractCache::cacheDir()
 	return m_opts.cacheDir() + "/" + uuid();
 }
 
+// Decodes the records 0 to n-1
+std::vector<Revision *> AbstractCache::RecordDecoder::decodeAll(size_t n)
+{
+	std::vector<Revision *> revs(n, (Revision *)NULL);
+	size_t nthreads = std::min((size_t)std::max(1, sys::parallel::idealThreadCount()), n / DECODE_MIN_CHUNK);
+	if (nthreads <= 1) {
+		try {
+			for (size_t i = 0; i < n; i++) {
+				revs[i] = decode(i);
+			}
+		} catch (...) {
+			for (size_t i = 0; i < n; i++) {
+				delete revs[i];
+			}
+			throw;
+		}
+		return revs;
+	}
+
+	// Let each thread decode a contiguous range, so records are
+	// still read sequentially
+	std::vector<RecordDecoderThread *> threads;
+	for (size_t i = 0; i < nthreads; i++) {
+		threads.push_back(new RecordDecoderThread(this, &revs, (n * i) / nthreads, (n * (i+1)) / nthreads));
+		threads.back()->start();
+	}
+	std::string error;
+	for (size_t i = 0; i < nthreads; i++) {
+		threads[i]->wait();
+		if (error.empty()) {
+			error = threads[i]->error();
+		}
+		delete threads[i];
+	}
+
+	if (!error.empty()) {
+		for (size_t i = 0; i < n; i++) {
+			delete revs[i];
+		}
+		throw PEX(error);
+	}
+	return revs;
+}
+
 // Ensures that the cache dir is writable and exists
 void AbstractCache::checkDir(const std::string &path, bool *created)
 {
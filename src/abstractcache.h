@@ -15,14 +15,24 @@
 #define ABSTRACTCACHE_H_
 
 
+#include <atomic>
+#include <deque>
+#include <map>
+#include <memory>
+#include <set>
+
 #include "backend.h"
 
 class Revision;
+class RevisionLru;
 
 
 // This cache should be transparent and inherits the wrapped class
 class AbstractCache : public Backend
 {
+	friend class CacheArchive; // For exporting and importing revisions
+	friend class CacheDaemon; // For serving cached revisions
+
 	public:
 		AbstractCache(Backend *backend, const Options &options);
 		virtual ~AbstractCache();
@@ -50,8 +60,30 @@ class AbstractCache : public Backend
 
 		static std::string cacheFile(Backend *backend, const std::string &name);
 
+		// Counters describing the cache behaviour. Some of them are updated
+		// by decoding and writing threads, so all of them are atomic. Times
+		// are in microseconds.
+		struct Stats
+		{
+			std::atomic<uint64_t> hits, misses, memoryHits;
+			std::atomic<uint64_t> bytesRead, bytesWritten;
+			std::atomic<uint64_t> decodeTime; // Decompressing and decoding records
+			std::atomic<uint64_t> indexTime; // Loading the index
+			std::atomic<uint64_t> writes, writeTime;
+
+			Stats();
+
+			std::map<std::string, double> values() const;
+		};
+
+		const Stats &stats() const { return *m_stats; }
+
+		void warm(const std::vector<std::string> &branches);
+
 		virtual void flush() = 0;
 		virtual void check(bool force = false) = 0;
+		virtual void compact(const std::string &branch = std::string()) = 0;
+		virtual void merge(const std::vector<std::string> &dirs) = 0;
 
 	protected:
 		std::string cacheDir();
@@ -60,11 +92,38 @@ class AbstractCache : public Backend
 		virtual void put(const std::string &id, const Revision &rev) = 0;
 		virtual Revision *get(const std::string &id) = 0;
 
+		virtual std::vector<bool> lookupMany(const std::vector<std::string> &ids);
+		virtual std::vector<Revision *> getMany(const std::vector<std::string> &ids);
+		virtual std::vector<std::string> cachedIds() = 0;
+
 		static void checkDir(const std::string &path, bool *created = NULL);
 
+	private:
+		Revision *retrieve(const std::string &id);
+
+	public:
+		// Decodes a batch of cached records, using multiple threads
+		// for larger batches
+		class RecordDecoder
+		{
+			public:
+				virtual ~RecordDecoder() { }
+
+				std::vector<Revision *> decodeAll(size_t n);
+				virtual Revision *decode(size_t i) = 0;
+		};
+
 	protected:
 		Backend *m_backend;
 		std::string m_uuid; // Cached backend UUID
+		std::shared_ptr<Stats> m_stats; // Shared with revision loaders
+
+	private:
+		std::deque<std::string> m_prefetched;
+		std::set<std::string> m_prefetchedSet;
+		std::set<std::string> m_fetching; // Prefetched by the backend
+		std::map<std::string, Revision *> m_decoded;
+		std::shared_ptr<RevisionLru> m_lru; // Recently used revisions
 };
 
 
@@ -13,7 +13,10 @@
 
 #include "main.h"
 
+#include <memory>
+
 #include "options.h"
+#include "revision.h"
 
 #include "backend.h"
 
@@ -125,6 +128,22 @@ void Backend::prefetch(const std::vector<std::string> &)
 	// The default implementation does nothing
 }
 
+// Returns the date of the given revision. The default implementation
+// fetches the whole revision.
+int64_t Backend::date(const std::string &id)
+{
+	std::unique_ptr<Revision> rev(revision(id));
+	return rev->date();
+}
+
+// Returns the dates of all revisions that can be determined at once, e.g.
+// using a single call to an external program. The default implementation
+// returns an empty map, so date() will be used for every revision.
+std::map<std::string, int64_t> Backend::dates()
+{
+	return std::map<std::string, int64_t>();
+}
+
 // Optional diffstat filtering before it is presented to the report script
 void Backend::filterDiffstat(DiffstatPtr)
 {
@@ -16,6 +16,7 @@
 
 
 #include <iostream>
+#include <map>
 #include <queue>
 #include <string>
 #include <vector>
@@ -75,6 +76,8 @@ class Backend
 		virtual LogIterator *iterator(const std::string &branch = std::string(), int64_t start = -1, int64_t end = -1) = 0;
 		virtual void prefetch(const std::vector<std::string> &ids);
 		virtual Revision *revision(const std::string &id) = 0;
+		virtual int64_t date(const std::string &id);
+		virtual std::map<std::string, int64_t> dates();
 		virtual void finalize();
 
 		const Options &options() const;
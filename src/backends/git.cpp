@@ -164,14 +164,9 @@ public:
 			throw PEX(str::printf("Unable to parse commit date from line: %s", header[line].c_str()));
 		}
 		size_t pos2 = header[line].find_last_of(' ', pos - 1);
-		if (pos2 == std::string::npos || !str::str2int(header[line].substr(pos2, pos - pos2), &(dest->date), 10)) {
+		if (pos2 == std::string::npos || !parseDate(header[line].substr(pos2+1), &(dest->date))) {
 			throw PEX(str::printf("Unable to parse commit date from line: %s", header[line].c_str()));
 		}
-		int64_t offset_hr = 0, offset_min = 0;
-		if (!str::str2int(header[line].substr(pos+1, 3), &offset_hr, 10) || !str::str2int(header[line].substr(pos+4, 2), &offset_min, 10)) {
-			throw PEX(str::printf("Unable to parse commit date from line: %s", header[line].c_str()));
-		}
-		dest->date += offset_hr * 60 * 60 + offset_min * 60;
 
 		// Commit message
 		dest->message.clear();
@@ -185,6 +180,22 @@ public:
 		}
 	}
 
+	// Parses a commit date given as "$SECONDS ... $TIMEZONE_OFFSET", adding
+	// the offset to the date
+	static bool parseDate(const std::string &str, int64_t *date)
+	{
+		size_t pos = str.find(' '), pos2 = str.find_last_of(' ');
+		int64_t offset_hr = 0, offset_min = 0;
+		if (pos == std::string::npos || !str::str2int(str.substr(0, pos), date, 10)) {
+			return false;
+		}
+		if (!str::str2int(str.substr(pos2+1, 3), &offset_hr, 10) || !str::str2int(str.substr(pos2+4, 2), &offset_min, 10)) {
+			return false;
+		}
+		*date += offset_hr * 60 * 60 + offset_min * 60;
+		return true;
+	}
+
 	static void metaData(const std::string &gitpath, const std::string &id, Data *dest)
 	{
 		int ret;
@@ -697,7 +708,9 @@ Backend::LogIterator *GitBackend::iterator(const std::string &branch, int64_t st
 void GitBackend::prefetch(const std::vector<std::string> &ids)
 {
 	if (m_prefetcher == NULL) {
-		m_prefetcher = new GitRevisionPrefetcher(m_gitpath);
+		// When warming up the cache, there's no report competing for the CPU
+		int nthreads = (m_opts.warmCacheRequested() ? sys::parallel::idealThreadCount() : -1);
+		m_prefetcher = new GitRevisionPrefetcher(m_gitpath, nthreads);
 	}
 	m_prefetcher->prefetch(ids);
 	PDEBUG << "Started prefetching " << ids.size() << " revisions" << endl;
@@ -744,6 +757,45 @@ Revision *GitBackend::revision(const std::string &id)
 #endif
 }
 
+// Returns the commit date of the given revision, without computing its
+// diffstat
+int64_t GitBackend::date(const std::string &id)
+{
+	GitMetaDataThread::Data data;
+	GitMetaDataThread::metaData(m_gitpath, utils::childId(id), &data);
+	return data.date;
+}
+
+// Returns the commit dates of all revisions that are reachable from any
+// reference, using a single call to git-rev-list
+std::map<std::string, int64_t> GitBackend::dates()
+{
+	std::map<std::string, int64_t> dates;
+	sys::io::PopenStreambuf buf((m_gitpath+"/git-rev-list").c_str(), "--all", "--pretty=format:%ct %ci");
+	std::istream in(&buf);
+
+	// Every commit is listed as "commit $ID_HASH", followed by its date
+	std::string str, id;
+	while (std::getline(in, str)) {
+		if (!str.compare(0, 7, "commit ")) {
+			id = str.substr(7);
+			continue;
+		}
+		int64_t date;
+		if (id.empty() || !GitMetaDataThread::parseDate(str, &date)) {
+			throw PEX(str::printf("Unable to parse commit date from line: %s", str.c_str()));
+		}
+		dates[id] = date;
+		id.clear();
+	}
+
+	int ret = buf.close();
+	if (ret != 0) {
+		throw PEX(str::printf("Unable to retrieve commit dates (%d)", ret));
+	}
+	return dates;
+}
+
 // Handle cleanup of diffstat scheduler
 void GitBackend::finalize()
 {
@@ -44,6 +44,8 @@ class GitBackend : public Backend
 		LogIterator *iterator(const std::string &branch = std::string(), int64_t start = -1, int64_t end = -1);
 		void prefetch(const std::vector<std::string> &ids);
 		Revision *revision(const std::string &id);
+		int64_t date(const std::string &id);
+		std::map<std::string, int64_t> dates();
 		void finalize();
 
 	private:
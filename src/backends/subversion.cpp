@@ -1072,9 +1072,10 @@ void SubversionBackend::prefetch(const std::vector<std::string> &ids)
 			return;
 		}
 
-		// Don't use that many threads for local repositories
+		// Don't use that many threads for local repositories, unless the
+		// cache is being warmed up
 		if (!strncmp(d->url, "file://", strlen("file://"))) {
-			nthreads = std::max(1, sys::parallel::idealThreadCount() / 2);
+			nthreads = std::max(1, sys::parallel::idealThreadCount() / (m_opts.warmCacheRequested() ? 1 : 2));
 		}
 		m_prefetcher = new SvnDiffstatPrefetcher(d, nthreads);
 	}
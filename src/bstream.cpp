@@ -13,6 +13,7 @@
 
 #include "main.h"
 
+#include <algorithm>
 #include <cstring>
 
 #ifdef HAVE_LIBZ
@@ -21,51 +22,107 @@
 
 #include "bstream.h"
 
+// Size of the read buffer for files
+#define FILE_BUFFER_SIZE 65536
 
-// RawStream implementation for cstdio
+
+// RawStream implementation for cstdio. Data is read in large blocks, so
+// decoding doesn't require a library call per field.
 class FileStream : public BStream::RawStream
 {
 public:
-	FileStream(FILE *f) : f(f) { }
+	FileStream(FILE *f) : f(f), rp(0), rn(0), reof(false) { }
 	~FileStream() { if (f) fclose(f); }
 
 	bool ok() const {
 		return !(f == NULL || ferror(f) != 0);
 	}
 	bool eof() const {
-		return feof(f);
+		// Like feof(), this is only set after trying to read past the end
+		return reof;
 	}
 	size_t tell() const {
-		return ftell(f);
+		return ftell(f) - (rn - rp);
 	}
 	bool seek(size_t offset) {
+		rp = rn = 0;
+		reof = false;
 		return (fseek(f, offset, SEEK_SET) >= 0);
 	}
 	ssize_t read(void *ptr, size_t n) {
-		if (feof(f)) {
-			return 0;
+		size_t nr = std::min(n, rn - rp);
+		if (nr > 0) {
+			memcpy(ptr, &rbuffer[rp], nr);
+			rp += nr;
 		}
-		return fread(ptr, 1, n, f);
+		if (nr < n) {
+			// Read large blocks directly
+			if (n - nr >= FILE_BUFFER_SIZE) {
+				nr += fread((char *)ptr + nr, 1, n - nr, f);
+			} else if (fill()) {
+				size_t k = std::min(n - nr, rn);
+				memcpy((char *)ptr + nr, &rbuffer[0], k);
+				rp = k;
+				nr += k;
+			}
+			reof = (nr < n);
+		}
+		return nr;
 	}
 	ssize_t write(const void *ptr, size_t n) {
 		return fwrite(ptr, 1, n, f);
 	}
+	bool flush() {
+		return (fflush(f) == 0);
+	}
+
+	const char *peek(size_t *n) {
+		if (rp == rn && !fill()) {
+			reof = true;
+		}
+		*n = rn - rp;
+		return (rbuffer.empty() ? "" : &rbuffer[rp]);
+	}
+	void consume(size_t n) {
+		rp += n;
+	}
+
+	// Reads the next block into the buffer
+	bool fill() {
+		rp = rn = 0;
+		if (feof(f)) {
+			return false;
+		}
+		if (rbuffer.empty()) {
+			rbuffer.resize(FILE_BUFFER_SIZE);
+		}
+		rn = fread(&rbuffer[0], 1, rbuffer.size(), f);
+		return (rn > 0);
+	}
 
 	FILE *f;
+	std::vector<char> rbuffer;
+	size_t rp, rn;
+	bool reof;
 };
 
-// RawStream implementation for memory buffers
+// RawStream implementation for memory buffers. Input streams may refer to
+// external buffers without copying them.
 class MemoryStream : public BStream::RawStream
 {
 public:
-	MemoryStream() : p(0), size(0), asize(512) {
+	MemoryStream() : p(0), size(0), asize(512), owner(true) {
 		m_buffer = new char[asize];
 	}
-	MemoryStream(const char *data, size_t n) : p(0), size(n) {
-		m_buffer = new char[n];
-		memcpy(m_buffer, data, n);
+	MemoryStream(const char *data, size_t n, bool copy = true) : p(0), size(n), asize(n), owner(copy) {
+		if (copy) {
+			m_buffer = new char[n];
+			memcpy(m_buffer, data, n);
+		} else {
+			m_buffer = const_cast<char *>(data);
+		}
 	}
-	~MemoryStream() { delete[] m_buffer;} 
+	~MemoryStream() { if (owner) delete[] m_buffer; }
 
 	bool ok() const {
 		return true;
@@ -93,6 +150,9 @@ public:
 		return nr;
 	}
 	ssize_t write(const void *ptr, size_t n) {
+		if (!owner) {
+			return -1;
+		}
 		if (p + n >= asize) {
 			size_t oldsize = size;
 			do {
@@ -109,8 +169,17 @@ public:
 		return n;
 	}
 
+	const char *peek(size_t *n) {
+		*n = size - p;
+		return m_buffer + p;
+	}
+	void consume(size_t n) {
+		p += n;
+	}
+
 	char *m_buffer;
 	size_t p, size, asize;
+	bool owner;
 };
 
 #ifdef HAVE_LIBZ
@@ -177,6 +246,11 @@ BOStream::BOStream(const std::string &path, bool append)
 {
 }
 
+BOStream::BOStream(FILE *f)
+	: BStream(new FileStream(f))
+{
+}
+
 BOStream::BOStream(RawStream *stream)
 	: BStream(stream)
 {
@@ -192,6 +266,16 @@ MIStream::MIStream(const std::vector<char> &data)
 {
 }
 
+VIStream::VIStream(const char *data, size_t n)
+	: BIStream(new MemoryStream(data, n, false))
+{
+}
+
+VIStream::VIStream(const std::vector<char> &data)
+	: BIStream(new MemoryStream(data.empty() ? NULL : &data[0], data.size(), false))
+{
+}
+
 MOStream::MOStream()
 	: BOStream(new MemoryStream())
 {
@@ -204,6 +288,58 @@ std::vector<char> MOStream::data() const
 	return std::vector<char>(ms->m_buffer, ms->m_buffer + ms->size);
 }
 
+// Reads a NUL-terminated string from an unbuffered stream
+BIStream &BIStream::readString(std::string &s)
+{
+	char buffer[120], *bptr = buffer;
+	char c;
+	s.clear();
+	do {
+		if (eof()) {
+			s.clear();
+			return *this;
+		}
+		(*this) >> c;
+		switch (c) {
+			case 0: break;
+			default: {
+				*bptr = c;
+				if (bptr-buffer == sizeof(buffer)-1) {
+					s.append(buffer, sizeof(buffer));
+					bptr = buffer;
+				} else {
+					++bptr;
+				}
+				continue;
+			}
+		}
+		break;
+	} while (true);
+
+	if (bptr != buffer) {
+		s.append(buffer, bptr-buffer);
+	}
+	return *this;
+}
+
+// Reads a variable-length integer byte by byte
+BIStream &BIStream::readVarintSlow(uint64_t &i)
+{
+	i = 0;
+	unsigned char c;
+	for (int shift = 0; shift < 70; shift += 7) {
+		if (read(&c, 1) != 1) {
+			i = 0;
+			break;
+		}
+		i |= (uint64_t)(c & 0x7F) << shift;
+		if (!(c & 0x80)) {
+			break;
+		}
+	}
+	return *this;
+}
+
 
 // Constructors
 GZIStream::GZIStream(const std::string &path)
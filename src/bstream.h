@@ -17,6 +17,7 @@
 
 #include <cassert>
 #include <cstdio>
+#include <cstring>
 #include <string>
 #include <vector>
 
@@ -51,6 +52,12 @@ class BStream
 				virtual bool seek(size_t offset) = 0;
 				virtual ssize_t read(void *ptr, size_t n) = 0;
 				virtual ssize_t write(const void *ptr, size_t n) = 0;
+				virtual bool flush() { return true; }
+
+				// Buffered streams return the data that can be read without
+				// copying. At the end of the stream, *n will be 0.
+				virtual const char *peek(size_t *n) { *n = 0; return NULL; }
+				virtual void consume(size_t n) { (void)n; }
 		};
 
 		BStream(RawStream *stream) : m_stream(stream) { }
@@ -62,6 +69,7 @@ class BStream
 		inline bool seek(size_t offset) { return (m_stream ? m_stream->seek(offset) : false); }
 		inline ssize_t read(void *ptr, size_t n) { return (m_stream ? m_stream->read(ptr, n) : 0); }
 		inline ssize_t write(const void *ptr, size_t n) { return (m_stream ? m_stream->write(ptr, n) : 0); }
+		inline bool flush() { return (m_stream ? m_stream->flush() : false); }
 
 		// Byte swapping (from Qt)
 		static inline uint32_t bswap(uint32_t source) {
@@ -78,6 +86,15 @@ class BStream
 			return source;
 		}
 
+		// ZigZag encoding of signed integers, so that values of small
+		// magnitude result in short varints
+		static inline uint64_t zigzag(int64_t i) {
+			return ((uint64_t)i << 1) ^ (uint64_t)(i >> 63);
+		}
+		static inline int64_t unzigzag(uint64_t i) {
+			return (int64_t)(i >> 1) ^ -(int64_t)(i & 1);
+		}
+
 	protected:
 		RawStream *m_stream;
 };
@@ -105,8 +122,16 @@ class BIStream : public BStream
 			return *this;
 		}
 
+		// LEB128 variable-length integers
+		BIStream &readVarint(uint64_t &i);
+		inline BIStream &readVarint(uint32_t &i) { uint64_t v; readVarint(v); i = (uint32_t)v; return *this; }
+
 	protected:
 		BIStream(RawStream *stream);
+
+	private:
+		BIStream &readString(std::string &s);
+		BIStream &readVarintSlow(uint64_t &i);
 };
 
 // Output stream
@@ -130,6 +155,9 @@ class BOStream : public BStream
 			return *this;
 		}
 
+		// LEB128 variable-length integers
+		BOStream &writeVarint(uint64_t i);
+
 	protected:
 		BOStream(RawStream *stream);
 };
@@ -142,6 +170,15 @@ class MIStream : public BIStream
 		MIStream(const std::vector<char> &data);
 };
 
+// Memory input stream reading from an external buffer without copying it,
+// e.g. from a memory-mapped file. The buffer must outlive the stream.
+class VIStream : public BIStream
+{
+	public:
+		VIStream(const char *data, size_t n);
+		VIStream(const std::vector<char> &data);
+};
+
 // Memory output stream
 class MOStream : public BOStream
 {
@@ -199,6 +236,18 @@ inline BOStream &BOStream::operator<<(const std::vector<char> &v) {
 	return *this;
 }
 
+inline BOStream &BOStream::writeVarint(uint64_t i) {
+	char buffer[10];
+	size_t n = 0;
+	while (i >= 0x80) {
+		buffer[n++] = char((i & 0x7F) | 0x80);
+		i >>= 7;
+	}
+	buffer[n++] = char(i);
+	ASSERT_WRITE(buffer, n);
+	return *this;
+}
+
 inline BIStream &BIStream::operator>>(char &c) {
 	ASSERT_READ((char *)&c, 1);
 	return *this;
@@ -221,34 +270,26 @@ inline BIStream &BIStream::operator>>(uint64_t &i) {
 }
 
 inline BIStream &BIStream::operator>>(std::string &s) {
-	char buffer[120], *bptr = buffer;
-	char c;
+	size_t n;
+	const char *p = (m_stream ? m_stream->peek(&n) : NULL);
+	if (p == NULL) {
+		return readString(s);
+	}
+
+	// Search the buffered data for the terminating NUL character
 	s.clear();
-	do {
-		if (eof()) {
-			s.clear();
+	while (n > 0) {
+		const char *end = (const char *)memchr(p, 0, n);
+		if (end != NULL) {
+			s.append(p, end - p);
+			m_stream->consume(end - p + 1);
 			return *this;
 		}
-		(*this) >> c;
-		switch (c) {
-			case 0: break;
-			default: {
-				*bptr = c;
-				if (bptr-buffer == sizeof(buffer)-1) {
-					s.append(buffer, sizeof(buffer));
-					bptr = buffer;
-				} else {
-					++bptr;
-				}
-				continue;
-			}
-		}
-		break;
-	} while (true);
-
-	if (bptr != buffer) {
-		s.append(buffer, bptr-buffer);
+		s.append(p, n);
+		m_stream->consume(n);
+		p = m_stream->peek(&n);
 	}
+	s.clear();
 	return *this;
 }
 
@@ -260,5 +301,30 @@ inline BIStream &BIStream::operator>>(std::vector<char> &v) {
 	return *this;
 }
 
+inline BIStream &BIStream::readVarint(uint64_t &i) {
+	size_t n;
+	const unsigned char *p = (const unsigned char *)(m_stream ? m_stream->peek(&n) : NULL);
+	if (p == NULL) {
+		return readVarintSlow(i);
+	}
+
+	// Decode directly from the buffered data
+	size_t max = (n < 10 ? n : 10);
+	i = 0;
+	for (size_t k = 0; k < max; k++) {
+		i |= (uint64_t)(p[k] & 0x7F) << (7 * k);
+		if (!(p[k] & 0x80)) {
+			m_stream->consume(k + 1);
+			return *this;
+		}
+	}
+	if (n >= 10) {
+		// Overlong encoding
+		m_stream->consume(10);
+		return *this;
+	}
+	return readVarintSlow(i);
+}
+
 
 #endif // BSTREAM_H_
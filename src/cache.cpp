@@ -13,31 +13,792 @@
 
 #include "main.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cstring>
+#include <deque>
 #include <fcntl.h>
+#include <set>
+#include <signal.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include "bstream.h"
+#include "cacheindex.h"
+#include "checksum.h"
+#include "codec.h"
 #include "logger.h"
 #include "options.h"
 #include "revision.h"
+#include "revisioniterator.h"
 #include "strlib.h"
 #include "utils.h"
 
 #include "syslib/datetime.h"
 #include "syslib/fs.h"
+#include "syslib/parallel.h"
 #include "syslib/sigblock.h"
 
 #include "cache.h"
 
-#define CACHE_VERSION (uint32_t)5
+#define CACHE_VERSION (uint32_t)10
 #define MAX_CACHEFILE_SIZE 4194304
 
+// Maximum number of records waiting to be written in the background
+#define PIPELINE_CAPACITY 256
+// Maximum number of records that are appended to the cache at once
+#define PIPELINE_BATCH 64
+// Maximum number of records that are converted at once during a migration
+#define MIGRATION_BATCH 256
+// Version of the migration state file format
+#define MIGRATION_FORMAT (uint32_t)1
+
+// First cache version that stores revisions in separate column files
+#define COLUMNS_VERSION (uint32_t)6
+// First cache version that stores authors and paths in the dictionary
+#define DICTIONARY_VERSION (uint32_t)7
+// First cache version that uses CRC32C checksums
+#define CRC32C_VERSION (uint32_t)9
+// First cache version that stores record heads and diffstats using
+// variable-length integers
+#define COMPACT_VERSION (uint32_t)10
+
+
+// A cached revision, split into columns. The message and diffstat are stored
+// compressed in separate files, so reports that don't use them won't have to
+// read or decompress them. Since version 8, they may use any codec; older
+// versions always use zlib. The author and all paths are stored as IDs in the
+// string dictionary of the cache. Since COMPACT_VERSION, diffstats use the
+// compact format.
+struct ColumnRecord
+{
+	int64_t date;
+	uint32_t author;
+	uint32_t strings; // Minimum size of the dictionary
+	std::vector<char> message;
+	std::vector<char> diffstat;
+};
+
+// Record in the head file of a segment, pointing to the other columns. The
+// checksums are CRC32C since CRC32C_VERSION and CRC32 before. All other
+// fields are variable-length integers since COMPACT_VERSION.
+struct RecordHead
+{
+	int64_t date;
+	uint32_t author, strings;
+	std::string authorName; // Prior to DICTIONARY_VERSION
+	uint32_t msgOffset, msgSize, msgCrc;
+	uint32_t statOffset, statSize, statCrc;
+
+	void write(BOStream &out) const
+	{
+		out.writeVarint(BStream::zigzag(date)).writeVarint(author).writeVarint(strings);
+		out.writeVarint(msgOffset).writeVarint(msgSize) << msgCrc;
+		out.writeVarint(statOffset).writeVarint(statSize) << statCrc;
+	}
+
+	bool load(BIStream &in, uint32_t version)
+	{
+		if (version >= COMPACT_VERSION) {
+			uint64_t zdate;
+			in.readVarint(zdate).readVarint(author).readVarint(strings);
+			in.readVarint(msgOffset).readVarint(msgSize) >> msgCrc;
+			in.readVarint(statOffset).readVarint(statSize) >> statCrc;
+			date = BStream::unzigzag(zdate);
+			return in.ok();
+		}
+
+		in >> date;
+		if (version < DICTIONARY_VERSION) {
+			in >> authorName;
+			author = strings = 0;
+		} else {
+			in >> author >> strings;
+		}
+		in >> msgOffset >> msgSize >> msgCrc;
+		in >> statOffset >> statSize >> statCrc;
+		return in.ok();
+	}
+};
+
+
+// Returns the checksum of a record or column, using the algorithm of the
+// given cache version
+static inline uint32_t recordChecksum(uint32_t version, const char *data, size_t len)
+{
+	return checksum::compute(version < CRC32C_VERSION ? checksum::Crc32 : checksum::Crc32c, data, len);
+}
+
+static inline uint32_t recordChecksum(const std::vector<char> &data)
+{
+	return recordChecksum(CACHE_VERSION, &data[0], data.size());
+}
+
+// Returns the path of a cache file
+static std::string columnPath(const std::string &dir, uint32_t index, int column)
+{
+	static const char *suffixes[] = {"", ".msg", ".diff"};
+	return str::printf("%s/cache.%u%s", dir.c_str(), index, suffixes[column]);
+}
+
+// Parses the segment index from the name of a cache file
+static bool parseColumnPath(const std::string &name, uint32_t *index)
+{
+	if (name.compare(0, 6, "cache.") != 0) {
+		return false;
+	}
+	return str::stoi(name.substr(6, name.find('.', 6) - 6), index, 10);
+}
+
+// Reads the state of an unfinished migration from the given cache version.
+// The state file is written when a migration starts and removed once all
+// records have been converted. Converted records are appended to new
+// segments, starting with the one given in the state file. Returns 0 if
+// there's no migration.
+//
+//    migration: "PMIG" <format> <previous cache version> <first new segment>
+uint32_t Cache::readMigration(const std::string &dir, uint32_t version)
+{
+	std::string path = dir + "/migration";
+	if (version >= CACHE_VERSION || !sys::fs::fileExists(path)) {
+		return 0;
+	}
+
+	BIStream in(path);
+	char magic[4];
+	uint32_t format, from, segment;
+	in.read(magic, 4);
+	in >> format >> from >> segment;
+	if (!in.ok() || memcmp(magic, "PMIG", 4) != 0 || format != MIGRATION_FORMAT || from != version || segment == 0) {
+		throw PEX(str::printf("Invalid cache migration file: %s", path.c_str()));
+	}
+	return segment;
+}
+
+// Writes the state of a migration
+void Cache::writeMigration(const std::string &dir, uint32_t version, uint32_t segment)
+{
+	std::string path = dir + "/migration";
+	std::string tmppath = path + ".tmp";
+	{
+		BOStream out(tmppath);
+		out.write("PMIG", 4);
+		out << MIGRATION_FORMAT << version << segment;
+		if (!out.ok()) {
+			throw PEX(str::printf("Unable to write cache migration file: %s", tmppath.c_str()));
+		}
+	}
+	sys::fs::rename(tmppath, path);
+}
+
+// Reads the gzipped index of cache versions prior to COLUMNS_VERSION, whose
+// records are stored in the head files only. Returns false if there's no
+// such index.
+//
+//    index: <version> (<id> <segment> <offset> <crc32>) ...
+static bool readLegacyIndex(const std::string &dir, uint32_t *version, std::map<std::string, CacheIndex::Entry> *index)
+{
+	GZIStream in(dir + "/index");
+	if (!in.ok()) {
+		return false;
+	}
+
+	in >> *version;
+	std::string id;
+	CacheIndex::Entry entry;
+	while (!(in >> id).eof()) {
+		in >> entry.segment >> entry.offset >> entry.crc;
+		if (!in.ok() || id.empty()) {
+			std::cerr << "Cache: Index file is corrupted, dropping remaining entries" << std::endl;
+			break;
+		}
+		(*index)[id] = entry;
+	}
+	return true;
+}
+
+// Splits a revision into uncompressed columns. The author and all paths must
+// be part of the dictionary.
+static void encodeRecord(const Revision &rev, const Dictionary &dict, ColumnRecord *record)
+{
+	record->date = rev.date();
+	record->author = dict.find(rev.author());
+	if (record->author == Dictionary::None) {
+		throw PEX(str::printf("Author %s is missing from dictionary", rev.author().c_str()));
+	}
+	record->strings = dict.size();
+	std::string message = rev.message();
+	record->message.assign(message.begin(), message.end());
+	MOStream dout;
+	rev.diffstat()->write(dout, dict, Diffstat::Compact);
+	record->diffstat = dout.data();
+}
+
+// Compresses the columns of an encoded record
+static void compressRecord(ColumnRecord *record)
+{
+	record->message = Codec::encode(record->message);
+	record->diffstat = Codec::encode(record->diffstat);
+}
+
+// Decodes a single compressed record, as written by cache versions prior to
+// COLUMNS_VERSION
+static Revision *decodeLegacyRecord(const std::string &id, const char *data, uint32_t size)
+{
+	std::vector<char> buffer = utils::uncompress(data, size);
+	if (buffer.empty()) {
+		throw PEX(str::printf("Unable to read from cache: Revision %s is corrupted", id.c_str()));
+	}
+	Revision *rev = new Revision(id);
+	VIStream rin(buffer);
+	if (!rev->load03(rin)) {
+		delete rev;
+		throw PEX(str::printf("Unable to read from cache: Revision %s is corrupted", id.c_str()));
+	}
+	return rev;
+}
+
+// Sets a lock on a single byte of a cache lock file
+static bool lockByte(int fd, int type, off_t start, bool wait)
+{
+	struct flock flck;
+	memset(&flck, 0x00, sizeof(struct flock));
+	flck.l_type = type;
+	flck.l_whence = SEEK_SET;
+	flck.l_start = start;
+	flck.l_len = 1;
+	while (fcntl(fd, (wait ? F_SETLKW : F_SETLK), &flck) == -1) {
+		if (!wait || errno != EINTR) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Shared access lock on a cache directory that is read by this process
+// without being opened as a Cache, e.g. when merging other caches. It
+// keeps maintenance tasks from truncating the cache files while they
+// are mapped.
+class ReadLock
+{
+	public:
+		ReadLock(const std::string &path)
+		{
+			// The lock file may not be writable for caches from other machines
+			m_fd = ::open((path + "/lock").c_str(), O_RDONLY | O_CREAT, S_IRUSR | S_IWUSR);
+			if (m_fd == -1) {
+				throw PEX(str::printf("Unable to lock cache %s: %s", path.c_str(), PepperException::strerror(errno).c_str()));
+			}
+			if (!lockByte(m_fd, F_RDLCK, CACHE_LOCK_ACCESS, false)) {
+				::close(m_fd);
+				throw PEX(str::printf("Unable to lock cache %s, it may be used by another instance", path.c_str()));
+			}
+		}
+
+		~ReadLock()
+		{
+			// Closing the file releases the lock
+			::close(m_fd);
+		}
+
+	private:
+		int m_fd;
+};
+
+// Returns the cache version of the records in the given segment. During a
+// migration, records in new segments are in the current version already.
+uint32_t Cache::segmentVersion(uint32_t segment, uint32_t version, uint32_t migration)
+{
+	return (migration > 0 && segment >= migration ? CACHE_VERSION : version);
+}
+
+// Locates a record in a mapped head file, returning false if the record
+// exceeds the file
+static bool locateRecord(const sys::fs::MappedFile *in, uint32_t offset, const char **data, uint32_t *size)
+{
+	if ((size_t)offset + 4 > in->size()) {
+		return false;
+	}
+	memcpy((char *)size, in->data() + offset, 4);
+#ifndef WORDS_BIGENDIAN
+	*size = BStream::bswap(*size);
+#endif
+	*data = in->data() + offset + 4;
+	return ((size_t)offset + 4 + *size <= in->size());
+}
+
+// Parses the head of a record and verifies the checksums of its columns
+static bool checkRecord(const char *data, uint32_t size, uint32_t version, const sys::fs::MappedFile *messages, const sys::fs::MappedFile *diffstats, RecordHead *head)
+{
+	VIStream hin(data, size);
+	if (!head->load(hin, version)) {
+		return false;
+	}
+	if (messages == NULL || (size_t)head->msgOffset + head->msgSize > messages->size()
+			|| recordChecksum(version, messages->data() + head->msgOffset, head->msgSize) != head->msgCrc) {
+		return false;
+	}
+	if (diffstats == NULL || (size_t)head->statOffset + head->statSize > diffstats->size()
+			|| recordChecksum(version, diffstats->data() + head->statOffset, head->statSize) != head->statCrc) {
+		return false;
+	}
+	return true;
+}
+
+
+// Loads the message and diffstat of a cached revision from the column files
+// of the given cache version
+class ColumnLoader : public Revision::Loader
+{
+public:
+	ColumnLoader(const std::string &id, const RecordHead &head, const std::shared_ptr<sys::fs::MappedFile> &messages, const std::shared_ptr<sys::fs::MappedFile> &diffstats, const std::shared_ptr<const Dictionary> &dict, const std::shared_ptr<AbstractCache::Stats> &stats, uint32_t version = CACHE_VERSION)
+		: m_id(id), m_head(head), m_messages(messages), m_diffstats(diffstats), m_dict(dict), m_stats(stats),
+		  m_format(version < COMPACT_VERSION ? Diffstat::Fixed : Diffstat::Compact)
+	{
+	}
+
+	std::string message()
+	{
+		sys::datetime::Watch watch;
+		std::vector<char> data = Codec::decode(m_messages->data() + m_head.msgOffset, m_head.msgSize);
+		m_stats->bytesRead += m_head.msgSize;
+		m_stats->decodeTime += watch.elapsedUSecs();
+		return std::string(data.begin(), data.end());
+	}
+
+	DiffstatPtr diffstat()
+	{
+		sys::datetime::Watch watch;
+		DiffstatPtr stat = load();
+		m_stats->bytesRead += m_head.statSize;
+		m_stats->decodeTime += watch.elapsedUSecs();
+		return stat;
+	}
+
+private:
+	DiffstatPtr load()
+	{
+		std::vector<char> data = Codec::decode(m_diffstats->data() + m_head.statOffset, m_head.statSize);
+		DiffstatPtr stat = std::make_shared<Diffstat>();
+		if (data.empty()) {
+			throw PEX(str::printf("Unable to read from cache: Revision %s is corrupted", m_id.c_str()));
+		}
+		VIStream in(data);
+		if (!(m_dict ? stat->load(in, *m_dict, m_format) : stat->load(in, m_format))) {
+			throw PEX(str::printf("Unable to read from cache: Revision %s is corrupted", m_id.c_str()));
+		}
+		return stat;
+	}
+
+private:
+	std::string m_id;
+	RecordHead m_head;
+	std::shared_ptr<sys::fs::MappedFile> m_messages;
+	std::shared_ptr<sys::fs::MappedFile> m_diffstats;
+	std::shared_ptr<const Dictionary> m_dict;
+	std::shared_ptr<AbstractCache::Stats> m_stats;
+	Diffstat::Format m_format;
+};
+
+// Converts the columns of a record of the given cache version, which must
+// store its strings in the dictionary, to the current format. Messages are
+// copied without decoding them.
+static void convertColumns(const std::string &id, const RecordHead &head, uint32_t version, const std::shared_ptr<sys::fs::MappedFile> &messages, const std::shared_ptr<sys::fs::MappedFile> &diffstats, const std::shared_ptr<const Dictionary> &dict, const std::shared_ptr<AbstractCache::Stats> &stats, ColumnRecord *columns)
+{
+	columns->date = head.date;
+	columns->author = head.author;
+	columns->strings = head.strings;
+	columns->message.assign(messages->data() + head.msgOffset, messages->data() + head.msgOffset + head.msgSize);
+	if (version < COMPACT_VERSION) {
+		// Only the diffstat needs to be converted
+		ColumnLoader loader(id, head, messages, diffstats, dict, stats, version);
+		MOStream dout;
+		loader.diffstat()->write(dout, *dict, Diffstat::Compact);
+		columns->diffstat = Codec::encode(dout.data());
+	} else {
+		columns->diffstat.assign(diffstats->data() + head.statOffset, diffstats->data() + head.statOffset + head.statSize);
+	}
+}
+
+
+// Appends records to the files of a single cache segment
+class SegmentWriter
+{
+public:
+	SegmentWriter(const std::string &dir, uint32_t index)
+		: m_index(index)
+	{
+		for (int i = 0; i < Cache::NumColumns; i++) {
+			m_paths[i] = columnPath(dir, index, i);
+			m_streams[i] = new BOStream(m_paths[i], true);
+		}
+	}
+
+	~SegmentWriter()
+	{
+		for (int i = 0; i < Cache::NumColumns; i++) {
+			delete m_streams[i];
+		}
+	}
+
+	uint32_t index() const
+	{
+		return m_index;
+	}
+
+	// Returns the total size of the segment files
+	uint64_t size() const
+	{
+		uint64_t size = 0;
+		for (int i = 0; i < Cache::NumColumns; i++) {
+			size += m_streams[i]->tell();
+		}
+		return size;
+	}
+
+	// Checks whether any of the segment files reached the maximum size
+	bool full() const
+	{
+		for (int i = 0; i < Cache::NumColumns; i++) {
+			if (m_streams[i]->tell() >= MAX_CACHEFILE_SIZE) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Checks whether the segment files haven't been appended to by another
+	// process since they have been opened
+	bool current() const
+	{
+		for (int i = 0; i < Cache::NumColumns; i++) {
+			if (sys::fs::filesize(m_paths[i]) != m_streams[i]->tell()) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Writes a record and returns its location
+	CacheIndex::Entry write(const ColumnRecord &record)
+	{
+		return write(std::vector<const ColumnRecord *>(1, &record)).front();
+	}
+
+	// Writes several records and returns their locations. The columns are
+	// written before the heads, so that complete heads always point to valid
+	// data.
+	std::vector<CacheIndex::Entry> write(const std::vector<const ColumnRecord *> &records)
+	{
+		std::vector<RecordHead> heads(records.size());
+		for (size_t i = 0; i < records.size(); i++) {
+			const ColumnRecord &record = *records[i];
+			RecordHead &head = heads[i];
+			head.date = record.date;
+			head.author = record.author;
+			head.strings = record.strings;
+			head.msgOffset = m_streams[Cache::MessageColumn]->tell();
+			head.msgSize = record.message.size();
+			head.msgCrc = recordChecksum(record.message);
+			head.statOffset = m_streams[Cache::DiffstatColumn]->tell();
+			head.statSize = record.diffstat.size();
+			head.statCrc = recordChecksum(record.diffstat);
+
+			m_streams[Cache::MessageColumn]->write(record.message.data(), record.message.size());
+			m_streams[Cache::DiffstatColumn]->write(record.diffstat.data(), record.diffstat.size());
+		}
+		flush(Cache::MessageColumn);
+		flush(Cache::DiffstatColumn);
+
+		std::vector<CacheIndex::Entry> entries;
+		for (size_t i = 0; i < heads.size(); i++) {
+			MOStream hout;
+			heads[i].write(hout);
+			std::vector<char> data = hout.data();
+			uint32_t offset = m_streams[Cache::HeadColumn]->tell();
+			*m_streams[Cache::HeadColumn] << data;
+			entries.push_back(CacheIndex::Entry(m_index, offset, recordChecksum(data)));
+		}
+		flush(Cache::HeadColumn);
+		return entries;
+	}
+
+private:
+	void flush(int column)
+	{
+		if (!m_streams[column]->flush() || !m_streams[column]->ok()) {
+			throw PEX(str::printf("Unable to write to cache file: %s", m_paths[column].c_str()));
+		}
+	}
+
+private:
+	uint32_t m_index;
+	std::string m_paths[Cache::NumColumns];
+	BOStream *m_streams[Cache::NumColumns];
+};
+
+
+// Compresses records on a pool of threads and hands them to a single writer
+// thread, which appends them to the cache in the order they have been
+// submitted. Records that are ready at the same time are written at once.
+class RecordPipeline
+{
+public:
+	RecordPipeline(Cache *cache, int nworkers)
+		: m_cache(cache), m_next(0), m_stop(false), m_records(0), m_batches(0)
+	{
+		// Signals should be handled by the main thread only, since the
+		// signal handler flushes the cache
+		sigset_t signals, mask;
+		sigemptyset(&signals);
+		sigaddset(&signals, SIGINT);
+		sigaddset(&signals, SIGTERM);
+		pthread_sigmask(SIG_BLOCK, &signals, &mask);
+		for (int i = 0; i < nworkers; i++) {
+			m_threads.push_back(new Worker(this, false));
+			m_threads.back()->start();
+		}
+		m_threads.push_back(new Worker(this, true));
+		m_threads.back()->start();
+		pthread_sigmask(SIG_SETMASK, &mask, NULL);
+	}
+
+	~RecordPipeline()
+	{
+		m_mutex.lock();
+		m_stop = true;
+		m_mutex.unlock();
+		m_queued.wakeAll();
+		m_compressed.wakeAll();
+		for (size_t i = 0; i < m_threads.size(); i++) {
+			m_threads[i]->wait();
+			delete m_threads[i];
+		}
+		for (size_t i = 0; i < m_jobs.size(); i++) {
+			delete m_jobs[i]->record;
+			delete m_jobs[i];
+		}
+		PDEBUG << "Cache: Wrote " << m_records << " revisions in " << m_batches << " batches" << endl;
+	}
+
+	// Queues a record for writing, taking ownership of it. Blocks while the
+	// pipeline is full.
+	void push(const std::string &id, ColumnRecord *record)
+	{
+		sys::parallel::MutexLocker locker(&m_mutex);
+		while (m_jobs.size() >= PIPELINE_CAPACITY && m_error.empty()) {
+			m_written.wait(&m_mutex);
+		}
+		if (!m_error.empty()) {
+			delete record;
+			throw PEX(m_error);
+		}
+
+		Job *job = new Job();
+		job->id = id;
+		job->record = record;
+		job->compressed = false;
+		m_jobs.push_back(job);
+		m_pending.insert(id);
+		m_queued.wake();
+	}
+
+	// Checks whether the given revision has not been written yet
+	bool pending(const std::string &id)
+	{
+		sys::parallel::MutexLocker locker(&m_mutex);
+		return (m_pending.find(id) != m_pending.end());
+	}
+
+	// Waits until all queued records have been written
+	void drain()
+	{
+		sys::parallel::MutexLocker locker(&m_mutex);
+		while (!m_jobs.empty()) {
+			m_written.wait(&m_mutex);
+		}
+		if (!m_error.empty()) {
+			std::string error = m_error;
+			m_error.clear();
+			throw PEX(error);
+		}
+	}
+
+private:
+	struct Job
+	{
+		std::string id;
+		ColumnRecord *record;
+		bool compressed;
+	};
+
+	class Worker : public sys::parallel::Thread
+	{
+	public:
+		Worker(RecordPipeline *pipeline, bool writer) : m_pipeline(pipeline), m_writer(writer) { }
+
+	protected:
+		void run()
+		{
+			if (m_writer) {
+				m_pipeline->writeLoop();
+			} else {
+				m_pipeline->compressLoop();
+			}
+		}
+
+	private:
+		RecordPipeline *m_pipeline;
+		bool m_writer;
+	};
+
+	void compressLoop()
+	{
+		sys::parallel::MutexLocker locker(&m_mutex);
+		while (true) {
+			while (!m_stop && m_next >= m_jobs.size()) {
+				m_queued.wait(&m_mutex);
+			}
+			if (m_next >= m_jobs.size()) {
+				break;
+			}
+
+			// Jobs are not removed before they have been compressed
+			Job *job = m_jobs[m_next++];
+			locker.unlock();
+			std::string error;
+			try {
+				compressRecord(job->record);
+			} catch (const std::exception &ex) {
+				error = ex.what();
+			}
+			locker.relock();
+
+			job->compressed = true;
+			if (!error.empty() && m_error.empty()) {
+				m_error = error;
+			}
+			m_compressed.wakeAll();
+		}
+	}
+
+	void writeLoop()
+	{
+		sys::parallel::MutexLocker locker(&m_mutex);
+		while (true) {
+			while (!(m_stop && m_jobs.empty()) && (m_jobs.empty() || !m_jobs.front()->compressed)) {
+				m_compressed.wait(&m_mutex);
+			}
+			if (m_jobs.empty()) {
+				break;
+			}
+
+			// Records are dropped after an error, which will be reported
+			// to the main thread
+			std::vector<std::pair<std::string, ColumnRecord *> > batch;
+			for (size_t i = 0; i < m_jobs.size() && m_jobs[i]->compressed && batch.size() < PIPELINE_BATCH; i++) {
+				batch.push_back(std::pair<std::string, ColumnRecord *>(m_jobs[i]->id, m_jobs[i]->record));
+			}
+			bool failed = !m_error.empty();
+			locker.unlock();
+			std::string error;
+			if (!failed) {
+				try {
+					m_cache->commit(batch);
+				} catch (const std::exception &ex) {
+					error = ex.what();
+				}
+			}
+			locker.relock();
+
+			for (size_t i = 0; i < batch.size(); i++) {
+				m_pending.erase(m_jobs.front()->id);
+				delete m_jobs.front()->record;
+				delete m_jobs.front();
+				m_jobs.pop_front();
+			}
+			m_next -= batch.size();
+			if (!error.empty() && m_error.empty()) {
+				m_error = error;
+			}
+			if (!failed && error.empty()) {
+				m_records += batch.size();
+				++m_batches;
+			}
+			m_written.wakeAll();
+		}
+	}
+
+private:
+	Cache *m_cache;
+	sys::parallel::Mutex m_mutex;
+	sys::parallel::WaitCondition m_queued, m_compressed, m_written;
+	std::deque<Job *> m_jobs; // In order of submission
+	size_t m_next; // First job that has not been compressed yet
+	std::set<std::string> m_pending;
+	std::vector<Worker *> m_threads;
+	std::string m_error;
+	bool m_stop;
+	size_t m_records, m_batches;
+};
+
+
+// Converts the records of an unfinished migration in the background. The
+// converted records are appended to the cache like new ones, so the index
+// can be used all along. Strings that are moved to the dictionary are added
+// using a separate instance, since the one of the cache is read by the main
+// thread.
+class CacheMigrator : public sys::parallel::Thread
+{
+public:
+	CacheMigrator(Cache *cache, const std::vector<std::string> &ids, const std::shared_ptr<CacheDictionary> &dict)
+		: m_cache(cache), m_ids(ids), m_dict(dict), m_stop(false), m_done(false), m_converted(0)
+	{
+	}
+
+	void stop()
+	{
+		m_stop = true;
+	}
+
+	// Checks whether all records have been processed
+	bool done() const
+	{
+		return m_done;
+	}
+
+	size_t converted() const
+	{
+		return m_converted;
+	}
+
+protected:
+	void run()
+	{
+		try {
+			for (size_t i = 0; i < m_ids.size() && !m_stop; i += MIGRATION_BATCH) {
+				std::vector<std::string> batch(m_ids.begin() + i, m_ids.begin() + std::min(i + MIGRATION_BATCH, m_ids.size()));
+				m_converted += m_cache->migrate(batch, m_dict);
+			}
+			m_done = !m_stop;
+		} catch (const std::exception &ex) {
+			Logger::warn() << "Warning: Unable to convert cached revisions: " << ex.what() << endl;
+		}
+	}
+
+private:
+	Cache *m_cache;
+	std::vector<std::string> m_ids; // Sorted by location
+	std::shared_ptr<CacheDictionary> m_dict;
+	std::atomic<bool> m_stop, m_done;
+	std::atomic<size_t> m_converted;
+};
+
 
 // Constructor
 Cache::Cache(Backend *backend, const Options &options)
-	: AbstractCache(backend, options), m_iout(NULL), m_cout(NULL),
-	  m_cin(0), m_coindex(0), m_ciindex(0), m_loaded(false), m_lock(-1)
+	: AbstractCache(backend, options), m_writer(NULL), m_pipeline(NULL),
+	  m_coindex(0), m_loaded(false), m_lock(-1), m_index(NULL), m_version(CACHE_VERSION), m_migration(0), m_outdated(false), m_migrator(NULL)
 {
 
 }
@@ -45,21 +806,67 @@ Cache::Cache(Backend *backend, const Options &options)
 // Destructor
 Cache::~Cache()
 {
-	flush();
+	try {
+		stopMigration();
+		flush();
+	} catch (const std::exception &ex) {
+		std::cerr << "Cache: " << ex.what() << std::endl;
+	}
+	delete m_index;
 	unlock();
 }
 
-// Flushes and closes the cache streams
+// Writes all pending revisions and closes the cache streams
 void Cache::flush()
 {
 	PTRACE << "Flushing cache..." << endl;
-	delete m_iout;
-	m_iout = NULL;
-	delete m_cout;
-	m_cout = NULL;
-	delete m_cin;
-	m_cin = NULL;
+
+	// Defer any signals until the cache is consistent, since the signal
+	// handler will flush the cache, too
+	SIGBLOCK_DEFER();
+
+	std::string error;
+	if (m_pipeline) {
+		RecordPipeline *pipeline = m_pipeline;
+		m_pipeline = NULL;
+		try {
+			pipeline->drain();
+		} catch (const std::exception &ex) {
+			error = ex.what();
+		}
+		delete pipeline;
+	}
+
+	if (m_migrator && m_migrator->done()) {
+		stopMigration();
+		try {
+			finishMigration();
+		} catch (const std::exception &ex) {
+			error = ex.what();
+		}
+	}
+
+	// Records may be converted in the background meanwhile
+	sys::parallel::MutexLocker locker(&m_writeMutex);
+	if (m_index) {
+		// Merging the index log requires exclusive access to the cache
+		sys::parallel::MutexLocker indexLocker(&m_indexMutex);
+		bool merge = (m_index->needsMerge() && m_lock >= 0 && setLock(F_WRLCK, CACHE_LOCK_ACCESS, false));
+		m_index->flush(merge);
+		if (merge) {
+			setLock(F_RDLCK, CACHE_LOCK_ACCESS, false);
+		}
+	}
+	delete m_writer;
+	m_writer = NULL;
+	for (int i = 0; i < NumColumns; i++) {
+		m_segments[i].clear();
+	}
 	PTRACE << "Cache flushed" << endl;
+
+	if (!error.empty()) {
+		throw PEX(str::printf("Unable to write to cache: %s", error.c_str()));
+	}
 }
 
 // Checks if the diffstat of the given revision is already cached
@@ -69,7 +876,19 @@ bool Cache::lookup(const std::string &id)
 		load();
 	}
 
-	return (m_index.find(id) != m_index.end());
+	SIGBLOCK_DEFER();
+
+	// The revision may be about to be written
+	if (m_pipeline && m_pipeline->pending(id)) {
+		m_pipeline->drain();
+	}
+
+	sys::parallel::MutexLocker locker(&m_indexMutex);
+	if (locate(id)) {
+		return true;
+	}
+	// The revision may have been added by another process
+	return (m_index->refresh() && m_index->lookup(id));
 }
 
 // Adds the revision to the cache
@@ -79,50 +898,120 @@ void Cache::put(const std::string &id, const Revision &rev)
 		load();
 	}
 
+	std::vector<std::string> strings = rev.strings();
+
 	// Defer any signals while writing to the cache
 	SIGBLOCK_DEFER();
 
-	// Add revision to cache
-	std::string dir = m_opts.cacheDir() + "/" + uuid(), path;
-	if (m_cout == NULL) {
-		m_coindex = 0;
-		do {
-			path = str::printf("%s/cache.%u", dir.c_str(), m_coindex);
-			if (!sys::fs::fileExists(path) || sys::fs::filesize(path) < MAX_CACHEFILE_SIZE) {
-				break;
+	intern(strings);
+	std::unique_ptr<ColumnRecord> record(new ColumnRecord());
+	encodeRecord(rev, *m_dict, record.get());
+
+	// The record will be compressed and written in the background
+	if (m_pipeline == NULL) {
+		m_pipeline = new RecordPipeline(this, std::max(1, std::min(sys::parallel::idealThreadCount() - 1, 4)));
+	}
+	m_pipeline->push(id, record.release());
+}
+
+// Makes sure that the given strings are part of the dictionary
+void Cache::intern(const std::vector<std::string> &strings)
+{
+	size_t i = 0;
+	while (i < strings.size() && m_dict->find(strings[i]) != Dictionary::None) {
+		++i;
+	}
+	if (i == strings.size()) {
+		return;
+	}
+
+	// New strings will be assigned the next free IDs, so only a single
+	// process may add strings at a time
+	sys::parallel::MutexLocker locker(&m_writeMutex);
+	if (!setLock(F_WRLCK, CACHE_LOCK_WRITE, true)) {
+		throw PEX(str::printf("Unable to lock cache %s for writing: %s", cacheDir().c_str(), PepperException::strerror(errno).c_str()));
+	}
+	try {
+		m_dict->append(strings);
+	} catch (...) {
+		setLock(F_UNLCK, CACHE_LOCK_WRITE, false);
+		throw;
+	}
+	setLock(F_UNLCK, CACHE_LOCK_WRITE, false);
+}
+
+// Appends compressed revisions to the cache. This is called from the writer
+// thread of the record pipeline.
+void Cache::commit(const std::vector<std::pair<std::string, ColumnRecord *> > &records)
+{
+	// Only a single process, and a single thread of this process, may append
+	// to the cache at a time
+	sys::parallel::MutexLocker locker(&m_writeMutex);
+	if (!setLock(F_WRLCK, CACHE_LOCK_WRITE, true)) {
+		throw PEX(str::printf("Unable to lock cache %s for writing: %s", cacheDir().c_str(), PepperException::strerror(errno).c_str()));
+	}
+	try {
+		append(records);
+	} catch (...) {
+		setLock(F_UNLCK, CACHE_LOCK_WRITE, false);
+		throw;
+	}
+	setLock(F_UNLCK, CACHE_LOCK_WRITE, false);
+}
+
+// Writes encoded revisions to the current cache segment and adds them to the
+// index. The write lock must be held when calling this function. If replace
+// is set, records of an unfinished migration will be replaced.
+void Cache::append(const std::vector<std::pair<std::string, ColumnRecord *> > &records, bool replace)
+{
+	// Another process may have added some of the revisions in the meantime
+	std::vector<std::string> ids;
+	std::vector<const ColumnRecord *> batch;
+	{
+		sys::parallel::MutexLocker locker(&m_indexMutex);
+		m_index->refresh();
+		for (size_t i = 0; i < records.size(); i++) {
+			CacheIndex::Entry entry;
+			if (!locate(records[i].first, &entry) || (replace && entry.segment < m_migration)) {
+				ids.push_back(records[i].first);
+				batch.push_back(records[i].second);
 			}
+		}
+	}
+	if (batch.empty()) {
+		return;
+	}
+
+	// Add revision to cache. Other processes may have appended to the
+	// current segment, too.
+	if (m_writer != NULL && (m_writer->full() || !m_writer->current())) {
+		delete m_writer;
+		m_writer = NULL;
+	}
+	while (m_writer == NULL) {
+		m_writer = new SegmentWriter(cacheDir(), m_coindex);
+		if (m_writer->full()) {
+			delete m_writer;
+			m_writer = NULL;
 			++m_coindex;
-		} while (true);
-
-		delete m_cout;
-		m_cout = new BOStream(path, true);
-	} else if (m_cout->tell() >= MAX_CACHEFILE_SIZE) {
-		delete m_cout;
-		path = str::printf("%s/cache.%u", dir.c_str(), ++m_coindex);
-		m_cout = new BOStream(path, true);
-	}
-
-	uint32_t offset = m_cout->tell();
-	MOStream rout;
-	rev.write03(rout);
-	std::vector<char> compressed = utils::compress(rout.data());
-	*m_cout << compressed;
-
-	// Add revision to index
-	if (m_iout == NULL) {
-		if (sys::fs::exists(dir + "/index")) {
-			m_iout = new GZOStream(dir + "/index", true);
-		} else {
-			m_iout = new GZOStream(dir + "/index", false);
-			// Version number
-			*m_iout << CACHE_VERSION;
 		}
 	}
-	*m_iout << id;
-	*m_iout << m_coindex << offset << utils::crc32(compressed);
 
-	// Update cached index
-	m_index[id] = std::pair<uint32_t, uint32_t>(m_coindex, offset);
+	sys::datetime::Watch watch;
+	uint64_t size = m_writer->size();
+	std::vector<CacheIndex::Entry> locations = m_writer->write(batch);
+
+	// Add the revisions to the index, after their data has been written
+	std::vector<std::pair<std::string, CacheIndex::Entry> > entries;
+	for (size_t i = 0; i < ids.size(); i++) {
+		entries.push_back(std::pair<std::string, CacheIndex::Entry>(ids[i], locations[i]));
+	}
+	sys::parallel::MutexLocker locker(&m_indexMutex);
+	m_index->insert(entries, CACHE_VERSION);
+
+	m_stats->bytesWritten += m_writer->size() - size;
+	m_stats->writeTime += watch.elapsedUSecs();
+	++m_stats->writes;
 }
 
 // Loads a revision from the cache
@@ -132,42 +1021,338 @@ Revision *Cache::get(const std::string &id)
 		load();
 	}
 
-	std::string dir = cacheDir();
-	std::pair<uint32_t, uint32_t> offset = m_index[id];
-	std::string path = str::printf("%s/cache.%u", dir.c_str(), offset.first);
-	if (m_cin == NULL || offset.first != m_ciindex) {
-		delete m_cin;
-		m_cin = new BIStream(path);
-		m_ciindex = offset.first;
-		if (!m_cin->ok()) {
-			throw PEX(str::printf("Unable to read from cache file: %s", path.c_str()));
+	CacheIndex::Entry entry;
+	{
+		SIGBLOCK_DEFER();
+		sys::parallel::MutexLocker locker(&m_indexMutex);
+		if (!locate(id, &entry)) {
+			throw PEX(str::printf("Revision %s is not cached", id.c_str()));
 		}
 	}
-	if (!m_cin->seek(offset.second)) {
-		throw PEX(str::printf("Unable to read from cache file: %s", path.c_str()));
+	return decode(id, entry);
+}
+
+// Checks whether the given revisions are cached
+std::vector<bool> Cache::lookupMany(const std::vector<std::string> &ids)
+{
+	if (!m_loaded) {
+		load();
 	}
 
-	Revision *rev = new Revision(id);
-	std::vector<char> data;
-	*m_cin >> data;
-	data = utils::uncompress(data);
-	if (data.empty()) {
-		throw PEX(str::printf("Unable to read from cache file: %s", path.c_str()));
+	SIGBLOCK_DEFER();
+	if (m_pipeline) {
+		m_pipeline->drain();
 	}
-	MIStream rin(data);
-	if (!rev->load03(rin)) {
+
+	sys::parallel::MutexLocker locker(&m_indexMutex);
+	m_index->refresh();
+	std::vector<bool> cached(ids.size());
+	for (size_t i = 0; i < ids.size(); i++) {
+		cached[i] = locate(ids[i]);
+	}
+	return cached;
+}
+
+// Sorts index entries by their location
+struct EntryLocationCmp
+{
+	EntryLocationCmp(const std::vector<CacheIndex::Entry> &entries) : entries(entries) { }
+
+	bool operator()(size_t a, size_t b) const
+	{
+		if (entries[a].segment != entries[b].segment) {
+			return entries[a].segment < entries[b].segment;
+		}
+		return entries[a].offset < entries[b].offset;
+	}
+
+	const std::vector<CacheIndex::Entry> &entries;
+};
+
+// Appends the IDs of the given index entries to a list, sorted by location
+static void appendByLocation(const std::map<std::string, CacheIndex::Entry> &index, std::vector<std::string> *order)
+{
+	std::vector<CacheIndex::Entry> entries;
+	std::vector<std::string> ids;
+	for (std::map<std::string, CacheIndex::Entry>::const_iterator it = index.begin(); it != index.end(); ++it) {
+		ids.push_back(it->first);
+		entries.push_back(it->second);
+	}
+	std::vector<size_t> perm(entries.size());
+	for (size_t i = 0; i < perm.size(); i++) {
+		perm[i] = i;
+	}
+	std::sort(perm.begin(), perm.end(), EntryLocationCmp(entries));
+	for (size_t i = 0; i < perm.size(); i++) {
+		order->push_back(ids[perm[i]]);
+	}
+}
+
+// Loads the given revisions from the cache, in the order of the given IDs.
+// Only the record heads are read here, in a single sweep over the cache
+// files. Messages and diffstats will be decoded on demand.
+std::vector<Revision *> Cache::getMany(const std::vector<std::string> &ids)
+{
+	if (!m_loaded) {
+		load();
+	}
+
+	std::vector<CacheIndex::Entry> entries(ids.size());
+	std::vector<size_t> order(ids.size());
+	{
+		SIGBLOCK_DEFER();
+		sys::parallel::MutexLocker locker(&m_indexMutex);
+		for (size_t i = 0; i < ids.size(); i++) {
+			if (!locate(ids[i], &entries[i])) {
+				throw PEX(str::printf("Revision %s is not cached", ids[i].c_str()));
+			}
+			order[i] = i;
+		}
+	}
+
+	std::sort(order.begin(), order.end(), EntryLocationCmp(entries));
+	std::vector<Revision *> revs(ids.size(), NULL);
+	try {
+		for (size_t i = 0; i < order.size(); i++) {
+			revs[order[i]] = decode(ids[order[i]], entries[order[i]]);
+		}
+	} catch (...) {
+		for (size_t i = 0; i < revs.size(); i++) {
+			delete revs[i];
+		}
+		throw;
+	}
+	return revs;
+}
+
+// Returns the IDs of all cached revisions, sorted by location
+std::vector<std::string> Cache::cachedIds()
+{
+	if (!m_loaded) {
+		load();
+	}
+
+	SIGBLOCK_DEFER();
+	std::vector<std::pair<std::string, CacheIndex::Entry> > entries;
+	{
+		sys::parallel::MutexLocker locker(&m_indexMutex);
+		m_index->refresh();
+		entries = indexEntries();
+	}
+	std::vector<std::string> ids;
+	appendByLocation(std::map<std::string, CacheIndex::Entry>(entries.begin(), entries.end()), &ids);
+	return ids;
+}
+
+// Searches the index for the given revision. Records of a legacy cache are
+// found in its previous index until they have been converted, unless they
+// may be affected by bugs of their version. The index mutex must be held
+// when calling this function.
+bool Cache::locate(const std::string &id, CacheIndex::Entry *entry) const
+{
+	if (m_index->lookup(id, entry)) {
+		return true;
+	}
+	if (m_outdated) {
+		return false;
+	}
+
+	std::map<std::string, CacheIndex::Entry>::const_iterator it = m_legacy.find(id);
+	if (it == m_legacy.end()) {
+		return false;
+	}
+	if (entry) {
+		*entry = it->second;
+	}
+	return true;
+}
+
+// Returns the entries of all revisions that can be located, in no particular
+// order. The index mutex must be held when calling this function.
+std::vector<std::pair<std::string, CacheIndex::Entry> > Cache::indexEntries() const
+{
+	std::vector<std::pair<std::string, CacheIndex::Entry> > entries = m_index->entries();
+	if (m_outdated) {
+		return entries;
+	}
+	for (std::map<std::string, CacheIndex::Entry>::const_iterator it = m_legacy.begin(); it != m_legacy.end(); ++it) {
+		if (!m_index->lookup(it->first)) {
+			entries.push_back(*it);
+		}
+	}
+	return entries;
+}
+
+// Creates a revision from the head of the given record. The message and the
+// diffstat will be read from the column files on demand.
+Revision *Cache::decode(const std::string &id, const CacheIndex::Entry &entry)
+{
+	sys::datetime::Watch watch;
+	uint32_t size;
+	std::shared_ptr<sys::fs::MappedFile> in = record(id, entry.segment, entry.offset, &size);
+	uint32_t version = segmentVersion(entry.segment, m_version, m_migration);
+	if (version < COLUMNS_VERSION) {
+		// Records of legacy caches are decoded at once
+		Revision *rev = decodeLegacyRecord(id, in->data() + entry.offset + 4, size);
+		m_stats->bytesRead += size + 4;
+		m_stats->decodeTime += watch.elapsedUSecs();
+		return rev;
+	}
+
+	RecordHead head;
+	VIStream hin(in->data() + entry.offset + 4, size);
+	if (!head.load(hin, version)) {
+		throw PEX(str::printf("Unable to read from cache: Revision %s is corrupted", id.c_str()));
+	}
+
+	// The record may refer to strings that have been added by another
+	// process or by a migration.
+	if (version >= DICTIONARY_VERSION && head.strings > m_dict->size()) {
+		SIGBLOCK_DEFER();
+		sys::parallel::MutexLocker locker(&m_writeMutex);
+		m_dict->refresh();
+	}
+	if (version >= DICTIONARY_VERSION && (head.strings > m_dict->size() || head.author >= head.strings)) {
+		throw PEX(str::printf("Unable to read from cache: Revision %s is corrupted", id.c_str()));
+	}
+
+	std::shared_ptr<sys::fs::MappedFile> messages = segment(entry.segment, (size_t)head.msgOffset + head.msgSize, MessageColumn);
+	std::shared_ptr<sys::fs::MappedFile> diffstats = segment(entry.segment, (size_t)head.statOffset + head.statSize, DiffstatColumn);
+	m_stats->bytesRead += size + 4;
+	m_stats->decodeTime += watch.elapsedUSecs();
+	if (version < DICTIONARY_VERSION) {
+		// The author and paths are stored in the record
+		return new Revision(id, head.date, head.authorName, new ColumnLoader(id, head, messages, diffstats, std::shared_ptr<const Dictionary>(), m_stats, version));
+	}
+	return new Revision(id, head.date, m_dict->at(head.author), new ColumnLoader(id, head, messages, diffstats, m_dict, m_stats, version));
+}
+
+// Returns the encoded data of the given column for all cached revisions, in
+// the order of the cache files
+std::vector<std::vector<char> > Cache::columnData(Column column)
+{
+	if (!m_loaded) {
+		load();
+	}
+	if (m_pipeline) {
+		m_pipeline->drain();
+	}
+
+	// The index may be extended by a background migration
+	std::vector<std::pair<std::string, CacheIndex::Entry> > entries;
+	{
+		SIGBLOCK_DEFER();
+		sys::parallel::MutexLocker locker(&m_indexMutex);
+		entries = indexEntries();
+	}
+	std::vector<CacheIndex::Entry> locations(entries.size());
+	std::vector<size_t> order(entries.size());
+	for (size_t i = 0; i < entries.size(); i++) {
+		locations[i] = entries[i].second;
+		order[i] = i;
+	}
+	std::sort(order.begin(), order.end(), EntryLocationCmp(locations));
+
+	std::vector<std::vector<char> > data;
+	data.reserve(entries.size());
+	for (size_t i = 0; i < order.size(); i++) {
+		// Records of legacy caches that haven't been converted yet don't
+		// have any columns
+		const CacheIndex::Entry &entry = locations[order[i]];
+		uint32_t version = segmentVersion(entry.segment, m_version, m_migration);
+		if (version < COLUMNS_VERSION) {
+			continue;
+		}
+
+		uint32_t size;
+		std::shared_ptr<sys::fs::MappedFile> in = record(entries[order[i]].first, entry.segment, entry.offset, &size);
+		if (column == HeadColumn) {
+			data.push_back(std::vector<char>(in->data() + entry.offset + 4, in->data() + entry.offset + 4 + size));
+			continue;
+		}
+
+		RecordHead head;
+		VIStream hin(in->data() + entry.offset + 4, size);
+		if (!head.load(hin, version)) {
+			throw PEX(str::printf("Unable to read from cache: Revision %s is corrupted", entries[order[i]].first.c_str()));
+		}
+		uint32_t offset = (column == MessageColumn ? head.msgOffset : head.statOffset);
+		size = (column == MessageColumn ? head.msgSize : head.statSize);
+		std::shared_ptr<sys::fs::MappedFile> file = segment(entry.segment, (size_t)offset + size, column);
+		data.push_back(std::vector<char>(file->data() + offset, file->data() + offset + size));
+	}
+	return data;
+}
+
+// Returns the mapping of the head file that contains the given record, along
+// with the size of the record data. Records consist of a big-endian size
+// field, followed by the record data.
+std::shared_ptr<sys::fs::MappedFile> Cache::record(const std::string &id, uint32_t index, uint32_t offset, uint32_t *size)
+{
+	std::shared_ptr<sys::fs::MappedFile> in = segment(index, (size_t)offset + 4);
+	memcpy((char *)size, in->data() + offset, 4);
+#ifndef WORDS_BIGENDIAN
+	*size = BStream::bswap(*size);
+#endif
+	size_t end = (size_t)offset + 4 + *size;
+	if (end > in->size()) {
+		// The file may have been appended to by another process, but a
+		// record that exceeds it has a corrupted size field
+		if (end > sys::fs::filesize(columnPath(cacheDir(), index, HeadColumn))) {
+			throw PEX(str::printf("Unable to read from cache: Revision %s is corrupted", id.c_str()));
+		}
+		in = segment(index, end);
+	}
+	return in;
+}
+
+// Returns a memory mapping of the given cache file, covering at least size
+// bytes. Revisions that are loaded lazily keep the mappings alive.
+std::shared_ptr<sys::fs::MappedFile> Cache::segment(uint32_t index, size_t size, Column column)
+{
+	std::vector<std::shared_ptr<sys::fs::MappedFile> > &files = m_segments[column];
+	if (index < files.size() && files[index] && files[index]->size() >= size) {
+		return files[index];
+	}
+
+	if (index >= files.size()) {
+		files.resize(index + 1);
+	}
+
+	std::string path = columnPath(cacheDir(), index, column);
+	try {
+		if (!files[index]) {
+			PTRACE << "Mapping cache file " << path << endl;
+			files[index] = std::make_shared<sys::fs::MappedFile>(path);
+		} else {
+			// The file has been appended to since it has been mapped
+			files[index]->remap();
+		}
+	} catch (const std::exception &ex) {
+		throw PEX(str::printf("Unable to read from cache file: %s: %s", path.c_str(), ex.what()));
+	}
+
+	if (files[index]->size() < size) {
 		throw PEX(str::printf("Unable to read from cache file: %s", path.c_str()));
 	}
-	return rev;
+	return files[index];
 }
 
-// Loads the index file
-void Cache::load()
+// Loads the index file. Caches of older versions are converted in the
+// background unless convert is false, and their records are read in the
+// previous format meanwhile.
+void Cache::load(bool convert)
 {
 	std::string path = cacheDir();
 	PDEBUG << "Using cache dir: " << path << endl;
 
-	m_index.clear();
+	delete m_index;
+	m_index = new CacheIndex(path);
+	m_dict = std::make_shared<CacheDictionary>(path);
+	m_version = CACHE_VERSION;
+	m_migration = 0;
+	m_legacy.clear();
+	m_outdated = false;
 	m_loaded = true;
 
 	bool created;
@@ -180,48 +1365,101 @@ void Cache::load()
 	// For git repositories, the hardest part is calling uuid()
 	sys::datetime::Watch watch;
 
-	GZIStream *in = new GZIStream(path+"/index");
-	if (!in->ok()) {
+	// The gzipped index of a legacy cache is kept until all of its records
+	// have been converted, and converted records are added to a new index.
+	// Otherwise, the index table is mapped and searched in place, so there's
+	// no need to read all entries here.
+	uint32_t version;
+	if (readLegacyIndex(path, &version, &m_legacy)) {
+		if (CacheIndex::exists(path)) {
+			m_index->open();
+		}
+	} else if (CacheIndex::exists(path)) {
+		m_index->open();
+		version = m_index->version();
+	} else {
 		Logger::info() << "Cache: Empty cache for '" << uuid() << '\'' << endl;
 		return;
 	}
 
-	uint32_t version;
-	*in >> version;
 	switch (checkVersion(version)) {
 		case OutOfDate:
-			delete in;
-			throw PEX(str::printf("Cache is out of date - please run the check_cache report", version));
+			// Records affected by bugs of this version will be dropped
+			// during the conversion, so none of the unconverted ones
+			// can be used
+			m_outdated = true;
+			break;
 		case UnknownVersion:
-			delete in;
 			throw PEX(str::printf("Unknown cache version number %u - please run the check_cache report", version));
 		default:
 			break;
 	}
+	m_version = version;
+	m_dict->refresh();
 
-	Logger::status() << "Loading cache index... " << ::flush;
+	if (version < CACHE_VERSION && convert) {
+		migrate(version);
+	} else if (version < CACHE_VERSION) {
+		m_migration = readMigration(path, version);
+	}
 
-	std::string buffer;
-	std::pair<uint32_t, uint32_t> pos;
-	uint32_t crc;
-	while (!(*in >> buffer).eof()) {
-		if (buffer.empty()) {
-			break;
+	std::map<std::string, CacheIndex::Entry> pending;
+	for (std::map<std::string, CacheIndex::Entry>::const_iterator it = m_legacy.begin(); it != m_legacy.end(); ++it) {
+		if (!m_index->lookup(it->first)) {
+			pending.insert(*it);
 		}
-		*in >> pos.first >> pos.second;
-		*in >> crc;
-		m_index[buffer] = pos;
 	}
 
-	Logger::status() << "done" << endl;
-	delete in;
-	Logger::info() << "Cache: Loaded " << m_index.size() << " revisions in " << watch.elapsedMSecs() << " ms" << endl;
+	m_stats->indexTime += watch.elapsedUSecs();
+	Logger::info() << "Cache: Loaded " << m_index->size() + pending.size() << " revisions in " << watch.elapsedMSecs() << " ms" << endl;
+
+	if (m_migration == 0) {
+		return;
+	}
+
+	// New records must not be appended to segments of the previous version
+	m_coindex = std::max(m_coindex, m_migration);
+	if (!convert) {
+		return;
+	}
+
+	std::vector<std::pair<std::string, CacheIndex::Entry> > entries = m_index->entries();
+	for (size_t i = 0; i < entries.size(); i++) {
+		if (entries[i].second.segment < m_migration) {
+			pending.insert(entries[i]);
+		}
+	}
+	if (pending.empty()) {
+		finishMigration();
+		return;
+	}
+
+	// Convert the remaining records in their current order. Signals should
+	// be handled by the main thread only.
+	std::vector<std::string> order;
+	appendByLocation(pending, &order);
+	PDEBUG << "Cache: Converting " << order.size() << " revisions from version " << version << " in the background" << endl;
+	sigset_t signals, mask;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, &mask);
+	m_migrator = new CacheMigrator(this, order, std::make_shared<CacheDictionary>(path));
+	m_migrator->start();
+	pthread_sigmask(SIG_SETMASK, &mask, NULL);
 }
 
 // Clears all cache files
 void Cache::clear()
 {
 	flush();
+	if (m_index) {
+		m_index->close();
+	}
+	m_dict.reset();
+	m_migration = 0;
+	m_legacy.clear();
+	m_outdated = false;
 
 	std::string path = cacheDir();
 	if (!sys::fs::dirExists(path)) {
@@ -231,33 +1469,42 @@ void Cache::clear()
 	PDEBUG << "Clearing cache in dir: " << path << endl;
 	std::vector<std::string> files = sys::fs::ls(path);
 	for (size_t i = 0; i < files.size(); i++) {
+		if (files[i] == "lock") {
+			continue;
+		}
 		std::string fullpath = path + "/" + files[i];
 		PDEBUG << "Unlinking " << fullpath << endl;
 		sys::fs::unlink(fullpath);
 	}
 }
 
-// Locks the cache directory for this process
-void Cache::lock()
+// Locks the cache directory for this process. Any number of processes may
+// use the cache at the same time unless exclusive access is requested.
+void Cache::lock(bool exclusive)
 {
-	if (m_lock >= 0) {
-		PDEBUG << "Already locked (" << m_lock << ")" << endl;
-		return;
-	}
-
 	std::string path = cacheDir();
 	std::string lock = path + "/lock";
-	m_lock = ::open(lock.c_str(), O_WRONLY | O_CREAT, S_IWUSR);
-	if (m_lock == -1) {
-		throw PEX(str::printf("Unable to lock cache %s: %s", path.c_str(), PepperException::strerror(errno).c_str()));
+	if (m_lock < 0) {
+		m_lock = ::open(lock.c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+		if (m_lock == -1 && errno == EACCES && ::chmod(lock.c_str(), S_IRUSR | S_IWUSR) == 0) {
+			// Lock files created by older versions are write-only
+			m_lock = ::open(lock.c_str(), O_RDWR);
+		}
+		if (m_lock == -1) {
+			throw PEX(str::printf("Unable to lock cache %s: %s", path.c_str(), PepperException::strerror(errno).c_str()));
+		}
 	}
 
-	PTRACE << "Locking file " << lock << endl;
-	struct flock flck;
-	memset(&flck, 0x00, sizeof(struct flock));
-	flck.l_type = F_WRLCK;
-	if (fcntl(m_lock, F_SETLK, &flck) == -1) {
-		throw PEX(str::printf("Unable to lock cache %s, it may be used by another instance", path.c_str()));
+	PTRACE << "Locking file " << lock << (exclusive ? " (exclusive)" : " (shared)") << endl;
+	if (exclusive) {
+		if (!setLock(F_WRLCK, CACHE_LOCK_ACCESS, false)) {
+			throw PEX(str::printf("Unable to lock cache %s, it may be used by another instance", path.c_str()));
+		}
+	} else if (!setLock(F_RDLCK, CACHE_LOCK_ACCESS, false)) {
+		Logger::info() << "Cache: Waiting for another instance to release the cache" << endl;
+		if (!setLock(F_RDLCK, CACHE_LOCK_ACCESS, true)) {
+			throw PEX(str::printf("Unable to lock cache %s: %s", path.c_str(), PepperException::strerror(errno).c_str()));
+		}
 	}
 }
 
@@ -280,6 +1527,13 @@ void Cache::unlock()
 	if (::close(m_lock) == -1) {
 		throw PEX_ERRNO();
 	}
+	m_lock = -1;
+}
+
+// Sets a lock on a single byte of the lock file
+bool Cache::setLock(int type, off_t start, bool wait)
+{
+	return lockByte(m_lock, type, start, wait);
 }
 
 // Checks the cache version
@@ -308,10 +1562,399 @@ Cache::VersionCheckResult Cache::checkVersion(int version)
 	return UnknownVersion;
 }
 
-// Checks cache entries and removes invalid ones from the index file
+// Checks whether a revision from an older cache version is affected by a
+// bug of that version and needs to be fetched again
+bool Cache::outdated(const Revision &rev, uint32_t version)
+{
+	if (version <= 1) {
+		// The diffstats for Mercurial and Git have been flawed in version 1.
+		// The Subversion backend uses repository-wide diffstats now.
+		return true;
+	}
+	if (version <= 2 && m_backend->name() == "subversion") {
+		// Invalid diffstats for deleted files in version 2, which are
+		// listed with removed lines only
+		std::map<std::string, Diffstat::Stat> stats = rev.diffstat()->stats();
+		for (std::map<std::string, Diffstat::Stat>::const_iterator it = stats.begin(); it != stats.end(); ++it) {
+			if (it->second.ladd == 0 && it->second.cadd == 0) {
+				return true;
+			}
+		}
+	}
+	if (version <= 4 && m_backend->name() == "git") {
+		// Invalid commit times in version 3. The dates of all revisions are
+		// fetched at once, since querying them one by one would take as
+		// long as fetching the revisions again.
+		if (m_dates.empty()) {
+			m_dates = m_backend->dates();
+		}
+		std::map<std::string, int64_t>::const_iterator it = m_dates.find(rev.id());
+		return (rev.date() != (it != m_dates.end() ? it->second : m_backend->date(rev.id())));
+	}
+	return false;
+}
+
+// Starts or resumes migrating the records of an older cache version.
+// Converted records will be written to new segments, and the index keeps
+// the old version until the migration has been finished.
+void Cache::migrate(uint32_t version)
+{
+	std::string path = cacheDir();
+
+	// The state file is shared with other processes that may be starting
+	// the same migration
+	SIGBLOCK_DEFER();
+	sys::parallel::MutexLocker locker(&m_writeMutex);
+	if (!setLock(F_WRLCK, CACHE_LOCK_WRITE, true)) {
+		throw PEX(str::printf("Unable to lock cache %s for writing: %s", path.c_str(), PepperException::strerror(errno).c_str()));
+	}
+
+	try {
+		m_migration = readMigration(path, version);
+		if (m_migration == 0) {
+			uint32_t segment = 0;
+			std::vector<std::string> files = sys::fs::ls(path);
+			for (size_t i = 0; i < files.size(); i++) {
+				uint32_t n;
+				if (parseColumnPath(files[i], &n)) {
+					segment = std::max(segment, n + 1);
+				}
+			}
+			writeMigration(path, version, std::max(segment, (uint32_t)1));
+			m_migration = std::max(segment, (uint32_t)1);
+			Logger::info() << "Cache: Converting cache from version " << version << " in the background" << endl;
+		}
+	} catch (...) {
+		setLock(F_UNLCK, CACHE_LOCK_WRITE, false);
+		throw;
+	}
+	setLock(F_UNLCK, CACHE_LOCK_WRITE, false);
+}
+
+// Converts the given records of an unfinished migration and appends them to
+// the cache. This is called from the migration thread, which adds strings
+// to its own instance of the dictionary. Returns the number of converted
+// records.
+size_t Cache::migrate(const std::vector<std::string> &ids, const std::shared_ptr<CacheDictionary> &dict)
+{
+	std::string path = cacheDir();
+
+	// Only a single process, and a single thread of this process, may append
+	// to the cache at a time. This also protects the dictionary.
+	sys::parallel::MutexLocker locker(&m_writeMutex);
+	if (!setLock(F_WRLCK, CACHE_LOCK_WRITE, true)) {
+		throw PEX(str::printf("Unable to lock cache %s for writing: %s", path.c_str(), PepperException::strerror(errno).c_str()));
+	}
+
+	std::vector<std::pair<std::string, ColumnRecord *> > records;
+	try {
+		dict->refresh();
+
+		// Unconverted records of legacy caches are only present in the
+		// previous index, which isn't modified during the migration
+		std::vector<CacheIndex::Entry> entries(ids.size());
+		std::vector<bool> found(ids.size());
+		{
+			sys::parallel::MutexLocker indexLocker(&m_indexMutex);
+			m_index->refresh();
+			for (size_t i = 0; i < ids.size(); i++) {
+				found[i] = m_index->lookup(ids[i], &entries[i]);
+				std::map<std::string, CacheIndex::Entry>::const_iterator it;
+				if (!found[i] && (it = m_legacy.find(ids[i])) != m_legacy.end()) {
+					entries[i] = it->second;
+					found[i] = true;
+				}
+			}
+		}
+
+		// The old cache files are mapped separately, since the mappings of
+		// this instance are used by the main thread
+		int ncolumns = (m_version < COLUMNS_VERSION ? 1 : (int)NumColumns);
+		std::map<uint32_t, std::shared_ptr<sys::fs::MappedFile> > files[NumColumns];
+		for (size_t i = 0; i < ids.size(); i++) {
+			// The record may have been converted by another process
+			const CacheIndex::Entry &entry = entries[i];
+			if (!found[i] || entry.segment >= m_migration) {
+				continue;
+			}
+
+			std::unique_ptr<ColumnRecord> columns(new ColumnRecord());
+			bool ok, outdated = false;
+			try {
+				std::shared_ptr<sys::fs::MappedFile> mapped[NumColumns];
+				for (int j = 0; j < ncolumns; j++) {
+					std::shared_ptr<sys::fs::MappedFile> &file = files[j][entry.segment];
+					if (!file) {
+						file = std::make_shared<sys::fs::MappedFile>(columnPath(path, entry.segment, j));
+					}
+					mapped[j] = file;
+				}
+				ok = convert(ids[i], entry, m_version, mapped, dict, columns.get(), &outdated);
+			} catch (const std::exception &ex) {
+				PDEBUG << ex.what() << endl;
+				ok = false;
+			}
+			if (ok) {
+				records.push_back(std::pair<std::string, ColumnRecord *>(ids[i], columns.release()));
+			} else if (outdated) {
+				PDEBUG << "Cache: Revision " << ids[i] << " is outdated, dropping it" << endl;
+			} else {
+				PDEBUG << "Cache: Unable to convert revision " << ids[i] << endl;
+			}
+		}
+
+		append(records, true);
+	} catch (...) {
+		for (size_t i = 0; i < records.size(); i++) {
+			delete records[i].second;
+		}
+		setLock(F_UNLCK, CACHE_LOCK_WRITE, false);
+		throw;
+	}
+
+	for (size_t i = 0; i < records.size(); i++) {
+		delete records[i].second;
+	}
+	setLock(F_UNLCK, CACHE_LOCK_WRITE, false);
+	return records.size();
+}
+
+// Converts a record of the given cache version to the current format. The
+// mapped cache files of its segment are given, i.e. only the head file for
+// records of versions prior to COLUMNS_VERSION. Strings that are missing
+// from the dictionary are added, so the write lock or exclusive access is
+// required. Returns false if the record is corrupted or affected by a bug of
+// its version, and sets outdated in the latter case.
+bool Cache::convert(const std::string &id, const CacheIndex::Entry &entry, uint32_t version, const std::shared_ptr<sys::fs::MappedFile> *files, const std::shared_ptr<CacheDictionary> &dict, ColumnRecord *columns, bool *outdated)
+{
+	const char *data;
+	uint32_t size;
+	if (!locateRecord(files[HeadColumn].get(), entry.offset, &data, &size) || recordChecksum(version, data, size) != entry.crc) {
+		return false;
+	}
+
+	if (version < COLUMNS_VERSION) {
+		std::unique_ptr<Revision> rev(decodeLegacyRecord(id, data, size));
+		if (this->outdated(*rev, version)) {
+			*outdated = true;
+			return false;
+		}
+		dict->append(rev->strings());
+		encodeRecord(*rev, *dict, columns);
+		compressRecord(columns);
+		return true;
+	}
+
+	RecordHead head;
+	if (!checkRecord(data, size, version, files[MessageColumn].get(), files[DiffstatColumn].get(), &head)) {
+		return false;
+	}
+	if (version < DICTIONARY_VERSION) {
+		// Move the author and paths to the dictionary
+		Revision rev(id, head.date, head.authorName, new ColumnLoader(id, head, files[MessageColumn], files[DiffstatColumn], std::shared_ptr<const Dictionary>(), m_stats, version));
+		dict->append(rev.strings());
+		encodeRecord(rev, *dict, columns);
+		compressRecord(columns);
+		return true;
+	}
+	if (head.strings > dict->size() || head.author >= head.strings) {
+		return false;
+	}
+	convertColumns(id, head, version, files[MessageColumn], files[DiffstatColumn], dict, m_stats, columns);
+	return true;
+}
+
+// Stops converting records in the background. The migration will be resumed
+// when the cache is loaded again.
+void Cache::stopMigration()
+{
+	if (m_migrator == NULL) {
+		return;
+	}
+
+	m_migrator->stop();
+	m_migrator->wait();
+	PDEBUG << "Cache: Converted " << m_migrator->converted() << " revisions in the background" << endl;
+	delete m_migrator;
+	m_migrator = NULL;
+}
+
+// Finishes a migration once all records have been converted. Records that
+// couldn't be converted are dropped from the index, so they will be fetched
+// again, and the old cache files are removed, including the previous index
+// of a legacy cache. This requires exclusive access to the cache, so it may
+// be postponed to a later run.
+void Cache::finishMigration()
+{
+	if (m_lock < 0 || !setLock(F_WRLCK, CACHE_LOCK_ACCESS, false)) {
+		PDEBUG << "Cache: Cache is in use, postponing the end of the migration" << endl;
+		return;
+	}
+
+	std::string path = cacheDir();
+	size_t dropped = 0;
+	try {
+		SIGBLOCK_DEFER();
+		sys::parallel::MutexLocker locker(&m_indexMutex);
+		m_index->refresh();
+		std::vector<std::pair<std::string, CacheIndex::Entry> > entries = m_index->entries();
+		std::map<std::string, CacheIndex::Entry> index;
+		for (size_t i = 0; i < entries.size(); i++) {
+			if (entries[i].second.segment < m_migration) {
+				PDEBUG << "Cache: Revision " << entries[i].first << " has not been converted, removing from index file" << endl;
+				++dropped;
+			} else {
+				index.insert(entries[i]);
+			}
+		}
+		for (std::map<std::string, CacheIndex::Entry>::const_iterator it = m_legacy.begin(); it != m_legacy.end(); ++it) {
+			if (index.find(it->first) == index.end()) {
+				PDEBUG << "Cache: Revision " << it->first << " has not been converted, removing from index file" << endl;
+				++dropped;
+			}
+		}
+		m_index->rewrite(index, CACHE_VERSION);
+
+		// The previous index is removed first, so an interrupted cleanup
+		// won't resume the migration
+		if (sys::fs::fileExists(path + "/index")) {
+			sys::fs::unlink(path + "/index");
+		}
+		sys::fs::unlink(path + "/migration");
+		std::vector<std::string> files = sys::fs::ls(path);
+		for (size_t i = 0; i < files.size(); i++) {
+			uint32_t n;
+			if (parseColumnPath(files[i], &n) && n < m_migration) {
+				PDEBUG << "Unlinking " << path << "/" << files[i] << endl;
+				sys::fs::unlink(path + "/" + files[i]);
+			}
+		}
+	} catch (...) {
+		setLock(F_RDLCK, CACHE_LOCK_ACCESS, false);
+		throw;
+	}
+	setLock(F_RDLCK, CACHE_LOCK_ACCESS, false);
+
+	Logger::info() << "Cache: Finished conversion from version " << m_version << endl;
+	if (dropped > 0) {
+		Logger::info() << "Cache: Dropped " << dropped << " revisions that couldn't be converted, they will be fetched again" << endl;
+	}
+	m_version = CACHE_VERSION;
+	m_migration = 0;
+	m_legacy.clear();
+	m_outdated = false;
+}
+
+// Verifies the records in a set of cache files
+class SegmentChecker : public sys::parallel::Thread
+{
+public:
+	typedef std::vector<const std::pair<const std::string, CacheIndex::Entry> *> Records;
+
+	SegmentChecker(const std::string &dir, uint32_t version, uint32_t migration, size_t strings, const std::vector<std::pair<uint32_t, Records *> > *queue, size_t *next, sys::parallel::Mutex *mutex)
+		: m_dir(dir), m_version(version), m_migration(migration), m_strings(strings), m_queue(queue), m_next(next), m_mutex(mutex), m_bytes(0)
+	{
+	}
+
+	const std::vector<std::string> &corrupted() const
+	{
+		return m_corrupted;
+	}
+
+	uint64_t bytes() const
+	{
+		return m_bytes;
+	}
+
+protected:
+	void run()
+	{
+		while (true) {
+			size_t index;
+			{
+				sys::parallel::MutexLocker locker(m_mutex);
+				if (*m_next >= m_queue->size()) {
+					break;
+				}
+				index = (*m_next)++;
+			}
+			check((*m_queue)[index].first, *(*m_queue)[index].second);
+		}
+	}
+
+	void check(uint32_t segment, const Records &records)
+	{
+		// Records of older versions are stored in the head file only
+		uint32_t version = Cache::segmentVersion(segment, m_version, m_migration);
+		int ncolumns = (version < COLUMNS_VERSION ? 1 : (int)Cache::NumColumns);
+		sys::fs::MappedFile *files[Cache::NumColumns] = {NULL, NULL, NULL};
+		for (int i = 0; i < ncolumns; i++) {
+			std::string path = columnPath(m_dir, segment, i);
+			try {
+				files[i] = new sys::fs::MappedFile(path);
+			} catch (const std::exception &ex) {
+				PDEBUG << "Unable to read from cache file " << path << ": " << ex.what() << endl;
+			}
+		}
+
+		const sys::fs::MappedFile *in = files[Cache::HeadColumn];
+		for (size_t i = 0; i < records.size(); i++) {
+			const CacheIndex::Entry &entry = records[i]->second;
+			bool ok = false;
+			if (in != NULL && (size_t)entry.offset + 4 <= in->size()) {
+				uint32_t size;
+				memcpy((char *)&size, in->data() + entry.offset, 4);
+#ifndef WORDS_BIGENDIAN
+				size = BStream::bswap(size);
+#endif
+				if ((size_t)entry.offset + 4 + size <= in->size()) {
+					const char *data = in->data() + entry.offset + 4;
+					ok = (recordChecksum(version, data, size) == entry.crc);
+					m_bytes += size + 4;
+					if (ok && ncolumns > 1) {
+						RecordHead head;
+						ok = checkRecord(data, size, version, files[Cache::MessageColumn], files[Cache::DiffstatColumn], &head);
+						if (ok && version >= DICTIONARY_VERSION) {
+							// All strings must be present in the dictionary
+							ok = (head.strings <= m_strings && head.author < head.strings);
+						}
+						if (ok) {
+							m_bytes += (uint64_t)head.msgSize + head.statSize;
+						}
+					}
+				}
+			}
+
+			if (ok) {
+				PTRACE << "Revision " << records[i]->first << " ok" << endl;
+			} else {
+				PTRACE << "Revision " << records[i]->first << " corrupted!" << endl;
+				m_corrupted.push_back(records[i]->first);
+			}
+		}
+
+		for (int i = 0; i < ncolumns; i++) {
+			delete files[i];
+		}
+	}
+
+private:
+	std::string m_dir;
+	uint32_t m_version;
+	uint32_t m_migration;
+	size_t m_strings;
+	const std::vector<std::pair<uint32_t, Records *> > *m_queue;
+	size_t *m_next;
+	sys::parallel::Mutex *m_mutex;
+	std::vector<std::string> m_corrupted;
+	uint64_t m_bytes;
+};
+
+// Checks cache entries and removes invalid ones from the index file.
+// Indexes in the old gzipped format will be converted.
 void Cache::check(bool force)
 {
-	std::map<std::string, std::pair<uint32_t, uint32_t> > index;
+	std::map<std::string, CacheIndex::Entry> index;
 
 	std::string path = cacheDir();
 	PDEBUG << "Checking cache in dir: " << path << endl;
@@ -324,31 +1967,59 @@ void Cache::check(bool force)
 	}
 	sys::datetime::Watch watch;
 
-	GZIStream *in = new GZIStream(path+"/index");
-	if (!in->ok()) {
+	// Close the index of this instance, it will be reloaded on demand
+	stopMigration();
+	flush();
+	delete m_index;
+	m_index = NULL;
+	m_loaded = false;
+
+	// No other process may use the cache during the check
+	lock(true);
+
+	m_dict = std::make_shared<CacheDictionary>(path);
+	try {
+		m_dict->refresh();
+	} catch (const std::exception &ex) {
+		// Records referring to the dictionary will be reported as corrupted
+		std::cerr << "Cache: " << ex.what() << std::endl;
+		m_dict = std::make_shared<CacheDictionary>(path);
+	}
+
+	uint32_t version;
+	bool legacy = false, pending = false;
+	m_migration = 0;
+	if (readLegacyIndex(path, &version, &index)) {
+		// Records that have been converted in the background already are
+		// listed in the new index
+		legacy = true;
+		m_migration = readMigration(path, version);
+		if (m_migration > 0 && CacheIndex::exists(path)) {
+			CacheIndex in(path);
+			in.open();
+			std::vector<std::pair<std::string, CacheIndex::Entry> > entries = in.entries();
+			for (size_t i = 0; i < entries.size(); i++) {
+				index[entries[i].first] = entries[i].second;
+			}
+		}
+	} else if (CacheIndex::exists(path)) {
+		CacheIndex in(path);
+		in.open();
+		version = in.version();
+		m_migration = readMigration(path, version);
+		std::vector<std::pair<std::string, CacheIndex::Entry> > entries = in.entries();
+		index.insert(entries.begin(), entries.end());
+		pending = sys::fs::fileExists(path + "/index.log");
+	} else {
 		Logger::info() << "Cache: Empty cache for '" << uuid() << '\'' << endl;
-		delete in;
 		return;
 	}
 
-	BIStream *cache_in = NULL;
-	uint32_t cache_index = -1;
-
-	uint32_t version;
-	*in >> version;
 	switch (checkVersion(version)) {
 		case OutOfDate:
-			delete in;
-			Logger::warn() << "Cache: Cache is out of date";
-			if (!force) {
-				Logger::warn() << " - won't clear it until forced to do so" << endl;
-			} else {
-				Logger::warn() << ", clearing" << endl;
-				clear();
-			}
-			return;
+			Logger::info() << "Cache: Cache is out of date, revisions affected by bugs of version " << version << " will be fetched again" << endl;
+			break;
 		case UnknownVersion:
-			delete in;
 			Logger::warn() << "Cache: Unknown cache version number " << version;
 			if (!force) {
 				Logger::warn() << " - won't clear it until forced to do so" << endl;
@@ -361,89 +2032,377 @@ void Cache::check(bool force)
 			break;
 	}
 
+	PDEBUG << "Checksum kernel: " << checksum::kernel(version < CRC32C_VERSION ? checksum::Crc32 : checksum::Crc32c).name << endl;
 	Logger::status() << "Checking all indexed revisions... " << ::flush;
 
-	std::string id;
-	std::pair<uint32_t, uint32_t> pos;
-	uint32_t crc;
-	std::map<std::string, uint32_t> crcs;
+	// Group records by cache file
+	std::map<uint32_t, SegmentChecker::Records> segments;
+	for (std::map<std::string, CacheIndex::Entry>::iterator it = index.begin(); it != index.end(); ++it) {
+		segments[it->second.segment].push_back(&(*it));
+	}
+	std::vector<std::pair<uint32_t, SegmentChecker::Records *> > queue;
+	for (std::map<uint32_t, SegmentChecker::Records>::iterator it = segments.begin(); it != segments.end(); ++it) {
+		queue.push_back(std::pair<uint32_t, SegmentChecker::Records *>(it->first, &(it->second)));
+	}
+
+	// Verify the cache files in parallel
+	sys::datetime::Watch checkWatch;
+	sys::parallel::Mutex mutex;
+	size_t next = 0;
+	int nthreads = std::max(1, std::min(sys::parallel::idealThreadCount(), (int)queue.size()));
+	std::vector<SegmentChecker *> threads;
+	for (int i = 0; i < nthreads; i++) {
+		threads.push_back(new SegmentChecker(path, version, m_migration, m_dict->size(), &queue, &next, &mutex));
+		threads.back()->start();
+	}
+
 	std::vector<std::string> corrupted;
-	while (!(*in >> id).eof()) {
-		if (!in->ok()) {
-			goto corrupt;
-		}
+	uint64_t bytes = 0;
+	for (int i = 0; i < nthreads; i++) {
+		threads[i]->wait();
+		corrupted.insert(corrupted.end(), threads[i]->corrupted().begin(), threads[i]->corrupted().end());
+		bytes += threads[i]->bytes();
+		delete threads[i];
+	}
+	std::sort(corrupted.begin(), corrupted.end());
+	for (size_t i = 0; i < corrupted.size(); i++) {
+		std::cerr << "Cache: Revision " << corrupted[i] << " is corrupted, removing from index file" << std::endl;
+	}
 
-		*in >> pos.first >> pos.second;
-		*in >> crc;
-		if (!in->ok()) {
-			goto corrupt;
-		}
+	Logger::status() << "done" << endl;
 
-		index[id] = pos;
-		crcs[id] = crc;
+	float secs = std::max(checkWatch.elapsed(), 0.001f);
+	Logger::info() << "Cache: Checked " << index.size() << " revisions in " << watch.elapsedMSecs() << " ms using "
+		<< nthreads << " threads (" << int(index.size() / secs) << " records/s, "
+		<< str::printf("%.1f", bytes / (1024.0f * 1024.0f * secs)) << " MB/s)" << endl;
 
-		if (cache_in == NULL || cache_index != pos.first) {
-			delete cache_in;
-			cache_in = new BIStream(str::printf("%s/cache.%u", path.c_str(), pos.first));
-			cache_index = pos.first;
-			if (!cache_in->ok()) {
-				delete cache_in; cache_in = NULL;
-				goto corrupt;
-			}
+	bool convert = (version < CACHE_VERSION);
+	if (corrupted.empty() && !legacy && !pending && !convert) {
+		Logger::info() << "Cache: Everything's alright" << endl;
+		return;
+	}
+
+	if (legacy) {
+		Logger::info() << "Cache: Converting index file to the current format" << endl;
+	} else if (!corrupted.empty()) {
+		Logger::info() << "Cache: " << corrupted.size() << " corrupted revisions, rewriting index file" << endl;
+	}
+
+	// Remove corrupted revisions from index file
+	for (unsigned int i = 0; i < corrupted.size(); i++) {
+		index.erase(corrupted[i]);
+	}
+
+	if (convert) {
+		// Split the records into column files, keeping their current order
+		Logger::info() << "Cache: Converting cache files to the current format" << endl;
+		std::vector<std::string> order;
+		appendByLocation(index, &order);
+
+		Logger::status() << "Converting cache files... " << ::flush;
+		uint64_t oldSize, newSize;
+		size_t dropped = rewrite(order, index, version, &oldSize, &newSize);
+		Logger::status() << "done" << endl;
+		Logger::info() << "Cache: Converted " << index.size() - dropped << " revisions, size " << oldSize / 1024 << " KiB -> " << newSize / 1024 << " KiB" << endl;
+	} else {
+		// Rewrite index file
+		CacheIndex out(path);
+		out.rewrite(index, CACHE_VERSION);
+	}
+	if (legacy) {
+		SIGBLOCK_DEFER();
+		sys::fs::unlink(path + "/index");
+	}
+}
+
+// Writes the given records to new cache files in the given order, publishes
+// a new index and removes the previous cache files. Records of older cache
+// versions, including the ones of an unfinished migration, are converted to
+// the current format. Corrupted records are dropped, as well as records that
+// are affected by bugs of older versions, which will be fetched again. The
+// cache must be locked exclusively. Returns the number of dropped records.
+size_t Cache::rewrite(const std::vector<std::string> &order, const std::map<std::string, CacheIndex::Entry> &index, uint32_t version, uint64_t *oldSize, uint64_t *newSize)
+{
+	std::string path = cacheDir();
+
+	// New cache files are numbered after the existing ones, so a rewrite
+	// that has been interrupted doesn't affect the current index
+	std::vector<std::string> files = sys::fs::ls(path);
+	std::vector<std::string> oldFiles;
+	uint32_t coindex = 0;
+	*oldSize = 0;
+	for (size_t i = 0; i < files.size(); i++) {
+		uint32_t n;
+		if (!parseColumnPath(files[i], &n)) {
+			continue;
 		}
-		if (cache_in != NULL) {
-			if (!cache_in->seek(pos.second)) {
-				goto corrupt;
-			} else {
-				std::vector<char> data;
-				*cache_in >> data;
-				if (utils::crc32(data) != crc) {
-					goto corrupt;
+		oldFiles.push_back(path + "/" + files[i]);
+		*oldSize += sys::fs::filesize(oldFiles.back());
+		coindex = std::max(coindex, n + 1);
+	}
+
+	std::map<std::string, CacheIndex::Entry> rewritten;
+	SegmentWriter *out = new SegmentWriter(path, coindex);
+	size_t dropped = 0, refetch = 0;
+	*newSize = 0;
+	try {
+		for (size_t i = 0; i < order.size(); i++) {
+			const CacheIndex::Entry &entry = index.find(order[i])->second;
+			uint32_t rversion = segmentVersion(entry.segment, version, m_migration);
+			ColumnRecord columns;
+			bool ok, stale = false;
+			try {
+				std::shared_ptr<sys::fs::MappedFile> files[NumColumns];
+				files[HeadColumn] = segment(entry.segment, 0);
+				if (rversion >= COLUMNS_VERSION) {
+					files[MessageColumn] = segment(entry.segment, 0, MessageColumn);
+					files[DiffstatColumn] = segment(entry.segment, 0, DiffstatColumn);
 				}
+				ok = convert(order[i], entry, rversion, files, m_dict, &columns, &stale);
+			} catch (const std::exception &ex) {
+				PDEBUG << ex.what() << endl;
+				ok = false;
 			}
+			if (stale) {
+				PDEBUG << "Cache: Revision " << order[i] << " is outdated, dropping it" << endl;
+				++refetch;
+				continue;
+			}
+			if (!ok) {
+				std::cerr << "Cache: Revision " << order[i] << " is corrupted, removing from index file" << std::endl;
+				++dropped;
+				continue;
+			}
+
+			if (out->full()) {
+				*newSize += out->size();
+				delete out;
+				out = new SegmentWriter(path, ++coindex);
+			}
+			rewritten[order[i]] = out->write(columns);
 		}
+		*newSize += out->size();
+		delete out;
+		out = NULL;
+	} catch (...) {
+		delete out;
+		flush();
+		throw;
+	}
+	flush();
 
-		PTRACE << "Revision " << id << " ok" << endl;
-		continue;
+	if (refetch > 0) {
+		Logger::info() << "Cache: Dropped " << refetch << " revisions affected by bugs of older versions, they will be fetched again" << endl;
+	}
 
-corrupt:
-		PTRACE << "Revision " << id << " corrupted!" << endl;
-		std::cerr << "Cache: Revision " << id << " is corrupted, removing from index file" << std::endl;
-		corrupted.push_back(id);
+	// Publish the new index, then remove the old cache files. All records
+	// are in the current version now.
+	SIGBLOCK_DEFER();
+	CacheIndex rewrittenIndex(path);
+	rewrittenIndex.rewrite(rewritten, CACHE_VERSION);
+	if (m_migration > 0) {
+		sys::fs::unlink(path + "/migration");
+		m_migration = 0;
 	}
-	delete cache_in;
-	delete in;
+	for (size_t i = 0; i < oldFiles.size(); i++) {
+		PDEBUG << "Unlinking " << oldFiles[i] << endl;
+		sys::fs::unlink(oldFiles[i]);
+	}
+	return dropped + refetch;
+}
 
-	Logger::status() << "done" << endl;
+// Rewrites all cache files, storing the revisions of the given branch in
+// iteration order. Records that are not referenced by the index are dropped.
+void Cache::compact(const std::string &branch)
+{
+	std::string path = cacheDir();
+	PDEBUG << "Compacting cache in dir: " << path << endl;
+
+	bool created;
+	checkDir(path, &created);
+	if (created) {
+		Logger::info() << "Cache: Created empty cache for '" << uuid() << '\'' << endl;
+		return;
+	}
+	sys::datetime::Watch watch;
+
+	// Close the index of this instance, it will be reloaded on demand
+	stopMigration();
+	flush();
+	delete m_index;
+	m_index = NULL;
+	m_loaded = false;
 
-	Logger::info() << "Cache: Checked " << index.size() << " revisions in " << watch.elapsedMSecs() << " ms" << endl;
+	// Cache files will be removed, so no other process may use the cache
+	lock(true);
+	m_dict = std::make_shared<CacheDictionary>(path);
+	m_dict->refresh();
 
-	if (corrupted.empty()) {
-		Logger::info() << "Cache: Everything's alright" << endl;
+	if (sys::fs::fileExists(path + "/index")) {
+		throw PEX("Cache is in an old format - please run the check_cache report");
+	}
+	if (!CacheIndex::exists(path)) {
+		Logger::info() << "Cache: Empty cache for '" << uuid() << '\'' << endl;
 		return;
 	}
 
-	Logger::info() << "Cache: " << corrupted.size() << " corrupted revisions, rewriting index file" << endl;
+	CacheIndex in(path);
+	in.open();
+	uint32_t version = in.version();
+	m_migration = 0;
+	if (checkVersion(version) != Ok) {
+		throw PEX(str::printf("Cache is out of date or has an unknown version number (%u) - please run the check_cache report", version));
+	}
+	if (version < CACHE_VERSION) {
+		throw PEX("Cache is in an old format - please run the check_cache report");
+	}
+	std::vector<std::pair<std::string, CacheIndex::Entry> > entries = in.entries();
+	in.close();
 
-	// Remove corrupted revisions from index file
-	for (unsigned int i = 0; i < corrupted.size(); i++) {
-		std::map<std::string, std::pair<uint32_t, uint32_t> >::iterator it = index.find(corrupted[i]);
-		if (it != index.end()) {
-			index.erase(it);
+	// Determine the new record order: revisions of the given branch first,
+	// followed by all other revisions in their current order
+	Logger::status() << "Determining iteration order... " << ::flush;
+	std::map<std::string, CacheIndex::Entry> index(entries.begin(), entries.end());
+	std::vector<std::string> order;
+	{
+		RevisionIterator it(m_backend, branch, -1, -1, (RevisionIterator::Flags)0);
+		while (!it.atEnd()) {
+			std::string id = it.next();
+			std::map<std::string, CacheIndex::Entry>::iterator jt = index.find(id);
+			if (jt != index.end()) {
+				order.push_back(id);
+				index.erase(jt);
+			}
 		}
 	}
+	size_t nbranch = order.size();
+	appendByLocation(index, &order);
+	index.clear();
+	index.insert(entries.begin(), entries.end());
+	Logger::status() << "done" << endl;
 
-	// Defer any signals while writing to the cache
-	{
-		SIGBLOCK_DEFER();
+	Logger::status() << "Rewriting cache files... " << ::flush;
+	uint64_t oldSize, newSize;
+	size_t dropped = rewrite(order, index, version, &oldSize, &newSize);
+	Logger::status() << "done" << endl;
 
-		// Rewrite index file
-		GZOStream out(path+"/index");
-		out << CACHE_VERSION;
-		for (std::map<std::string, std::pair<uint32_t, uint32_t> >::iterator it = index.begin(); it != index.end(); ++it) {
-			out << it->first;
-			out << it->second.first << it->second.second;
-			out << crcs[it->first];
+	Logger::info() << "Cache: Compacted " << index.size() - dropped << " revisions (" << nbranch << " on branch";
+	if (dropped) {
+		Logger::info() << ", " << dropped << " corrupted ones dropped";
+	}
+	Logger::info() << ") in " << watch.elapsedMSecs() << " ms, size " << oldSize / 1024 << " KiB -> " << newSize / 1024 << " KiB" << endl;
+}
+
+// Merges the caches of this repository found in other cache directories,
+// e.g. built by several machines for parts of the history. Records are
+// verified before being added, revisions that are cached already are
+// skipped, and the merged cache is compacted afterwards. The other caches
+// are only read, and they are locked for shared access meanwhile.
+void Cache::merge(const std::vector<std::string> &dirs)
+{
+	if (!m_loaded) {
+		load(false);
+	}
+	if (m_version < CACHE_VERSION) {
+		// The merged cache will be compacted, which requires the current
+		// format
+		throw PEX("Cache is in an old format - please run the check_cache report first");
+	}
+
+	sys::datetime::Watch watch;
+	size_t merged = 0, duplicates = 0, corrupted = 0;
+	for (size_t d = 0; d < dirs.size(); d++) {
+		// Both cache roots and repository caches are accepted
+		std::string path = dirs[d] + "/" + uuid();
+		if (!CacheIndex::exists(path) && CacheIndex::exists(dirs[d]) && sys::fs::basename(dirs[d]) == uuid()) {
+			path = dirs[d];
+		}
+		if (!CacheIndex::exists(path)) {
+			throw PEX(str::printf("No cache for repository %s in %s", uuid().c_str(), dirs[d].c_str()));
 		}
+		if (path == cacheDir()) {
+			throw PEX(str::printf("Unable to merge %s into itself", path.c_str()));
+		}
+
+		ReadLock lock(path);
+		CacheIndex in(path);
+		in.open();
+		uint32_t version = in.version();
+		if (checkVersion(version) != Ok || version < DICTIONARY_VERSION || sys::fs::fileExists(path + "/index")) {
+			throw PEX(str::printf("Cache in %s is in an old format - please run the check_cache report on it first", dirs[d].c_str()));
+		}
+		uint32_t migration = readMigration(path, version);
+		std::shared_ptr<CacheDictionary> dict = std::make_shared<CacheDictionary>(path);
+		dict->refresh();
+		std::vector<std::pair<std::string, CacheIndex::Entry> > entries = in.entries();
+		std::map<std::string, CacheIndex::Entry> index(entries.begin(), entries.end());
+		entries.clear();
+		in.close();
+
+		std::vector<std::string> order;
+		appendByLocation(index, &order);
+		Logger::status() << "Merging cache from " << path << "... " << ::flush;
+		std::map<uint32_t, std::shared_ptr<sys::fs::MappedFile> > files[NumColumns];
+		for (size_t i = 0; i < order.size(); i += MIGRATION_BATCH) {
+			std::vector<std::string> batch(order.begin() + i, order.begin() + std::min(i + MIGRATION_BATCH, order.size()));
+			std::vector<bool> cached = lookupMany(batch);
+			for (size_t j = 0; j < batch.size(); j++) {
+				if (cached[j]) {
+					++duplicates;
+					continue;
+				}
+
+				const CacheIndex::Entry &entry = index[batch[j]];
+				uint32_t rversion = segmentVersion(entry.segment, version, migration);
+				Revision *rev = NULL;
+				try {
+					std::shared_ptr<sys::fs::MappedFile> mapped[NumColumns];
+					for (int k = 0; k < NumColumns; k++) {
+						std::shared_ptr<sys::fs::MappedFile> &file = files[k][entry.segment];
+						if (!file) {
+							file = std::make_shared<sys::fs::MappedFile>(columnPath(path, entry.segment, k));
+						}
+						mapped[k] = file;
+					}
+
+					const char *data;
+					uint32_t size;
+					RecordHead head;
+					if (locateRecord(mapped[HeadColumn].get(), entry.offset, &data, &size)
+						&& recordChecksum(rversion, data, size) == entry.crc
+						&& checkRecord(data, size, rversion, mapped[MessageColumn].get(), mapped[DiffstatColumn].get(), &head)
+						&& head.strings <= dict->size() && head.author < head.strings) {
+						rev = new Revision(batch[j], head.date, dict->at(head.author), new ColumnLoader(batch[j], head, mapped[MessageColumn], mapped[DiffstatColumn], dict, m_stats, rversion));
+					}
+				} catch (const std::exception &ex) {
+					PDEBUG << ex.what() << endl;
+				}
+				if (rev == NULL) {
+					Logger::warn() << "Cache: Revision " << batch[j] << " in " << path << " is corrupted, skipping it" << endl;
+					++corrupted;
+					continue;
+				}
+
+				try {
+					put(batch[j], *rev);
+				} catch (...) {
+					delete rev;
+					throw;
+				}
+				delete rev;
+				++merged;
+			}
+		}
+		Logger::status() << "done" << endl;
+	}
+
+	Logger::info() << "Cache: Merged " << merged << " revisions from " << dirs.size() << " caches (" << duplicates << " duplicates";
+	if (corrupted) {
+		Logger::info() << ", " << corrupted << " corrupted ones skipped";
 	}
+	Logger::info() << ") in " << watch.elapsedMSecs() << " ms" << endl;
+
+	// Merged revisions are appended in the order of the other caches, so
+	// rewrite the cache in iteration order of the main branch
+	compact(m_backend->mainBranch());
 }
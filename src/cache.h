@@ -15,15 +15,38 @@
 #define CACHE_H_
 
 
+#include <memory>
+
 #include "abstractcache.h"
+#include "cacheindex.h"
+#include "dictionary.h"
+
+#include "syslib/parallel.h"
+
+// Regions of the lock file: Every process holds a shared lock on the access
+// byte while using the cache, and an exclusive one for maintenance tasks.
+// Processes appending to the cache hold an exclusive lock on the write byte.
+#define CACHE_LOCK_ACCESS 0
+#define CACHE_LOCK_WRITE 1
+
+struct ColumnRecord;
+class CacheMigrator;
+class RecordPipeline;
+class SegmentWriter;
 
-class BIStream;
-class BOStream;
+namespace sys {
+	namespace fs {
+		class MappedFile;
+	}
+}
 
 
 class Cache : public AbstractCache
 {
+	friend class CacheMigrator; // For converting revisions
 	friend class LdbCache; // For importing revisions
+	friend class RecordPipeline; // For writing revisions
+	friend class SegmentChecker; // For checking revisions
 
 	private:
 		typedef enum {
@@ -33,33 +56,82 @@ class Cache : public AbstractCache
 			OutOfDate
 		} VersionCheckResult;
 
+	public:
+		// Files that make up a cache segment
+		typedef enum {
+			HeadColumn = 0,
+			MessageColumn,
+			DiffstatColumn,
+			NumColumns
+		} Column;
+
 	public:
 		Cache(Backend *backend, const Options &options);
 		~Cache();
 
 		void flush();
 		void check(bool force = false);
+		void compact(const std::string &branch = std::string());
+		void merge(const std::vector<std::string> &dirs);
 
-	protected:
+		std::vector<std::vector<char> > columnData(Column column);
+
+	PEPPER_PROTVARS:
 		bool lookup(const std::string &id);
 		void put(const std::string &id, const Revision &rev);
 		Revision *get(const std::string &id);
 
-	private:
-		void load();
+		std::vector<bool> lookupMany(const std::vector<std::string> &ids);
+		std::vector<Revision *> getMany(const std::vector<std::string> &ids);
+		std::vector<std::string> cachedIds();
+
+	PEPPER_PVARS:
+		void load(bool convert = true);
 		void clear();
-		void lock();
+		void lock(bool exclusive = false);
 		void unlock();
+		bool setLock(int type, off_t start, bool wait);
+		void intern(const std::vector<std::string> &strings);
+		void commit(const std::vector<std::pair<std::string, ColumnRecord *> > &records);
+		void append(const std::vector<std::pair<std::string, ColumnRecord *> > &records, bool replace = false);
 		VersionCheckResult checkVersion(int version);
-
-	private:
-		BOStream *m_iout, *m_cout;
-		BIStream *m_cin;
-		uint32_t m_coindex, m_ciindex;
+		bool outdated(const Revision &rev, uint32_t version);
+		void migrate(uint32_t version);
+		size_t migrate(const std::vector<std::string> &ids, const std::shared_ptr<CacheDictionary> &dict);
+		bool convert(const std::string &id, const CacheIndex::Entry &entry, uint32_t version, const std::shared_ptr<sys::fs::MappedFile> *files, const std::shared_ptr<CacheDictionary> &dict, ColumnRecord *columns, bool *outdated);
+		void stopMigration();
+		void finishMigration();
+		bool locate(const std::string &id, CacheIndex::Entry *entry = NULL) const;
+		std::vector<std::pair<std::string, CacheIndex::Entry> > indexEntries() const;
+		Revision *decode(const std::string &id, const CacheIndex::Entry &entry);
+		size_t rewrite(const std::vector<std::string> &order, const std::map<std::string, CacheIndex::Entry> &index, uint32_t version, uint64_t *oldSize, uint64_t *newSize);
+		std::shared_ptr<sys::fs::MappedFile> segment(uint32_t index, size_t size, Column column = HeadColumn);
+		std::shared_ptr<sys::fs::MappedFile> record(const std::string &id, uint32_t index, uint32_t offset, uint32_t *size);
+
+		static uint32_t readMigration(const std::string &dir, uint32_t version);
+		static void writeMigration(const std::string &dir, uint32_t version, uint32_t segment);
+		static uint32_t segmentVersion(uint32_t segment, uint32_t version, uint32_t migration);
+
+	PEPPER_PVARS:
+		SegmentWriter *m_writer;
+		RecordPipeline *m_pipeline;
+		uint32_t m_coindex;
+		std::vector<std::shared_ptr<sys::fs::MappedFile> > m_segments[NumColumns];
 		bool m_loaded;
 		int m_lock;
 
-		std::map<std::string, std::pair<uint32_t, uint32_t> > m_index;
+		CacheIndex *m_index;
+		std::shared_ptr<CacheDictionary> m_dict;
+
+		std::map<std::string, int64_t> m_dates; // Commit dates for finding outdated revisions
+		uint32_t m_version; // Version of the records before m_migration
+		uint32_t m_migration; // First segment written by an unfinished migration
+		std::map<std::string, CacheIndex::Entry> m_legacy; // Index of a legacy cache that is being converted
+		bool m_outdated; // Unconverted records may be affected by bugs of their version
+		CacheMigrator *m_migrator;
+
+		sys::parallel::Mutex m_indexMutex; // Guards the index while writing in the background
+		sys::parallel::Mutex m_writeMutex; // Guards the write lock of this process
 };
 
 
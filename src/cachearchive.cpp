@@ -0,0 +1,304 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: cachearchive.cpp
+ * Portable archives of repository caches
+ */
+
+/*
+ * An archive contains the cached revisions of a single repository and the
+ * Subversion log interval files. Revisions are stored in the same encoding
+ * as used by the cache daemon, so archives don't depend on the cache
+ * implementation and can be merged into existing caches. The archive is
+ * written sequentially and may be streamed through a pipe. Every block is
+ * compressed and checksummed, and the end block guards against truncation.
+ *
+ *    archive: "PARC" <format> <backend name> <uuid> <block> ...
+ *    block:   <type> <size> <crc32c> <data>
+ *
+ *    revisions block: <number of revisions> <id> <revision data> ...
+ *    file block:      <file name> <contents>
+ *    end block:       <number of revisions> <number of files>
+ */
+
+
+#include "main.h"
+
+#include <cstring>
+#include <unistd.h>
+
+#include "abstractcache.h"
+#include "bstream.h"
+#include "cachedaemon.h"
+#include "checksum.h"
+#include "codec.h"
+#include "logger.h"
+#include "revision.h"
+#include "strlib.h"
+
+#include "syslib/datetime.h"
+#include "syslib/fs.h"
+
+#include "cachearchive.h"
+
+// Version of the archive format
+#define ARCHIVE_FORMAT (uint32_t)1
+// Number of revisions per block
+#define ARCHIVE_BATCH 256
+// Maximum size of a single block
+#define ARCHIVE_MAX_BLOCK (256 * 1024 * 1024)
+
+
+// Opens the given file, or the standard streams for "-"
+static FILE *openFile(const std::string &path, bool write)
+{
+	FILE *f;
+	if (path == "-") {
+		// The stream will be closed by the caller
+		int fd = dup(write ? STDOUT_FILENO : STDIN_FILENO);
+		f = (fd >= 0 ? fdopen(fd, (write ? "wb" : "rb")) : NULL);
+	} else {
+		f = fopen(path.c_str(), (write ? "wb" : "rb"));
+	}
+	if (f == NULL) {
+		throw PEX(str::printf("Unable to open cache archive %s: %s", path.c_str(), PepperException::strerror(errno).c_str()));
+	}
+	return f;
+}
+
+
+// Constructor
+CacheArchive::CacheArchive(AbstractCache *cache)
+	: m_cache(cache)
+{
+}
+
+// Writes all cached revisions of the current repository to the given file
+void CacheArchive::exportTo(const std::string &path)
+{
+	sys::datetime::Watch watch;
+	std::vector<std::string> ids = m_cache->cachedIds();
+	std::vector<std::string> files = logFiles();
+
+	BOStream out(openFile(path, true));
+	out.write("PARC", 4);
+	out << ARCHIVE_FORMAT << m_cache->name() << m_cache->uuid();
+
+	int progress = -1;
+	for (size_t i = 0; i < ids.size(); i += ARCHIVE_BATCH) {
+		std::vector<std::string> batch(ids.begin() + i, ids.begin() + std::min(i + ARCHIVE_BATCH, ids.size()));
+		std::vector<Revision *> revs = m_cache->getMany(batch);
+		MOStream block;
+		block << (uint32_t)batch.size();
+		for (size_t j = 0; j < batch.size(); j++) {
+			block << batch[j] << CacheDaemon::encode(*revs[j]);
+			delete revs[j];
+		}
+		writeBlock(out, RevisionsBlock, block.data());
+
+		if (progress != int(100.0f * (i + batch.size()) / ids.size())) {
+			progress = int(100.0f * (i + batch.size()) / ids.size());
+			Logger::status() << "\r\033[0K";
+			Logger::status() << "Exporting revisions... " << progress << "%" << ::flush;
+		}
+	}
+	if (!ids.empty()) {
+		Logger::status() << "\r\033[0K";
+		Logger::status() << "Exporting revisions... done" << endl;
+	}
+
+	std::string dir = m_cache->cacheDir();
+	for (size_t i = 0; i < files.size(); i++) {
+		sys::fs::MappedFile file(dir + "/" + files[i]);
+		MOStream block;
+		block << files[i] << std::vector<char>(file.data(), file.data() + file.size());
+		writeBlock(out, FileBlock, block.data());
+	}
+
+	MOStream block;
+	block << (uint64_t)ids.size() << (uint32_t)files.size();
+	writeBlock(out, EndBlock, block.data());
+	if (!out.flush() || !out.ok()) {
+		throw PEX(str::printf("Unable to write cache archive %s", path.c_str()));
+	}
+
+	Logger::status() << "Cache: Exported " << ids.size() << " revisions and " << files.size() << " files in " << watch.elapsedMSecs() << " ms" << endl;
+}
+
+// Merges the revisions of the given archive into the cache. Revisions that
+// are cached already are kept.
+void CacheArchive::importFrom(const std::string &path)
+{
+	sys::datetime::Watch watch;
+	BIStream in(openFile(path, false));
+	char magic[4];
+	uint32_t format;
+	std::string name, uuid;
+	if (in.read(magic, 4) != 4 || memcmp(magic, "PARC", 4) != 0) {
+		throw PEX(str::printf("%s is not a cache archive", path.c_str()));
+	}
+	in >> format >> name >> uuid;
+	if (!in.ok() || format != ARCHIVE_FORMAT) {
+		throw PEX(str::printf("Unknown cache archive format %u", format));
+	}
+	if (name != m_cache->name() || uuid != m_cache->uuid()) {
+		throw PEX(str::printf("Cache archive belongs to a different repository (%s %s)", name.c_str(), uuid.c_str()));
+	}
+
+	std::string dir = m_cache->cacheDir();
+	AbstractCache::checkDir(dir);
+	uint64_t nrevs = 0, imported = 0;
+	uint32_t nfiles = 0;
+	char type;
+	std::vector<char> data;
+	while (readBlock(in, &type, &data)) {
+		VIStream block(data);
+		switch (type) {
+			case RevisionsBlock: {
+				uint32_t n;
+				block >> n;
+				std::vector<std::string> ids(n);
+				std::vector<std::vector<char> > values(n);
+				for (uint32_t i = 0; i < n; i++) {
+					block >> ids[i] >> values[i];
+				}
+				if (!block.ok()) {
+					throw PEX("Corrupted cache archive (invalid revisions block)");
+				}
+
+				std::vector<bool> cached = m_cache->lookupMany(ids);
+				for (uint32_t i = 0; i < n; i++) {
+					if (cached[i]) {
+						continue;
+					}
+					Revision *rev = CacheDaemon::decode(ids[i], values[i]);
+					try {
+						m_cache->put(ids[i], *rev);
+					} catch (...) {
+						delete rev;
+						throw;
+					}
+					delete rev;
+					++imported;
+				}
+				nrevs += n;
+				Logger::status() << "\r\033[0K";
+				Logger::status() << "Importing revisions... " << nrevs << ::flush;
+				break;
+			}
+
+			case FileBlock: {
+				std::string file;
+				std::vector<char> contents;
+				block >> file >> contents;
+				if (!block.ok() || file.compare(0, 4, "log_") != 0 || file.find('/') != std::string::npos) {
+					throw PEX("Corrupted cache archive (invalid file block)");
+				}
+
+				// Local log intervals are consistent with the local cache
+				if (sys::fs::fileExists(dir + "/" + file)) {
+					PDEBUG << "Cache: Keeping existing file " << file << endl;
+				} else {
+					std::string tmppath = dir + "/" + file + ".tmp";
+					{
+						BOStream out(tmppath);
+						if (!contents.empty()) {
+							out.write(&contents[0], contents.size());
+						}
+						if (!out.ok()) {
+							throw PEX(str::printf("Unable to write cache file %s", tmppath.c_str()));
+						}
+					}
+					sys::fs::rename(tmppath, dir + "/" + file);
+				}
+				++nfiles;
+				break;
+			}
+
+			case EndBlock: {
+				uint64_t n;
+				uint32_t k;
+				block >> n >> k;
+				if (!block.ok() || n != nrevs || k != nfiles) {
+					throw PEX("Corrupted cache archive (missing blocks)");
+				}
+				m_cache->flush();
+				if (nrevs > 0) {
+					Logger::status() << "\r\033[0K";
+					Logger::status() << "Importing revisions... done" << endl;
+				}
+				Logger::status() << "Cache: Imported " << imported << " of " << nrevs << " revisions and " << nfiles << " files in " << watch.elapsedMSecs() << " ms" << endl;
+				return;
+			}
+
+			default:
+				throw PEX(str::printf("Corrupted cache archive (unknown block type %d)", (int)type));
+		}
+	}
+
+	// Imported revisions are valid nevertheless
+	m_cache->flush();
+	throw PEX(str::printf("Cache archive %s is truncated, imported %u revisions", path.c_str(), (unsigned int)imported));
+}
+
+// Compresses and writes a single block
+void CacheArchive::writeBlock(BOStream &out, char type, const std::vector<char> &data)
+{
+	std::vector<char> payload = Codec::encode(data);
+	out << type << (uint32_t)payload.size() << checksum::crc32c(payload);
+	out.write(&payload[0], payload.size());
+	if (!out.ok()) {
+		throw PEX(str::printf("Unable to write cache archive: %s", PepperException::strerror(errno).c_str()));
+	}
+}
+
+// Reads and verifies a single block. Returns false if the input ends before
+// the block is complete.
+bool CacheArchive::readBlock(BIStream &in, char *type, std::vector<char> *data)
+{
+	uint32_t size, crc;
+	in >> *type;
+	if (in.eof()) {
+		return false;
+	}
+	in >> size >> crc;
+	if (in.eof()) {
+		return false;
+	}
+	if (size > ARCHIVE_MAX_BLOCK) {
+		throw PEX("Corrupted cache archive (invalid block size)");
+	}
+
+	std::vector<char> payload(size);
+	if (size > 0 && in.read(&payload[0], size) != (ssize_t)size) {
+		return false;
+	}
+	if (checksum::crc32c(payload) != crc) {
+		throw PEX("Corrupted cache archive (checksum mismatch)");
+	}
+	*data = Codec::decode(payload);
+	return true;
+}
+
+// Returns the Subversion log interval files of the current cache
+std::vector<std::string> CacheArchive::logFiles()
+{
+	std::string dir = m_cache->cacheDir();
+	std::vector<std::string> files;
+	if (!sys::fs::dirExists(dir)) {
+		return files;
+	}
+
+	std::vector<std::string> names = sys::fs::ls(dir);
+	for (size_t i = 0; i < names.size(); i++) {
+		if (names[i].compare(0, 4, "log_") == 0 && !str::endsWith(names[i], ".tmp") && !sys::fs::dirExists(dir + "/" + names[i])) {
+			files.push_back(names[i]);
+		}
+	}
+	return files;
+}
@@ -0,0 +1,54 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: cachearchive.h
+ * Portable archives of repository caches (interface)
+ */
+
+
+#ifndef CACHEARCHIVE_H_
+#define CACHEARCHIVE_H_
+
+
+#include <string>
+#include <vector>
+
+#include "main.h"
+
+class AbstractCache;
+class BIStream;
+class BOStream;
+
+
+class CacheArchive
+{
+	public:
+		// Block types
+		typedef enum {
+			RevisionsBlock = 'R',
+			FileBlock = 'F',
+			EndBlock = 'E'
+		} BlockType;
+
+	public:
+		CacheArchive(AbstractCache *cache);
+
+		void exportTo(const std::string &path);
+		void importFrom(const std::string &path);
+
+	private:
+		void writeBlock(BOStream &out, char type, const std::vector<char> &data);
+		bool readBlock(BIStream &in, char *type, std::vector<char> *data);
+		std::vector<std::string> logFiles();
+
+	PEPPER_PVARS:
+		AbstractCache *m_cache;
+};
+
+
+#endif // CACHEARCHIVE_H_
@@ -0,0 +1,318 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: cachebudget.cpp
+ * Disk usage limit for the cache directory
+ */
+
+/*
+ * The disk usage of the cache directory is limited by removing whole
+ * repository caches, least recently used first. Sizes and access times are
+ * kept in a small ledger file in the cache directory, so an update only
+ * needs to measure the cache of the current repository. Caches that are not
+ * listed in the ledger (e.g. created by older versions) are measured once.
+ *
+ *    usage: "PUSE" <format> <number of entries>
+ *           <uuid> <size> <access time> ...
+ *
+ * The ledger is locked exclusively while being updated. Caches are only
+ * removed if no other process is using them, i.e. if the access byte of
+ * their lock file (and the LevelDB lock file, if present) can be locked.
+ */
+
+
+#include "main.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bstream.h"
+#include "cache.h"
+#include "logger.h"
+#include "strlib.h"
+
+#include "syslib/fs.h"
+
+#include "cachebudget.h"
+
+// Version of the ledger file format
+#define LEDGER_FORMAT (uint32_t)1
+// Prefix of cache directories that are being removed
+#define EVICTED_PREFIX ".evicted-"
+
+
+// Locks the given region of a file, returning false if it is locked by
+// another process
+static bool lockRegion(int fd, off_t start, off_t len, bool wait)
+{
+	struct flock flck;
+	memset(&flck, 0x00, sizeof(struct flock));
+	flck.l_type = F_WRLCK;
+	flck.l_whence = SEEK_SET;
+	flck.l_start = start;
+	flck.l_len = len;
+	while (fcntl(fd, (wait ? F_SETLKW : F_SETLK), &flck) == -1) {
+		if (!wait || errno != EINTR) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Returns the modification time of the given path
+static int64_t mtime(const std::string &path)
+{
+	struct stat statbuf;
+	if (stat(path.c_str(), &statbuf) == -1) {
+		return 0;
+	}
+	return statbuf.st_mtime;
+}
+
+
+// Constructor
+CacheBudget::CacheBudget(const std::string &root, uint64_t budget)
+	: m_root(root), m_budget(budget)
+{
+}
+
+// Returns the total disk usage as of the last update
+uint64_t CacheBudget::usage() const
+{
+	uint64_t total = 0;
+	for (std::map<std::string, Entry>::const_iterator it = m_entries.begin(); it != m_entries.end(); ++it) {
+		total += it->second.size;
+	}
+	return total;
+}
+
+// Returns the repository caches as of the last update
+std::map<std::string, CacheBudget::Entry> CacheBudget::entries() const
+{
+	return m_entries;
+}
+
+// Records an access to the cache of the given repository and removes the
+// least recently used caches of other repositories if the budget is
+// exceeded. Returns the UUIDs of the removed caches.
+std::vector<std::string> CacheBudget::update(const std::string &uuid, int64_t now)
+{
+	if (now < 0) {
+		now = time(NULL);
+	}
+
+	std::string path = m_root + "/usage";
+	int fd = ::open(path.c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+	if (fd == -1) {
+		throw PEX(str::printf("Unable to open cache ledger %s: %s", path.c_str(), PepperException::strerror(errno).c_str()));
+	}
+
+	std::vector<std::string> evicted;
+	try {
+		if (!lockRegion(fd, 0, 0, true)) {
+			throw PEX(str::printf("Unable to lock cache ledger %s: %s", path.c_str(), PepperException::strerror(errno).c_str()));
+		}
+
+		read(fd);
+		scan();
+		if (sys::fs::dirExists(m_root + "/" + uuid)) {
+			m_entries[uuid] = Entry(dirSize(m_root + "/" + uuid), now);
+		}
+
+		uint64_t total = usage();
+		PDEBUG << "Cache: " << m_entries.size() << " repositories using " << total / 1024 << " KiB, budget is " << m_budget / 1024 << " KiB" << endl;
+		if (total > m_budget) {
+			std::vector<std::pair<int64_t, std::string> > order;
+			for (std::map<std::string, Entry>::const_iterator it = m_entries.begin(); it != m_entries.end(); ++it) {
+				if (it->first != uuid) {
+					order.push_back(std::pair<int64_t, std::string>(it->second.access, it->first));
+				}
+			}
+			std::sort(order.begin(), order.end());
+
+			for (size_t i = 0; i < order.size() && total > m_budget; i++) {
+				uint64_t size = m_entries[order[i].second].size;
+				if (evict(order[i].second)) {
+					Logger::info() << "Cache: Removed cache for " << order[i].second << " (" << size / 1024 << " KiB)" << endl;
+					m_entries.erase(order[i].second);
+					evicted.push_back(order[i].second);
+					total -= size;
+				}
+			}
+			if (total > m_budget) {
+				Logger::warn() << "Warning: Cache size (" << total / 1024 << " KiB) exceeds the budget of " << m_budget / 1024 << " KiB" << endl;
+			}
+		}
+
+		write(fd);
+	} catch (...) {
+		::close(fd);
+		throw;
+	}
+	::close(fd);
+	return evicted;
+}
+
+// Returns the total size of all files in the given directory
+uint64_t CacheBudget::dirSize(const std::string &path)
+{
+	uint64_t size = 0;
+	std::vector<std::string> files;
+	try {
+		files = sys::fs::ls(path);
+	} catch (const std::exception &) {
+		return 0;
+	}
+	for (size_t i = 0; i < files.size(); i++) {
+		std::string file = path + "/" + files[i];
+		if (sys::fs::dirExists(file)) {
+			size += dirSize(file);
+			continue;
+		}
+		try {
+			size += sys::fs::filesize(file);
+		} catch (const std::exception &) {
+			// The file may have been removed in the meantime
+		}
+	}
+	return size;
+}
+
+// Reads the ledger. Invalid ledgers will be rebuilt.
+void CacheBudget::read(int fd)
+{
+	m_entries.clear();
+
+	std::vector<char> data;
+	char buffer[4096];
+	ssize_t n;
+	while ((n = ::read(fd, buffer, sizeof(buffer))) != 0) {
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			throw PEX_ERRNO();
+		}
+		data.insert(data.end(), buffer, buffer + n);
+	}
+	if (data.size() < 12) {
+		return;
+	}
+
+	VIStream in(data);
+	char magic[4];
+	uint32_t format, count;
+	in.read(magic, 4);
+	in >> format >> count;
+	if (memcmp(magic, "PUSE", 4) != 0 || format != LEDGER_FORMAT) {
+		PDEBUG << "Cache: Unknown ledger format, rebuilding it" << endl;
+		return;
+	}
+	for (uint32_t i = 0; i < count && !in.eof(); i++) {
+		std::string uuid;
+		Entry entry;
+		in >> uuid >> entry.size >> entry.access;
+		m_entries[uuid] = entry;
+	}
+}
+
+// Writes the ledger
+void CacheBudget::write(int fd)
+{
+	MOStream out;
+	out.write("PUSE", 4);
+	out << LEDGER_FORMAT << (uint32_t)m_entries.size();
+	for (std::map<std::string, Entry>::const_iterator it = m_entries.begin(); it != m_entries.end(); ++it) {
+		out << it->first << it->second.size << it->second.access;
+	}
+
+	std::vector<char> data = out.data();
+	if (ftruncate(fd, 0) != 0 || pwrite(fd, &data[0], data.size(), 0) != (ssize_t)data.size()) {
+		throw PEX(str::printf("Unable to write cache ledger: %s", PepperException::strerror(errno).c_str()));
+	}
+}
+
+// Synchronizes the ledger with the cache directory. Caches that are not
+// listed yet will be measured once.
+void CacheBudget::scan()
+{
+	std::vector<std::string> dirs = sys::fs::ls(m_root);
+	std::map<std::string, Entry> entries;
+	for (size_t i = 0; i < dirs.size(); i++) {
+		std::string path = m_root + "/" + dirs[i];
+		if (!sys::fs::dirExists(path)) {
+			continue;
+		}
+
+		if (dirs[i].compare(0, strlen(EVICTED_PREFIX), EVICTED_PREFIX) == 0) {
+			// Left over by an interrupted removal
+			try {
+				sys::fs::unlinkr(path);
+			} catch (const std::exception &ex) {
+				PDEBUG << "Cache: Unable to remove " << path << ": " << ex.what() << endl;
+			}
+			continue;
+		}
+
+		std::map<std::string, Entry>::const_iterator it = m_entries.find(dirs[i]);
+		if (it != m_entries.end()) {
+			entries[dirs[i]] = it->second;
+		} else {
+			entries[dirs[i]] = Entry(dirSize(path), mtime(path));
+		}
+	}
+	m_entries.swap(entries);
+}
+
+// Removes the cache of the given repository if it is not in use
+bool CacheBudget::evict(const std::string &uuid)
+{
+	std::string path = m_root + "/" + uuid;
+	std::vector<int> fds;
+	std::string locks[] = {path + "/lock", path + "/ldb/LOCK"};
+	bool ok = true;
+	for (size_t i = 0; i < sizeof(locks) / sizeof(locks[0]) && ok; i++) {
+		if (i > 0 && !sys::fs::fileExists(locks[i])) {
+			continue;
+		}
+		int fd = ::open(locks[i].c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+		if (fd == -1) {
+			ok = false;
+			break;
+		}
+		fds.push_back(fd);
+
+		// The access byte of the cache lock file, or the whole LevelDB lock file
+		ok = (i == 0 ? lockRegion(fd, CACHE_LOCK_ACCESS, 1, false) : lockRegion(fd, 0, 0, false));
+	}
+
+	// Rename the directory first, so other processes won't open the cache
+	// while it's being removed
+	if (ok) {
+		std::string tmp = m_root + "/" + EVICTED_PREFIX + uuid + str::printf("-%d", (int)getpid());
+		try {
+			sys::fs::rename(path, tmp);
+			sys::fs::unlinkr(tmp);
+		} catch (const std::exception &ex) {
+			PDEBUG << "Cache: Unable to remove " << path << ": " << ex.what() << endl;
+			ok = !sys::fs::dirExists(path);
+		}
+	} else {
+		PDEBUG << "Cache: Cache for " << uuid << " is in use, not removing it" << endl;
+	}
+
+	for (size_t i = 0; i < fds.size(); i++) {
+		::close(fds[i]);
+	}
+	return ok;
+}
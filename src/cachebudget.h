@@ -0,0 +1,61 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: cachebudget.h
+ * Disk usage limit for the cache directory (interface)
+ */
+
+
+#ifndef CACHEBUDGET_H_
+#define CACHEBUDGET_H_
+
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "main.h"
+
+
+class CacheBudget
+{
+	public:
+		// Disk usage and last access of a repository cache
+		struct Entry
+		{
+			uint64_t size;
+			int64_t access;
+
+			Entry() : size(0), access(0) { }
+			Entry(uint64_t size, int64_t access) : size(size), access(access) { }
+		};
+
+	public:
+		CacheBudget(const std::string &root, uint64_t budget);
+
+		uint64_t usage() const;
+		std::map<std::string, Entry> entries() const;
+
+		std::vector<std::string> update(const std::string &uuid, int64_t now = -1);
+
+		static uint64_t dirSize(const std::string &path);
+
+	private:
+		void read(int fd);
+		void write(int fd);
+		void scan();
+		bool evict(const std::string &uuid);
+
+	PEPPER_PVARS:
+		std::string m_root;
+		uint64_t m_budget;
+		std::map<std::string, Entry> m_entries;
+};
+
+
+#endif // CACHEBUDGET_H_
@@ -0,0 +1,302 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: cacheclient.cpp
+ * Revision cache served by a local cache daemon
+ */
+
+
+#include "main.h"
+
+#include <unistd.h>
+
+#include "bstream.h"
+#include "cachedaemon.h"
+#include "logger.h"
+#include "revision.h"
+#include "strlib.h"
+
+#include "syslib/datetime.h"
+#include "syslib/sigblock.h"
+
+#include "cacheclient.h"
+
+// Maximum number of revisions and bytes that will be sent to the daemon at once
+#define PUT_BATCH_REVISIONS 256
+#define PUT_BATCH_BYTES (4 * 1024 * 1024)
+
+
+// Constructor
+CacheClient::CacheClient(Backend *backend, const Options &options)
+	: AbstractCache(backend, options), m_socket(-1), m_pendingSize(0), m_last(NULL)
+{
+}
+
+// Destructor
+CacheClient::~CacheClient()
+{
+	try {
+		commit();
+	} catch (const std::exception &ex) {
+		Logger::err() << "Error sending revisions to cache daemon: " << ex.what() << endl;
+	}
+	delete m_last;
+	if (m_socket >= 0) {
+		::close(m_socket);
+	}
+}
+
+// Checks whether a cache daemon is running for the current cache directory
+bool CacheClient::available(const Options &options)
+{
+	int fd = CacheDaemon::connect(CacheDaemon::socketPath(options));
+	if (fd < 0) {
+		return false;
+	}
+	::close(fd);
+	return true;
+}
+
+// Connects to the daemon and selects the cache of the current repository
+void CacheClient::init()
+{
+	std::string path = CacheDaemon::socketPath(m_opts);
+	m_socket = CacheDaemon::connect(path);
+	if (m_socket < 0) {
+		throw PEX(str::printf("Unable to connect to cache daemon at %s", path.c_str()));
+	}
+
+	MOStream out;
+	out << char(CacheDaemon::Hello) << CacheDaemon::ProtocolVersion << uuid() << name();
+	request(out.data());
+	PDEBUG << "Cache: Connected to cache daemon at " << path << endl;
+}
+
+// Sends pending revisions and tells the daemon to flush the cache
+void CacheClient::flush()
+{
+	if (m_socket < 0) {
+		return;
+	}
+
+	commit();
+	MOStream out;
+	out << char(CacheDaemon::Flush);
+	request(out.data());
+}
+
+// Cache maintenance needs exclusive access to the cache files
+void CacheClient::check(bool)
+{
+	throw PEX("The cache can't be checked while a cache daemon is running, please stop it first");
+}
+
+// Cache maintenance needs exclusive access to the cache files
+void CacheClient::compact(const std::string &)
+{
+	throw PEX("The cache can't be compacted while a cache daemon is running, please stop it first");
+}
+
+// Cache maintenance needs exclusive access to the cache files
+void CacheClient::merge(const std::vector<std::string> &)
+{
+	throw PEX("Caches can't be merged while a cache daemon is running, please stop it first");
+}
+
+// Checks if the given revision is cached. The revision is fetched right
+// away, so a cache hit costs a single request.
+bool CacheClient::lookup(const std::string &id)
+{
+	if (m_pending.find(id) != m_pending.end() || (m_last != NULL && id == m_lastId)) {
+		return true;
+	}
+
+	std::vector<Revision *> revs = fetch(std::vector<std::string>(1, id));
+	if (revs[0] == NULL) {
+		return false;
+	}
+	delete m_last;
+	m_last = revs[0];
+	m_lastId = id;
+	return true;
+}
+
+// Adds the revision to the next batch that will be sent to the daemon
+void CacheClient::put(const std::string &id, const Revision &rev)
+{
+	std::vector<char> &data = m_pending[id];
+	m_pendingSize -= data.size();
+	data = CacheDaemon::encode(rev);
+	m_pendingSize += data.size();
+
+	if (m_pending.size() >= PUT_BATCH_REVISIONS || m_pendingSize >= PUT_BATCH_BYTES) {
+		commit();
+	}
+}
+
+// Loads a revision from the cache
+Revision *CacheClient::get(const std::string &id)
+{
+	std::map<std::string, std::vector<char> >::const_iterator it = m_pending.find(id);
+	if (it != m_pending.end()) {
+		return CacheDaemon::decode(id, it->second);
+	}
+	if (m_last != NULL && id == m_lastId) {
+		Revision *rev = m_last;
+		m_last = NULL;
+		return rev;
+	}
+
+	std::vector<Revision *> revs = fetch(std::vector<std::string>(1, id));
+	if (revs[0] == NULL) {
+		throw PEX(str::printf("Revision %s is not cached", id.c_str()));
+	}
+	return revs[0];
+}
+
+// Checks whether the given revisions are cached, using a single request
+std::vector<bool> CacheClient::lookupMany(const std::vector<std::string> &ids)
+{
+	std::vector<bool> cached(ids.size(), true);
+	std::vector<std::string> remote;
+	for (size_t i = 0; i < ids.size(); i++) {
+		if (m_pending.find(ids[i]) == m_pending.end()) {
+			remote.push_back(ids[i]);
+		}
+	}
+	if (remote.empty()) {
+		return cached;
+	}
+
+	MOStream out;
+	out << char(CacheDaemon::Lookup) << remote;
+	std::vector<char> response = request(out.data());
+	VIStream in(response);
+	std::vector<char> found;
+	in >> found;
+	if (found.size() != remote.size()) {
+		throw PEX("Invalid response from cache daemon");
+	}
+	for (size_t i = 0, j = 0; i < ids.size(); i++) {
+		if (j < remote.size() && remote[j] == ids[i]) {
+			cached[i] = (found[j++] != 0);
+		}
+	}
+	return cached;
+}
+
+// Loads the given revisions from the cache, using a single request
+std::vector<Revision *> CacheClient::getMany(const std::vector<std::string> &ids)
+{
+	commit();
+	std::vector<Revision *> revs = fetch(ids);
+	for (size_t i = 0; i < revs.size(); i++) {
+		if (revs[i] == NULL) {
+			for (size_t j = 0; j < revs.size(); j++) {
+				delete revs[j];
+			}
+			throw PEX(str::printf("Revision %s is not cached", ids[i].c_str()));
+		}
+	}
+	return revs;
+}
+
+// The daemon doesn't list cached revisions
+std::vector<std::string> CacheClient::cachedIds()
+{
+	throw PEX("The cache can't be exported while a cache daemon is running, please stop it first");
+}
+
+// Fetches the given revisions from the daemon. Revisions that are not
+// cached will be returned as NULL.
+std::vector<Revision *> CacheClient::fetch(const std::vector<std::string> &ids)
+{
+	MOStream out;
+	out << char(CacheDaemon::Get) << ids;
+	std::vector<char> response = request(out.data());
+	m_stats->bytesRead += response.size();
+
+	sys::datetime::Watch watch;
+	VIStream in(response);
+	uint32_t n;
+	in >> n;
+	if (n != ids.size()) {
+		throw PEX("Invalid response from cache daemon");
+	}
+
+	std::vector<Revision *> revs;
+	try {
+		for (size_t i = 0; i < ids.size(); i++) {
+			char found;
+			in >> found;
+			if (!found) {
+				revs.push_back(NULL);
+				continue;
+			}
+			std::vector<char> data;
+			in >> data;
+			revs.push_back(CacheDaemon::decode(ids[i], data));
+		}
+	} catch (...) {
+		for (size_t i = 0; i < revs.size(); i++) {
+			delete revs[i];
+		}
+		throw;
+	}
+	m_stats->decodeTime += watch.elapsedUSecs();
+	return revs;
+}
+
+// Sends pending revisions to the daemon
+void CacheClient::commit()
+{
+	if (m_pending.empty() || m_socket < 0) {
+		return;
+	}
+
+	sys::datetime::Watch watch;
+	MOStream out;
+	out << char(CacheDaemon::Put) << (uint32_t)m_pending.size();
+	for (std::map<std::string, std::vector<char> >::const_iterator it = m_pending.begin(); it != m_pending.end(); ++it) {
+		out << it->first << it->second;
+	}
+	PTRACE << "Sending " << m_pending.size() << " revisions (" << m_pendingSize << " bytes) to cache daemon" << endl;
+	std::vector<char> data = out.data();
+	request(data);
+	m_pending.clear();
+	m_pendingSize = 0;
+
+	m_stats->bytesWritten += data.size();
+	m_stats->writeTime += watch.elapsedUSecs();
+	++m_stats->writes;
+}
+
+// Sends a request to the daemon and returns the response data following
+// the status
+std::vector<char> CacheClient::request(const std::vector<char> &data)
+{
+	// The signal handler may flush the cache, so requests must not be interrupted
+	SIGBLOCK_DEFER();
+
+	std::vector<char> response;
+	CacheDaemon::send(m_socket, data);
+	if (!CacheDaemon::receive(m_socket, &response) || response.empty()) {
+		throw PEX("Connection to cache daemon closed");
+	}
+
+	if (response[0] == CacheDaemon::Error) {
+		VIStream in(response);
+		char status;
+		std::string message;
+		in >> status >> message;
+		throw PEX(str::printf("Cache daemon: %s", message.c_str()));
+	} else if (response[0] != CacheDaemon::Ok) {
+		throw PEX("Invalid response from cache daemon");
+	}
+	return std::vector<char>(response.begin() + 1, response.end());
+}
@@ -0,0 +1,61 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: cacheclient.h
+ * Revision cache served by a local cache daemon (interface)
+ */
+
+
+#ifndef CACHECLIENT_H_
+#define CACHECLIENT_H_
+
+
+#include <map>
+
+#include "abstractcache.h"
+
+
+class CacheClient : public AbstractCache
+{
+	public:
+		CacheClient(Backend *backend, const Options &options);
+		~CacheClient();
+
+		static bool available(const Options &options);
+
+		void init();
+
+		void flush();
+		void check(bool force = false);
+		void compact(const std::string &branch = std::string());
+		void merge(const std::vector<std::string> &dirs);
+
+	protected:
+		bool lookup(const std::string &id);
+		void put(const std::string &id, const Revision &rev);
+		Revision *get(const std::string &id);
+
+		std::vector<bool> lookupMany(const std::vector<std::string> &ids);
+		std::vector<Revision *> getMany(const std::vector<std::string> &ids);
+		std::vector<std::string> cachedIds();
+
+	private:
+		std::vector<Revision *> fetch(const std::vector<std::string> &ids);
+		void commit();
+		std::vector<char> request(const std::vector<char> &data);
+
+	private:
+		int m_socket;
+		std::map<std::string, std::vector<char> > m_pending; // Revisions that haven't been sent yet
+		size_t m_pendingSize;
+		std::string m_lastId; // Revision fetched by lookup()
+		Revision *m_last;
+};
+
+
+#endif // CACHECLIENT_H_
@@ -0,0 +1,639 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: cachedaemon.cpp
+ * Local daemon serving revision caches over a Unix socket
+ */
+
+
+#include "main.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "bstream.h"
+#include "diffstat.h"
+#include "logger.h"
+#include "options.h"
+#include "revision.h"
+#include "revisionlru.h"
+#include "strlib.h"
+
+#ifdef USE_LDBCACHE
+ #include "ldbcache.h"
+#else
+ #include "cache.h"
+#endif
+
+#include "syslib/fs.h"
+#include "syslib/sigblock.h"
+
+#include "cachedaemon.h"
+
+// Maximum size of a single message
+#define MAX_MESSAGE_SIZE (256 * 1024 * 1024)
+// Maximum number of bytes read from a client at once
+#define READ_CHUNK_SIZE (64 * 1024)
+
+#ifndef MSG_NOSIGNAL
+ #define MSG_NOSIGNAL 0
+#endif
+
+
+// Stands in for the repository backend of a client. The daemon only
+// serves cached data, so it won't access any repositories itself.
+class DaemonBackend : public Backend
+{
+public:
+	DaemonBackend(const Options &options, const std::string &uuid, const std::string &name)
+		: Backend(options), m_uuid(uuid), m_name(name)
+	{
+	}
+
+	std::string name() const { return m_name; }
+	std::string uuid() { return m_uuid; }
+
+	std::string head(const std::string &) { throw unavailable(); }
+	std::string mainBranch() { throw unavailable(); }
+	std::vector<std::string> branches() { throw unavailable(); }
+	std::vector<Tag> tags() { throw unavailable(); }
+	DiffstatPtr diffstat(const std::string &) { throw unavailable(); }
+	std::vector<std::string> tree(const std::string &) { throw unavailable(); }
+	std::string cat(const std::string &, const std::string &) { throw unavailable(); }
+	LogIterator *iterator(const std::string &, int64_t, int64_t) { throw unavailable(); }
+	Revision *revision(const std::string &) { throw unavailable(); }
+
+private:
+	PepperException unavailable() const
+	{
+		return PEX("Repository access is not available in the cache daemon");
+	}
+
+private:
+	std::string m_uuid;
+	std::string m_name;
+};
+
+
+// Cache of a single repository
+struct CacheDaemon::Repository
+{
+	Backend *backend;
+	AbstractCache *cache;
+	std::shared_ptr<RevisionLru> lru; // Hot records
+};
+
+// Client connection. The sockets are non-blocking, so requests and
+// responses are buffered until they are complete.
+struct CacheDaemon::Connection
+{
+	int fd;
+	Repository *repository; // Set by the handshake
+	std::vector<char> input; // Received data, starting with a size prefix
+	std::vector<char> output; // Pending response data
+	size_t written; // Number of output bytes that have been sent
+
+	Connection(int fd) : fd(fd), repository(NULL), written(0) { }
+};
+
+
+// Constructor. Throws if the wakeup pipe can't be created.
+CacheDaemon::CacheDaemon(const Options &options)
+	: m_opts(options), m_socket(-1)
+{
+	m_path = socketPath(options);
+	if (pipe(m_wakeup) != 0) {
+		throw PEX_ERRNO();
+	}
+}
+
+// Destructor. All caches will be flushed.
+CacheDaemon::~CacheDaemon()
+{
+	for (std::map<int, Connection *>::iterator it = m_connections.begin(); it != m_connections.end(); ++it) {
+		::close(it->first);
+		delete it->second;
+	}
+	for (std::map<std::string, Repository *>::iterator it = m_repositories.begin(); it != m_repositories.end(); ++it) {
+		try {
+			delete it->second->cache;
+		} catch (const std::exception &ex) {
+			Logger::err() << "Error flushing cache for " << it->first << ": " << ex.what() << endl;
+		}
+		delete it->second->backend;
+		delete it->second;
+	}
+	if (m_socket >= 0) {
+		::close(m_socket);
+		unlink(m_path.c_str());
+	}
+	::close(m_wakeup[0]);
+	::close(m_wakeup[1]);
+}
+
+// Serves clients until the process is terminated by a signal or stop()
+// is called. Clients are served in turn, so a client that stalls while
+// sending a request or receiving a response won't block the others.
+void CacheDaemon::run()
+{
+	listen();
+	Logger::info() << "Cache daemon listening on " << m_path << endl;
+
+	std::vector<struct pollfd> fds;
+	while (true) {
+		fds.clear();
+		struct pollfd pfd;
+		pfd.fd = m_socket;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		fds.push_back(pfd);
+		pfd.fd = m_wakeup[0];
+		fds.push_back(pfd);
+		for (std::map<int, Connection *>::iterator it = m_connections.begin(); it != m_connections.end(); ++it) {
+			// Further requests are read once the response has been sent
+			pfd.fd = it->first;
+			pfd.events = (it->second->output.empty() ? POLLIN : POLLOUT);
+			fds.push_back(pfd);
+		}
+
+		if (poll(&fds[0], fds.size(), -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			throw PEX_ERRNO();
+		}
+		if (fds[1].revents != 0) {
+			PDEBUG << "CacheDaemon: Stopping" << endl;
+			return;
+		}
+
+		for (size_t i = 2; i < fds.size(); i++) {
+			if (fds[i].revents == 0) {
+				continue;
+			}
+			Connection *connection = m_connections[fds[i].fd];
+			bool ok;
+			try {
+				ok = serve(connection);
+			} catch (const std::exception &ex) {
+				PDEBUG << "CacheDaemon: Error serving client " << connection->fd << ": " << ex.what() << endl;
+				ok = false;
+			}
+			if (!ok) {
+				PDEBUG << "CacheDaemon: Closing connection " << connection->fd << endl;
+				::close(connection->fd);
+				m_connections.erase(connection->fd);
+				delete connection;
+			}
+		}
+		if (fds[0].revents & POLLIN) {
+			accept();
+		}
+	}
+}
+
+// Makes run() return. This may be called from another thread.
+void CacheDaemon::stop()
+{
+	char c = 0;
+	while (::write(m_wakeup[1], &c, 1) < 0 && errno == EINTR) ;
+}
+
+// Flushes the caches of all served repositories
+void CacheDaemon::flush()
+{
+	for (std::map<std::string, Repository *>::iterator it = m_repositories.begin(); it != m_repositories.end(); ++it) {
+		it->second->cache->flush();
+	}
+}
+
+// Returns the path of the daemon socket for the given cache directory
+std::string CacheDaemon::socketPath(const Options &options)
+{
+	return options.cacheDir() + "/daemon.sock";
+}
+
+// Connects to the daemon at the given socket. Returns -1 if no daemon
+// is running.
+int CacheDaemon::connect(const std::string &path)
+{
+	struct sockaddr_un addr;
+	if (path.length() >= sizeof(addr.sun_path)) {
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	if (::connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		::close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// Sends a message, prefixed with its size. This is used by clients, which
+// block until the message has been sent.
+void CacheDaemon::send(int fd, const std::vector<char> &data)
+{
+	uint32_t size = data.size();
+#ifndef WORDS_BIGENDIAN
+	size = BStream::bswap(size);
+#endif
+	std::vector<char> buffer((const char *)&size, (const char *)&size + 4);
+	buffer.insert(buffer.end(), data.begin(), data.end());
+
+	size_t offset = 0;
+	while (offset < buffer.size()) {
+		ssize_t n = ::send(fd, &buffer[offset], buffer.size() - offset, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			throw PEX_ERRNO();
+		}
+		offset += n;
+	}
+}
+
+// Receives a message, blocking until it is complete. Returns false if the
+// connection has been closed before the message started.
+bool CacheDaemon::receive(int fd, std::vector<char> *data)
+{
+	uint32_t size;
+	char *ptr = (char *)&size;
+	size_t offset = 0, total = 4;
+	while (offset < total) {
+		ssize_t n = ::recv(fd, ptr + offset, total - offset, 0);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			throw PEX_ERRNO();
+		} else if (n == 0) {
+			if (ptr == (char *)&size && offset == 0) {
+				return false;
+			}
+			throw PEX("Connection closed while receiving message");
+		}
+		offset += n;
+
+		if (offset == total && ptr == (char *)&size) {
+#ifndef WORDS_BIGENDIAN
+			size = BStream::bswap(size);
+#endif
+			if (size > MAX_MESSAGE_SIZE) {
+				throw PEX(str::printf("Message too large (%u bytes)", size));
+			}
+			data->resize(size);
+			if (size == 0) {
+				break;
+			}
+			ptr = &(*data)[0];
+			offset = 0;
+			total = size;
+		}
+	}
+	return true;
+}
+
+// Encodes a revision, including the strings it refers to. The diffstat is
+// stored in the compact format, so the paths are front-coded.
+std::vector<char> CacheDaemon::encode(const Revision &rev)
+{
+	MOStream out;
+	out.writeVarint(BStream::zigzag(rev.date()));
+	out << rev.author() << rev.message();
+	rev.diffstat()->write(out, Diffstat::Compact);
+	return out.data();
+}
+
+// Decodes a revision that has been encoded by encode()
+Revision *CacheDaemon::decode(const std::string &id, const std::vector<char> &data)
+{
+	VIStream in(data);
+	uint64_t date;
+	std::string author, message;
+	in.readVarint(date) >> author >> message;
+	DiffstatPtr stat = std::make_shared<Diffstat>();
+	if (author.empty() || !stat->load(in, Diffstat::Compact) || !in.ok()) {
+		throw PEX(str::printf("Unable to decode revision %s: Data corrupted", id.c_str()));
+	}
+	return new Revision(id, BStream::unzigzag(date), author, message, stat);
+}
+
+// Creates the daemon socket
+void CacheDaemon::listen()
+{
+	std::string dir = m_opts.cacheDir();
+	if (!sys::fs::dirExists(dir)) {
+		sys::fs::mkpath(dir);
+	}
+
+	struct sockaddr_un addr;
+	if (m_path.length() >= sizeof(addr.sun_path)) {
+		throw PEX(str::printf("Socket path is too long: %s", m_path.c_str()));
+	}
+
+	int fd = connect(m_path);
+	if (fd >= 0) {
+		::close(fd);
+		throw PEX(str::printf("A cache daemon is already listening on %s", m_path.c_str()));
+	}
+
+	// Remove stale sockets of previous daemons
+	if (unlink(m_path.c_str()) != 0 && errno != ENOENT) {
+		throw PEX_ERRNO();
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, m_path.c_str(), sizeof(addr.sun_path) - 1);
+
+	m_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (m_socket < 0) {
+		throw PEX_ERRNO();
+	}
+	if (bind(m_socket, (struct sockaddr *)&addr, sizeof(addr)) != 0 || ::listen(m_socket, SOMAXCONN) != 0) {
+		int err = errno;
+		::close(m_socket);
+		m_socket = -1;
+		throw PEX_ERR(err);
+	}
+}
+
+// Accepts a new client connection
+void CacheDaemon::accept()
+{
+	int fd = ::accept(m_socket, NULL, NULL);
+	if (fd < 0) {
+		PDEBUG << "CacheDaemon: Error accepting connection: " << PepperException::strerror(errno) << endl;
+		return;
+	}
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+		PDEBUG << "CacheDaemon: Error setting up connection: " << PepperException::strerror(errno) << endl;
+		::close(fd);
+		return;
+	}
+	PDEBUG << "CacheDaemon: New connection " << fd << endl;
+	m_connections[fd] = new Connection(fd);
+}
+
+// Continues sending the pending response or receiving requests of the given
+// client, and handles the requests that are complete. Returns false if the
+// connection has been closed.
+bool CacheDaemon::serve(Connection *connection)
+{
+	if (!connection->output.empty()) {
+		transmit(connection);
+	} else if (!read(connection)) {
+		return false;
+	}
+
+	while (connection->output.empty() && connection->input.size() >= 4) {
+		uint32_t size;
+		memcpy((char *)&size, &connection->input[0], 4);
+#ifndef WORDS_BIGENDIAN
+		size = BStream::bswap(size);
+#endif
+		if (size > MAX_MESSAGE_SIZE) {
+			throw PEX(str::printf("Message too large (%u bytes)", size));
+		}
+		if (connection->input.size() < (size_t)size + 4) {
+			break;
+		}
+		std::vector<char> request(connection->input.begin() + 4, connection->input.begin() + 4 + size);
+		connection->input.erase(connection->input.begin(), connection->input.begin() + 4 + size);
+
+		// Signals will terminate the daemon, so requests must not be interrupted
+		std::vector<char> response;
+		{
+			SIGBLOCK_DEFER();
+			try {
+				handle(connection, request, &response);
+			} catch (const std::exception &ex) {
+				PDEBUG << "CacheDaemon: Error handling request: " << ex.what() << endl;
+				MOStream out;
+				out << char(Error) << std::string(ex.what());
+				response = out.data();
+			}
+		}
+
+		uint32_t rsize = response.size();
+#ifndef WORDS_BIGENDIAN
+		rsize = BStream::bswap(rsize);
+#endif
+		connection->output.assign((const char *)&rsize, (const char *)&rsize + 4);
+		connection->output.insert(connection->output.end(), response.begin(), response.end());
+		connection->written = 0;
+		transmit(connection);
+	}
+	return true;
+}
+
+// Reads available request data of the given client. Returns false if the
+// connection has been closed.
+bool CacheDaemon::read(Connection *connection)
+{
+	char buffer[READ_CHUNK_SIZE];
+	ssize_t n;
+	while ((n = ::recv(connection->fd, buffer, sizeof(buffer), 0)) < 0 && errno == EINTR) ;
+	if (n < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return true;
+		}
+		throw PEX_ERRNO();
+	} else if (n == 0) {
+		if (!connection->input.empty()) {
+			throw PEX("Connection closed while receiving message");
+		}
+		return false;
+	}
+	connection->input.insert(connection->input.end(), buffer, buffer + n);
+	return true;
+}
+
+// Sends as much of the pending response of the given client as possible
+// without blocking
+void CacheDaemon::transmit(Connection *connection)
+{
+	std::vector<char> &output = connection->output;
+	while (connection->written < output.size()) {
+		ssize_t n = ::send(connection->fd, &output[connection->written], output.size() - connection->written, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return;
+			}
+			throw PEX_ERRNO();
+		}
+		connection->written += n;
+	}
+	std::vector<char>().swap(output);
+	connection->written = 0;
+}
+
+// Handles a request
+void CacheDaemon::handle(Connection *connection, const std::vector<char> &request, std::vector<char> *response)
+{
+	VIStream in(request);
+	MOStream out;
+	char type;
+	in >> type;
+
+	if (type == Hello) {
+		uint32_t version;
+		std::string uuid, name;
+		in >> version >> uuid >> name;
+		if (version != ProtocolVersion) {
+			throw PEX(str::printf("Unsupported protocol version %u", version));
+		}
+		connection->repository = repository(uuid, name);
+		out << char(Ok);
+		*response = out.data();
+		return;
+	}
+
+	Repository *repo = connection->repository;
+	if (repo == NULL) {
+		throw PEX("No repository selected");
+	}
+
+	switch (type) {
+		case Lookup: {
+			std::vector<std::string> ids, stored;
+			in >> ids;
+			std::vector<char> found(ids.size(), 1);
+			for (size_t i = 0; i < ids.size(); i++) {
+				if (!repo->lru || !repo->lru->contains(ids[i])) {
+					stored.push_back(ids[i]);
+				}
+			}
+			std::vector<bool> cached = repo->cache->lookupMany(stored);
+			for (size_t i = 0, j = 0; i < ids.size(); i++) {
+				if (j < stored.size() && stored[j] == ids[i]) {
+					found[i] = cached[j++];
+				}
+			}
+			out << char(Ok) << found;
+			break;
+		}
+
+		case Get: {
+			std::vector<std::string> ids;
+			in >> ids;
+			out << char(Ok) << (uint32_t)ids.size();
+			for (size_t i = 0; i < ids.size(); i++) {
+				Revision *rev = (repo->lru ? repo->lru->get(ids[i]) : NULL);
+				if (rev == NULL) {
+					if (!repo->cache->lookup(ids[i])) {
+						out << char(0);
+						continue;
+					}
+					rev = repo->cache->get(ids[i]);
+					if (repo->lru) {
+						rev = repo->lru->put(rev);
+					}
+				}
+				try {
+					out << char(1) << encode(*rev);
+				} catch (...) {
+					delete rev;
+					throw;
+				}
+				delete rev;
+			}
+			break;
+		}
+
+		case Put: {
+			uint32_t n;
+			in >> n;
+			for (uint32_t i = 0; i < n; i++) {
+				std::string id;
+				std::vector<char> data;
+				in >> id >> data;
+				Revision *rev = decode(id, data);
+				try {
+					if (!repo->cache->lookup(id)) {
+						repo->cache->put(id, *rev);
+					}
+				} catch (...) {
+					delete rev;
+					throw;
+				}
+				if (repo->lru) {
+					rev = repo->lru->put(rev);
+				}
+				delete rev;
+			}
+			out << char(Ok);
+			break;
+		}
+
+		case Flush:
+			repo->cache->flush();
+			out << char(Ok);
+			break;
+
+		default:
+			throw PEX(str::printf("Unknown request type %d", int(type)));
+	}
+
+	*response = out.data();
+}
+
+// Returns the cache for the given repository, opening it if necessary
+CacheDaemon::Repository *CacheDaemon::repository(const std::string &uuid, const std::string &name)
+{
+	std::map<std::string, Repository *>::iterator it = m_repositories.find(uuid);
+	if (it != m_repositories.end()) {
+		return it->second;
+	}
+
+	// The UUID names the cache directory
+	if (uuid.empty() || uuid == "." || uuid == ".." || uuid.find('/') != std::string::npos) {
+		throw PEX(str::printf("Invalid repository UUID: %s", uuid.c_str()));
+	}
+
+	Repository *repo = new Repository();
+	repo->backend = new DaemonBackend(m_opts, uuid, name);
+	try {
+#ifdef USE_LDBCACHE
+		repo->cache = new LdbCache(repo->backend, m_opts);
+#else
+		repo->cache = new Cache(repo->backend, m_opts);
+#endif
+		repo->cache->init();
+	} catch (...) {
+		delete repo->cache;
+		delete repo->backend;
+		delete repo;
+		throw;
+	}
+	size_t budget = m_opts.cacheMemory();
+	if (budget > 0) {
+		repo->lru = std::make_shared<RevisionLru>(budget);
+	}
+
+	Logger::info() << "CacheDaemon: Serving cache for " << name << " repository " << uuid << endl;
+	m_repositories[uuid] = repo;
+	return repo;
+}
@@ -0,0 +1,90 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: cachedaemon.h
+ * Local daemon serving revision caches over a Unix socket (interface)
+ */
+
+
+#ifndef CACHEDAEMON_H_
+#define CACHEDAEMON_H_
+
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "main.h"
+
+class Options;
+class Revision;
+
+
+class CacheDaemon
+{
+	public:
+		// Request types. Each request starts with one of these characters,
+		// each response starts with Ok or Error.
+		typedef enum {
+			Hello = 'H',
+			Lookup = 'L',
+			Get = 'G',
+			Put = 'P',
+			Flush = 'F',
+			Ok = 'K',
+			Error = 'E'
+		} Message;
+
+	public:
+		static const uint32_t ProtocolVersion = 2;
+
+	public:
+		CacheDaemon(const Options &options);
+		~CacheDaemon();
+
+		void run();
+		void stop();
+		void flush();
+
+		static std::string socketPath(const Options &options);
+		static int connect(const std::string &path);
+
+		static void send(int fd, const std::vector<char> &data);
+		static bool receive(int fd, std::vector<char> *data);
+
+		static std::vector<char> encode(const Revision &rev);
+		static Revision *decode(const std::string &id, const std::vector<char> &data);
+
+	private:
+		struct Repository;
+		struct Connection;
+
+		void listen();
+		void accept();
+		bool serve(Connection *connection);
+		bool read(Connection *connection);
+		void transmit(Connection *connection);
+		void handle(Connection *connection, const std::vector<char> &request, std::vector<char> *response);
+		Repository *repository(const std::string &uuid, const std::string &name);
+
+	private:
+		const Options &m_opts;
+		std::string m_path;
+		int m_socket;
+		int m_wakeup[2]; // Pipe for stopping the daemon
+		std::map<int, Connection *> m_connections;
+		std::map<std::string, Repository *> m_repositories;
+
+	private:
+		// Not allowed
+		CacheDaemon(const CacheDaemon &);
+		CacheDaemon &operator=(const CacheDaemon &);
+};
+
+
+#endif // CACHEDAEMON_H_
@@ -0,0 +1,598 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: cacheindex.cpp
+ * Sorted binary index for the revision cache
+ *
+ * The index consists of two files. "index.bin" is a table of fixed-width
+ * entries, sorted by key, followed by a pool containing the keys
+ * themselves. It is memory-mapped and binary-searched in place, so opening
+ * the index does not depend on the size of the history. New entries are
+ * appended to "index.log" and kept in memory until they are merged into the
+ * table. All integers are stored in big-endian byte order.
+ *
+ * Keys are binary encodings of the revision IDs. Object IDs of Git and
+ * Mercurial, as well as pairs of them as used for diffstats, are stored as
+ * raw 20-byte hashes, and Subversion revision numbers as 32-bit integers.
+ * Other IDs are stored as they are. The first byte of a key specifies its
+ * type. Format 1 files contain plain revision IDs.
+ *
+ * Several processes may use the index at the same time. Entries are appended
+ * to the log using single write() calls, and the table is only replaced by
+ * renaming a new file over it. The caller is responsible for serializing
+ * calls to insert() and for making sure that nobody else is using the index
+ * during flush(true) and rewrite().
+ *
+ *    index.bin: "PIDX" <format> <cache version> <number of entries>
+ *               <key offset> <key length> <segment> <offset> <crc> ...
+ *               <key pool>
+ *    index.log: "PLOG" <format> <cache version>
+ *               <key length> <key> <segment> <offset> <crc> ...
+ *
+ *    key:       0x00 <revision ID>
+ *               0x01 <revision number>
+ *               0x02 <object ID>
+ *               0x03 <parent object ID> <object ID>
+ */
+
+
+#include "main.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "bstream.h"
+#include "logger.h"
+#include "strlib.h"
+
+#include "syslib/fs.h"
+#include "syslib/sigblock.h"
+
+#include "cacheindex.h"
+
+#define INDEX_FORMAT (uint32_t)2
+#define PLAIN_FORMAT (uint32_t)1
+#define HEADER_SIZE 16
+#define ENTRY_SIZE 20
+#define LOG_HEADER_SIZE 12
+#define MERGE_THRESHOLD 4096
+#define HASH_SIZE 20
+
+// Key types
+enum KeyType {
+	PlainKey = 0,
+	NumberKey,
+	HashKey,
+	HashPairKey
+};
+
+
+// Reads a big-endian integer from the given memory location
+static inline uint32_t readu32(const char *ptr)
+{
+	uint32_t i;
+	memcpy((char *)&i, ptr, 4);
+#ifndef WORDS_BIGENDIAN
+	i = BStream::bswap(i);
+#endif
+	return i;
+}
+
+// Compares a key from the table to the given ID, like std::string::compare()
+static inline int compareKey(const char *key, uint32_t len, const std::string &id)
+{
+	int c = memcmp(key, id.data(), std::min((size_t)len, id.length()));
+	if (c != 0) {
+		return c;
+	}
+	return (len < id.length() ? -1 : (len > id.length() ? 1 : 0));
+}
+
+// Orders index entries by key
+static bool compareFirst(const std::pair<std::string, CacheIndex::Entry> &a, const std::pair<std::string, CacheIndex::Entry> &b)
+{
+	return (a.first < b.first);
+}
+
+// Converts a hexadecimal object ID to a raw hash, returning false if the
+// string is not a full-length lowercase object ID
+static bool parseHash(const char *hex, size_t len, char *hash)
+{
+	if (len != 2 * HASH_SIZE) {
+		return false;
+	}
+	for (size_t i = 0; i < 2 * HASH_SIZE; i++) {
+		char c = hex[i];
+		int v;
+		if (c >= '0' && c <= '9') {
+			v = c - '0';
+		} else if (c >= 'a' && c <= 'f') {
+			v = c - 'a' + 10;
+		} else {
+			return false;
+		}
+		if (i % 2 == 0) {
+			hash[i / 2] = (char)(v << 4);
+		} else {
+			hash[i / 2] |= (char)v;
+		}
+	}
+	return true;
+}
+
+// Appends the hexadecimal representation of a raw hash to a string
+static void formatHash(const char *hash, std::string *hex)
+{
+	static const char digits[] = "0123456789abcdef";
+	for (size_t i = 0; i < HASH_SIZE; i++) {
+		unsigned char c = hash[i];
+		hex->push_back(digits[c >> 4]);
+		hex->push_back(digits[c & 0x0F]);
+	}
+}
+
+// Converts a decimal revision number, returning false if the string is not
+// a canonical number that fits into 32 bits
+static bool parseNumber(const std::string &str, uint32_t *number)
+{
+	if (str.empty() || str.length() > 10 || (str[0] == '0' && str.length() > 1)) {
+		return false;
+	}
+	uint64_t n = 0;
+	for (size_t i = 0; i < str.length(); i++) {
+		if (str[i] < '0' || str[i] > '9') {
+			return false;
+		}
+		n = n * 10 + (str[i] - '0');
+	}
+	if (n > 0xFFFFFFFF) {
+		return false;
+	}
+	*number = (uint32_t)n;
+	return true;
+}
+
+
+// Constructor
+CacheIndex::CacheIndex(const std::string &dir)
+	: m_dir(dir), m_table(NULL), m_tableSize(0), m_tableFormat(INDEX_FORMAT), m_version(0), m_log(-1), m_logSize(0), m_logFormat(INDEX_FORMAT)
+{
+
+}
+
+// Destructor
+CacheIndex::~CacheIndex()
+{
+	close();
+}
+
+// Checks whether an index is present in the given directory
+bool CacheIndex::exists(const std::string &dir)
+{
+	return (sys::fs::fileExists(dir + "/index.bin") || sys::fs::fileExists(dir + "/index.log"));
+}
+
+// Returns the binary key for the given revision ID
+std::string CacheIndex::encodeKey(const std::string &id)
+{
+	char buffer[1 + 2 * HASH_SIZE];
+	uint32_t number;
+	if (parseHash(id.data(), id.length(), buffer + 1)) {
+		buffer[0] = HashKey;
+		return std::string(buffer, 1 + HASH_SIZE);
+	}
+	if (id.length() == 4 * HASH_SIZE + 1 && id[2 * HASH_SIZE] == ':'
+		&& parseHash(id.data(), 2 * HASH_SIZE, buffer + 1)
+		&& parseHash(id.data() + 2 * HASH_SIZE + 1, 2 * HASH_SIZE, buffer + 1 + HASH_SIZE)) {
+		buffer[0] = HashPairKey;
+		return std::string(buffer, 1 + 2 * HASH_SIZE);
+	}
+	if (parseNumber(id, &number)) {
+		buffer[0] = NumberKey;
+		buffer[1] = (char)(number >> 24);
+		buffer[2] = (char)(number >> 16);
+		buffer[3] = (char)(number >> 8);
+		buffer[4] = (char)number;
+		return std::string(buffer, 5);
+	}
+	return std::string(1, (char)PlainKey) + id;
+}
+
+// Returns the revision ID for the given binary key
+std::string CacheIndex::decodeKey(const char *data, size_t len)
+{
+	std::string id;
+	if (len == 1 + HASH_SIZE && data[0] == HashKey) {
+		formatHash(data + 1, &id);
+	} else if (len == 1 + 2 * HASH_SIZE && data[0] == HashPairKey) {
+		formatHash(data + 1, &id);
+		id.push_back(':');
+		formatHash(data + 1 + HASH_SIZE, &id);
+	} else if (len == 5 && data[0] == NumberKey) {
+		id = str::itos(readu32(data + 1));
+	} else if (len >= 1 && data[0] == PlainKey) {
+		id.assign(data + 1, len - 1);
+	} else {
+		throw PEX("Invalid cache index key");
+	}
+	return id;
+}
+
+// Maps the index table and reads pending entries from the log file
+void CacheIndex::open()
+{
+	close();
+
+	std::string path = m_dir + "/index.bin";
+	if (sys::fs::fileExists(path)) {
+		m_table = new sys::fs::MappedFile(path);
+		const char *data = m_table->data();
+		if (m_table->size() < HEADER_SIZE || memcmp(data, "PIDX", 4) || (readu32(data + 4) != INDEX_FORMAT && readu32(data + 4) != PLAIN_FORMAT)) {
+			close();
+			throw PEX(str::printf("Invalid cache index file: %s", path.c_str()));
+		}
+		m_tableFormat = readu32(data + 4);
+		m_version = readu32(data + 8);
+		m_tableSize = readu32(data + 12);
+		if (HEADER_SIZE + (size_t)m_tableSize * ENTRY_SIZE > m_table->size()) {
+			close();
+			throw PEX(str::printf("Invalid cache index file: %s", path.c_str()));
+		}
+	}
+
+	readLog();
+}
+
+// Closes the index files and clears all entries
+void CacheIndex::close()
+{
+	if (m_log >= 0) {
+		::close(m_log);
+		m_log = -1;
+	}
+	delete m_table;
+	m_table = NULL;
+	m_tableSize = 0;
+	m_tableFormat = INDEX_FORMAT;
+	m_version = 0;
+	m_delta.clear();
+	m_logSize = 0;
+	m_logFormat = INDEX_FORMAT;
+}
+
+// Returns the cache version number of the index
+uint32_t CacheIndex::version() const
+{
+	return m_version;
+}
+
+// Returns the number of indexed revisions
+size_t CacheIndex::size() const
+{
+	size_t n = m_tableSize;
+	for (std::map<std::string, Entry>::const_iterator it = m_delta.begin(); it != m_delta.end(); ++it) {
+		if (!tableLookup(it->first, NULL)) {
+			++n;
+		}
+	}
+	return n;
+}
+
+// Searches the index for the given revision
+bool CacheIndex::lookup(const std::string &id, Entry *entry) const
+{
+	std::string key = encodeKey(id);
+	std::map<std::string, Entry>::const_iterator it = m_delta.find(key);
+	if (it != m_delta.end()) {
+		if (entry) {
+			*entry = it->second;
+		}
+		return true;
+	}
+	return tableLookup(key, entry);
+}
+
+// Reads entries that have been appended to the log file by other processes.
+// Returns true if there were any.
+bool CacheIndex::refresh()
+{
+	std::string path = m_dir + "/index.log";
+	if (!sys::fs::fileExists(path) || sys::fs::filesize(path) == m_logSize) {
+		return false;
+	}
+
+	size_t size = m_delta.size();
+	readLog();
+	return (m_delta.size() != size);
+}
+
+// Adds a revision to the index log
+void CacheIndex::insert(const std::string &id, const Entry &entry, uint32_t version)
+{
+	insert(std::vector<std::pair<std::string, Entry> >(1, std::pair<std::string, Entry>(id, entry)), version);
+}
+
+// Adds several revisions to the index log at once
+void CacheIndex::insert(const std::vector<std::pair<std::string, Entry> > &entries, uint32_t version)
+{
+	if (entries.empty()) {
+		return;
+	}
+	refresh();
+
+	std::string path = m_dir + "/index.log";
+	if (m_log < 0) {
+		m_log = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0666);
+		if (m_log == -1) {
+			throw PEX(str::printf("Unable to open cache index log %s: %s", path.c_str(), PepperException::strerror(errno).c_str()));
+		}
+	}
+
+	if (m_version == 0) {
+		m_version = version;
+	}
+	if (m_logSize == 0) {
+		// New or invalid log file
+		if (ftruncate(m_log, 0) == -1) {
+			throw PEX_ERRNO();
+		}
+		MOStream out;
+		out.write("PLOG", 4);
+		out << INDEX_FORMAT << m_version;
+		m_logFormat = INDEX_FORMAT;
+		std::vector<char> data(out.data());
+		if (::write(m_log, &data[0], data.size()) != (ssize_t)data.size()) {
+			throw PEX_ERRNO();
+		}
+		m_logSize = data.size();
+	} else if (sys::fs::filesize(path) != m_logSize && ftruncate(m_log, m_logSize) == -1) {
+		// Drop incomplete trailing entries, e.g. from a process that
+		// has been killed while writing
+		throw PEX_ERRNO();
+	}
+
+	// Write the entries using a single call, so there are no partial entries
+	// unless the process is killed. Logs of the previous format will be
+	// continued using plain revision IDs.
+	MOStream out;
+	std::vector<std::string> keys(entries.size());
+	for (size_t i = 0; i < entries.size(); i++) {
+		keys[i] = encodeKey(entries[i].first);
+		const std::string &key = (m_logFormat == PLAIN_FORMAT ? entries[i].first : keys[i]);
+		out << (uint32_t)key.length();
+		out.write(key.data(), key.length());
+		out << entries[i].second.segment << entries[i].second.offset << entries[i].second.crc;
+	}
+	std::vector<char> data(out.data());
+	if (::write(m_log, &data[0], data.size()) != (ssize_t)data.size()) {
+		throw PEX(str::printf("Unable to write to cache index log: %s", PepperException::strerror(errno).c_str()));
+	}
+	m_logSize += data.size();
+	for (size_t i = 0; i < entries.size(); i++) {
+		m_delta[keys[i]] = entries[i].second;
+	}
+}
+
+// Returns all index entries, sorted by key
+std::vector<std::pair<std::string, CacheIndex::Entry> > CacheIndex::entries() const
+{
+	std::vector<std::pair<std::string, Entry> > entries = keyEntries();
+	for (size_t i = 0; i < entries.size(); i++) {
+		entries[i].first = decodeKey(entries[i].first.data(), entries[i].first.length());
+	}
+	return entries;
+}
+
+// Returns all index entries with binary keys, sorted by key
+std::vector<std::pair<std::string, CacheIndex::Entry> > CacheIndex::keyEntries() const
+{
+	std::vector<std::pair<std::string, Entry> > entries;
+	entries.reserve(m_tableSize + m_delta.size());
+
+	const char *base = (m_table ? m_table->data() + HEADER_SIZE : NULL);
+	const char *pool = base + (size_t)m_tableSize * ENTRY_SIZE;
+	const char *end = (m_table ? m_table->data() + m_table->size() : NULL);
+	for (uint32_t i = 0; i < m_tableSize; i++) {
+		const char *e = base + (size_t)i * ENTRY_SIZE;
+		uint32_t keyoff = readu32(e), keylen = readu32(e + 4);
+		if (pool + keyoff + keylen > end) {
+			throw PEX(str::printf("Corrupted cache index in %s", m_dir.c_str()));
+		}
+		std::string key(pool + keyoff, keylen);
+		if (m_tableFormat == PLAIN_FORMAT) {
+			key = encodeKey(key);
+		}
+		entries.push_back(std::pair<std::string, Entry>(key, Entry(readu32(e + 8), readu32(e + 12), readu32(e + 16))));
+	}
+	if (m_tableFormat == PLAIN_FORMAT) {
+		// Tables of the previous format are sorted by revision ID
+		std::sort(entries.begin(), entries.end(), compareFirst);
+	}
+
+	// Merge log entries, which replace table entries with the same key
+	std::vector<std::pair<std::string, Entry> > added;
+	for (std::map<std::string, Entry>::const_iterator it = m_delta.begin(); it != m_delta.end(); ++it) {
+		std::pair<std::string, Entry> item(*it);
+		std::vector<std::pair<std::string, Entry> >::iterator jt = std::lower_bound(entries.begin(), entries.end(), item, compareFirst);
+		if (jt != entries.end() && jt->first == item.first) {
+			jt->second = item.second;
+		} else {
+			added.push_back(item);
+		}
+	}
+	if (!added.empty()) {
+		size_t n = entries.size();
+		entries.insert(entries.end(), added.begin(), added.end());
+		std::inplace_merge(entries.begin(), entries.begin() + n, entries.end(), compareFirst);
+	}
+	return entries;
+}
+
+// Checks whether the log file should be merged into the table
+bool CacheIndex::needsMerge() const
+{
+	return (m_delta.size() >= MERGE_THRESHOLD);
+}
+
+// Closes the log file, merging it into the table if requested
+void CacheIndex::flush(bool merge)
+{
+	if (m_log >= 0) {
+		::close(m_log);
+		m_log = -1;
+	}
+	if (m_delta.empty() || !merge) {
+		return;
+	}
+
+	PDEBUG << "Merging " << m_delta.size() << " log entries into cache index" << endl;
+	{
+		// Defer any signals while writing to the cache
+		SIGBLOCK_DEFER();
+		writeTable(keyEntries(), m_version);
+		sys::fs::unlink(m_dir + "/index.log");
+	}
+	open();
+}
+
+// Replaces the whole index
+void CacheIndex::rewrite(const std::map<std::string, Entry> &entries, uint32_t version)
+{
+	close();
+	{
+		// Defer any signals while writing to the cache
+		SIGBLOCK_DEFER();
+		std::vector<std::pair<std::string, Entry> > keys;
+		keys.reserve(entries.size());
+		for (std::map<std::string, Entry>::const_iterator it = entries.begin(); it != entries.end(); ++it) {
+			keys.push_back(std::pair<std::string, Entry>(encodeKey(it->first), it->second));
+		}
+		std::sort(keys.begin(), keys.end(), compareFirst);
+		writeTable(keys, version);
+		if (sys::fs::fileExists(m_dir + "/index.log")) {
+			sys::fs::unlink(m_dir + "/index.log");
+		}
+	}
+	open();
+}
+
+// Binary search in the index table
+bool CacheIndex::tableLookup(const std::string &key, Entry *entry) const
+{
+	if (m_tableSize == 0) {
+		return false;
+	}
+
+	// Tables of the previous format are sorted by revision ID
+	std::string plain;
+	if (m_tableFormat == PLAIN_FORMAT) {
+		plain = decodeKey(key.data(), key.length());
+	}
+	const std::string &id = (m_tableFormat == PLAIN_FORMAT ? plain : key);
+
+	const char *base = m_table->data() + HEADER_SIZE;
+	const char *pool = base + (size_t)m_tableSize * ENTRY_SIZE;
+	const char *end = m_table->data() + m_table->size();
+	size_t lo = 0, hi = m_tableSize;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		const char *e = base + mid * ENTRY_SIZE;
+		uint32_t keyoff = readu32(e), keylen = readu32(e + 4);
+		if (pool + keyoff + keylen > end) {
+			throw PEX(str::printf("Corrupted cache index in %s", m_dir.c_str()));
+		}
+
+		int c = compareKey(pool + keyoff, keylen, id);
+		if (c < 0) {
+			lo = mid + 1;
+		} else if (c > 0) {
+			hi = mid;
+		} else {
+			if (entry) {
+				*entry = Entry(readu32(e + 8), readu32(e + 12), readu32(e + 16));
+			}
+			return true;
+		}
+	}
+	return false;
+}
+
+// Reads all complete entries from the log file that haven't been read yet
+void CacheIndex::readLog()
+{
+	std::string path = m_dir + "/index.log";
+	if (!sys::fs::fileExists(path)) {
+		return;
+	}
+
+	sys::fs::MappedFile log(path);
+	const char *data = log.data();
+	if (log.size() < LOG_HEADER_SIZE || memcmp(data, "PLOG", 4) || (readu32(data + 4) != INDEX_FORMAT && readu32(data + 4) != PLAIN_FORMAT)) {
+		PDEBUG << "Ignoring invalid cache index log " << path << endl;
+		m_logSize = 0;
+		return;
+	}
+	m_logFormat = readu32(data + 4);
+	if (m_table == NULL) {
+		m_version = readu32(data + 8);
+	}
+	if (m_logSize < LOG_HEADER_SIZE || m_logSize > log.size()) {
+		m_logSize = LOG_HEADER_SIZE;
+	}
+
+	const char *ptr = data + m_logSize, *end = data + log.size();
+	while (ptr + 4 <= end) {
+		uint32_t keylen = readu32(ptr);
+		if (ptr + 4 + keylen + 12 > end) {
+			break;
+		}
+		std::string key(ptr + 4, keylen);
+		if (m_logFormat == PLAIN_FORMAT) {
+			key = encodeKey(key);
+		}
+		ptr += 4 + keylen;
+		m_delta[key] = Entry(readu32(ptr), readu32(ptr + 4), readu32(ptr + 8));
+		ptr += 12;
+	}
+	m_logSize = ptr - data;
+	if (ptr != end) {
+		PDEBUG << "Ignoring " << (end - ptr) << " trailing bytes in " << path << endl;
+	}
+}
+
+// Writes a new index table and atomically replaces the current one. The
+// entries must be sorted by key.
+void CacheIndex::writeTable(const std::vector<std::pair<std::string, Entry> > &entries, uint32_t version)
+{
+	std::string path = m_dir + "/index.bin";
+	std::string tmppath = path + ".tmp";
+	{
+		BOStream out(tmppath);
+		if (!out.ok()) {
+			throw PEX(str::printf("Unable to write cache index file: %s", tmppath.c_str()));
+		}
+
+		out.write("PIDX", 4);
+		out << INDEX_FORMAT << version << (uint32_t)entries.size();
+		uint32_t keyoff = 0;
+		for (size_t i = 0; i < entries.size(); i++) {
+			out << keyoff << (uint32_t)entries[i].first.length();
+			out << entries[i].second.segment << entries[i].second.offset << entries[i].second.crc;
+			keyoff += entries[i].first.length();
+		}
+		for (size_t i = 0; i < entries.size(); i++) {
+			out.write(entries[i].first.data(), entries[i].first.length());
+		}
+		if (!out.ok()) {
+			throw PEX(str::printf("Unable to write cache index file: %s", tmppath.c_str()));
+		}
+	}
+	sys::fs::rename(tmppath, path);
+}
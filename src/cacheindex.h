@@ -0,0 +1,93 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: cacheindex.h
+ * Sorted binary index for the revision cache (interface)
+ */
+
+
+#ifndef CACHEINDEX_H_
+#define CACHEINDEX_H_
+
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "main.h"
+
+namespace sys {
+	namespace fs {
+		class MappedFile;
+	}
+}
+
+
+class CacheIndex
+{
+	public:
+		// Location of a cached revision
+		struct Entry
+		{
+			uint32_t segment;
+			uint32_t offset;
+			uint32_t crc;
+
+			Entry() : segment(0), offset(0), crc(0) { }
+			Entry(uint32_t segment, uint32_t offset, uint32_t crc)
+				: segment(segment), offset(offset), crc(crc) { }
+		};
+
+	public:
+		CacheIndex(const std::string &dir);
+		~CacheIndex();
+
+		static bool exists(const std::string &dir);
+		static std::string encodeKey(const std::string &id);
+		static std::string decodeKey(const char *data, size_t len);
+
+		void open();
+		void close();
+		uint32_t version() const;
+		size_t size() const;
+
+		bool lookup(const std::string &id, Entry *entry = NULL) const;
+		bool refresh();
+		void insert(const std::string &id, const Entry &entry, uint32_t version);
+		void insert(const std::vector<std::pair<std::string, Entry> > &entries, uint32_t version);
+		std::vector<std::pair<std::string, Entry> > entries() const;
+
+		bool needsMerge() const;
+		void flush(bool merge = false);
+		void rewrite(const std::map<std::string, Entry> &entries, uint32_t version);
+
+	private:
+		bool tableLookup(const std::string &key, Entry *entry) const;
+		std::vector<std::pair<std::string, Entry> > keyEntries() const;
+		void readLog();
+		void writeTable(const std::vector<std::pair<std::string, Entry> > &entries, uint32_t version);
+
+	PEPPER_PVARS:
+		std::string m_dir;
+		sys::fs::MappedFile *m_table;
+		uint32_t m_tableSize;
+		uint32_t m_tableFormat;
+		uint32_t m_version;
+		std::map<std::string, Entry> m_delta; // Keyed by binary key
+		int m_log;
+		size_t m_logSize;
+		uint32_t m_logFormat;
+
+	private:
+		// Not allowed
+		CacheIndex(const CacheIndex &);
+		CacheIndex &operator=(const CacheIndex &);
+};
+
+
+#endif // CACHEINDEX_H_
@@ -0,0 +1,299 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: checksum.cpp
+ * CRC checksums with runtime-dispatched kernels
+ *
+ * Every algorithm has a portable slice-by-8 kernel, which processes eight
+ * bytes per iteration using eight lookup tables. On x86 processors, CRC32C is
+ * computed with the crc32 instruction of SSE4.2, and CRC32 is computed by
+ * folding 64-byte blocks with carry-less multiplications (PCLMULQDQ), as
+ * described in Intel's paper "Fast CRC Computation for Generic Polynomials
+ * Using PCLMULQDQ Instruction". The fastest kernel supported by the CPU is
+ * chosen on first use.
+ */
+
+
+#include "main.h"
+
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+ #define HAVE_X86_KERNELS
+ #include <cpuid.h>
+ #include <nmmintrin.h>
+ #include <wmmintrin.h>
+#endif
+
+#include "checksum.h"
+
+
+namespace checksum
+{
+
+// Lookup tables for the slice-by-8 kernels
+struct Tables
+{
+	uint32_t t[8][256];
+
+	Tables(uint32_t poly)
+	{
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t crc = i;
+			for (int j = 0; j < 8; j++) {
+				crc = (crc >> 1) ^ ((crc & 1) ? poly : 0);
+			}
+			t[0][i] = crc;
+		}
+		for (uint32_t i = 0; i < 256; i++) {
+			for (int k = 1; k < 8; k++) {
+				t[k][i] = (t[k-1][i] >> 8) ^ t[0][t[k-1][i] & 0xFF];
+			}
+		}
+	}
+};
+
+static const Tables &crc32Tables()
+{
+	static const Tables tables(0xEDB88320);
+	return tables;
+}
+
+static const Tables &crc32cTables()
+{
+	static const Tables tables(0x82F63B78);
+	return tables;
+}
+
+// Updates the internal (inverted) CRC state byte by byte
+static inline uint32_t updateBytes(const Tables &tables, uint32_t state, const unsigned char *p, size_t len)
+{
+	while (len--) {
+		state = tables.t[0][(state ^ *p++) & 0xFF] ^ (state >> 8);
+	}
+	return state;
+}
+
+// Updates the internal (inverted) CRC state eight bytes at a time
+static uint32_t updateSliceBy8(const Tables &tables, uint32_t state, const unsigned char *p, size_t len)
+{
+	const uint32_t (*t)[256] = tables.t;
+	while (len >= 8) {
+		uint32_t lo = ((uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24)) ^ state;
+		uint32_t hi = (uint32_t)p[4] | ((uint32_t)p[5] << 8) | ((uint32_t)p[6] << 16) | ((uint32_t)p[7] << 24);
+		state = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24]
+			^ t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+		p += 8;
+		len -= 8;
+	}
+	return updateBytes(tables, state, p, len);
+}
+
+static uint32_t crc32Table(uint32_t crc, const char *data, size_t len)
+{
+	return ~updateBytes(crc32Tables(), ~crc, (const unsigned char *)data, len);
+}
+
+static uint32_t crc32SliceBy8(uint32_t crc, const char *data, size_t len)
+{
+	return ~updateSliceBy8(crc32Tables(), ~crc, (const unsigned char *)data, len);
+}
+
+static uint32_t crc32cTable(uint32_t crc, const char *data, size_t len)
+{
+	return ~updateBytes(crc32cTables(), ~crc, (const unsigned char *)data, len);
+}
+
+static uint32_t crc32cSliceBy8(uint32_t crc, const char *data, size_t len)
+{
+	return ~updateSliceBy8(crc32cTables(), ~crc, (const unsigned char *)data, len);
+}
+
+#ifdef HAVE_X86_KERNELS
+
+// Checks whether the CPU supports SSE4.2 and PCLMULQDQ
+static void cpuFeatures(bool *sse42, bool *pclmul)
+{
+	unsigned int eax, ebx, ecx, edx;
+	*sse42 = *pclmul = false;
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+		*sse42 = (ecx & bit_SSE4_2) != 0;
+		*pclmul = *sse42 && (ecx & bit_PCLMUL) != 0;
+	}
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32cSse42(uint32_t crc, const char *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	uint32_t state = ~crc;
+#ifdef __x86_64__
+	uint64_t state64 = state;
+	while (len >= 8) {
+		uint64_t v;
+		memcpy(&v, p, 8);
+		state64 = _mm_crc32_u64(state64, v);
+		p += 8;
+		len -= 8;
+	}
+	state = (uint32_t)state64;
+#endif
+	while (len >= 4) {
+		uint32_t v;
+		memcpy(&v, p, 4);
+		state = _mm_crc32_u32(state, v);
+		p += 4;
+		len -= 4;
+	}
+	while (len--) {
+		state = _mm_crc32_u8(state, *p++);
+	}
+	return ~state;
+}
+
+// Folding constants for the IEEE polynomial, in the bit-reflected domain
+static const uint64_t foldK1K2[2] __attribute__((aligned(16))) = {0x0154442bd4ULL, 0x01c6e41596ULL};
+static const uint64_t foldK3K4[2] __attribute__((aligned(16))) = {0x01751997d0ULL, 0x00ccaa009eULL};
+static const uint64_t foldK5K0[2] __attribute__((aligned(16))) = {0x0163cd6124ULL, 0x0000000000ULL};
+static const uint64_t foldPoly[2] __attribute__((aligned(16))) = {0x01db710641ULL, 0x01f7011641ULL};
+
+// Updates the internal (inverted) CRC32 state. The length must be a multiple
+// of 16 and at least 64.
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t updatePclmul(uint32_t state, const unsigned char *p, size_t len)
+{
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+	x1 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(state));
+	x0 = _mm_load_si128((const __m128i *)foldK1K2);
+	p += 64;
+	len -= 64;
+
+	// Fold four 128-bit lanes in parallel
+	while (len >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)(p + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(p + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(p + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(p + 0x30)));
+		p += 64;
+		len -= 64;
+	}
+
+	// Fold the lanes into a single one
+	x0 = _mm_load_si128((const __m128i *)foldK3K4);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	// Fold the remaining 16-byte blocks
+	while (len >= 16) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i *)p)), x5);
+		p += 16;
+		len -= 16;
+	}
+
+	// Fold 128 to 64 bits
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+	x0 = _mm_loadl_epi64((const __m128i *)foldK5K0);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	// Barrett reduction to 32 bits
+	x0 = _mm_load_si128((const __m128i *)foldPoly);
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+	return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc32Pclmul(uint32_t crc, const char *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	uint32_t state = ~crc;
+	if (len >= 64) {
+		size_t n = len & ~(size_t)15;
+		state = updatePclmul(state, p, n);
+		p += n;
+		len -= n;
+	}
+	return ~updateSliceBy8(crc32Tables(), state, p, len);
+}
+
+#endif // HAVE_X86_KERNELS
+
+
+// Returns all kernels for the given algorithm that are supported by the CPU,
+// fastest first
+std::vector<Kernel> kernels(Algorithm algorithm)
+{
+	std::vector<Kernel> v;
+#ifdef HAVE_X86_KERNELS
+	bool sse42, pclmul;
+	cpuFeatures(&sse42, &pclmul);
+	if (algorithm == Crc32c && sse42) {
+		Kernel k = {"sse4.2", &crc32cSse42};
+		v.push_back(k);
+	} else if (algorithm == Crc32 && pclmul) {
+		Kernel k = {"pclmul", &crc32Pclmul};
+		v.push_back(k);
+	}
+#endif
+	Kernel sliced = {"slice-by-8", (algorithm == Crc32c ? &crc32cSliceBy8 : &crc32SliceBy8)};
+	Kernel table = {"table", (algorithm == Crc32c ? &crc32cTable : &crc32Table)};
+	v.push_back(sliced);
+	v.push_back(table);
+	return v;
+}
+
+// Returns the fastest kernel for the given algorithm
+Kernel kernel(Algorithm algorithm)
+{
+	return kernels(algorithm).front();
+}
+
+// Computes the CRC32 checksum of the given data
+uint32_t crc32(const char *data, size_t len, uint32_t crc)
+{
+	static const Function f = kernel(Crc32).function;
+	return f(crc, data, len);
+}
+
+// Computes the CRC32C checksum of the given data
+uint32_t crc32c(const char *data, size_t len, uint32_t crc)
+{
+	static const Function f = kernel(Crc32c).function;
+	return f(crc, data, len);
+}
+
+} // namespace checksum
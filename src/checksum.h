@@ -0,0 +1,62 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: checksum.h
+ * CRC checksums with runtime-dispatched kernels (interface)
+ */
+
+
+#ifndef CHECKSUM_H_
+#define CHECKSUM_H_
+
+
+#include <string>
+#include <vector>
+
+#include "main.h"
+
+
+namespace checksum
+{
+
+typedef enum {
+	Crc32,  // IEEE 802.3 polynomial, as used by zlib
+	Crc32c  // Castagnoli polynomial
+} Algorithm;
+
+// Updates a checksum with the given data. The initial checksum is 0.
+typedef uint32_t (*Function)(uint32_t crc, const char *data, size_t len);
+
+// An implementation of a checksum algorithm
+struct Kernel
+{
+	const char *name;
+	Function function;
+};
+
+std::vector<Kernel> kernels(Algorithm algorithm);
+Kernel kernel(Algorithm algorithm);
+
+uint32_t crc32(const char *data, size_t len, uint32_t crc = 0);
+inline uint32_t crc32(const std::vector<char> &data) {
+	return crc32(&data[0], data.size());
+}
+
+uint32_t crc32c(const char *data, size_t len, uint32_t crc = 0);
+inline uint32_t crc32c(const std::vector<char> &data) {
+	return crc32c(&data[0], data.size());
+}
+
+inline uint32_t compute(Algorithm algorithm, const char *data, size_t len) {
+	return (algorithm == Crc32c ? crc32c(data, len) : crc32(data, len));
+}
+
+} // namespace checksum
+
+
+#endif // CHECKSUM_H_
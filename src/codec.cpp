@@ -0,0 +1,370 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: codec.cpp
+ * Compression codecs for cache records
+ *
+ * Encoded records start with a header identifying the codec, followed by the
+ * compressed data. Data without this header has been written by utils::
+ * compress(), which stores the big-endian data size in the first four bytes.
+ * Since records are much smaller than 4 GiB, the first byte of such data is
+ * never 0xFF.
+ *
+ *    record: 0xFF <codec id> <uncompressed size> <data>
+ *
+ * The built-in LZ codec uses the block format of LZ4: a sequence consists of
+ * a token byte, with the number of literals in the upper and the match length
+ * minus 4 in the lower nibble, the literals, and a little-endian 16-bit match
+ * offset. Lengths of 15 or more are continued in the following bytes, which
+ * are added up until a byte other than 255 is encountered. The last sequence
+ * consists of literals only.
+ */
+
+
+#include "main.h"
+
+#include <cstring>
+
+#ifdef HAVE_LIBZ
+ #include <zlib.h>
+#endif
+
+#include "bstream.h"
+#include "strlib.h"
+#include "utils.h"
+
+#include "codec.h"
+
+#define HEADER_MAGIC (char)0xFF
+#define HEADER_SIZE 6
+
+// Parameters of the LZ codec
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_LAST_LITERALS 5
+#define LZ_MFLIMIT 12
+#define LZ_MIN_HASHLOG 8
+#define LZ_MAX_HASHLOG 14
+
+
+// Stores data without compressing it
+class StoreCodec : public Codec
+{
+public:
+	uint8_t id() const { return StoreId; }
+	std::string name() const { return "none"; }
+
+	void compress(const char *data, size_t len, std::vector<char> *out) const
+	{
+		out->insert(out->end(), data, data + len);
+	}
+
+	bool uncompress(const char *data, size_t len, char *out, size_t outlen) const
+	{
+		if (len != outlen) {
+			return false;
+		}
+		memcpy(out, data, len);
+		return true;
+	}
+};
+
+#ifdef HAVE_LIBZ
+
+// Compresses data using zlib
+class ZlibCodec : public Codec
+{
+public:
+	uint8_t id() const { return ZlibId; }
+	std::string name() const { return "zlib"; }
+
+	void compress(const char *data, size_t len, std::vector<char> *out) const
+	{
+		size_t offset = out->size();
+		unsigned long dlen = compressBound(len);
+		out->resize(offset + dlen);
+		int ret = ::compress2((unsigned char *)&(*out)[offset], &dlen, (const unsigned char *)data, len, 9);
+		if (ret != Z_OK) {
+			throw PEX(str::printf("Data compression failed (%d)", ret));
+		}
+		out->resize(offset + dlen);
+	}
+
+	bool uncompress(const char *data, size_t len, char *out, size_t outlen) const
+	{
+		unsigned long dlen = outlen;
+		int ret = ::uncompress((unsigned char *)out, &dlen, (const unsigned char *)data, len);
+		return (ret == Z_OK && dlen == outlen);
+	}
+};
+
+#endif // HAVE_LIBZ
+
+// Fast LZ77 compression, using the LZ4 block format
+class LzCodec : public Codec
+{
+public:
+	uint8_t id() const { return LzId; }
+	std::string name() const { return "lz"; }
+
+	void compress(const char *data, size_t len, std::vector<char> *out) const
+	{
+		out->reserve(out->size() + len + len / 255 + 16);
+		if (len < LZ_MFLIMIT + 1) {
+			writeSequence(data, len, 0, 0, out);
+			return;
+		}
+
+		// Small inputs use small hash tables, which are cheaper to clear
+		int hashLog = LZ_MIN_HASHLOG;
+		while (hashLog < LZ_MAX_HASHLOG && ((size_t)1 << hashLog) < len) {
+			++hashLog;
+		}
+		uint32_t table[1 << LZ_MAX_HASHLOG];
+		memset(table, 0, sizeof(uint32_t) << hashLog);
+
+		size_t ip = 0, anchor = 0;
+		size_t limit = len - LZ_MFLIMIT, matchLimit = len - LZ_LAST_LITERALS;
+		while (ip < limit) {
+			uint32_t seq = read32(data + ip);
+			uint32_t h = hash(seq, hashLog);
+			size_t ref = table[h];
+			table[h] = ip;
+			if (ref >= ip || ip - ref > LZ_MAX_OFFSET || read32(data + ref) != seq) {
+				// Skip faster through incompressible data
+				ip += 1 + ((ip - anchor) >> 6);
+				continue;
+			}
+
+			size_t mlen = LZ_MIN_MATCH;
+			while (ip + mlen < matchLimit && data[ref + mlen] == data[ip + mlen]) {
+				++mlen;
+			}
+			writeSequence(data + anchor, ip - anchor, ip - ref, mlen, out);
+			ip += mlen;
+			anchor = ip;
+		}
+		writeSequence(data + anchor, len - anchor, 0, 0, out);
+	}
+
+	bool uncompress(const char *data, size_t len, char *out, size_t outlen) const
+	{
+		const unsigned char *ip = (const unsigned char *)data, *iend = ip + len;
+		char *op = out, *oend = out + outlen;
+		while (ip < iend) {
+			unsigned char token = *ip++;
+			size_t litlen = (token >> 4);
+			if (litlen == 15 && !readLength(&ip, iend, &litlen)) {
+				return false;
+			}
+			if ((size_t)(iend - ip) < litlen || (size_t)(oend - op) < litlen) {
+				return false;
+			}
+			memcpy(op, ip, litlen);
+			ip += litlen;
+			op += litlen;
+			if (ip == iend) {
+				// Last sequence
+				break;
+			}
+
+			if (iend - ip < 2) {
+				return false;
+			}
+			size_t offset = ip[0] | (ip[1] << 8);
+			ip += 2;
+			if (offset == 0 || offset > (size_t)(op - out)) {
+				return false;
+			}
+			size_t mlen = (token & 0x0F);
+			if (mlen == 15 && !readLength(&ip, iend, &mlen)) {
+				return false;
+			}
+			mlen += LZ_MIN_MATCH;
+			if ((size_t)(oend - op) < mlen) {
+				return false;
+			}
+
+			const char *ref = op - offset;
+			if (offset >= mlen) {
+				memcpy(op, ref, mlen);
+				op += mlen;
+			} else {
+				// Overlapping match
+				for (size_t i = 0; i < mlen; i++) {
+					*op++ = *ref++;
+				}
+			}
+		}
+		return (op == oend);
+	}
+
+private:
+	static inline uint32_t read32(const char *p)
+	{
+		uint32_t i;
+		memcpy(&i, p, 4);
+		return i;
+	}
+
+	static inline uint32_t hash(uint32_t seq, int hashLog)
+	{
+		return (seq * 2654435761U) >> (32 - hashLog);
+	}
+
+	static void writeLength(size_t n, std::vector<char> *out)
+	{
+		while (n >= 255) {
+			out->push_back((char)255);
+			n -= 255;
+		}
+		out->push_back((char)n);
+	}
+
+	static bool readLength(const unsigned char **ip, const unsigned char *iend, size_t *n)
+	{
+		unsigned char c;
+		do {
+			if (*ip >= iend) {
+				return false;
+			}
+			c = *(*ip)++;
+			*n += c;
+		} while (c == 255);
+		return true;
+	}
+
+	// Writes literals, followed by a match unless mlen is 0
+	static void writeSequence(const char *literals, size_t litlen, size_t offset, size_t mlen, std::vector<char> *out)
+	{
+		size_t mcode = (mlen ? mlen - LZ_MIN_MATCH : 0);
+		out->push_back((char)((std::min(litlen, (size_t)15) << 4) | std::min(mcode, (size_t)15)));
+		if (litlen >= 15) {
+			writeLength(litlen - 15, out);
+		}
+		out->insert(out->end(), literals, literals + litlen);
+		if (mlen == 0) {
+			return;
+		}
+		out->push_back((char)(offset & 0xFF));
+		out->push_back((char)(offset >> 8));
+		if (mcode >= 15) {
+			writeLength(mcode - 15, out);
+		}
+	}
+};
+
+
+static const StoreCodec storeCodec;
+#ifdef HAVE_LIBZ
+static const ZlibCodec zlibCodec;
+#endif
+static const LzCodec lzCodec;
+
+
+// Returns the codec with the given ID, or NULL
+const Codec *Codec::get(uint8_t id)
+{
+	switch (id) {
+		case StoreId: return &storeCodec;
+#ifdef HAVE_LIBZ
+		case ZlibId: return &zlibCodec;
+#endif
+		case LzId: return &lzCodec;
+		default: break;
+	}
+	return NULL;
+}
+
+// Returns the codec with the given name, or NULL
+const Codec *Codec::get(const std::string &name)
+{
+	std::vector<const Codec *> codecs = all();
+	for (size_t i = 0; i < codecs.size(); i++) {
+		if (codecs[i]->name() == name) {
+			return codecs[i];
+		}
+	}
+	return NULL;
+}
+
+// Returns all available codecs
+std::vector<const Codec *> Codec::all()
+{
+	std::vector<const Codec *> codecs;
+	codecs.push_back(&storeCodec);
+#ifdef HAVE_LIBZ
+	codecs.push_back(&zlibCodec);
+#endif
+	codecs.push_back(&lzCodec);
+	return codecs;
+}
+
+// Returns the codec for new records
+const Codec *Codec::defaultCodec()
+{
+	return &lzCodec;
+}
+
+// Compresses data and prepends a header identifying the codec. Incompressible
+// data is stored as-is.
+std::vector<char> Codec::encode(const char *data, size_t len, const Codec *codec)
+{
+	if (codec == NULL) {
+		codec = defaultCodec();
+	}
+
+	std::vector<char> out(HEADER_SIZE);
+	out[0] = HEADER_MAGIC;
+	uint32_t size = len;
+#ifndef WORDS_BIGENDIAN
+	size = BStream::bswap(size);
+#endif
+	memcpy(&out[2], (const char *)&size, 4);
+
+	codec->compress(data, len, &out);
+	if (out.size() - HEADER_SIZE > len && codec != &storeCodec) {
+		out.resize(HEADER_SIZE);
+		codec = &storeCodec;
+		codec->compress(data, len, &out);
+	}
+	out[1] = (char)codec->id();
+	return out;
+}
+
+std::vector<char> Codec::encode(const std::vector<char> &data, const Codec *codec)
+{
+	return encode(data.data(), data.size(), codec);
+}
+
+// Decompresses data written by encode() or utils::compress()
+std::vector<char> Codec::decode(const char *data, size_t len)
+{
+	if (len == 0 || data[0] != HEADER_MAGIC) {
+		return utils::uncompress(data, len);
+	}
+	if (len < HEADER_SIZE) {
+		throw PEX("Corrupted data (truncated header)");
+	}
+
+	const Codec *codec = get((uint8_t)data[1]);
+	if (codec == NULL) {
+		throw PEX(str::printf("Unknown compression codec %u", (unsigned int)(uint8_t)data[1]));
+	}
+	uint32_t size;
+	memcpy((char *)&size, data + 2, 4);
+#ifndef WORDS_BIGENDIAN
+	size = BStream::bswap(size);
+#endif
+
+	std::vector<char> out(size);
+	if (size > 0 && !codec->uncompress(data + HEADER_SIZE, len - HEADER_SIZE, &out[0], size)) {
+		throw PEX(str::printf("Corrupted data (%s)", codec->name().c_str()));
+	}
+	return out;
+}
@@ -0,0 +1,60 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: codec.h
+ * Compression codecs for cache records (interface)
+ */
+
+
+#ifndef CODEC_H_
+#define CODEC_H_
+
+
+#include <string>
+#include <vector>
+
+#include "main.h"
+
+
+class Codec
+{
+	public:
+		// Built-in codecs. IDs are stored in the record headers, so they
+		// must never change.
+		typedef enum {
+			StoreId = 0,
+			ZlibId = 1,
+			LzId = 2
+		} Id;
+
+	public:
+		virtual ~Codec() { }
+
+		virtual uint8_t id() const = 0;
+		virtual std::string name() const = 0;
+
+		// Appends the compressed data to out
+		virtual void compress(const char *data, size_t len, std::vector<char> *out) const = 0;
+		// Decompresses exactly outlen bytes
+		virtual bool uncompress(const char *data, size_t len, char *out, size_t outlen) const = 0;
+
+		static const Codec *get(uint8_t id);
+		static const Codec *get(const std::string &name);
+		static std::vector<const Codec *> all();
+		static const Codec *defaultCodec();
+
+		static std::vector<char> encode(const std::vector<char> &data, const Codec *codec = NULL);
+		static std::vector<char> encode(const char *data, size_t len, const Codec *codec = NULL);
+		static std::vector<char> decode(const char *data, size_t len);
+		static inline std::vector<char> decode(const std::vector<char> &data) {
+			return decode(&data[0], data.size());
+		}
+};
+
+
+#endif // CODEC_H_
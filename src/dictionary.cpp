@@ -0,0 +1,225 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: dictionary.cpp
+ * String dictionaries for the revision caches
+ *
+ * Strings that occur in many revisions, i.e. author names and file paths,
+ * are stored once per repository and referenced by their index in the
+ * dictionary. Strings are never removed, so IDs stay valid for the lifetime
+ * of the cache.
+ *
+ * The cache dictionary is stored in the "strings" file. Strings are appended
+ * using single write() calls while holding the cache write lock, and readers
+ * ignore incomplete strings at the end of the file.
+ *
+ *    strings: "PDIC" <format> <string> '\0' <string> '\0' ...
+ */
+
+
+#include "main.h"
+
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <unordered_set>
+
+#include "bstream.h"
+#include "strlib.h"
+
+#include "syslib/fs.h"
+
+#include "dictionary.h"
+
+#define DICTIONARY_FORMAT (uint32_t)1
+#define HEADER_SIZE 8
+
+
+const uint32_t Dictionary::None;
+
+
+// Constructor
+Dictionary::Dictionary()
+{
+
+}
+
+// Destructor
+Dictionary::~Dictionary()
+{
+
+}
+
+// Returns the number of strings in the dictionary
+size_t Dictionary::size() const
+{
+	return m_strings.size();
+}
+
+// Returns the ID of the given string, or None
+uint32_t Dictionary::find(const std::string &str) const
+{
+	std::unordered_map<std::string, uint32_t>::const_iterator it = m_ids.find(str);
+	return (it != m_ids.end() ? it->second : None);
+}
+
+// Returns the string with the given ID
+const std::string &Dictionary::at(uint32_t id) const
+{
+	if (id >= m_strings.size()) {
+		throw PEX(str::printf("Unknown string ID %u", id));
+	}
+	return m_strings[id];
+}
+
+// Adds a string to the dictionary if necessary and returns its ID
+uint32_t Dictionary::insert(const std::string &str)
+{
+	uint32_t id = find(str);
+	if (id == None) {
+		id = m_strings.size();
+		m_strings.push_back(str);
+		m_ids[str] = id;
+	}
+	return id;
+}
+
+// Removes all strings
+void Dictionary::clear()
+{
+	m_strings.clear();
+	m_ids.clear();
+}
+
+
+// Constructor
+CacheDictionary::CacheDictionary(const std::string &dir)
+	: Dictionary(), m_dir(dir), m_fileSize(0)
+{
+
+}
+
+// Reads strings that have been appended to the dictionary file, e.g. by
+// other processes. Returns true if there were any.
+bool CacheDictionary::refresh()
+{
+	std::string path = m_dir + "/strings";
+	if (!sys::fs::fileExists(path)) {
+		return false;
+	}
+	size_t fileSize = sys::fs::filesize(path);
+	if (fileSize <= m_fileSize) {
+		return false;
+	}
+
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd == -1) {
+		throw PEX(str::printf("Unable to open cache dictionary %s: %s", path.c_str(), PepperException::strerror(errno).c_str()));
+	}
+	std::vector<char> buffer(fileSize - m_fileSize);
+	size_t nread = 0;
+	while (nread < buffer.size()) {
+		ssize_t n = ::pread(fd, &buffer[nread], buffer.size() - nread, m_fileSize + nread);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		nread += n;
+	}
+	::close(fd);
+
+	const char *begin = &buffer[0], *p = begin, *end = begin + nread;
+	if (m_fileSize == 0) {
+		if (nread < HEADER_SIZE) {
+			return false;
+		}
+		uint32_t format;
+		memcpy((char *)&format, p + 4, 4);
+#ifndef WORDS_BIGENDIAN
+		format = BStream::bswap(format);
+#endif
+		if (memcmp(p, "PDIC", 4) || format != DICTIONARY_FORMAT) {
+			throw PEX(str::printf("Invalid cache dictionary file: %s", path.c_str()));
+		}
+		p += HEADER_SIZE;
+	}
+
+	// Strings are appended in ID order, without duplicates
+	size_t n = size();
+	while (p < end) {
+		const char *q = (const char *)memchr(p, '\0', end - p);
+		if (q == NULL) {
+			// Incomplete string
+			break;
+		}
+		insert(std::string(p, q - p));
+		p = q + 1;
+	}
+	m_fileSize += (p - begin);
+	return (size() != n);
+}
+
+// Adds the given strings to the dictionary file, unless they're already part
+// of it. The caller is responsible for serializing calls to this function.
+void CacheDictionary::append(const std::vector<std::string> &strings)
+{
+	refresh();
+
+	std::vector<std::string> missing;
+	std::unordered_set<std::string> seen;
+	for (size_t i = 0; i < strings.size(); i++) {
+		if (find(strings[i]) == None && seen.insert(strings[i]).second) {
+			missing.push_back(strings[i]);
+		}
+	}
+	if (missing.empty()) {
+		return;
+	}
+
+	std::string path = m_dir + "/strings";
+	int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0666);
+	if (fd == -1) {
+		throw PEX(str::printf("Unable to open cache dictionary %s: %s", path.c_str(), PepperException::strerror(errno).c_str()));
+	}
+
+	MOStream out;
+	if (m_fileSize == 0) {
+		// New or invalid dictionary file
+		if (ftruncate(fd, 0) == -1) {
+			::close(fd);
+			throw PEX_ERRNO();
+		}
+		out.write("PDIC", 4);
+		out << DICTIONARY_FORMAT;
+	} else if (sys::fs::filesize(path) != m_fileSize && ftruncate(fd, m_fileSize) == -1) {
+		// Drop incomplete trailing strings, e.g. from a process that
+		// has been killed while writing
+		::close(fd);
+		throw PEX_ERRNO();
+	}
+
+	// Write all strings using a single call, so there are no partial
+	// strings unless the process is killed
+	for (size_t i = 0; i < missing.size(); i++) {
+		out << missing[i];
+	}
+	std::vector<char> data(out.data());
+	if (::write(fd, &data[0], data.size()) != (ssize_t)data.size()) {
+		int err = errno;
+		::close(fd);
+		throw PEX(str::printf("Unable to write to cache dictionary: %s", PepperException::strerror(err).c_str()));
+	}
+	::close(fd);
+
+	m_fileSize += data.size();
+	for (size_t i = 0; i < missing.size(); i++) {
+		insert(missing[i]);
+	}
+}
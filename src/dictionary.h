@@ -0,0 +1,60 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: dictionary.h
+ * String dictionaries for the revision caches (interface)
+ */
+
+
+#ifndef DICTIONARY_H_
+#define DICTIONARY_H_
+
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "main.h"
+
+
+class Dictionary
+{
+	public:
+		static const uint32_t None = 0xFFFFFFFF;
+
+	public:
+		Dictionary();
+		virtual ~Dictionary();
+
+		size_t size() const;
+		uint32_t find(const std::string &str) const;
+		const std::string &at(uint32_t id) const;
+		uint32_t insert(const std::string &str);
+		void clear();
+
+	PEPPER_PVARS:
+		std::vector<std::string> m_strings;
+		std::unordered_map<std::string, uint32_t> m_ids;
+};
+
+
+class CacheDictionary : public Dictionary
+{
+	public:
+		CacheDictionary(const std::string &dir);
+
+		bool refresh();
+		void append(const std::vector<std::string> &strings);
+
+	PEPPER_PVARS:
+		std::string m_dir;
+		size_t m_fileSize;
+};
+
+
+#endif // DICTIONARY_H_
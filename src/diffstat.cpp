@@ -13,7 +13,10 @@
 
 #include "main.h"
 
+#include <algorithm>
+
 #include "bstream.h"
+#include "dictionary.h"
 #include "logger.h"
 #include "luahelpers.h"
 #include "strlib.h"
@@ -39,6 +42,17 @@ std::map<std::string, Diffstat::Stat> Diffstat::stats() const
 	return m_stats;
 }
 
+// Returns the approximate number of bytes used by the stat
+size_t Diffstat::memoryUsage() const
+{
+	size_t n = sizeof(Diffstat);
+	for (std::map<std::string, Stat>::const_iterator it = m_stats.begin(); it != m_stats.end(); ++it) {
+		// Tree nodes store three pointers and the color in addition to the value
+		n += sizeof(*it) + 4 * sizeof(void *) + it->first.capacity();
+	}
+	return n;
+}
+
 // Removes all paths not matching the given filter
 void Diffstat::filter(const std::string &prefix)
 {
@@ -53,35 +67,153 @@ void Diffstat::filter(const std::string &prefix)
 	}
 }
 
-// Writes the stat to a binary stream
-void Diffstat::write(BOStream &out) const
+// Writes the counters of a single file
+static inline void writeStat(BOStream &out, const Diffstat::Stat &stat, Diffstat::Format format)
+{
+	if (format == Diffstat::Compact) {
+		out.writeVarint(stat.cadd).writeVarint(stat.ladd).writeVarint(stat.cdel).writeVarint(stat.ldel);
+	} else {
+		out << stat.cadd << stat.ladd << stat.cdel << stat.ldel;
+	}
+}
+
+// Reads the counters of a single file
+static inline void readStat(BIStream &in, Diffstat::Stat *stat, Diffstat::Format format)
+{
+	if (format == Diffstat::Compact) {
+		in.readVarint(stat->cadd).readVarint(stat->ladd).readVarint(stat->cdel).readVarint(stat->ldel);
+	} else {
+		in >> stat->cadd >> stat->ladd >> stat->cdel >> stat->ldel;
+	}
+}
+
+// Writes the stat to a binary stream. In the compact format, paths are
+// stored as the length of the prefix shared with the previous path and the
+// remaining suffix.
+void Diffstat::write(BOStream &out, Format format) const
 {
-	out << (uint32_t)m_stats.size();
+	if (format == Compact) {
+		out.writeVarint(m_stats.size());
+	} else {
+		out << (uint32_t)m_stats.size();
+	}
+	const std::string *prev = NULL;
 	for (std::map<std::string, Stat>::const_iterator it = m_stats.begin(); it != m_stats.end(); ++it) {
-		out << it->first.data();
-		out << it->second.cadd << it->second.ladd << it->second.cdel << it->second.ldel;
+		if (format == Compact) {
+			size_t prefix = 0;
+			if (prev != NULL) {
+				size_t max = std::min(prev->length(), it->first.length());
+				while (prefix < max && (*prev)[prefix] == it->first[prefix]) {
+					++prefix;
+				}
+			}
+			out.writeVarint(prefix);
+			out << it->first.data() + prefix;
+			prev = &(it->first);
+		} else {
+			out << it->first.data();
+		}
+		writeStat(out, it->second, format);
 	}
 }
 
 // Loads the stat from a binary stream
-bool Diffstat::load(BIStream &in)
+bool Diffstat::load(BIStream &in, Format format)
 {
 	m_stats.clear();
 	uint32_t i = 0, n;
-	in >> n;
-	std::string buffer;
+	if (format == Compact) {
+		in.readVarint(n);
+	} else {
+		in >> n;
+	}
+	std::string buffer, path;
 	Stat stat;
 	while (i++ < n && !in.eof()) {
-		in >> buffer;
-		if (buffer.empty()) {
-			return false;
+		if (format == Compact) {
+			uint32_t prefix;
+			in.readVarint(prefix) >> buffer;
+			if (prefix > path.length() || buffer.empty()) {
+				return false;
+			}
+			path.replace(prefix, std::string::npos, buffer);
+			readStat(in, &stat, format);
+			// Paths are written in sorted order
+			m_stats.insert(m_stats.end(), std::pair<std::string, Stat>(path, stat));
+		} else {
+			in >> buffer;
+			if (buffer.empty()) {
+				return false;
+			}
+			readStat(in, &stat, format);
+			m_stats[buffer] = stat;
 		}
-		in >> stat.cadd >> stat.ladd >> stat.cdel >> stat.ldel;
-		m_stats[buffer] = stat;
 	}
 	return true;
 }
 
+// Writes the stat to a binary stream, storing paths by their IDs in the
+// given dictionary. All paths must be part of the dictionary. In the compact
+// format, IDs are stored as differences to the previous ID, since the paths
+// of a revision are usually added to the dictionary together.
+void Diffstat::write(BOStream &out, const Dictionary &dict, Format format) const
+{
+	if (format == Compact) {
+		out.writeVarint(m_stats.size());
+	} else {
+		out << (uint32_t)m_stats.size();
+	}
+	int64_t prev = -1;
+	for (std::map<std::string, Stat>::const_iterator it = m_stats.begin(); it != m_stats.end(); ++it) {
+		uint32_t id = dict.find(it->first);
+		if (id == Dictionary::None) {
+			throw PEX(str::printf("Path %s is missing from dictionary", it->first.c_str()));
+		}
+		if (format == Compact) {
+			out.writeVarint(BStream::zigzag((int64_t)id - prev - 1));
+			prev = id;
+		} else {
+			out << id;
+		}
+		writeStat(out, it->second, format);
+	}
+}
+
+// Loads the stat from a binary stream, looking up paths in the given
+// dictionary
+bool Diffstat::load(BIStream &in, const Dictionary &dict, Format format)
+{
+	m_stats.clear();
+	uint32_t i = 0, n, id;
+	if (format == Compact) {
+		in.readVarint(n);
+	} else {
+		in >> n;
+	}
+	int64_t prev = -1;
+	Stat stat;
+	while (i++ < n && !in.eof()) {
+		if (format == Compact) {
+			uint64_t delta;
+			in.readVarint(delta);
+			int64_t next = prev + 1 + BStream::unzigzag(delta);
+			if (next < 0 || next >= (int64_t)dict.size()) {
+				return false;
+			}
+			id = prev = next;
+		} else {
+			in >> id;
+			if (id >= dict.size()) {
+				return false;
+			}
+		}
+		readStat(in, &stat, format);
+		// Paths are written in sorted order
+		m_stats.insert(m_stats.end(), std::pair<std::string, Stat>(dict.at(id), stat));
+	}
+	return in.ok();
+}
+
 /*
  * Lua binding
  */
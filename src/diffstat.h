@@ -28,6 +28,7 @@
 
 class BIStream;
 class BOStream;
+class Dictionary;
 
 
 class Diffstat
@@ -47,16 +48,26 @@ class Diffstat
 			}
 		};
 
+		// Binary formats: Fixed-width counters, or variable-length integers
+		// with front-coded paths
+		enum Format {
+			Fixed,
+			Compact
+		};
+
 	public:
 		Diffstat();
 		~Diffstat();
 
 		std::map<std::string, Stat> stats() const;
 
+		size_t memoryUsage() const;
 		void filter(const std::string &prefix);
 
-		void write(BOStream &out) const;
-		bool load(BIStream &in);
+		void write(BOStream &out, Format format = Fixed) const;
+		bool load(BIStream &in, Format format = Fixed);
+		void write(BOStream &out, const Dictionary &dict, Format format = Fixed) const;
+		bool load(BIStream &in, const Dictionary &dict, Format format = Fixed);
 
 	PEPPER_PVARS:
 		std::map<std::string, Stat> m_stats;
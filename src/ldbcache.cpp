@@ -13,7 +13,12 @@
 
 #include "main.h"
 
+#include <algorithm>
+
+#include <leveldb/cache.h>
 #include <leveldb/db.h>
+#include <leveldb/filter_policy.h>
+#include <leveldb/write_batch.h>
 
 #include "bstream.h"
 #include "cache.h"
@@ -22,14 +27,52 @@
 #include "strlib.h"
 #include "utils.h"
 
+#include "syslib/datetime.h"
 #include "syslib/fs.h"
+#include "syslib/sigblock.h"
 
 #include "ldbcache.h"
 
+// Number of revisions that will be checked at once
+#define CHECK_CHUNK_SIZE 4096
+
+// Bloom filter bits per key. Most lookups for new revisions won't need to
+// touch the disk at all.
+#define BLOOM_BITS_PER_KEY 10
+
+// Size of the LevelDB block cache
+#define BLOCK_CACHE_SIZE (16 * 1024 * 1024)
+
+// Pending revisions are written once either limit is reached
+#define WRITE_BATCH_REVISIONS 256
+#define WRITE_BATCH_BYTES (4 * 1024 * 1024)
+
+// Number of revisions that will be imported from the old cache at once
+#define IMPORT_CHUNK_SIZE 4096
+
+
+// Returns the database key of a dictionary string. Dictionary keys start with
+// a NUL byte, which isn't part of any revision ID, followed by the big-endian
+// string ID. Thus, they are stored in ID order, before all revisions.
+static std::string dictionaryKey(uint32_t id)
+{
+	MOStream out;
+	out << '\0' << id;
+	std::vector<char> data(out.data());
+	return std::string(data.begin(), data.end());
+}
+
+// Checks whether the given database key refers to a dictionary string
+static inline bool isDictionaryKey(const leveldb::Slice &key)
+{
+	return (!key.empty() && key[0] == '\0');
+}
+
 
 // Constructor
 LdbCache::LdbCache(Backend *backend, const Options &options)
-	: AbstractCache(backend, options), m_db(NULL)
+	: AbstractCache(backend, options), m_db(NULL), m_filter(NULL), m_blockCache(NULL),
+	  m_batch(new leveldb::WriteBatch())
 {
 
 }
@@ -37,20 +80,52 @@ LdbCache::LdbCache(Backend *backend, const Options &options)
 // Destructor
 LdbCache::~LdbCache()
 {
+	try {
+		flush();
+	} catch (const std::exception &ex) {
+		Logger::err() << "Error: " << ex.what() << endl;
+	}
 	closedb();
+	delete m_batch;
 }
 
 // Flushes the cache to disk
 void LdbCache::flush()
 {
-
+	SIGBLOCK_DEFER();
+	if (m_db) {
+		commit();
+	}
 }
 
+// Decodes database values, ignoring corrupted ones
+class LdbRecordChecker : public AbstractCache::RecordDecoder
+{
+public:
+	LdbRecordChecker(const Dictionary *dict) : dict(dict) { }
+
+	Revision *decode(size_t i)
+	{
+		Revision *rev = new Revision(ids[i]);
+		VIStream rin(values[i].c_str(), values[i].length());
+		if (!rev->load(rin, *dict)) {
+			delete rev;
+			return NULL;
+		}
+		return rev;
+	}
+
+	const Dictionary *dict;
+	std::vector<std::string> ids;
+	std::vector<std::string> values;
+};
+
 // Checks cache consistency
 void LdbCache::check(bool force)
 {
 	try {
 		if (!m_db) opendb();
+		commit();
 	} catch (const std::exception &ex) {
 		PDEBUG << "Exception while opening database: " << ex.what() << endl;
 		Logger::info() << "LdbCache: Database can't be opened, trying to repair it" << endl;
@@ -68,30 +143,53 @@ void LdbCache::check(bool force)
 		opendb();
 	}
 
-	// Simply try to read all revisions
+	// Simply try to read all revisions. The database is scanned sequentially,
+	// and the revisions are decoded in parallel in chunks.
 	Logger::info() << "LdbCache: Checking revisions..." << endl;
+	sys::datetime::Watch watch;
 	std::vector<std::string> corrupted;
 	size_t n = 0;
+	uint64_t bytes = 0;
 	leveldb::Iterator* it = m_db->NewIterator(leveldb::ReadOptions());
-	for (it->SeekToFirst(); it->Valid(); it->Next()) {
-		Revision rev(it->key().ToString());
-		std::string value = it->value().ToString();
-		MIStream rin(value.c_str(), value.length());
-		if (!rev.load(rin)) {
-			PDEBUG << "Revision " << it->key().ToString() << " corrupted!" << endl;
-			corrupted.push_back(it->key().ToString());
+	it->SeekToFirst();
+	while (it->Valid() && isDictionaryKey(it->key())) {
+		it->Next();
+	}
+	while (it->Valid()) {
+		LdbRecordChecker checker(&m_dict);
+		for (; it->Valid() && checker.ids.size() < CHECK_CHUNK_SIZE; it->Next()) {
+			checker.ids.push_back(it->key().ToString());
+			checker.values.push_back(it->value().ToString());
+			bytes += checker.values.back().length();
+		}
+
+		std::vector<Revision *> revs = checker.decodeAll(checker.ids.size());
+		for (size_t i = 0; i < revs.size(); i++) {
+			if (revs[i] == NULL) {
+				PDEBUG << "Revision " << checker.ids[i] << " corrupted!" << endl;
+				corrupted.push_back(checker.ids[i]);
+			}
+			delete revs[i];
 		}
-		++n;
+		n += revs.size();
 	}
 	if (!it->status().ok()) {
 		Logger::err() << "Error iterating over cached revisions: " << it->status().ToString() << endl;
 		Logger::err() << "Please re-run with --force to repair the database (might cause data loss)" << endl;
+		delete it;
 		return;
 	}
-	Logger::info() << "LdbCache: Checked " << n << " revisions, found " << corrupted.size() << " to be corrupted" << endl;
+	delete it;
+
+	float secs = std::max(watch.elapsed(), 0.001f);
+	Logger::info() << "LdbCache: Checked " << n << " revisions, found " << corrupted.size() << " to be corrupted ("
+		<< int(n / secs) << " records/s, " << str::printf("%.1f", bytes / (1024.0f * 1024.0f * secs)) << " MB/s)" << endl;
 
 	for (size_t i = 0; i < corrupted.size(); i++) {
 		Logger::err() << "LdbCache: Revision " << corrupted[i] << " is corrupted, removing from index file" << endl;
+		if (m_lastId == corrupted[i]) {
+			m_lastId.clear();
+		}
 		leveldb::Status status = m_db->Delete(leveldb::WriteOptions(), corrupted[i]);
 		if (!status.ok()) {
 			Logger::err() << "Error: Can't remove from revision " << corrupted[i] << " from database: " << status.ToString() << endl;
@@ -100,11 +198,38 @@ void LdbCache::check(bool force)
 	}
 }
 
-// Checks if the diffstat of the given revision is already cached
+// Compacts the database. The storage layout is managed by LevelDB, so
+// revisions can't be arranged in iteration order.
+void LdbCache::compact(const std::string &)
+{
+	if (!m_db) opendb();
+	commit();
+
+	sys::datetime::Watch watch;
+	Logger::status() << "Compacting database... " << ::flush;
+	m_db->CompactRange(NULL, NULL);
+	Logger::status() << "done" << endl;
+	Logger::info() << "LdbCache: Compacted database in " << watch.elapsedMSecs() << " ms" << endl;
+}
+
+// Other databases can't be opened alongside this one, since the options
+// are shared
+void LdbCache::merge(const std::vector<std::string> &)
+{
+	throw PEX("Merging cache directories is not supported by the LevelDB cache, please use --export-cache and --import-cache");
+}
+
+// Checks if the diffstat of the given revision is already cached. The value
+// is kept for a subsequent call to get(), so a cache hit costs a single read.
 bool LdbCache::lookup(const std::string &id)
 {
+	SIGBLOCK_DEFER();
 	if (!m_db) opendb();
 
+	if (id == m_lastId || m_pending.find(id) != m_pending.end()) {
+		return true;
+	}
+
 	std::string value;
 	leveldb::Status s = m_db->Get(leveldb::ReadOptions(), id, &value);
 	if (s.IsNotFound()) {
@@ -113,41 +238,183 @@ bool LdbCache::lookup(const std::string &id)
 	if (!s.ok()) {
 		throw PEX(str::printf("Error reading from cache: %s", s.ToString().c_str()));
 	}
+	m_stats->bytesRead += value.length();
+	m_lastId = id;
+	m_lastValue.swap(value);
 	return true;
 }
 
-// Adds the revision to the cache
+// Adds the revision to the cache. Revisions are written in batches.
 void LdbCache::put(const std::string &id, const Revision &rev)
 {
+	SIGBLOCK_DEFER();
 	if (!m_db) opendb();
 
+	// New dictionary strings are written along with the revision
+	std::vector<std::string> strings = rev.strings();
+	for (size_t i = 0; i < strings.size(); i++) {
+		if (m_dict.find(strings[i]) == Dictionary::None) {
+			m_batch->Put(dictionaryKey(m_dict.insert(strings[i])), strings[i]);
+		}
+	}
+
 	MOStream rout;
-	rev.write(rout);
+	rev.write(rout, m_dict);
 	std::vector<char> data(rout.data());
-	leveldb::Status s = m_db->Put(leveldb::WriteOptions(), id, std::string(data.begin(), data.end()));
-	if (!s.ok()) {
-		throw PEX(str::printf("Error writing to cache: %s", s.ToString().c_str()));
+	std::string &value = m_pending[id];
+	value.assign(data.begin(), data.end());
+	m_batch->Put(id, value);
+
+	if (m_pending.size() >= WRITE_BATCH_REVISIONS || m_batch->ApproximateSize() >= WRITE_BATCH_BYTES) {
+		commit();
 	}
 }
 
 Revision *LdbCache::get(const std::string &id)
 {
+	SIGBLOCK_DEFER();
 	if (!m_db) opendb();
 
 	std::string value;
-	leveldb::Status s = m_db->Get(leveldb::ReadOptions(), id, &value);
-	if (!s.ok()) {
-		throw PEX(str::printf("Error reading from cache: %s", s.ToString().c_str()));
+	std::map<std::string, std::string>::const_iterator it = m_pending.find(id);
+	if (it != m_pending.end()) {
+		value = it->second;
+	} else if (id == m_lastId) {
+		value.swap(m_lastValue);
+		m_lastId.clear();
+	} else {
+		leveldb::Status s = m_db->Get(leveldb::ReadOptions(), id, &value);
+		if (!s.ok()) {
+			throw PEX(str::printf("Error reading from cache: %s", s.ToString().c_str()));
+		}
+		m_stats->bytesRead += value.length();
 	}
 
+	sys::datetime::Watch watch;
 	Revision *rev = new Revision(id);
-	MIStream rin(value.c_str(), value.length());
-	if (!rev->load(rin)) {
+	VIStream rin(value.c_str(), value.length());
+	if (!rev->load(rin, m_dict)) {
+		delete rev;
 		throw PEX(str::printf("Unable to read from cache: Data corrupted"));
 	}
+	m_stats->decodeTime += watch.elapsedUSecs();
 	return rev;
 }
 
+// Checks whether the given revisions are cached, using a single sweep over
+// the database
+std::vector<bool> LdbCache::lookupMany(const std::vector<std::string> &ids)
+{
+	SIGBLOCK_DEFER();
+	if (!m_db) opendb();
+	commit();
+
+	std::vector<std::pair<std::string, size_t> > keys(ids.size());
+	for (size_t i = 0; i < ids.size(); i++) {
+		keys[i] = std::pair<std::string, size_t>(ids[i], i);
+	}
+	std::sort(keys.begin(), keys.end());
+
+	std::vector<bool> cached(ids.size(), false);
+	leveldb::Iterator *it = m_db->NewIterator(leveldb::ReadOptions());
+	for (size_t i = 0; i < keys.size(); i++) {
+		it->Seek(keys[i].first);
+		cached[keys[i].second] = (it->Valid() && it->key() == keys[i].first);
+	}
+	leveldb::Status s = it->status();
+	delete it;
+	if (!s.ok()) {
+		throw PEX(str::printf("Error reading from cache: %s", s.ToString().c_str()));
+	}
+	return cached;
+}
+
+// Decodes revisions read from the database
+class LdbRecordDecoder : public AbstractCache::RecordDecoder
+{
+public:
+	LdbRecordDecoder(const Dictionary *dict, size_t n) : dict(dict), ids(n), values(n) { }
+
+	Revision *decode(size_t i)
+	{
+		Revision *rev = new Revision(ids[i]);
+		VIStream rin(values[i].c_str(), values[i].length());
+		if (!rev->load(rin, *dict)) {
+			delete rev;
+			throw PEX(str::printf("Unable to read from cache: Data corrupted"));
+		}
+		return rev;
+	}
+
+	const Dictionary *dict;
+	std::vector<std::string> ids;
+	std::vector<std::string> values;
+};
+
+// Loads the given revisions from the cache, in the order of the given IDs
+std::vector<Revision *> LdbCache::getMany(const std::vector<std::string> &ids)
+{
+	SIGBLOCK_DEFER();
+	if (!m_db) opendb();
+	commit();
+
+	std::vector<std::pair<std::string, size_t> > keys(ids.size());
+	for (size_t i = 0; i < ids.size(); i++) {
+		keys[i] = std::pair<std::string, size_t>(ids[i], i);
+	}
+	std::sort(keys.begin(), keys.end());
+
+	// Read all values in key order, then decode them in parallel
+	LdbRecordDecoder decoder(&m_dict, ids.size());
+	leveldb::Iterator *it = m_db->NewIterator(leveldb::ReadOptions());
+	for (size_t i = 0; i < keys.size(); i++) {
+		it->Seek(keys[i].first);
+		if (!it->Valid() || it->key() != keys[i].first) {
+			delete it;
+			throw PEX(str::printf("Error reading from cache: Revision %s not found", keys[i].first.c_str()));
+		}
+		decoder.ids[i] = keys[i].first;
+		decoder.values[i] = it->value().ToString();
+		m_stats->bytesRead += decoder.values[i].length();
+	}
+	leveldb::Status s = it->status();
+	delete it;
+	if (!s.ok()) {
+		throw PEX(str::printf("Error reading from cache: %s", s.ToString().c_str()));
+	}
+
+	sys::datetime::Watch watch;
+	std::vector<Revision *> decoded = decoder.decodeAll(ids.size());
+	m_stats->decodeTime += watch.elapsedUSecs();
+	std::vector<Revision *> revs(ids.size());
+	for (size_t i = 0; i < keys.size(); i++) {
+		revs[keys[i].second] = decoded[i];
+	}
+	return revs;
+}
+
+// Returns the IDs of all cached revisions
+std::vector<std::string> LdbCache::cachedIds()
+{
+	SIGBLOCK_DEFER();
+	if (!m_db) opendb();
+	commit();
+
+	std::vector<std::string> ids;
+	leveldb::Iterator *it = m_db->NewIterator(leveldb::ReadOptions());
+	for (it->SeekToFirst(); it->Valid(); it->Next()) {
+		if (!isDictionaryKey(it->key())) {
+			ids.push_back(it->key().ToString());
+		}
+	}
+	leveldb::Status s = it->status();
+	delete it;
+	if (!s.ok()) {
+		throw PEX(str::printf("Error reading from cache: %s", s.ToString().c_str()));
+	}
+	return ids;
+}
+
 // Opens the database connection
 void LdbCache::opendb()
 {
@@ -158,7 +425,16 @@ void LdbCache::opendb()
 	if (!sys::fs::dirExists(path)) {
 		sys::fs::mkpath(path);
 	}
+	if (m_filter == NULL) {
+		m_filter = leveldb::NewBloomFilterPolicy(BLOOM_BITS_PER_KEY);
+	}
+	if (m_blockCache == NULL) {
+		m_blockCache = leveldb::NewLRUCache(BLOCK_CACHE_SIZE);
+	}
+
 	leveldb::Options options;
+	options.filter_policy = m_filter;
+	options.block_cache = m_blockCache;
 	options.create_if_missing = false;
 	leveldb::Status s = leveldb::DB::Open(options, path, &m_db);
 	if (!s.ok()) {
@@ -169,36 +445,176 @@ void LdbCache::opendb()
 			throw PEX(str::printf("Unable to open database %s: %s", path.c_str(), s.ToString().c_str()));
 		}
 
+		m_dict.clear();
 		Cache c(m_backend, m_opts);
 		import(&c);
+		return;
 	}
+
+	sys::datetime::Watch watch;
+	loadDictionary();
+	m_stats->indexTime += watch.elapsedUSecs();
 }
 
 // Closes the database connection
 void LdbCache::closedb()
 {
+	m_batch->Clear();
+	m_pending.clear();
+	m_lastId.clear();
 	delete m_db;
 	m_db = NULL;
+
+	// These must outlive the database
+	delete m_blockCache;
+	m_blockCache = NULL;
+	delete m_filter;
+	m_filter = NULL;
+}
+
+// Reads the string dictionary from the database
+void LdbCache::loadDictionary()
+{
+	m_dict.clear();
+	leveldb::Iterator *it = m_db->NewIterator(leveldb::ReadOptions());
+	for (it->Seek(dictionaryKey(0)); it->Valid() && isDictionaryKey(it->key()); it->Next()) {
+		uint32_t id = m_dict.size();
+		if (it->key() != dictionaryKey(id) || m_dict.insert(it->value().ToString()) != id) {
+			delete it;
+			throw PEX("Error reading from cache: String dictionary is corrupted");
+		}
+	}
+	leveldb::Status s = it->status();
+	delete it;
+	if (!s.ok()) {
+		throw PEX(str::printf("Error reading from cache: %s", s.ToString().c_str()));
+	}
 }
 
-// Imports all revisions from the given cache
+// Loads the messages and diffstats of revisions from the old cache
+class LdbImportDecoder : public AbstractCache::RecordDecoder
+{
+public:
+	LdbImportDecoder(const std::vector<Revision *> &revs) : revs(revs) { }
+
+	~LdbImportDecoder()
+	{
+		for (size_t i = 0; i < revs.size(); i++) {
+			delete revs[i];
+		}
+	}
+
+	Revision *decode(size_t i)
+	{
+		Revision *rev = revs[i];
+		rev->message();
+		rev->diffstat();
+		revs[i] = NULL;
+		return rev;
+	}
+
+	std::vector<Revision *> revs;
+};
+
+// Imports all revisions from the given cache. The old records are read in
+// the order of the cache files and decompressed in parallel, and each chunk
+// is written in key order.
 void LdbCache::import(Cache *cache)
 {
+	// Caches of older versions are read in their current format, without
+	// converting them first
+	std::vector<std::string> ids;
 	try {
-		cache->load();
+		cache->load(false);
+		ids = cache->cachedIds();
 	} catch (const std::exception &ex) {
-		PDEBUG << "Error loading old cache for import: " << ex.what() << endl;
+		Logger::warn() << "Warning: Unable to import old cache: " << ex.what() << endl;
+		return;
+	}
+	if (ids.empty()) {
 		return;
 	}
 
 	Logger::info() << "LdbCache: Found old cache, importing revisions..." << endl;
-	std::map<std::string, std::pair<uint32_t, uint32_t> >::const_iterator it;
-	size_t n = 0;
-	for (it = cache->m_index.begin(); it != cache->m_index.end(); ++it) {
-		Revision *rev = cache->get(it->first);
-		put(it->first, *rev);
-		delete rev;
-		++n;
+
+	sys::datetime::Watch watch;
+	Logger::status() << "Importing revisions... " << ::flush;
+	leveldb::WriteBatch batch;
+	uint64_t bytes = 0;
+	for (size_t i = 0; i < ids.size(); i += IMPORT_CHUNK_SIZE) {
+		size_t n = std::min(ids.size() - i, (size_t)IMPORT_CHUNK_SIZE);
+		std::vector<std::string> chunk(ids.begin() + i, ids.begin() + i + n);
+
+		LdbImportDecoder decoder(cache->getMany(chunk));
+		std::vector<Revision *> revs = decoder.decodeAll(n);
+
+		// New dictionary strings are written before the revisions
+		std::vector<std::pair<std::string, std::string> > records(n);
+		for (size_t j = 0; j < n; j++) {
+			std::vector<std::string> strings = revs[j]->strings();
+			for (size_t k = 0; k < strings.size(); k++) {
+				if (m_dict.find(strings[k]) == Dictionary::None) {
+					batch.Put(dictionaryKey(m_dict.insert(strings[k])), strings[k]);
+				}
+			}
+
+			MOStream rout;
+			revs[j]->write(rout, m_dict);
+			std::vector<char> data(rout.data());
+			records[j].first = chunk[j];
+			records[j].second.assign(data.begin(), data.end());
+			delete revs[j];
+		}
+
+		std::sort(records.begin(), records.end());
+		for (size_t j = 0; j < n; j++) {
+			batch.Put(records[j].first, records[j].second);
+			bytes += records[j].second.length();
+			if (batch.ApproximateSize() >= WRITE_BATCH_BYTES) {
+				write(&batch);
+			}
+		}
+		write(&batch);
+
+		Logger::status() << "\r\033[0K";
+		Logger::status() << "Importing revisions... " << int(100.0f * (i + n) / ids.size()) << "%" << ::flush;
+	}
+	Logger::status() << "\r\033[0K";
+	Logger::status() << "Importing revisions... done" << endl;
+
+	float secs = std::max(watch.elapsed(), 0.001f);
+	Logger::info() << "LdbCache: Imported " << ids.size() << " revisions in " << str::printf("%.1f", secs) << " s ("
+		<< int(ids.size() / secs) << " records/s, " << str::printf("%.1f", bytes / (1024.0f * 1024.0f * secs)) << " MB/s)" << endl;
+}
+
+// Writes pending revisions to the database
+void LdbCache::commit()
+{
+	if (m_pending.empty()) {
+		return;
+	}
+
+	PTRACE << "Writing " << m_pending.size() << " revisions" << endl;
+	m_pending.clear();
+	write(m_batch);
+}
+
+// Writes and clears the given batch. The write isn't synced, i.e. it
+// returns as soon as the data has been handed to the operating system.
+void LdbCache::write(leveldb::WriteBatch *batch)
+{
+	sys::datetime::Watch watch;
+	size_t size = batch->ApproximateSize();
+	leveldb::WriteOptions options;
+	options.sync = false;
+	leveldb::Status s = m_db->Write(options, batch);
+	batch->Clear();
+	m_stats->bytesWritten += size;
+	m_stats->writeTime += watch.elapsedUSecs();
+	++m_stats->writes;
+	if (!s.ok()) {
+		// Forget about strings that haven't been stored
+		loadDictionary();
+		throw PEX(str::printf("Error writing to cache: %s", s.ToString().c_str()));
 	}
-	Logger::info() << "LdbCache: Imported " << n << " revisions" << endl;
 }
@@ -15,12 +15,18 @@
 #define LDBCACHE_H_
 
 
+#include <map>
+
 #include "abstractcache.h"
+#include "dictionary.h"
 
 class Cache;
 
 namespace leveldb {
+	class Cache;
 	class DB;
+	class FilterPolicy;
+	class WriteBatch;
 }
 
 
@@ -32,19 +38,35 @@ class LdbCache : public AbstractCache
 
 		void flush();
 		void check(bool force = false);
+		void compact(const std::string &branch = std::string());
+		void merge(const std::vector<std::string> &dirs);
 
 	protected:
 		bool lookup(const std::string &id);
 		void put(const std::string &id, const Revision &rev);
 		Revision *get(const std::string &id);
 
+		std::vector<bool> lookupMany(const std::vector<std::string> &ids);
+		std::vector<Revision *> getMany(const std::vector<std::string> &ids);
+		std::vector<std::string> cachedIds();
+
 	private:
 		void opendb();
 		void closedb();
+		void loadDictionary();
 		void import(Cache *cache);
+		void commit();
+		void write(leveldb::WriteBatch *batch);
 
 	private:
 		leveldb::DB *m_db;
+		const leveldb::FilterPolicy *m_filter;
+		leveldb::Cache *m_blockCache;
+		Dictionary m_dict;
+
+		leveldb::WriteBatch *m_batch;
+		std::map<std::string, std::string> m_pending; // Revisions in m_batch
+		std::string m_lastId, m_lastValue; // Value read by lookup()
 };
 
 
@@ -38,6 +38,7 @@ enum LogModifier
 class Logger
 {
 	friend struct SignalHandler;
+	friend struct DaemonSignalHandler;
 
 	public:
 		enum Level
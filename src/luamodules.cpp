@@ -15,10 +15,20 @@
 
 #include <cstring>
 
+#include <unistd.h>
+
+#include "abstractcache.h"
 #include "cache.h"
+#include "codec.h"
+#ifdef USE_LDBCACHE
+ #include "ldbcache.h"
+#endif
 #include "luahelpers.h"
+#include "options.h"
 #include "report.h"
 #include "repository.h"
+#include "revision.h"
+#include "revisioniterator.h"
 #include "strlib.h"
 
 #include "syslib/datetime.h"
@@ -66,12 +76,26 @@ int version(lua_State *L)
 	return LuaHelpers::push(L, PACKAGE_VERSION);
 }
 
+// Returns the counters of the revision cache for the current report
+int cache_stats(lua_State *L)
+{
+	if (Report::current() == NULL) {
+		return LuaHelpers::pushNil(L);
+	}
+	AbstractCache *cache = dynamic_cast<AbstractCache *>(Report::current()->repository()->backend());
+	if (cache == NULL) {
+		return LuaHelpers::pushNil(L);
+	}
+	return LuaHelpers::push(L, cache->stats().values());
+}
+
 // Function table of main functions
 const struct luaL_reg table[] = {
 	{"current_report", current_report},
 	{"run", run},
 	{"list_reports", list_reports},
 	{"version", version},
+	{"cache_stats", cache_stats},
 	{NULL, NULL}
 };
 
@@ -228,6 +252,305 @@ int check_cache(lua_State *L)
 	return LuaHelpers::pushNil(L);
 }
 
+// Rewrites the cache for the given repository in iteration order
+int compact_cache(lua_State *L)
+{
+	std::string branch;
+	if (lua_gettop(L) != 1 && lua_gettop(L) != 2) {
+		return LuaHelpers::pushError(L, "Invalid number of arguments (1 or 2 expected)");
+	}
+	if (lua_gettop(L) > 1) {
+		if (lua_type(L, -1) != LUA_TNIL) {
+			branch = LuaHelpers::pops(L);
+		} else {
+			lua_pop(L, 1);
+		}
+	}
+	Repository *repo = LuaHelpers::popl<Repository>(L);
+	AbstractCache *cache = dynamic_cast<AbstractCache *>(repo->backend());
+	if (cache == NULL) {
+		return LuaHelpers::pushError(L, "No active cache found");
+	}
+
+	try {
+		cache->compact(branch);
+	} catch (const PepperException &ex) {
+		return LuaHelpers::pushError(L, str::printf("Error compacting cache: %s: %s", ex.where(), ex.what()));
+	} catch (const std::exception &ex) {
+		return LuaHelpers::pushError(L, str::printf("Error compacting cache: %s", ex.what()));
+	}
+	return LuaHelpers::pushNil(L);
+}
+
+// Decodes the given records repeatedly and returns the throughput in MB/s of
+// uncompressed data
+static double decodeSpeed(const std::vector<std::vector<char> > &records, uint64_t bytes)
+{
+	sys::datetime::Watch watch;
+	int passes = 0;
+	do {
+		for (size_t i = 0; i < records.size(); i++) {
+			Codec::decode(records[i]);
+		}
+		++passes;
+	} while (watch.elapsed() < 0.25f);
+	return (bytes * passes) / (1024.0 * 1024.0 * watch.elapsed());
+}
+
+// Pushes a result row of the codec benchmark
+static void pushBenchmarkRow(lua_State *L, const std::string &codec, const std::string &column, size_t records, uint64_t raw, uint64_t compressed, double compressSpeed, double decompressSpeed)
+{
+	std::map<std::string, double> row;
+	row["records"] = records;
+	row["raw"] = raw;
+	row["compressed"] = compressed;
+	row["ratio"] = (compressed > 0 ? double(raw) / compressed : 0.0);
+	row["compress"] = compressSpeed;
+	row["decompress"] = decompressSpeed;
+	LuaHelpers::push(L, row);
+	LuaHelpers::push(L, codec);
+	lua_setfield(L, -2, "codec");
+	LuaHelpers::push(L, column);
+	lua_setfield(L, -2, "column");
+}
+
+// Measures compression ratio and speed of all codecs, using the messages and
+// diffstats from the cache of the given repository
+int benchmark_codecs(lua_State *L)
+{
+	if (lua_gettop(L) != 1) {
+		return LuaHelpers::pushError(L, "Invalid number of arguments (1 expected)");
+	}
+	Repository *repo = LuaHelpers::popl<Repository>(L);
+	Cache *cache = dynamic_cast<Cache *>(repo->backend());
+	if (cache == NULL) {
+		return LuaHelpers::pushError(L, "Codec benchmarks require the default revision cache");
+	}
+
+	static const Cache::Column columns[] = {Cache::MessageColumn, Cache::DiffstatColumn};
+	static const char *names[] = {"messages", "diffstats"};
+	std::vector<const Codec *> codecs = Codec::all();
+
+	lua_newtable(L);
+	int table = lua_gettop(L), row = 1;
+	try {
+		for (int c = 0; c < 2; c++) {
+			std::vector<std::vector<char> > stored = cache->columnData(columns[c]);
+			std::vector<std::vector<char> > data(stored.size());
+			uint64_t raw = 0, size = 0;
+			for (size_t i = 0; i < stored.size(); i++) {
+				data[i] = Codec::decode(stored[i]);
+				raw += data[i].size();
+				size += stored[i].size();
+			}
+
+			// Records as they are stored in the cache
+			pushBenchmarkRow(L, "cache", names[c], stored.size(), raw, size, 0.0, decodeSpeed(stored, raw));
+			lua_rawseti(L, table, row++);
+
+			for (size_t j = 0; j < codecs.size(); j++) {
+				std::vector<std::vector<char> > encoded(data.size());
+				sys::datetime::Watch watch;
+				size = 0;
+				for (size_t i = 0; i < data.size(); i++) {
+					encoded[i] = Codec::encode(data[i], codecs[j]);
+					size += encoded[i].size();
+				}
+				double compressSpeed = raw / (1024.0 * 1024.0 * std::max(watch.elapsed(), 0.001f));
+
+				pushBenchmarkRow(L, codecs[j]->name(), names[c], data.size(), raw, size, compressSpeed, decodeSpeed(encoded, raw));
+				lua_rawseti(L, table, row++);
+			}
+		}
+	} catch (const PepperException &ex) {
+		return LuaHelpers::pushError(L, str::printf("Error reading from cache: %s: %s", ex.where(), ex.what()));
+	} catch (const std::exception &ex) {
+		return LuaHelpers::pushError(L, str::printf("Error reading from cache: %s", ex.what()));
+	}
+	return 1;
+}
+
+// Serves copies of previously read revisions from memory, so the caches can
+// be benchmarked independently of the repository backend
+class MemoryBackend : public Backend
+{
+public:
+	MemoryBackend(Backend *backend) : Backend(backend->options()), m_backend(backend) { }
+	~MemoryBackend()
+	{
+		for (std::map<std::string, Revision *>::iterator it = m_revisions.begin(); it != m_revisions.end(); ++it) {
+			delete it->second;
+		}
+	}
+
+	void add(Revision *rev) { delete m_revisions[rev->id()]; m_revisions[rev->id()] = rev; }
+	void setUuid(const std::string &uuid) { m_uuid = uuid; }
+
+	std::string name() const { return "memory"; }
+	std::string uuid() { return m_uuid; }
+	std::string head(const std::string &branch) { return m_backend->head(branch); }
+	std::string mainBranch() { return m_backend->mainBranch(); }
+	std::vector<std::string> branches() { return m_backend->branches(); }
+	std::vector<Tag> tags() { return m_backend->tags(); }
+	DiffstatPtr diffstat(const std::string &id)
+	{
+		Revision *rev = revision(id);
+		DiffstatPtr stat = rev->diffstat();
+		delete rev;
+		return stat;
+	}
+	std::vector<std::string> tree(const std::string &id) { return m_backend->tree(id); }
+	std::string cat(const std::string &path, const std::string &id) { return m_backend->cat(path, id); }
+	LogIterator *iterator(const std::string &branch, int64_t start, int64_t end) { return m_backend->iterator(branch, start, end); }
+
+	Revision *revision(const std::string &id)
+	{
+		std::map<std::string, Revision *>::const_iterator it = m_revisions.find(id);
+		if (it == m_revisions.end()) {
+			throw PEX(str::printf("Revision %s not found", id.c_str()));
+		}
+		const Revision *r = it->second;
+		return new Revision(r->id(), r->date(), r->author(), r->message(), r->diffstat());
+	}
+
+private:
+	Backend *m_backend;
+	std::string m_uuid;
+	std::map<std::string, Revision *> m_revisions;
+};
+
+// Returns the size of all files below the given path
+static uint64_t diskUsage(const std::string &path)
+{
+	if (!sys::fs::dirExists(path)) {
+		return sys::fs::filesize(path);
+	}
+	uint64_t size = 0;
+	std::vector<std::string> entries = sys::fs::ls(path);
+	for (size_t i = 0; i < entries.size(); i++) {
+		size += diskUsage(path + "/" + entries[i]);
+	}
+	return size;
+}
+
+// Creates a revision cache of the given type
+static AbstractCache *createCache(const std::string &type, Backend *backend)
+{
+#ifdef USE_LDBCACHE
+	if (type == "ldbcache") {
+		return new LdbCache(backend, backend->options());
+	}
+#else
+	(void)type; // No compiler warnings, please
+#endif
+	return new Cache(backend, backend->options());
+}
+
+// Pushes a result row of the cache benchmark
+static void pushCacheBenchmarkRow(lua_State *L, const std::string &cache, const std::string &phase, size_t revisions, double seconds, uint64_t size)
+{
+	std::map<std::string, double> row;
+	row["revisions"] = revisions;
+	row["seconds"] = seconds;
+	row["rate"] = revisions / std::max(seconds, 0.001);
+	row["size"] = size;
+	LuaHelpers::push(L, row);
+	LuaHelpers::push(L, cache);
+	lua_setfield(L, -2, "cache");
+	LuaHelpers::push(L, phase);
+	lua_setfield(L, -2, "phase");
+}
+
+// Measures write and read throughput of the available revision caches on
+// the history of the given repository. Each cache is filled from memory, and
+// read back with single lookups and with prefetching.
+int benchmark_caches(lua_State *L)
+{
+	if (lua_gettop(L) < 1 || lua_gettop(L) > 2) {
+		return LuaHelpers::pushError(L, "Invalid number of arguments (1 or 2 expected)");
+	}
+	std::string branch;
+	if (lua_gettop(L) == 2) {
+		branch = LuaHelpers::pops(L);
+	}
+	Repository *repo = LuaHelpers::popl<Repository>(L);
+
+	std::vector<std::string> types;
+	types.push_back("cache");
+#ifdef USE_LDBCACHE
+	types.push_back("ldbcache");
+#endif
+
+	lua_newtable(L);
+	int table = lua_gettop(L), row = 1;
+	std::string dir;
+	try {
+		MemoryBackend source(repo->backend());
+		std::vector<std::string> ids;
+		RevisionIterator it(repo->backend(), branch);
+		while (!it.atEnd()) {
+			ids.push_back(it.next());
+			source.add(repo->backend()->revision(ids.back()));
+		}
+
+		for (size_t i = 0; i < types.size(); i++) {
+			source.setUuid(str::printf("benchmark-%s-%d", types[i].c_str(), (int)getpid()));
+			dir = source.options().cacheDir() + "/" + source.uuid();
+
+			// Cold cache: All revisions are written
+			AbstractCache *cache = createCache(types[i], &source);
+			sys::datetime::Watch watch;
+			for (size_t j = 0; j < ids.size(); j++) {
+				delete cache->revision(ids[j]);
+			}
+			cache->flush();
+			double secs = watch.elapsed();
+			delete cache;
+			pushCacheBenchmarkRow(L, types[i], "write", ids.size(), secs, diskUsage(dir));
+			lua_rawseti(L, table, row++);
+
+			// Warm cache: Single lookups
+			cache = createCache(types[i], &source);
+			watch.start();
+			for (size_t j = 0; j < ids.size(); j++) {
+				Revision *rev = cache->revision(ids[j]);
+				rev->message();
+				rev->diffstat();
+				delete rev;
+			}
+			secs = watch.elapsed();
+			delete cache;
+			pushCacheBenchmarkRow(L, types[i], "read", ids.size(), secs, diskUsage(dir));
+			lua_rawseti(L, table, row++);
+
+			// Warm cache: Prefetched lookups
+			cache = createCache(types[i], &source);
+			watch.start();
+			cache->prefetch(ids);
+			for (size_t j = 0; j < ids.size(); j++) {
+				Revision *rev = cache->revision(ids[j]);
+				rev->message();
+				rev->diffstat();
+				delete rev;
+			}
+			secs = watch.elapsed();
+			delete cache;
+			pushCacheBenchmarkRow(L, types[i], "prefetch", ids.size(), secs, diskUsage(dir));
+			lua_rawseti(L, table, row++);
+
+			sys::fs::unlinkr(dir);
+			dir.clear();
+		}
+	} catch (const PepperException &ex) {
+		if (!dir.empty()) sys::fs::unlinkr(dir);
+		return LuaHelpers::pushError(L, str::printf("Error benchmarking caches: %s: %s", ex.where(), ex.what()));
+	} catch (const std::exception &ex) {
+		if (!dir.empty()) sys::fs::unlinkr(dir);
+		return LuaHelpers::pushError(L, str::printf("Error benchmarking caches: %s", ex.what()));
+	}
+	return 1;
+}
+
 // Lua wrapper for sys::datetime::Watch
 class Watch : public sys::datetime::Watch
 {
@@ -253,6 +576,9 @@ Lunar<Watch>::RegType Watch::methods[] = {
 // Function table of internal functions
 const struct luaL_reg table[] = {
 	{"check_cache", check_cache},
+	{"compact_cache", compact_cache},
+	{"benchmark_codecs", benchmark_codecs},
+	{"benchmark_caches", benchmark_caches},
 	{NULL, NULL}
 };
 
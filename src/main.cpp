@@ -23,6 +23,10 @@
 
 #include "backend.h"
 #include "abstractcache.h"
+#include "cachearchive.h"
+#include "cachebudget.h"
+#include "cacheclient.h"
+#include "cachedaemon.h"
 #include "logger.h"
 #include "options.h"
 #include "report.h"
@@ -49,14 +53,41 @@ struct SignalHandler : public sys::sigblock::Handler
 		Logger::unlock();
 
 		if (cache) {
+			// Revisions that are still being written in the background
+			// will be written before the program terminates
 			Logger::status() << "Catched signal " << signum << ", flushing cache" << endl;
-			cache->flush();
+			try {
+				cache->flush();
+			} catch (const std::exception &ex) {
+				std::cerr << "Error flushing cache: " << ex.what() << std::endl;
+			}
 		}
 	}
 
 	AbstractCache *cache;
 };
 
+// Signal handler for the cache daemon
+struct DaemonSignalHandler : public sys::sigblock::Handler
+{
+	DaemonSignalHandler(CacheDaemon *daemon) : daemon(daemon) { }
+
+	void operator()(int signum)
+	{
+		Logger::unlock();
+
+		// Requests are never interrupted, so the caches are consistent
+		Logger::status() << "Catched signal " << signum << ", flushing caches" << endl;
+		try {
+			daemon->flush();
+		} catch (const std::exception &ex) {
+			std::cerr << "Error flushing caches: " << ex.what() << std::endl;
+		}
+	}
+
+	CacheDaemon *daemon;
+};
+
 
 // Prints a short footer for help screens and listings
 static void printFooter()
@@ -134,6 +165,82 @@ static void setupLogger(std::vector<std::ofstream *> *streams, const Options &)
 #endif
 }
 
+// Serves the revision cache to other processes until terminated
+static int runCacheDaemon(const Options &opts)
+{
+	CacheDaemon daemon(opts);
+	DaemonSignalHandler sighandler(&daemon);
+
+	int signums[] = {SIGINT, SIGTERM};
+	sys::sigblock::block(2, signums, &sighandler);
+	sys::sigblock::ignore(SIGPIPE);
+
+	try {
+		daemon.run();
+	} catch (const PepperException &ex) {
+		std::cerr << "Error running cache daemon: " << ex.where() << ": " << ex.what() << std::endl;
+		Logger::flush();
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+// Fills the cache with the revisions of the requested branches
+static int warmCache(AbstractCache *cache, const Options &opts)
+{
+	try {
+		cache->warm(opts.warmCacheBranches());
+	} catch (const PepperException &ex) {
+		std::cerr << "Error warming up cache: " << ex.where() << ": " << ex.what() << std::endl;
+		Logger::flush();
+		return EXIT_FAILURE;
+	} catch (const std::exception &ex) {
+		std::cerr << "Error warming up cache: " << ex.what() << std::endl;
+		Logger::flush();
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+// Merges the caches in the requested directories into the cache
+static int mergeCache(AbstractCache *cache, const Options &opts)
+{
+	try {
+		cache->merge(opts.mergeCacheDirs());
+	} catch (const PepperException &ex) {
+		std::cerr << "Error merging caches: " << ex.where() << ": " << ex.what() << std::endl;
+		Logger::flush();
+		return EXIT_FAILURE;
+	} catch (const std::exception &ex) {
+		std::cerr << "Error merging caches: " << ex.what() << std::endl;
+		Logger::flush();
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+// Merges a cache archive into the cache or writes the cache to an archive
+static int transferCache(AbstractCache *cache, const std::string &path, bool import)
+{
+	try {
+		CacheArchive archive(cache);
+		if (import) {
+			archive.importFrom(path);
+		} else {
+			archive.exportTo(path);
+		}
+	} catch (const PepperException &ex) {
+		std::cerr << "Error transferring cache: " << ex.where() << ": " << ex.what() << std::endl;
+		Logger::flush();
+		return EXIT_FAILURE;
+	} catch (const std::exception &ex) {
+		std::cerr << "Error transferring cache: " << ex.what() << std::endl;
+		Logger::flush();
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
 // Runs the program according to the given actions
 int start(const Options &opts)
 {
@@ -152,7 +259,25 @@ int start(const Options &opts)
 		Report::printReportListing();
 		printFooter();
 		return EXIT_SUCCESS;
-	} else if (opts.repository().empty() || opts.report().empty()) {
+	} else if (opts.cacheDaemonRequested()) {
+		return runCacheDaemon(opts);
+	}
+
+	bool transfer = (!opts.exportCacheFile().empty() || !opts.importCacheFile().empty());
+	bool merge = opts.mergeCacheRequested();
+	if (opts.warmCacheRequested() && !opts.useCache()) {
+		std::cerr << "Error: The cache can't be warmed up if it is disabled" << std::endl;
+		return EXIT_FAILURE;
+	} else if (transfer && !opts.useCache()) {
+		std::cerr << "Error: The cache can't be exported or imported if it is disabled" << std::endl;
+		return EXIT_FAILURE;
+	} else if (merge && !opts.useCache()) {
+		std::cerr << "Error: Caches can't be merged if the cache is disabled" << std::endl;
+		return EXIT_FAILURE;
+	} else if (merge && opts.mergeCacheDirs().empty()) {
+		std::cerr << "Error: No cache directories to merge given" << std::endl;
+		return EXIT_FAILURE;
+	} else if (opts.repository().empty() || (opts.report().empty() && !opts.warmCacheRequested() && !transfer && !merge)) {
 		printHelp(opts);
 		return EXIT_FAILURE;
 	}
@@ -178,11 +303,16 @@ int start(const Options &opts)
 		if (opts.useCache()) {
 			backend->init();
 
+			// Use the cache daemon if one is running
+			if (CacheClient::available(opts)) {
+				cache = new CacheClient(backend, opts);
+			} else {
 #ifdef USE_LDBCACHE
-			cache = new LdbCache(backend, opts);
+				cache = new LdbCache(backend, opts);
 #else
-			cache = new Cache(backend, opts);
+				cache = new Cache(backend, opts);
 #endif
+			}
 			sighandler.cache = cache;
 
 			cache->init();
@@ -200,22 +330,51 @@ int start(const Options &opts)
 	sys::sigblock::ignore(SIGPIPE);
 
 	int ret;
-	try {
-		Report r(opts.report(), (cache ? cache : backend));
-		ret = r.run();
-	} catch (const PepperException &ex) {
-		std::cerr << "Received exception while running report:" << std::endl;
-		std::cerr << "  what():  " << ex.what() << std::endl;
-		std::cerr << "  where(): " << ex.where() << std::endl;
-		std::cerr << "  trace(): " << ex.trace() << std::endl;
-		ret = EXIT_FAILURE;
-	} catch (const std::exception &ex) {
-		std::cerr << "Received exception while running report:" << std::endl;
-		std::cerr << "  what(): " << ex.what() << std::endl;
-		ret = EXIT_FAILURE;
+	if (transfer || merge || opts.warmCacheRequested()) {
+		// An imported or merged cache may be completed and exported again
+		ret = EXIT_SUCCESS;
+		if (!opts.importCacheFile().empty()) {
+			ret = transferCache(cache, opts.importCacheFile(), true);
+		}
+		if (ret == EXIT_SUCCESS && merge) {
+			ret = mergeCache(cache, opts);
+		}
+		if (ret == EXIT_SUCCESS && opts.warmCacheRequested()) {
+			ret = warmCache(cache, opts);
+		}
+		if (ret == EXIT_SUCCESS && !opts.exportCacheFile().empty()) {
+			ret = transferCache(cache, opts.exportCacheFile(), false);
+		}
+	} else {
+		try {
+			Report r(opts.report(), (cache ? cache : backend));
+			ret = r.run();
+		} catch (const PepperException &ex) {
+			std::cerr << "Received exception while running report:" << std::endl;
+			std::cerr << "  what():  " << ex.what() << std::endl;
+			std::cerr << "  where(): " << ex.where() << std::endl;
+			std::cerr << "  trace(): " << ex.trace() << std::endl;
+			ret = EXIT_FAILURE;
+		} catch (const std::exception &ex) {
+			std::cerr << "Received exception while running report:" << std::endl;
+			std::cerr << "  what(): " << ex.what() << std::endl;
+			ret = EXIT_FAILURE;
+		}
 	}
 
+	std::string uuid = (cache ? cache->uuid() : std::string());
 	delete cache; // This will also flush the cache
+
+	// Keep the cache directory within the configured size
+	if (!uuid.empty() && opts.cacheSize() > 0) {
+		try {
+			CacheBudget budget(opts.cacheDir(), opts.cacheSize());
+			budget.update(uuid);
+		} catch (const std::exception &ex) {
+			std::cerr << "Error limiting cache size: " << ex.what() << std::endl;
+		}
+	}
+
 	delete backend;
 	return ret;
 }
@@ -72,6 +72,70 @@ std::string Options::cacheDir() const
 	return value("cache_dir");
 }
 
+// Returns the memory budget for decoded revisions in bytes
+size_t Options::cacheMemory() const
+{
+	size_t mb;
+	if (!str::stoi(value("cache_memory", "64"), &mb)) {
+		throw PEX(str::printf("Invalid cache memory budget: %s", value("cache_memory").c_str()));
+	}
+	return mb * 1024 * 1024;
+}
+
+// Returns the disk usage limit for the cache directory in bytes
+uint64_t Options::cacheSize() const
+{
+	size_t mb;
+	if (!str::stoi(value("cache_size", "0"), &mb)) {
+		throw PEX(str::printf("Invalid cache size: %s", value("cache_size").c_str()));
+	}
+	return (uint64_t)mb * 1024 * 1024;
+}
+
+bool Options::memoizeReports() const
+{
+	return (value("memoize") == "true");
+}
+
+bool Options::cacheDaemonRequested() const
+{
+	return (value("cache_daemon") == "true");
+}
+
+bool Options::warmCacheRequested() const
+{
+	return (value("warm_cache") == "true");
+}
+
+// Returns the branches whose revisions should be cached, if any
+std::vector<std::string> Options::warmCacheBranches() const
+{
+	return m_branches;
+}
+
+bool Options::mergeCacheRequested() const
+{
+	return (value("merge_cache") == "true");
+}
+
+// Returns the cache directories that should be merged, if any
+std::vector<std::string> Options::mergeCacheDirs() const
+{
+	return m_mergeDirs;
+}
+
+// Returns the file the cache should be exported to, if any
+std::string Options::exportCacheFile() const
+{
+	return value("export_cache");
+}
+
+// Returns the file the cache should be imported from, if any
+std::string Options::importCacheFile() const
+{
+	return value("import_cache");
+}
+
 std::string Options::forcedBackend() const
 {
 	return value("backend");
@@ -156,6 +220,14 @@ void Options::printHelp(std::ostream &out)
 	print("-q, --quiet", "Set verbosity to minimum", out);
 	print("-bARG, --backend=ARG", "Force usage of backend named ARG", out);
 	print("--no-cache", "Disable revision cache usage", out);
+	print("--cache-memory=ARG", "Keep up to ARG MiB of decoded revisions in memory (default: 64, 0 disables)", out);
+	print("--cache-size=ARG", "Limit the cache directory to ARG MiB by removing least recently used repositories (default: 0, unlimited)", out);
+	print("--memoize", "Replay the output of a previous run if the report and repository are unchanged", out);
+	print("--cache-daemon", "Serve the revision cache to other pepper processes", out);
+	print("--warm-cache", "Fill the cache with all revisions of the branches given after the repository (default: main branch) instead of running a report", out);
+	print("--merge-cache", "Merge the caches of the repository in the directories given after the repository into the cache instead of running a report", out);
+	print("--export-cache=ARG", "Write the cache of the repository to the archive ARG (- for standard output) instead of running a report", out);
+	print("--import-cache=ARG", "Merge the archive ARG (- for standard input) into the cache of the repository instead of running a report", out);
 	out << std::endl;
 	print("--list-reports", "List report scrtips in search paths", out);
 	print("--list-backends", "List available backends", out);
@@ -167,6 +239,8 @@ void Options::reset()
 {
 	m_options.clear();
 	m_reportOptions.clear();
+	m_branches.clear();
+	m_mergeDirs.clear();
 
 	m_options["repository"] = sys::fs::cwd();
 	m_options["cache"] = "true";
@@ -196,9 +270,23 @@ void Options::parse(const std::vector<std::string> &args)
 		{"--help", "help", "true"},
 		{"--version", "version", "true"},
 		{"--no-cache", "cache", "false"},
+		{"--memoize", "memoize", "true"},
+		{"--cache-daemon", "cache_daemon", "true"},
+		{"--warm-cache", "warm_cache", "true"},
+		{"--merge-cache", "merge_cache", "true"},
 		{"--list-backends", "list_backends", "true"},
 		{"--list-reports", "list_reports", "true"}
 	};
+	// Main options with values whose keys differ from their names
+	struct valueopt_t {
+		const char *name, *key;
+	} static valueopts[] = {
+		{"b", "backend"},
+		{"cache-memory", "cache_memory"},
+		{"cache-size", "cache_size"},
+		{"export-cache", "export_cache"},
+		{"import-cache", "import_cache"}
+	};
 
 	unsigned int i = 0;
 	std::string key, value;
@@ -226,11 +314,21 @@ void Options::parse(const std::vector<std::string> &args)
 			} else if (compat01 && args[i] == "--check-cache") {
 				Logger::warn() << "NOTE: The --check-cache option is deprecated, plase use the cache_check report" << endl;
 
+			} else if ((args[i] == "--export-cache" || args[i] == "--import-cache") && i+1 < args.size()) {
+				// The archive may be given as a separate argument
+				m_options[args[i] == "--export-cache" ? "export_cache" : "import_cache"] = args[i+1];
+				++i;
 			} else if (parseOpt(args[i], &key, &value)) {
-				if (key == "b") {
-					key = "backend";
+				for (unsigned int j = 0; j < sizeof(valueopts) / sizeof(valueopt_t); j++) {
+					if (key == valueopts[j].name) {
+						key = valueopts[j].key;
+						break;
+					}
 				}
 				m_options[key] = value;
+			} else if (warmCacheRequested() || mergeCacheRequested() || !exportCacheFile().empty() || !importCacheFile().empty()) {
+				// No report, the repository follows
+				break;
 			} else {
 				m_options["report"] = args[i];
 				++i;
@@ -268,17 +366,36 @@ void Options::parse(const std::vector<std::string> &args)
 		} catch (...) {
 			m_options["repository"] = args[i];
 		}
+		++i;
 	}
 
-	// Parse additional options
+	// Parse additional options. When warming up the cache, the remaining
+	// arguments are branch names, and when merging caches they are
+	// cache directories.
 	while (i < args.size()) {
+		bool ok = false;
 		for (unsigned int j = 0; j < sizeof(mainopts) / sizeof(option_t); j++) {
 			if (args[i] == mainopts[j].flag) {
 				m_options[mainopts[j].key] = mainopts[j].value;
+				ok = true;
+			}
+		}
+		if (!ok && warmCacheRequested()) {
+			m_branches.push_back(args[i]);
+		} else if (!ok && mergeCacheRequested()) {
+			try {
+				m_mergeDirs.push_back(sys::fs::makeAbsolute(args[i]));
+			} catch (...) {
+				m_mergeDirs.push_back(args[i]);
 			}
 		}
 		++i;
 	}
+
+	// The remaining arguments can't be both branch names and cache directories
+	if (warmCacheRequested() && mergeCacheRequested()) {
+		throw PEX("--merge-cache can't be combined with --warm-cache");
+	}
 }
 
 // Parses a single option
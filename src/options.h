@@ -37,6 +37,16 @@ class Options
 
 		bool useCache() const;
 		std::string cacheDir() const;
+		size_t cacheMemory() const;
+		uint64_t cacheSize() const;
+		bool memoizeReports() const;
+		bool cacheDaemonRequested() const;
+		bool warmCacheRequested() const;
+		std::vector<std::string> warmCacheBranches() const;
+		bool mergeCacheRequested() const;
+		std::vector<std::string> mergeCacheDirs() const;
+		std::string exportCacheFile() const;
+		std::string importCacheFile() const;
 
 		std::string forcedBackend() const;
 		std::string repository() const;
@@ -57,6 +67,8 @@ class Options
 	PEPPER_PVARS:
 		std::map<std::string, std::string> m_options;
 		std::map<std::string, std::string> m_reportOptions;
+		std::vector<std::string> m_branches;
+		std::vector<std::string> m_mergeDirs;
 };
 
 
@@ -36,6 +36,12 @@ static inline int64_t convepoch(int64_t t)
 	return t - 946684800;
 }
 
+// Checks whether the given Gnuplot terminal displays plots on screen
+static inline bool interactive(const std::string &terminal)
+{
+	return (terminal == "x11" || terminal == "wxt" || terminal == "qt" || terminal == "aqua" || terminal == "windows");
+}
+
 // Gnuplot arguments (-persist only works with the X11 or wxt terminal)
 static const char *gp_args[] = {NULL};
 static const char *gp_args_persist[] = {"-persist", NULL};
@@ -82,6 +88,12 @@ Plot::Plot(lua_State *L)
 		m_args = gp_args_persist;
 	}
 
+	// Interactive plots can't be replayed. Plots that are written to a file
+	// later on are treated the same, as the terminal may be used before.
+	if (interactive(m_standardTerminal)) {
+		Report::current()->setReplayable(false);
+	}
+
 	try {
 		g = new Gnuplot(m_args, Report::current()->out());
 	} catch (const PepperException &ex) {
@@ -141,8 +153,13 @@ int Plot::set_output(lua_State *L)
 
 	if (!file.empty()) {
 		gcmd(str::printf("set output \"%s\"", file.c_str()));
+		Report::current()->addOutputFile(file);
 	} else {
 		gcmd(str::printf("set output"));
+		if (interactive(terminal)) {
+			// Interactive plots can't be replayed
+			Report::current()->setReplayable(false);
+		}
 	}
 	gcmd(str::printf("set terminal %s size %d,%d", terminal.c_str(), width, height));
 	return 0;
@@ -24,6 +24,7 @@
 #include "luahelpers.h"
 #include "luamodules.h"
 #include "options.h"
+#include "reportmemo.h"
 #include "repository.h"
 #include "revision.h"
 #include "revisioniterator.h"
@@ -120,6 +121,51 @@ std::string findScript(const std::string &script)
 	return script;
 }
 
+// Wrapper for os.time() and os.date(). Reports that use the current time,
+// i.e. omit the time argument, can't be replayed.
+int clockWrapper(lua_State *L)
+{
+	int arg = (int)lua_tointeger(L, lua_upvalueindex(2));
+	if (lua_isnoneornil(L, arg) && Report::current()) {
+		Report::current()->setReplayable(false);
+	}
+
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_insert(L, 1);
+	lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+	return lua_gettop(L);
+}
+
+// Wrapper for the Lua module searcher that registers the module files used
+// by the current report
+int moduleSearcher(lua_State *L)
+{
+	std::string name = luaL_checkstring(L, 1);
+	Report *report = Report::current();
+	if (report) {
+		std::replace(name.begin(), name.end(), '.', '/');
+		lua_getglobal(L, "package");
+		lua_getfield(L, -1, "path");
+		std::vector<std::string> templates = str::split(LuaHelpers::pops(L), ";");
+		lua_pop(L, 1);
+		for (size_t i = 0; i < templates.size(); i++) {
+			std::string path = templates[i];
+			for (size_t pos = path.find('?'); pos != std::string::npos; pos = path.find('?', pos + name.length())) {
+				path.replace(pos, 1, name);
+			}
+			if (!path.empty() && sys::fs::fileExists(path)) {
+				report->addDependency("module:" + path);
+				break;
+			}
+		}
+	}
+
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_insert(L, 1);
+	lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+	return lua_gettop(L);
+}
+
 // Sets up the lua context
 lua_State *setupLua()
 {
@@ -129,6 +175,24 @@ lua_State *setupLua()
 
 	lua_atpanic(L, atpanic);
 
+	// Track dependencies of the output for memoization
+	lua_getglobal(L, "os");
+	lua_getfield(L, -1, "time");
+	lua_pushinteger(L, 1);
+	lua_pushcclosure(L, clockWrapper, 2);
+	lua_setfield(L, -2, "time");
+	lua_getfield(L, -1, "date");
+	lua_pushinteger(L, 2);
+	lua_pushcclosure(L, clockWrapper, 2);
+	lua_setfield(L, -2, "date");
+	lua_pop(L, 1);
+	lua_getglobal(L, "package");
+	lua_getfield(L, -1, "loaders");
+	lua_rawgeti(L, -1, 2);
+	lua_pushcclosure(L, moduleSearcher, 1);
+	lua_rawseti(L, -2, 2);
+	lua_pop(L, 2);
+
 	// Register extra modules functions
 	LuaModules::registerModules(L);
 
@@ -212,6 +276,38 @@ int printWrapper(lua_State *L)
 	return 0;
 }
 
+// Writes to two stream buffers at once
+class TeeBuffer : public std::streambuf
+{
+public:
+	TeeBuffer(std::streambuf *a, std::streambuf *b) : m_a(a), m_b(b) { }
+
+protected:
+	int overflow(int c)
+	{
+		if (c == EOF) {
+			return !EOF;
+		}
+		int ra = m_a->sputc(c), rb = m_b->sputc(c);
+		return (ra == EOF || rb == EOF ? EOF : c);
+	}
+
+	std::streamsize xsputn(const char *s, std::streamsize n)
+	{
+		std::streamsize na = m_a->sputn(s, n), nb = m_b->sputn(s, n);
+		return std::min(na, nb);
+	}
+
+	int sync()
+	{
+		int ra = m_a->pubsync(), rb = m_b->pubsync();
+		return (ra == 0 && rb == 0 ? 0 : -1);
+	}
+
+private:
+	std::streambuf *m_a, *m_b;
+};
+
 } // anonymous namespace
 
 
@@ -224,7 +320,8 @@ std::stack<Report *> Report::s_stack;
 
 // Constructor
 Report::Report(const std::string &script, Backend *backend)
-	: m_repo(NULL), m_script(script), m_out(&std::cout),  m_metaDataRead(false)
+	: m_repo(NULL), m_script(script), m_out(&std::cout), m_redirected(false), m_metaDataRead(false),
+	  m_replayable(true)
 {
 	if (backend) {
 		m_repo = new Repository(backend);
@@ -234,7 +331,8 @@ Report::Report(const std::string &script, Backend *backend)
 
 // Constructor
 Report::Report(const std::string &script, const std::map<std::string, std::string> &options, Backend *backend)
-	: m_repo(NULL), m_script(script), m_options(options), m_out(&std::cout), m_metaDataRead(false)
+	: m_repo(NULL), m_script(script), m_options(options), m_out(&std::cout), m_redirected(false),
+	  m_metaDataRead(false), m_replayable(true)
 {
 	if (backend) {
 		m_repo = new Repository(backend);
@@ -265,11 +363,71 @@ int Report::run(std::ostream &out, std::ostream &err)
 	PDEBUG << "Stack size is " << s_stack.size() << endl;
 
 	std::ostream *prevout = m_out;
+	bool prevredirected = m_redirected;
 	m_out = &out;
+	m_redirected = (&out != &std::cout);
 
 	// Ensure the backend is ready
 	m_repo->backend()->open();
 
+	// With memoization, the output of a previous run is replayed if neither
+	// the report nor the repository have changed. Otherwise, the output is
+	// recorded while running the report.
+	m_outputFiles.clear();
+	m_dependencies.clear();
+	m_replayable = true;
+	ReportMemo *memo = NULL;
+	bool replayed = false;
+	std::ostringstream recorded;
+	TeeBuffer tee(out.rdbuf(), recorded.rdbuf());
+	std::ostream teeout(&tee);
+	if (m_repo->backend()->options().memoizeReports()) {
+		try {
+			memo = new ReportMemo(path, m_options, m_repo->backend());
+			replayed = memo->replay(out, &m_outputFiles);
+			m_out = &teeout;
+		} catch (const std::exception &ex) {
+			PDEBUG << "Not using memoized output: " << ex.what() << endl;
+			delete memo;
+			memo = NULL;
+		}
+	}
+
+	int ret = EXIT_SUCCESS;
+	if (replayed) {
+		Logger::info() << "Report: Replayed output of previous run" << endl;
+	} else {
+		ret = execute(path, err);
+		if (memo && ret == EXIT_SUCCESS && m_replayable) {
+			try {
+				memo->store(recorded.str(), m_outputFiles, m_dependencies);
+			} catch (const std::exception &ex) {
+				Logger::warn() << "Warning: Unable to store report output: " << ex.what() << endl;
+			}
+		}
+	}
+	delete memo;
+
+	// Inform backend that the report is done
+	m_repo->backend()->close();
+
+	PTRACE << "Popping report context for " << path <<  endl;
+	s_stack.pop();
+	m_out = prevout;
+	m_redirected = prevredirected;
+
+	// Plots of nested reports are part of the parent's output
+	if (!s_stack.empty()) {
+		s_stack.top()->m_outputFiles.insert(m_outputFiles.begin(), m_outputFiles.end());
+		s_stack.top()->m_dependencies.insert(m_dependencies.begin(), m_dependencies.end());
+		s_stack.top()->m_replayable &= m_replayable;
+	}
+	return ret;
+}
+
+// Runs the report script
+int Report::execute(const std::string &path, std::ostream &err)
+{
 	lua_State *L = setupLua();
 
 	// Wrap print() function to use custom output stream
@@ -300,13 +458,6 @@ error:
 cleanup:
 	lua_gc(L, LUA_GCCOLLECT, 0);
 	lua_close(L);
-
-	// Inform backend that the report is done
-	m_repo->backend()->close();
-
-	PTRACE << "Popping report context for " << path <<  endl;
-	s_stack.pop();
-	m_out = prevout;
 	return ret;
 }
 
@@ -363,7 +514,35 @@ std::ostream &Report::out() const
 // Returns whether the standard output is redirected
 bool Report::outputRedirected() const
 {
-	return (m_out != &std::cout);
+	return m_redirected;
+}
+
+// Registers a file that has been written by the report
+void Report::addOutputFile(const std::string &path)
+{
+	m_outputFiles.insert(path);
+}
+
+// Registers a module or a part of the repository state that the report
+// output depends on, see ReportMemo::fingerprint()
+void Report::addDependency(const std::string &dependency)
+{
+	if (!m_repo || !m_repo->backend()->options().memoizeReports() || m_dependencies.find(dependency) != m_dependencies.end()) {
+		return;
+	}
+	try {
+		m_dependencies[dependency] = ReportMemo::fingerprint(dependency, m_repo->backend());
+	} catch (const std::exception &ex) {
+		PDEBUG << "Unable to determine fingerprint of " << dependency << ": " << ex.what() << endl;
+		m_replayable = false;
+	}
+}
+
+// Sets whether the report output can be replayed, i.e. whether it doesn't
+// include interactive plots
+void Report::setReplayable(bool replayable)
+{
+	m_replayable = replayable;
 }
 
 // Lists all report scripts and their descriptions
@@ -552,7 +731,7 @@ Lunar<Report>::RegType Report::methods[] = {
 };
 
 Report::Report(lua_State *L)
-	: m_repo(NULL), m_out(&std::cout), m_metaDataRead(false)
+	: m_repo(NULL), m_out(&std::cout), m_redirected(false), m_metaDataRead(false), m_replayable(true)
 {
 	if (lua_gettop(L) != 1 && lua_gettop(L) != 2) {
 		LuaHelpers::pushError(L, "Invalid number of arguments (1 or 2 expected)");
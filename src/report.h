@@ -17,6 +17,7 @@
 
 #include <iostream>
 #include <map>
+#include <set>
 #include <stack>
 #include <string>
 
@@ -56,6 +57,9 @@ class Report
 		bool valid();
 		std::ostream &out() const;
 		bool outputRedirected() const;
+		void addOutputFile(const std::string &path);
+		void addDependency(const std::string &dependency);
+		void setReplayable(bool replayable);
 
 		static Report *current();
 		Repository *repository() const;
@@ -65,6 +69,7 @@ class Report
 		static void printReportListing(std::ostream &out = std::cout);
 
 	private:
+		int execute(const std::string &path, std::ostream &err);
 		void readMetaData();
 
 	private:
@@ -72,8 +77,12 @@ class Report
 		std::string m_script;
 		std::map<std::string, std::string> m_options;
 		std::ostream *m_out;
+		bool m_redirected;
 		MetaData m_metaData;
 		bool m_metaDataRead;
+		std::set<std::string> m_outputFiles; // Written by plots
+		std::map<std::string, std::string> m_dependencies; // For memoization
+		bool m_replayable;
 
 		static std::stack<Report *> s_stack;
 
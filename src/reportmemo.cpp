@@ -0,0 +1,210 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: reportmemo.cpp
+ * Stored report output for unchanged repositories
+ *
+ * A report run is identified by the script path and the report options,
+ * which determine the memo file. The file contains a fingerprint of the
+ * script contents, the options, the repository UUID, the head of the
+ * selected branch and the tags, along with the output and all plot files
+ * that have been written. Additional dependencies are recorded while the
+ * report is running, i.e. the contents of required modules and the heads
+ * of other branches that have been used. If the fingerprint and all
+ * dependencies match, the output can be replayed instead of running the
+ * report again. Otherwise, the file will be replaced by the next run.
+ */
+
+
+#include "main.h"
+
+#include <unistd.h>
+
+#include "abstractcache.h"
+#include "bstream.h"
+#include "checksum.h"
+#include "logger.h"
+#include "strlib.h"
+#include "tag.h"
+
+#include "syslib/fs.h"
+
+#include "reportmemo.h"
+
+// Memo file format version
+#define MEMO_VERSION 2
+
+
+// Constructor. Throws if the fingerprint can't be determined.
+ReportMemo::ReportMemo(const std::string &script, const std::map<std::string, std::string> &options, Backend *backend)
+	: m_backend(backend)
+{
+	std::string slot = script;
+	for (std::map<std::string, std::string>::const_iterator it = options.begin(); it != options.end(); ++it) {
+		slot += '\0' + it->first + '=' + it->second;
+	}
+
+	// Reports usually operate on a single branch
+	std::string branch;
+	if (options.find("branch") != options.end()) {
+		branch = options.find("branch")->second;
+	} else if (options.find("b") != options.end()) {
+		branch = options.find("b")->second;
+	} else {
+		branch = backend->mainBranch();
+	}
+
+	std::string contents;
+	sys::fs::MappedFile file(script);
+	contents.assign(file.data(), file.size());
+
+	m_key = str::printf("pepper %s\n", PACKAGE_VERSION);
+	m_key += str::printf("uuid %s\nbranch %s\nhead %s\n", backend->uuid().c_str(), branch.c_str(), backend->head(branch).c_str());
+	std::vector<Tag> tags = backend->tags();
+	for (size_t i = 0; i < tags.size(); i++) {
+		m_key += str::printf("tag %s %s\n", tags[i].name().c_str(), tags[i].id().c_str());
+	}
+	m_key += slot + '\0' + contents;
+
+	std::string dir = AbstractCache::cacheFile(backend, "reports");
+	if (!sys::fs::dirExists(dir)) {
+		sys::fs::mkpath(dir);
+	}
+	m_path = dir + "/" + str::printf("%08x", checksum::crc32c(slot.data(), slot.length()));
+}
+
+// Writes the stored output if the fingerprint matches, and restores the
+// plot files. Returns false if the report has to be run.
+bool ReportMemo::replay(std::ostream &out, std::set<std::string> *files)
+{
+	if (!sys::fs::fileExists(m_path) || sys::fs::filesize(m_path) <= 4) {
+		return false;
+	}
+
+	sys::fs::MappedFile file(m_path);
+	size_t size = file.size() - 4;
+	uint32_t crc;
+	VIStream tin(file.data() + size, 4);
+	tin >> crc;
+	if (crc != checksum::crc32c(file.data(), size)) {
+		PDEBUG << "Memo file " << m_path << " is corrupted" << endl;
+		return false;
+	}
+
+	VIStream in(file.data(), size);
+	uint32_t version, nfiles;
+	std::vector<char> key, output;
+	in >> version;
+	if (version != MEMO_VERSION) {
+		return false;
+	}
+	in >> key;
+	if (std::string(key.begin(), key.end()) != m_key) {
+		PDEBUG << "Memo file " << m_path << " is outdated" << endl;
+		return false;
+	}
+
+	uint32_t ndeps;
+	in >> ndeps;
+	for (uint32_t i = 0; i < ndeps && in.ok(); i++) {
+		std::string dependency, value;
+		in >> dependency >> value;
+		if (in.ok() && fingerprint(dependency, m_backend) != value) {
+			PDEBUG << "Memo file " << m_path << " is outdated (" << dependency << ")" << endl;
+			return false;
+		}
+	}
+
+	in >> output >> nfiles;
+	std::vector<std::pair<std::string, std::vector<char> > > contents(nfiles);
+	for (uint32_t i = 0; i < nfiles; i++) {
+		in >> contents[i].first >> contents[i].second;
+	}
+	if (!in.ok()) {
+		return false;
+	}
+
+	for (uint32_t i = 0; i < nfiles; i++) {
+		const std::vector<char> &data = contents[i].second;
+		BOStream fout(contents[i].first);
+		if (!fout.ok() || (!data.empty() && fout.write(&data[0], data.size()) != (ssize_t)data.size())) {
+			throw PEX(str::printf("Unable to write %s", contents[i].first.c_str()));
+		}
+		files->insert(contents[i].first);
+	}
+	if (!output.empty()) {
+		out.write(&output[0], output.size());
+	}
+	out.flush();
+	PDEBUG << "Replayed output from " << m_path << endl;
+	return true;
+}
+
+// Stores the output of the report and the contents of the given plot files,
+// along with the fingerprints of the dependencies recorded while running it
+void ReportMemo::store(const std::string &output, const std::set<std::string> &files, const std::map<std::string, std::string> &dependencies)
+{
+	MOStream out;
+	out << (uint32_t)MEMO_VERSION;
+	out << std::vector<char>(m_key.begin(), m_key.end());
+	out << (uint32_t)dependencies.size();
+	for (std::map<std::string, std::string>::const_iterator it = dependencies.begin(); it != dependencies.end(); ++it) {
+		out << it->first << it->second;
+	}
+	out << std::vector<char>(output.begin(), output.end());
+	out << (uint32_t)files.size();
+	for (std::set<std::string>::const_iterator it = files.begin(); it != files.end(); ++it) {
+		std::vector<char> data;
+		if (sys::fs::filesize(*it) > 0) {
+			sys::fs::MappedFile file(*it);
+			data.assign(file.data(), file.data() + file.size());
+		}
+		out << *it << data;
+	}
+
+	std::vector<char> data(out.data());
+	MOStream tout;
+	tout << checksum::crc32c(data);
+	std::vector<char> trailer(tout.data());
+	data.insert(data.end(), trailer.begin(), trailer.end());
+
+	// Replace the memo file atomically
+	std::string tmp = str::printf("%s.%d", m_path.c_str(), (int)getpid());
+	{
+		BOStream fout(tmp);
+		if (!fout.ok() || fout.write(&data[0], data.size()) != (ssize_t)data.size() || !fout.flush()) {
+			sys::fs::unlink(tmp);
+			throw PEX(str::printf("Unable to write %s", tmp.c_str()));
+		}
+	}
+	sys::fs::rename(tmp, m_path);
+	PDEBUG << "Stored output in " << m_path << endl;
+}
+
+// Returns the current state of the given dependency of a report. These are
+// "module:<path>" for Lua modules, "head:<branch>" for branch heads and
+// "branches" for the list of branches.
+std::string ReportMemo::fingerprint(const std::string &dependency, Backend *backend)
+{
+	if (str::startsWith(dependency, "module:")) {
+		std::string path = dependency.substr(7);
+		if (!sys::fs::fileExists(path)) {
+			return std::string();
+		}
+		if (sys::fs::filesize(path) == 0) {
+			return "0";
+		}
+		sys::fs::MappedFile file(path);
+		return str::printf("%08x %lu", checksum::crc32c(file.data(), file.size()), (unsigned long)file.size());
+	} else if (str::startsWith(dependency, "head:")) {
+		return backend->head(dependency.substr(5));
+	} else if (dependency == "branches") {
+		return str::join(backend->branches(), "\n");
+	}
+	throw PEX(str::printf("Unknown report dependency %s", dependency.c_str()));
+}
@@ -0,0 +1,45 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: reportmemo.h
+ * Stored report output for unchanged repositories (interface)
+ */
+
+
+#ifndef REPORTMEMO_H_
+#define REPORTMEMO_H_
+
+
+#include <iostream>
+#include <map>
+#include <set>
+#include <string>
+
+#include "main.h"
+
+class Backend;
+
+
+class ReportMemo
+{
+	public:
+		ReportMemo(const std::string &script, const std::map<std::string, std::string> &options, Backend *backend);
+
+		bool replay(std::ostream &out, std::set<std::string> *files);
+		void store(const std::string &output, const std::set<std::string> &files, const std::map<std::string, std::string> &dependencies);
+
+		static std::string fingerprint(const std::string &dependency, Backend *backend);
+
+	private:
+		Backend *m_backend;
+		std::string m_path;
+		std::string m_key;
+};
+
+
+#endif // REPORTMEMO_H_
@@ -17,6 +17,7 @@
 #include "logger.h"
 #include "luahelpers.h"
 #include "options.h"
+#include "report.h"
 #include "revision.h"
 #include "revisioniterator.h"
 #include "tag.h"
@@ -89,6 +90,9 @@ int Repository::head(lua_State *L)
 	std::string h;
 	try {
 		h = m_backend->head(branch);
+		if (Report::current()) {
+			Report::current()->addDependency("head:" + branch);
+		}
 	} catch (const PepperException &ex) {
 		return LuaHelpers::pushError(L, ex.what(), ex.where());
 	} catch (const std::exception &ex) {
@@ -109,6 +113,9 @@ int Repository::branches(lua_State *L)
 	std::vector<std::string> b;
 	try {
 		b = m_backend->branches();
+		if (Report::current()) {
+			Report::current()->addDependency("branches");
+		}
 	} catch (const PepperException &ex) {
 		return LuaHelpers::pushError(L, ex.what(), ex.where());
 	} catch (const std::exception &ex) {
@@ -165,7 +172,7 @@ int Repository::revision(lua_State *L)
 	Revision *rev = NULL;
 	try {
 		rev = m_backend->revision(id);
-		m_backend->filterDiffstat(rev->m_diffstat);
+		rev->filterDiffstat(m_backend);
 	} catch (const PepperException &ex) {
 		return LuaHelpers::pushError(L, ex.what(), ex.where());
 	} catch (const std::exception &ex) {
@@ -199,6 +206,9 @@ int Repository::iterator(lua_State *L)
 	RevisionIterator *it = NULL;
 	try {
 		it = new RevisionIterator(m_backend, branch, start, end, flags);
+		if (Report::current()) {
+			Report::current()->addDependency("head:" + branch);
+		}
 	} catch (const PepperException &ex) {
 		return LuaHelpers::pushError(L, ex.what(), ex.where());
 	} catch (const std::exception &ex) {
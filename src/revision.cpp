@@ -13,7 +13,9 @@
 
 #include "main.h"
 
+#include "backend.h"
 #include "bstream.h"
+#include "dictionary.h"
 #include "logger.h"
 #include "luahelpers.h"
 #include "strlib.h"
@@ -23,14 +25,25 @@
 
 // Constructor
 Revision::Revision(const std::string &id)
-	: m_id(id), m_date(0), m_diffstat(std::make_shared<Diffstat>())
+	: m_id(id), m_date(0), m_diffstat(std::make_shared<Diffstat>()), m_loader(NULL),
+	  m_messageLoaded(true), m_filter(NULL)
 {
 
 }
 
 // Constructor
 Revision::Revision(const std::string &id, int64_t date, const std::string &author, const std::string &message, DiffstatPtr diffstat)
-	: m_id(id), m_date(date), m_author(author), m_message(message), m_diffstat(diffstat)
+	: m_id(id), m_date(date), m_author(author), m_message(message), m_diffstat(diffstat),
+	  m_loader(NULL), m_messageLoaded(true), m_filter(NULL)
+{
+
+}
+
+// Constructor for revisions whose message and diffstat will be loaded on
+// demand. The revision takes ownership of the loader.
+Revision::Revision(const std::string &id, int64_t date, const std::string &author, Loader *loader)
+	: m_id(id), m_date(date), m_author(author), m_loader(loader), m_messageLoaded(false),
+	  m_filter(NULL)
 {
 
 }
@@ -38,7 +51,7 @@ Revision::Revision(const std::string &id, int64_t date, const std::string &autho
 // Destructor
 Revision::~Revision()
 {
-
+	delete m_loader;
 }
 
 // Returns the revision ID (e.g., the revision number)
@@ -47,23 +60,89 @@ std::string Revision::id() const
 	return m_id;
 }
 
-// Returns the diffstat object
+// Returns the revision date
+int64_t Revision::date() const
+{
+	return m_date;
+}
+
+// Returns the revision author
+std::string Revision::author() const
+{
+	return m_author;
+}
+
+// Returns the commit message, loading it if necessary
+std::string Revision::message() const
+{
+	if (!m_messageLoaded) {
+		loadMessage();
+	}
+	return m_message;
+}
+
+// Returns the diffstat object, loading it if necessary
 DiffstatPtr Revision::diffstat() const
 {
+	if (!m_diffstat) {
+		loadDiffstat();
+	}
 	return m_diffstat;
 }
 
-// Writes the revision to a binary stream (not writing the ID)
-void Revision::write(BOStream &out) const
+// Returns the approximate number of bytes used by the revision, including
+// the message and diffstat if they have been loaded
+size_t Revision::memoryUsage() const
+{
+	size_t n = sizeof(Revision) + m_id.capacity() + m_author.capacity() + m_message.capacity();
+	if (m_diffstat) {
+		n += m_diffstat->memoryUsage();
+	}
+	return n;
+}
+
+// Lets the given backend filter the diffstat. If the diffstat hasn't been
+// loaded yet, filtering will be deferred until it is.
+void Revision::filterDiffstat(Backend *backend)
 {
-	out << 'R' << char(1); // Head and version
-	out << m_date << m_author << m_message;
-	m_diffstat->write(out);
+	if (m_diffstat) {
+		backend->filterDiffstat(m_diffstat);
+	} else {
+		m_filter = backend;
+	}
+}
+
+// Returns the strings that will be stored in a dictionary when writing the
+// revision, i.e. the author and all paths
+std::vector<std::string> Revision::strings() const
+{
+	std::vector<std::string> strings(1, m_author);
+	std::map<std::string, Diffstat::Stat> stats = diffstat()->stats();
+	for (std::map<std::string, Diffstat::Stat>::const_iterator it = stats.begin(); it != stats.end(); ++it) {
+		strings.push_back(it->first);
+	}
+	return strings;
+}
+
+// Writes the revision to a binary stream (not writing the ID). The author and
+// all paths must be part of the given dictionary.
+void Revision::write(BOStream &out, const Dictionary &dict) const
+{
+	out << 'R' << char(3); // Head and version
+	uint32_t author = dict.find(m_author);
+	if (author == Dictionary::None) {
+		throw PEX(str::printf("Author %s is missing from dictionary", m_author.c_str()));
+	}
+	out.writeVarint(BStream::zigzag(m_date)).writeVarint(author);
+	out << message();
+	diffstat()->write(out, dict, Diffstat::Compact);
 	out << 'V'; // Tail
 }
 
-// Loads the revision from a binary stream (not changing the ID)
-bool Revision::load(BIStream &in)
+// Loads the revision from a binary stream (not changing the ID). Revisions
+// written by version 1 don't use the dictionary, and version 3 uses
+// variable-length integers.
+bool Revision::load(BIStream &in, const Dictionary &dict)
 {
 	char c, v;
 	in >> c;
@@ -71,16 +150,33 @@ bool Revision::load(BIStream &in)
 		return false;
 	}
 	in >> v;
-	if (v != 1) {
+	if (v == 1) {
+		in >> m_date >> m_author >> m_message;
+		if (!m_diffstat->load(in)) {
+			return false;
+		}
+	} else if (v == 2 || v == 3) {
+		uint32_t author;
+		if (v == 2) {
+			in >> m_date >> author;
+		} else {
+			uint64_t date;
+			in.readVarint(date).readVarint(author);
+			m_date = BStream::unzigzag(date);
+		}
+		in >> m_message;
+		if (author >= dict.size()) {
+			return false;
+		}
+		m_author = dict.at(author);
+		if (!m_diffstat->load(in, dict, v == 2 ? Diffstat::Fixed : Diffstat::Compact)) {
+			return false;
+		}
+	} else {
 		PDEBUG << "Unknown version number " << int(v) << ", aborting" << endl;
 		return false;
 	}
 
-	in >> m_date >> m_author >> m_message;
-	if (!m_diffstat->load(in)) {
-		return false;
-	}
-
 	in >> c;
 	if (c != 'V') { // Tail
 		return false;
@@ -91,8 +187,8 @@ bool Revision::load(BIStream &in)
 // Writes the revision to a binary stream (not writing the ID)
 void Revision::write03(BOStream &out) const
 {
-	out << m_date << m_author << m_message;
-	m_diffstat->write(out);
+	out << m_date << m_author << message();
+	diffstat()->write(out);
 }
 
 // Loads the revision from a binary stream (not changing the ID)
@@ -105,6 +201,30 @@ bool Revision::load03(BIStream &in)
 	return in.ok();
 }
 
+// Loads the commit message using the loader
+void Revision::loadMessage() const
+{
+	m_message = m_loader->message();
+	m_messageLoaded = true;
+	if (m_diffstat) {
+		delete m_loader;
+		m_loader = NULL;
+	}
+}
+
+// Loads the diffstat using the loader
+void Revision::loadDiffstat() const
+{
+	m_diffstat = m_loader->diffstat();
+	if (m_filter) {
+		m_filter->filterDiffstat(m_diffstat);
+	}
+	if (m_messageLoaded) {
+		delete m_loader;
+		m_loader = NULL;
+	}
+}
+
 /*
  * Lua binding
  */
@@ -120,7 +240,8 @@ Lunar<Revision>::RegType Revision::methods[] = {
 	{0,0}
 };
 
-Revision::Revision(lua_State *) {
+Revision::Revision(lua_State *)
+	: m_date(0), m_loader(NULL), m_messageLoaded(true), m_filter(NULL) {
 }
 
 int Revision::id(lua_State *L) {
@@ -144,9 +265,17 @@ int Revision::author(lua_State *L) {
 }
 
 int Revision::message(lua_State *L) {
-	return LuaHelpers::push(L, m_message);
+	try {
+		return LuaHelpers::push(L, message());
+	} catch (const PepperException &ex) {
+		return LuaHelpers::pushError(L, ex.what(), ex.where());
+	}
 }
 
 int Revision::diffstat(lua_State *L) {
-	return LuaHelpers::push(L, m_diffstat);
+	try {
+		return LuaHelpers::push(L, diffstat());
+	} catch (const PepperException &ex) {
+		return LuaHelpers::pushError(L, ex.what(), ex.where());
+	}
 }
@@ -16,6 +16,7 @@
 
 
 #include <string>
+#include <vector>
 
 #include "main.h"
 
@@ -23,34 +24,63 @@
 
 #include "lunar/lunar.h"
 
+class Backend;
 class BIStream;
 class BOStream;
+class Dictionary;
 
 
 class Revision
 {
-	friend class Repository;
-	friend class RevisionIterator;
+	public:
+		// Deferred loading of the message and diffstat, e.g. from a cache
+		class Loader
+		{
+			public:
+				virtual ~Loader() { }
+
+				virtual std::string message() = 0;
+				virtual DiffstatPtr diffstat() = 0;
+		};
 
 	public:
 		Revision(const std::string &id);
 		Revision(const std::string &id, int64_t date, const std::string &author, const std::string &message, DiffstatPtr diffstat);
+		Revision(const std::string &id, int64_t date, const std::string &author, Loader *loader);
 		~Revision();
 
 		std::string id() const;
+		int64_t date() const;
+		std::string author() const;
+		std::string message() const;
 		DiffstatPtr diffstat() const;
+		void filterDiffstat(Backend *backend);
+		size_t memoryUsage() const;
 
-		void write(BOStream &out) const;
-		bool load(BIStream &in);
+		std::vector<std::string> strings() const;
+		void write(BOStream &out, const Dictionary &dict) const;
+		bool load(BIStream &in, const Dictionary &dict);
 		void write03(BOStream &out) const;  // for pepper <= 0.3
 		bool load03(BIStream &in);          // for pepper <= 0.3
 
+	private:
+		void loadMessage() const;
+		void loadDiffstat() const;
+
 	PEPPER_PVARS:
 		std::string m_id;
 		int64_t m_date;
 		std::string m_author;
-		std::string m_message;
-		DiffstatPtr m_diffstat;
+		mutable std::string m_message;
+		mutable DiffstatPtr m_diffstat;
+		mutable Loader *m_loader;
+		mutable bool m_messageLoaded;
+		Backend *m_filter;
+
+	private:
+		// Not allowed
+		Revision(const Revision &);
+		Revision &operator=(const Revision &);
 
 	// Lua binding
 	public:
@@ -138,7 +138,7 @@ int RevisionIterator::next(lua_State *L)
 	Revision *revision = NULL;
 	try {
 		revision = m_backend->revision(next());
-		m_backend->filterDiffstat(revision->m_diffstat);
+		revision->filterDiffstat(m_backend);
 	} catch (const PepperException &ex) {
 		return LuaHelpers::pushError(L, ex.what(), ex.where());
 	}
@@ -183,7 +183,7 @@ int RevisionIterator::map(lua_State *L)
 		std::shared_ptr<Revision> revision;
 		try {
 			revision = std::move(std::shared_ptr<Revision>(m_backend->revision(next())));
-			m_backend->filterDiffstat(revision->m_diffstat);
+			revision->filterDiffstat(m_backend);
 		} catch (const PepperException &ex) {
 			return LuaHelpers::pushError(L, ex.what(), ex.where());
 		}
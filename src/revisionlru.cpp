@@ -0,0 +1,212 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: revisionlru.cpp
+ * Memory-bounded LRU of decoded revisions
+ *
+ * The LRU keeps a single instance of each revision. Callers receive
+ * lightweight copies that load the message and diffstat through that
+ * instance, so the data is decoded at most once and diffstats are shared
+ * among all copies. Memory usage is tracked as the data is loaded.
+ */
+
+
+#include "main.h"
+
+#include "revision.h"
+
+#include "revisionlru.h"
+
+
+// Loads the message and diffstat through the revision stored in the LRU
+class SharedLoader : public Revision::Loader
+{
+public:
+	SharedLoader(const std::shared_ptr<Revision> &rev, const std::weak_ptr<RevisionLru> &lru)
+		: m_rev(rev), m_lru(lru)
+	{
+	}
+
+	std::string message()
+	{
+		std::string message = m_rev->message();
+		update();
+		return message;
+	}
+
+	// Diffstat filters only remove files from the stat, so applying them to
+	// the shared instance is harmless
+	DiffstatPtr diffstat()
+	{
+		DiffstatPtr stat = m_rev->diffstat();
+		update();
+		return stat;
+	}
+
+private:
+	void update()
+	{
+		std::shared_ptr<RevisionLru> lru = m_lru.lock();
+		if (lru) {
+			lru->update(m_rev->id(), m_rev.get());
+		}
+	}
+
+	std::shared_ptr<Revision> m_rev;
+	std::weak_ptr<RevisionLru> m_lru;
+};
+
+
+// Constructor
+RevisionLru::RevisionLru(size_t budget)
+	: m_budget(budget), m_size(0), m_hits(0), m_misses(0)
+{
+
+}
+
+// Destructor
+RevisionLru::~RevisionLru()
+{
+
+}
+
+// Returns the maximum number of bytes used by the cached revisions
+size_t RevisionLru::budget() const
+{
+	return m_budget;
+}
+
+// Returns the approximate number of bytes used by the cached revisions
+size_t RevisionLru::size() const
+{
+	return m_size;
+}
+
+// Returns the number of cached revisions
+size_t RevisionLru::count() const
+{
+	return m_entries.size();
+}
+
+// Returns the number of successful lookups
+uint64_t RevisionLru::hits() const
+{
+	return m_hits;
+}
+
+// Returns the number of failed lookups
+uint64_t RevisionLru::misses() const
+{
+	return m_misses;
+}
+
+// Checks whether the given revision is cached, without affecting the
+// eviction order or the counters
+bool RevisionLru::contains(const std::string &id) const
+{
+	return (m_entries.find(id) != m_entries.end());
+}
+
+// Returns a copy of the given revision, or NULL if it isn't cached
+Revision *RevisionLru::get(const std::string &id)
+{
+	std::map<std::string, Entry>::iterator it = m_entries.find(id);
+	if (it == m_entries.end()) {
+		++m_misses;
+		return NULL;
+	}
+
+	++m_hits;
+	m_order.splice(m_order.begin(), m_order, it->second.pos);
+	return copy(it->second.rev);
+}
+
+// Returns the diffstat of the given revision, or a NULL pointer if it isn't
+// cached
+DiffstatPtr RevisionLru::diffstat(const std::string &id)
+{
+	std::map<std::string, Entry>::iterator it = m_entries.find(id);
+	if (it == m_entries.end()) {
+		++m_misses;
+		return DiffstatPtr();
+	}
+
+	++m_hits;
+	m_order.splice(m_order.begin(), m_order, it->second.pos);
+	std::shared_ptr<Revision> rev = it->second.rev;
+	DiffstatPtr stat = rev->diffstat();
+	update(id, rev.get());
+	return stat;
+}
+
+// Adds a revision to the LRU, taking ownership of it. Returns a copy that
+// will be owned by the caller.
+Revision *RevisionLru::put(Revision *rev)
+{
+	if (m_budget == 0) {
+		return rev;
+	}
+
+	std::shared_ptr<Revision> shared(rev);
+	std::map<std::string, Entry>::iterator it = m_entries.find(rev->id());
+	if (it != m_entries.end()) {
+		m_size -= it->second.size;
+		m_order.erase(it->second.pos);
+		m_entries.erase(it);
+	}
+
+	Entry &entry = m_entries[rev->id()];
+	entry.rev = shared;
+	entry.size = rev->memoryUsage();
+	entry.pos = m_order.insert(m_order.begin(), rev->id());
+	m_size += entry.size;
+
+	Revision *r = copy(shared);
+	evict();
+	return r;
+}
+
+// Updates the memory usage of a revision after its data has been loaded
+void RevisionLru::update(const std::string &id, const Revision *rev)
+{
+	std::map<std::string, Entry>::iterator it = m_entries.find(id);
+	if (it == m_entries.end() || it->second.rev.get() != rev) {
+		// Already evicted
+		return;
+	}
+
+	size_t size = rev->memoryUsage();
+	m_size = m_size - it->second.size + size;
+	it->second.size = size;
+	evict();
+}
+
+// Removes all revisions
+void RevisionLru::clear()
+{
+	m_entries.clear();
+	m_order.clear();
+	m_size = 0;
+}
+
+// Returns a copy of the given revision that shares its data
+Revision *RevisionLru::copy(const std::shared_ptr<Revision> &rev)
+{
+	return new Revision(rev->id(), rev->date(), rev->author(), new SharedLoader(rev, shared_from_this()));
+}
+
+// Removes the least recently used revisions until the budget is met
+void RevisionLru::evict()
+{
+	while (m_size > m_budget && !m_order.empty()) {
+		std::map<std::string, Entry>::iterator it = m_entries.find(m_order.back());
+		m_size -= it->second.size;
+		m_entries.erase(it);
+		m_order.pop_back();
+	}
+}
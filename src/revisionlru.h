@@ -0,0 +1,74 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: revisionlru.h
+ * Memory-bounded LRU of decoded revisions (interface)
+ */
+
+
+#ifndef REVISIONLRU_H_
+#define REVISIONLRU_H_
+
+
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+
+#include "main.h"
+
+#include "diffstat.h"
+
+class Revision;
+
+
+class RevisionLru : public std::enable_shared_from_this<RevisionLru>
+{
+	public:
+		RevisionLru(size_t budget);
+		~RevisionLru();
+
+		size_t budget() const;
+		size_t size() const;
+		size_t count() const;
+		uint64_t hits() const;
+		uint64_t misses() const;
+
+		bool contains(const std::string &id) const;
+		Revision *get(const std::string &id);
+		DiffstatPtr diffstat(const std::string &id);
+		Revision *put(Revision *rev);
+		void update(const std::string &id, const Revision *rev);
+		void clear();
+
+	private:
+		struct Entry
+		{
+			std::shared_ptr<Revision> rev;
+			size_t size;
+			std::list<std::string>::iterator pos;
+		};
+
+		Revision *copy(const std::shared_ptr<Revision> &rev);
+		void evict();
+
+	PEPPER_PVARS:
+		size_t m_budget;
+		size_t m_size;
+		uint64_t m_hits, m_misses;
+		std::list<std::string> m_order; // Most recently used first
+		std::map<std::string, Entry> m_entries;
+
+	private:
+		// Not allowed
+		RevisionLru(const RevisionLru &);
+		RevisionLru &operator=(const RevisionLru &);
+};
+
+
+#endif // REVISIONLRU_H_
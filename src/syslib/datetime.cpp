@@ -65,6 +65,13 @@ int Watch::elapsedMSecs() const
 	return (c.tv_sec - d->tv.tv_sec) * 1000 + (c.tv_usec - d->tv.tv_usec) / 1000;
 }
 
+int64_t Watch::elapsedUSecs() const
+{
+	timeval c;
+	gettimeofday(&c, NULL);
+	return int64_t(c.tv_sec - d->tv.tv_sec) * 1000000 + (c.tv_usec - d->tv.tv_usec);
+}
+
 
 // Wrapper for strptime()
 int64_t ptime(const std::string &str, const std::string &format)
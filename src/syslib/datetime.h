@@ -34,6 +34,7 @@ class Watch
 		void start();
 		float elapsed() const;
 		int elapsedMSecs() const;
+		int64_t elapsedUSecs() const;
 
 	private:
 		WatchData *d;
@@ -18,8 +18,10 @@
 #include <climits>
 
 #include <dirent.h>
+#include <fcntl.h>
 #include <unistd.h>
 
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #include "strlib.h"
@@ -317,6 +319,65 @@ std::vector<std::string> ls(const std::string &path)
 	return entries;
 }
 
+
+// Constructor
+MappedFile::MappedFile(const std::string &path)
+	: m_fd(-1), m_data(NULL), m_size(0)
+{
+	m_fd = ::open(path.c_str(), O_RDONLY);
+	if (m_fd == -1) {
+		throw PEX_ERRNO();
+	}
+	map();
+}
+
+// Destructor
+MappedFile::~MappedFile()
+{
+	unmap();
+	if (m_fd != -1) {
+		::close(m_fd);
+	}
+}
+
+// Re-maps the file, e.g. after it has grown
+void MappedFile::remap()
+{
+	unmap();
+	map();
+}
+
+// Maps the whole file into memory
+void MappedFile::map()
+{
+	struct stat statbuf;
+	if (fstat(m_fd, &statbuf) == -1) {
+		throw PEX_ERRNO();
+	}
+	m_size = statbuf.st_size;
+	if (m_size == 0) {
+		// Empty files can't be mapped
+		return;
+	}
+
+	void *data = mmap(NULL, m_size, PROT_READ, MAP_SHARED, m_fd, 0);
+	if (data == MAP_FAILED) {
+		m_size = 0;
+		throw PEX_ERRNO();
+	}
+	m_data = (char *)data;
+}
+
+// Removes the current mapping
+void MappedFile::unmap()
+{
+	if (m_data != NULL) {
+		munmap(m_data, m_size);
+		m_data = NULL;
+	}
+	m_size = 0;
+}
+
 } // namespace fs
 
 } // namespace sys
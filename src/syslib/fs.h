@@ -49,6 +49,33 @@ std::string which(const std::string &program);
 
 std::vector<std::string> ls(const std::string &path);
 
+// Read-only memory mapping of a whole file
+class MappedFile
+{
+	public:
+		MappedFile(const std::string &path);
+		~MappedFile();
+
+		inline const char *data() const { return m_data; }
+		inline size_t size() const { return m_size; }
+
+		void remap();
+
+	private:
+		void map();
+		void unmap();
+
+	private:
+		int m_fd;
+		char *m_data;
+		size_t m_size;
+
+	private:
+		// Not allowed
+		MappedFile(const MappedFile &);
+		MappedFile &operator=(const MappedFile &);
+};
+
 } // namespace fs
 
 } // namespace sys
@@ -50,7 +50,8 @@ class Deferrer
 
 } // namespace sys
 
-#define SIGBLOCK_DEFER() do { sys::sigblock::Deferrer defer__; } while (0)
+// Defers signals until the end of the current scope
+#define SIGBLOCK_DEFER() sys::sigblock::Deferrer defer__
 
 
 #endif // SYS_SIGBLOCK_H_
@@ -62,16 +62,16 @@ std::vector<char> compress(const std::vector<char> &data, int level)
 }
 
 // Decompresses the input data using zlib (or NULL)
-std::vector<char> uncompress(const std::vector<char> &data)
+std::vector<char> uncompress(const char *data, size_t len)
 {
 #ifdef HAVE_LIBZ
-	if (data.size() <= 4) {
+	if (len <= 4) {
 		return std::vector<char>();
 	}
 
 	// Read original data size
 	uint32_t dlen = 0;
-	memcpy((char *)&dlen, (char *)&data[0], 4);
+	memcpy((char *)&dlen, data, 4);
 #ifndef WORDS_BIGENDIAN
 	dlen = bswap(dlen);
 #endif
@@ -81,13 +81,13 @@ std::vector<char> uncompress(const std::vector<char> &data)
 
 	std::vector<char> dest(dlen);
 	unsigned long ldlen = dlen;
-	int ret = ::uncompress((unsigned char *)&dest[0], &ldlen, (const unsigned char *)&data[4], data.size()-4);
+	int ret = ::uncompress((unsigned char *)&dest[0], &ldlen, (const unsigned char *)data + 4, len-4);
 	if (ret != Z_OK) {
 		throw PEX(str::printf("Corrupted data (%d)", ret));
 	}
 	return dest;
 #else
-	return data;
+	return std::vector<char>(data, data + len);
 #endif
 }
 
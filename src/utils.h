@@ -25,7 +25,10 @@ namespace utils
 {
 
 std::vector<char> compress(const std::vector<char> &data, int level = 9);
-std::vector<char> uncompress(const std::vector<char> &data);
+std::vector<char> uncompress(const char *data, size_t len);
+inline std::vector<char> uncompress(const std::vector<char> &data) {
+	return uncompress(&data[0], data.size());
+}
 
 inline std::string childId(const std::string &id) {
 	size_t p = id.find_last_of(':');
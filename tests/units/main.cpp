@@ -45,7 +45,16 @@ void push_back(std::vector<std::string> *v, const char *s1 = 0, const char *s2 =
 
 // Unit tests
 #include "test_bstream.h"
+#include "test_cache.h"
+#include "test_cachebudget.h"
+#include "test_cachedaemon.h"
+#include "test_cacheindex.h"
+#include "test_checksum.h"
+#include "test_codec.h"
+#include "test_dictionary.h"
+#include "test_diffstat.h"
 #include "test_options.h"
+#include "test_revisionlru.h"
 #include "test_strlib.h"
 #include "test_sys_fs.h"
 #include "test_sys_io.h"
@@ -17,6 +17,8 @@
 
 #include "bstream.h"
 
+#include "syslib/fs.h"
+
 
 namespace test_bstream
 {
@@ -173,6 +175,111 @@ TEST_CASE("bstream/operators", "Stream operators")
 	}
 }
 
+TEST_CASE("bstream/view", "Memory views")
+{
+	MOStream out;
+	out << std::string("first") << (uint32_t)42 << std::string(1000, 'x');
+	std::vector<char> data = out.data();
+
+	VIStream in(data);
+	std::string s;
+	uint32_t i;
+	in >> s >> i;
+	REQUIRE(s == "first");
+	REQUIRE(i == 42);
+	in >> s;
+	REQUIRE(s == std::string(1000, 'x'));
+	REQUIRE(in.eof());
+
+	// Unterminated strings are discarded
+	VIStream tin(&data[0], 3);
+	tin >> s;
+	REQUIRE(s.empty());
+	REQUIRE(tin.eof());
+}
+
+TEST_CASE("bstream/file", "Buffered file streams")
+{
+	std::string path;
+	FILE *f = sys::fs::mkstemp(&path);
+	REQUIRE(f != NULL);
+	fclose(f);
+
+	// Strings crossing the boundaries of the read buffer
+	std::vector<std::string> strings;
+	for (size_t i = 0; i < 200; i++) {
+		strings.push_back(std::string(1 + (i * 997) % 4000, 'a' + (i % 26)));
+	}
+	std::vector<char> block(100000, 'b');
+	{
+		BOStream out(path);
+		for (size_t i = 0; i < strings.size(); i++) {
+			out << strings[i] << (uint32_t)i;
+		}
+		out << block << (uint32_t)7;
+	}
+
+	BIStream in(path);
+	for (size_t i = 0; i < strings.size(); i++) {
+		std::string s;
+		uint32_t n;
+		in >> s >> n;
+		REQUIRE(s == strings[i]);
+		REQUIRE(n == i);
+	}
+	std::vector<char> v;
+	uint32_t n;
+	in >> v >> n;
+	REQUIRE(v == block);
+	REQUIRE(n == 7);
+
+	// Like feof(), EOF is only reported after reading past the end
+	REQUIRE(!in.eof());
+	size_t end = in.tell();
+	char c;
+	in >> c;
+	REQUIRE(in.eof());
+	REQUIRE(in.seek(end - 4));
+	REQUIRE(!in.eof());
+	in >> n;
+	REQUIRE(n == 7);
+
+	sys::fs::unlink(path);
+}
+
+TEST_CASE("bstream/varint", "Variable-length integers")
+{
+	uint64_t values[] = {0, 1, 127, 128, 300, 16383, 16384, 0xFFFFFFFF, 0x123456789ABCULL, 0xFFFFFFFFFFFFFFFFULL};
+	size_t nvalues = sizeof(values) / sizeof(values[0]);
+	MOStream out;
+	for (size_t i = 0; i < nvalues; i++) {
+		out.writeVarint(values[i]);
+	}
+	out.writeVarint(BStream::zigzag(-1)).writeVarint(BStream::zigzag(-1300000000LL));
+	std::vector<char> data = out.data();
+	REQUIRE(data.size() == 1 + 1 + 1 + 2 + 2 + 2 + 3 + 5 + 7 + 10 + 1 + 5);
+
+	// Values at the end of the buffer are decoded byte by byte
+	VIStream in(data);
+	for (size_t i = 0; i < nvalues; i++) {
+		uint64_t v;
+		in.readVarint(v);
+		REQUIRE(v == values[i]);
+	}
+	uint64_t z1, z2;
+	in.readVarint(z1).readVarint(z2);
+	REQUIRE(BStream::unzigzag(z1) == -1);
+	REQUIRE(BStream::unzigzag(z2) == -1300000000LL);
+	REQUIRE(in.eof());
+
+	// Truncated values are read as zero
+	VIStream tin(&data[0] + 3, 1);
+	uint32_t t = 1;
+	tin.readVarint(t);
+	REQUIRE(t == 0);
+	REQUIRE(tin.eof());
+}
+
 } // namespace test_bstream
 
 #endif // TEST_BSTREAM_H
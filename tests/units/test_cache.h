@@ -0,0 +1,624 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: tests/units/test_cache.h
+ * Unit tests for the revision cache
+ */
+
+
+#ifndef TEST_CACHE_H
+#define TEST_CACHE_H
+
+
+#include <fstream>
+#include <memory>
+#include <set>
+
+#include "backend.h"
+#include "bstream.h"
+#include "cache.h"
+#include "cacheindex.h"
+#include "checksum.h"
+#include "dictionary.h"
+#include "options.h"
+#include "revision.h"
+#include "strlib.h"
+#include "utils.h"
+
+#include "syslib/fs.h"
+#include "syslib/parallel.h"
+
+
+namespace test_cache
+{
+
+// Version of newly written caches
+const uint32_t current = 10;
+
+// Backend serving a fixed set of revisions
+class StubBackend : public Backend
+{
+public:
+	StubBackend(const Options &options, const std::string &name = "git")
+		: Backend(options), m_name(name), m_uuid("0123abcd"), m_fetched(0), m_dateCalls(0), m_datesCalls(0) { }
+
+	~StubBackend() {
+		for (std::map<std::string, Revision *>::iterator it = m_revisions.begin(); it != m_revisions.end(); ++it) {
+			delete it->second;
+		}
+	}
+
+	// Adds n revisions with varying authors and paths
+	void populate(size_t n) {
+		for (size_t i = 0; i < n; i++) {
+			DiffstatPtr stat = std::make_shared<Diffstat>();
+			Diffstat::Stat s;
+			s.cadd = 100 * i + 1;
+			s.ladd = i + 1;
+			s.cdel = 10 * i;
+			s.ldel = i % 3;
+			stat->m_stats[str::printf("src/file%u.cpp", (unsigned int)(i % 7))] = s;
+			stat->m_stats[str::printf("doc/%u.txt", (unsigned int)i)] = s;
+			std::string id = str::printf("%040u", (unsigned int)i);
+			std::string author = str::printf("author%u", (unsigned int)(i % 5));
+			std::string message = str::printf("Commit number %u\n\nWith a longer description", (unsigned int)i);
+			m_revisions[id] = new Revision(id, 1300000000 + 3600 * i, author, message, stat);
+			m_ids.push_back(id);
+		}
+	}
+
+	std::string name() const { return m_name; }
+	std::string uuid() { return m_uuid; }
+	std::string head(const std::string & = std::string()) { return m_ids.back(); }
+	std::string mainBranch() { return "master"; }
+	std::vector<std::string> branches() { return std::vector<std::string>(1, "master"); }
+	std::vector<Tag> tags() { return std::vector<Tag>(); }
+	DiffstatPtr diffstat(const std::string &id) { return m_revisions[id]->diffstat(); }
+	std::vector<std::string> tree(const std::string & = std::string()) { return std::vector<std::string>(); }
+	std::string cat(const std::string &, const std::string & = std::string()) { return std::string(); }
+	LogIterator *iterator(const std::string & = std::string(), int64_t = -1, int64_t = -1) { return new LogIterator(m_ids); }
+
+	Revision *revision(const std::string &id) {
+		++m_fetched;
+		const Revision *rev = m_revisions[id];
+		return new Revision(id, rev->date(), rev->author(), rev->message(), rev->diffstat());
+	}
+
+	int64_t date(const std::string &id) {
+		++m_dateCalls;
+		return m_revisions[id]->date();
+	}
+
+	std::map<std::string, int64_t> dates() {
+		++m_datesCalls;
+		std::map<std::string, int64_t> dates;
+		for (std::map<std::string, Revision *>::iterator it = m_revisions.begin(); it != m_revisions.end(); ++it) {
+			if (m_unlisted.find(it->first) == m_unlisted.end()) {
+				dates[it->first] = it->second->date();
+			}
+		}
+		return dates;
+	}
+
+	std::string m_name, m_uuid;
+	std::vector<std::string> m_ids;
+	std::map<std::string, Revision *> m_revisions;
+	std::set<std::string> m_unlisted; // Missing from dates()
+	int m_fetched, m_dateCalls, m_datesCalls;
+};
+
+// Creates an empty cache root and returns the options for using it
+Options mkopts()
+{
+	std::string root;
+	FILE *f = sys::fs::mkstemp(&root);
+	REQUIRE(f != NULL);
+	fclose(f);
+	sys::fs::unlink(root);
+	sys::fs::mkdir(root);
+
+	Options opts;
+	opts.m_options["cache_dir"] = root;
+	opts.m_options["cache_memory"] = "0";
+	return opts;
+}
+
+// Appends a record to a cache file, prefixed by its size
+void writeRecord(BOStream &out, const std::vector<char> &data)
+{
+	out << (uint32_t)data.size();
+	out.write(&data[0], data.size());
+}
+
+// Writes a cache of a version prior to the column files, as done by
+// pepper 0.3, and returns its index
+std::map<std::string, CacheIndex::Entry> writeLegacy(const std::string &dir, uint32_t version, const std::vector<const Revision *> &revs)
+{
+	sys::fs::mkpath(dir);
+	std::map<std::string, CacheIndex::Entry> index;
+	BOStream out(dir + "/cache.0");
+	GZOStream iout(dir + "/index");
+	iout << version;
+	uint32_t offset = 0;
+	for (size_t i = 0; i < revs.size(); i++) {
+		MOStream rout;
+		revs[i]->write03(rout);
+		std::vector<char> data = utils::compress(rout.data());
+		writeRecord(out, data);
+
+		CacheIndex::Entry entry(0, offset, checksum::crc32(data));
+		iout << revs[i]->id() << entry.segment << entry.offset << entry.crc;
+		index[revs[i]->id()] = entry;
+		offset += 4 + data.size();
+	}
+	return index;
+}
+
+// Writes a cache using column files and the dictionary, with fixed-width
+// record heads and diffstats, and returns its index
+std::map<std::string, CacheIndex::Entry> writeColumns(const std::string &dir, uint32_t version, const std::vector<const Revision *> &revs)
+{
+	sys::fs::mkpath(dir);
+	CacheDictionary dict(dir);
+	for (size_t i = 0; i < revs.size(); i++) {
+		dict.append(revs[i]->strings());
+	}
+
+	checksum::Algorithm algorithm = (version < 9 ? checksum::Crc32 : checksum::Crc32c);
+	std::map<std::string, CacheIndex::Entry> index;
+	BOStream out(dir + "/cache.0"), mout(dir + "/cache.0.msg"), dout(dir + "/cache.0.diff");
+	uint32_t offset = 0, msgOffset = 0, statOffset = 0;
+	for (size_t i = 0; i < revs.size(); i++) {
+		std::string message = revs[i]->message();
+		std::vector<char> msg = utils::compress(std::vector<char>(message.begin(), message.end()));
+		MOStream sout;
+		revs[i]->diffstat()->write(sout, dict, Diffstat::Fixed);
+		std::vector<char> stat = utils::compress(sout.data());
+		mout.write(&msg[0], msg.size());
+		dout.write(&stat[0], stat.size());
+
+		MOStream hout;
+		hout << revs[i]->date() << dict.find(revs[i]->author()) << (uint32_t)dict.size();
+		hout << msgOffset << (uint32_t)msg.size() << checksum::compute(algorithm, &msg[0], msg.size());
+		hout << statOffset << (uint32_t)stat.size() << checksum::compute(algorithm, &stat[0], stat.size());
+		std::vector<char> data = hout.data();
+		writeRecord(out, data);
+
+		index[revs[i]->id()] = CacheIndex::Entry(0, offset, checksum::compute(algorithm, &data[0], data.size()));
+		offset += 4 + data.size();
+		msgOffset += msg.size();
+		statOffset += stat.size();
+	}
+	CacheIndex(dir).rewrite(index, version);
+	return index;
+}
+
+// Writes a cache of the given version containing the given revisions
+std::map<std::string, CacheIndex::Entry> writeCache(const std::string &dir, uint32_t version, const std::vector<const Revision *> &revs)
+{
+	return (version < 6 ? writeLegacy(dir, version, revs) : writeColumns(dir, version, revs));
+}
+
+// Returns the revisions of the backend
+std::vector<const Revision *> revisions(const StubBackend &backend)
+{
+	std::vector<const Revision *> revs;
+	for (size_t i = 0; i < backend.m_ids.size(); i++) {
+		revs.push_back(backend.m_revisions.find(backend.m_ids[i])->second);
+	}
+	return revs;
+}
+
+// Checks that a cached revision equals the original one
+void compare(Cache *cache, const Revision *expected)
+{
+	REQUIRE(cache->lookup(expected->id()));
+	std::unique_ptr<Revision> rev(cache->get(expected->id()));
+	int64_t date = rev->date();
+	std::string author = rev->author(), message = rev->message();
+	std::map<std::string, Diffstat::Stat> stats = rev->diffstat()->stats();
+	std::map<std::string, Diffstat::Stat> expectedStats = expected->diffstat()->stats();
+
+	REQUIRE(rev->id() == expected->id());
+	REQUIRE(date == expected->date());
+	REQUIRE(author == expected->author());
+	REQUIRE(message == expected->message());
+	REQUIRE(stats.size() == expectedStats.size());
+	for (std::map<std::string, Diffstat::Stat>::iterator it = stats.begin(), jt = expectedStats.begin(); it != stats.end(); ++it, ++jt) {
+		REQUIRE(it->first == jt->first);
+		REQUIRE(it->second.cadd == jt->second.cadd);
+		REQUIRE(it->second.ladd == jt->second.ladd);
+		REQUIRE(it->second.cdel == jt->second.cdel);
+		REQUIRE(it->second.ldel == jt->second.ldel);
+	}
+}
+
+// Adds revisions of the backend to the cache of the given options
+void fill(StubBackend *backend, const Options &opts, size_t begin, size_t end)
+{
+	Cache cache(backend, opts);
+	for (size_t i = begin; i < end; i++) {
+		const std::string &id = backend->m_ids[i];
+		cache.put(id, *backend->m_revisions[id]);
+	}
+}
+
+// Loads the cache and waits until the records have been converted in the
+// background and the migration has been finished
+void finish(Cache *cache, const std::string &dir)
+{
+	cache->load();
+	for (int i = 0; i < 1000 && cache->m_migration > 0; i++) {
+		sys::parallel::Thread::msleep(10);
+		cache->flush();
+	}
+	REQUIRE(cache->m_migration == 0);
+	REQUIRE(!sys::fs::fileExists(dir + "/migration"));
+}
+
+TEST_CASE("cache/migration_state", "Migration state files")
+{
+	Options opts = mkopts();
+	std::string dir = opts.cacheDir();
+
+	REQUIRE(Cache::readMigration(dir, 9) == 0);
+	Cache::writeMigration(dir, 9, 3);
+	REQUIRE(Cache::readMigration(dir, 9) == 3);
+	REQUIRE(!sys::fs::fileExists(dir + "/migration.tmp"));
+
+	// There's no migration to the current version
+	REQUIRE(Cache::readMigration(dir, current) == 0);
+
+	// The state file must match the version of the index
+	REQUIRE_THROWS(Cache::readMigration(dir, 7));
+	std::ofstream(dir + "/migration") << "PMIG";
+	REQUIRE_THROWS(Cache::readMigration(dir, 9));
+
+	sys::fs::unlinkr(dir);
+}
+
+TEST_CASE("cache/segment_version", "Record versions during a migration")
+{
+	REQUIRE(Cache::segmentVersion(0, 7, 0) == 7);
+	REQUIRE(Cache::segmentVersion(5, 7, 0) == 7);
+	REQUIRE(Cache::segmentVersion(2, 5, 3) == 5);
+	REQUIRE(Cache::segmentVersion(3, 5, 3) == current);
+	REQUIRE(Cache::segmentVersion(4, 9, 3) == current);
+}
+
+TEST_CASE("cache/migrate", "Caches of older versions are converted in the background")
+{
+	uint32_t versions[] = {4, 5, 7, 9};
+	for (size_t v = 0; v < sizeof(versions) / sizeof(versions[0]); v++) {
+		Options opts = mkopts();
+		StubBackend backend(opts, versions[v] < 5 ? "mercurial" : "git");
+		backend.populate(300);
+		std::vector<const Revision *> revs = revisions(backend);
+		std::string dir = opts.cacheDir() + "/" + backend.uuid();
+		writeCache(dir, versions[v], revs);
+
+		// Records are served in their previous format until they have been
+		// converted
+		{
+			Cache cache(&backend, opts);
+			cache.load(false);
+			REQUIRE(cache.m_version == versions[v]);
+			REQUIRE(cache.m_migration == 0);
+			for (size_t i = 0; i < revs.size(); i++) {
+				compare(&cache, revs[i]);
+			}
+			std::vector<std::string> ids = cache.cachedIds();
+			REQUIRE(ids == backend.m_ids);
+		}
+		REQUIRE(!sys::fs::fileExists(dir + "/migration"));
+
+		{
+			Cache cache(&backend, opts);
+			finish(&cache, dir);
+			REQUIRE(cache.m_version == current);
+			REQUIRE(cache.m_index->version() == current);
+			REQUIRE(cache.m_index->size() == revs.size());
+			for (size_t i = 0; i < revs.size(); i++) {
+				compare(&cache, revs[i]);
+			}
+		}
+
+		// The previous cache files have been removed
+		REQUIRE(!sys::fs::fileExists(dir + "/cache.0"));
+		REQUIRE(!sys::fs::fileExists(dir + "/index"));
+		{
+			Cache cache(&backend, opts);
+			cache.load();
+			REQUIRE(cache.m_version == current);
+			for (size_t i = 0; i < revs.size(); i++) {
+				compare(&cache, revs[i]);
+			}
+		}
+		REQUIRE(backend.m_fetched == 0);
+		sys::fs::unlinkr(opts.cacheDir());
+	}
+}
+
+TEST_CASE("cache/resume", "Interrupted migrations are resumed")
+{
+	uint32_t versions[] = {5, 9};
+	for (size_t v = 0; v < sizeof(versions) / sizeof(versions[0]); v++) {
+		Options opts = mkopts();
+		StubBackend backend(opts);
+		backend.populate(50);
+		std::vector<const Revision *> revs = revisions(backend);
+		std::string dir = opts.cacheDir() + "/" + backend.uuid();
+		writeCache(dir, versions[v], revs);
+
+		// Start the migration, but convert the first half of the records only
+		std::vector<std::string> half(backend.m_ids.begin(), backend.m_ids.begin() + revs.size() / 2);
+		Cache::writeMigration(dir, versions[v], 1);
+		{
+			Cache cache(&backend, opts);
+			cache.load(false);
+			REQUIRE(cache.m_migration == 1);
+			size_t converted = cache.migrate(half, std::make_shared<CacheDictionary>(dir));
+			REQUIRE(converted == half.size());
+		}
+		REQUIRE(Cache::readMigration(dir, versions[v]) == 1);
+
+		{
+			Cache cache(&backend, opts);
+			cache.load(false);
+			REQUIRE(cache.m_migration == 1);
+			for (size_t i = 0; i < revs.size(); i++) {
+				CacheIndex::Entry entry;
+				REQUIRE(cache.locate(revs[i]->id(), &entry));
+				REQUIRE((entry.segment >= 1) == (i < half.size()));
+				compare(&cache, revs[i]);
+			}
+		}
+
+		// Records that have been converted already are kept
+		{
+			Cache cache(&backend, opts);
+			finish(&cache, dir);
+			REQUIRE(cache.m_index->size() == revs.size());
+			for (size_t i = 0; i < revs.size(); i++) {
+				compare(&cache, revs[i]);
+			}
+		}
+		REQUIRE(!sys::fs::fileExists(dir + "/cache.0"));
+		REQUIRE(backend.m_fetched == 0);
+		sys::fs::unlinkr(opts.cacheDir());
+	}
+}
+
+TEST_CASE("cache/finish", "Records that haven't been converted are dropped")
+{
+	uint32_t versions[] = {5, 9};
+	for (size_t v = 0; v < sizeof(versions) / sizeof(versions[0]); v++) {
+		Options opts = mkopts();
+		StubBackend backend(opts);
+		backend.populate(40);
+		std::vector<const Revision *> revs = revisions(backend);
+		std::string dir = opts.cacheDir() + "/" + backend.uuid();
+		writeCache(dir, versions[v], revs);
+
+		Cache::writeMigration(dir, versions[v], 1);
+		{
+			Cache cache(&backend, opts);
+			cache.load(false);
+			std::vector<std::string> half(backend.m_ids.begin(), backend.m_ids.begin() + revs.size() / 2);
+			size_t converted = cache.migrate(half, std::make_shared<CacheDictionary>(dir));
+			REQUIRE(converted == half.size());
+
+			cache.finishMigration();
+			REQUIRE(cache.m_migration == 0);
+			REQUIRE(cache.m_version == current);
+			REQUIRE(cache.m_legacy.empty());
+			REQUIRE(cache.m_index->size() == half.size());
+			for (size_t i = 0; i < revs.size(); i++) {
+				if (i < half.size()) {
+					compare(&cache, revs[i]);
+				} else {
+					REQUIRE(!cache.lookup(revs[i]->id()));
+				}
+			}
+		}
+		REQUIRE(!sys::fs::fileExists(dir + "/migration"));
+		REQUIRE(!sys::fs::fileExists(dir + "/index"));
+		REQUIRE(!sys::fs::fileExists(dir + "/cache.0"));
+
+		// Corrupted records are dropped during a migration
+		sys::fs::unlinkr(dir);
+		std::map<std::string, CacheIndex::Entry> index = writeCache(dir, versions[v], revs);
+		{
+			std::fstream out((dir + "/cache.0").c_str(), std::ios::in | std::ios::out | std::ios::binary);
+			out.seekp(index[revs[3]->id()].offset + 6);
+			out.put('X');
+		}
+		{
+			Cache cache(&backend, opts);
+			finish(&cache, dir);
+			REQUIRE(cache.m_index->size() == revs.size() - 1);
+			REQUIRE(!cache.lookup(revs[3]->id()));
+			compare(&cache, revs[2]);
+			compare(&cache, revs[4]);
+		}
+		sys::fs::unlinkr(opts.cacheDir());
+	}
+}
+
+TEST_CASE("cache/outdated", "Revisions affected by bugs of older versions are fetched again")
+{
+	Options opts = mkopts();
+	StubBackend backend(opts);
+	backend.populate(30);
+	std::string dir = opts.cacheDir() + "/" + backend.uuid();
+
+	// Git caches of version 4 and older may contain invalid commit times
+	std::vector<const Revision *> revs;
+	std::vector<Revision *> invalid;
+	for (size_t i = 0; i < backend.m_ids.size(); i++) {
+		const Revision *rev = backend.m_revisions[backend.m_ids[i]];
+		if (i % 4 == 0) {
+			invalid.push_back(new Revision(rev->id(), rev->date() + 7200, rev->author(), rev->message(), rev->diffstat()));
+			revs.push_back(invalid.back());
+		} else {
+			revs.push_back(rev);
+		}
+	}
+	writeCache(dir, 4, revs);
+	backend.m_unlisted.insert(backend.m_ids[1]);
+	backend.m_unlisted.insert(backend.m_ids[4]);
+
+	{
+		// None of the records are served before they have been checked
+		Cache cache(&backend, opts);
+		cache.load(false);
+		REQUIRE(cache.m_outdated);
+		REQUIRE(!cache.lookup(backend.m_ids[1]));
+		REQUIRE(cache.cachedIds().empty());
+	}
+
+	{
+		Cache cache(&backend, opts);
+		finish(&cache, dir);
+		REQUIRE(cache.m_index->size() == revs.size() - invalid.size());
+		for (size_t i = 0; i < backend.m_ids.size(); i++) {
+			if (i % 4 == 0) {
+				REQUIRE(!cache.lookup(backend.m_ids[i]));
+			} else {
+				compare(&cache, backend.m_revisions[backend.m_ids[i]]);
+			}
+		}
+
+		// All dates are fetched at once, except for unknown revisions
+		REQUIRE(backend.m_datesCalls == 1);
+		REQUIRE(backend.m_dateCalls == 2);
+		REQUIRE(backend.m_fetched == 0);
+
+		// Dropped revisions are fetched again
+		std::unique_ptr<Revision> rev(cache.revision(backend.m_ids[8]));
+		REQUIRE(backend.m_fetched == 1);
+		REQUIRE(rev->date() == backend.m_revisions[backend.m_ids[8]]->date());
+		compare(&cache, backend.m_revisions[backend.m_ids[8]]);
+	}
+
+	for (size_t i = 0; i < invalid.size(); i++) {
+		delete invalid[i];
+	}
+	sys::fs::unlinkr(opts.cacheDir());
+}
+
+TEST_CASE("cache/merge", "Caches from other directories are merged and compacted")
+{
+	Options opts = mkopts(), opts1 = mkopts(), opts2 = mkopts();
+	StubBackend backend(opts);
+	backend.populate(60);
+	std::string dir = opts.cacheDir() + "/" + backend.uuid();
+	std::string dir2 = opts2.cacheDir() + "/" + backend.uuid();
+
+	// The caches overlap, and the local copy of a revision takes precedence
+	const std::string &local = backend.m_ids[55];
+	{
+		Revision *rev = backend.m_revisions[local];
+		Revision changed(local, rev->date(), rev->author(), "Local copy", rev->diffstat());
+		Cache cache(&backend, opts);
+		cache.put(local, changed);
+	}
+	fill(&backend, opts1, 0, 40);
+	fill(&backend, opts2, 20, 60);
+
+	// Corrupt a record that is only present in the second cache
+	const std::string &corrupted = backend.m_ids[45];
+	{
+		Cache cache(&backend, opts2);
+		cache.load();
+		CacheIndex::Entry entry;
+		REQUIRE(cache.m_index->lookup(corrupted, &entry));
+		std::fstream out(str::printf("%s/cache.%u", dir2.c_str(), entry.segment).c_str(), std::ios::in | std::ios::out | std::ios::binary);
+		out.seekp(entry.offset + 6);
+		out.put('X');
+	}
+
+	{
+		// Both cache roots and repository caches are accepted
+		Cache cache(&backend, opts);
+		std::vector<std::string> dirs;
+		dirs.push_back(opts1.cacheDir());
+		dirs.push_back(dir2);
+		cache.merge(dirs);
+	}
+	{
+		Cache cache(&backend, opts);
+		cache.load();
+		REQUIRE(cache.m_index->size() == backend.m_ids.size() - 1);
+		REQUIRE(!cache.lookup(corrupted));
+		for (size_t i = 0; i < backend.m_ids.size(); i++) {
+			const std::string &id = backend.m_ids[i];
+			if (id != corrupted && id != local) {
+				compare(&cache, backend.m_revisions[id]);
+			}
+		}
+		std::unique_ptr<Revision> rev(cache.get(local));
+		std::string message = rev->message();
+		REQUIRE(message == "Local copy");
+
+		// The merged cache has been compacted in iteration order
+		std::vector<std::string> expected(backend.m_ids);
+		expected.erase(expected.begin() + 45);
+		std::vector<std::string> ids = cache.cachedIds();
+		REQUIRE(ids == expected);
+	}
+	std::vector<std::string> files = sys::fs::ls(dir);
+	for (size_t i = 0; i < files.size(); i++) {
+		REQUIRE(files[i].compare(0, 8, "cache.0.") != 0);
+		REQUIRE(files[i] != "cache.0");
+	}
+	REQUIRE(backend.m_fetched == 0);
+
+	// The other caches are not modified
+	{
+		Cache cache(&backend, opts1);
+		cache.load();
+		REQUIRE(cache.m_index->size() == 40);
+	}
+
+	sys::fs::unlinkr(opts.cacheDir());
+	sys::fs::unlinkr(opts1.cacheDir());
+	sys::fs::unlinkr(opts2.cacheDir());
+}
+
+TEST_CASE("cache/merge_invalid", "Other repositories and old caches are not merged")
+{
+	Options opts = mkopts(), other = mkopts(), old = mkopts();
+	StubBackend backend(opts);
+	backend.populate(10);
+	fill(&backend, opts, 0, 5);
+
+	StubBackend otherBackend(other);
+	otherBackend.m_uuid = "4567cdef";
+	otherBackend.populate(10);
+	fill(&otherBackend, other, 0, 10);
+
+	writeLegacy(old.cacheDir() + "/" + backend.uuid(), 5, revisions(backend));
+
+	{
+		Cache cache(&backend, opts);
+		REQUIRE_THROWS(cache.merge(std::vector<std::string>(1, other.cacheDir())));
+		REQUIRE_THROWS(cache.merge(std::vector<std::string>(1, other.cacheDir() + "/" + otherBackend.uuid())));
+		REQUIRE_THROWS(cache.merge(std::vector<std::string>(1, opts.cacheDir())));
+		REQUIRE_THROWS(cache.merge(std::vector<std::string>(1, old.cacheDir())));
+		REQUIRE(cache.m_index->size() == 5);
+	}
+
+	sys::fs::unlinkr(opts.cacheDir());
+	sys::fs::unlinkr(other.cacheDir());
+	sys::fs::unlinkr(old.cacheDir());
+}
+
+} // namespace test_cache
+
+#endif // TEST_CACHE_H
@@ -0,0 +1,101 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: tests/units/test_cachebudget.h
+ * Unit tests for the disk usage limit of the cache directory
+ */
+
+
+#ifndef TEST_CACHEBUDGET_H
+#define TEST_CACHEBUDGET_H
+
+
+#include <fstream>
+
+#include "cachebudget.h"
+
+#include "syslib/fs.h"
+
+
+namespace test_cachebudget
+{
+
+// Creates a cache root containing repository caches of 1000 bytes each
+std::string mkroot(const char *uuids)
+{
+	std::string path;
+	FILE *f = sys::fs::mkstemp(&path);
+	REQUIRE(f != NULL);
+	fclose(f);
+	sys::fs::unlink(path);
+	sys::fs::mkdir(path);
+
+	for (const char *c = uuids; *c; c++) {
+		std::string dir = path + "/" + std::string(1, *c);
+		sys::fs::mkpath(dir + "/sub");
+		std::ofstream(dir + "/cache.0") << std::string(600, 'x');
+		std::ofstream(dir + "/sub/data") << std::string(400, 'x');
+	}
+	return path;
+}
+
+TEST_CASE("cachebudget/evict", "Least recently used caches are removed")
+{
+	std::string root = mkroot("abc");
+	REQUIRE(CacheBudget::dirSize(root + "/a") == 1000);
+
+	CacheBudget unlimited(root, 1024 * 1024);
+	unlimited.update("b", 10);
+	unlimited.update("c", 20);
+	std::vector<std::string> evicted = unlimited.update("a", 30);
+	REQUIRE(evicted.empty());
+	REQUIRE(unlimited.usage() == 3000);
+	REQUIRE(unlimited.entries()["b"].access == 10);
+
+	// The ledger is shared between instances
+	CacheBudget budget(root, 2500);
+	evicted = budget.update("c", 40);
+	REQUIRE(evicted == std::vector<std::string>(1, "b"));
+	REQUIRE(!sys::fs::exists(root + "/b"));
+	REQUIRE(sys::fs::dirExists(root + "/a"));
+	REQUIRE(budget.usage() == 2000);
+
+	// The current repository is never removed
+	CacheBudget tiny(root, 1);
+	evicted = tiny.update("c", 50);
+	REQUIRE(evicted == std::vector<std::string>(1, "a"));
+	REQUIRE(sys::fs::dirExists(root + "/c"));
+	REQUIRE(tiny.usage() == 1000);
+
+	sys::fs::unlinkr(root);
+}
+
+TEST_CASE("cachebudget/ledger", "Unknown or invalid ledgers are rebuilt")
+{
+	std::string root = mkroot("ab");
+	std::ofstream(root + "/usage") << "garbage";
+
+	CacheBudget budget(root, 1024 * 1024);
+	budget.update("a", 10);
+	REQUIRE(budget.entries().size() == 2);
+	REQUIRE(budget.usage() == 2000);
+	REQUIRE(budget.entries()["a"].access == 10);
+
+	// Removed caches are dropped from the ledger
+	sys::fs::unlinkr(root + "/b");
+	budget.update("a", 20);
+	REQUIRE(budget.entries().size() == 1);
+	REQUIRE(budget.usage() == 1000);
+
+	sys::fs::unlinkr(root);
+}
+
+} // namespace test_cachebudget
+
+
+#endif // TEST_CACHEBUDGET_H
@@ -0,0 +1,149 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: tests/units/test_cachedaemon.h
+ * Unit tests for the cache daemon
+ */
+
+
+#ifndef TEST_CACHEDAEMON_H
+#define TEST_CACHEDAEMON_H
+
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "bstream.h"
+#include "cachedaemon.h"
+#include "options.h"
+
+#include "syslib/fs.h"
+#include "syslib/parallel.h"
+
+
+namespace test_cachedaemon
+{
+
+// Runs a daemon in the background
+class DaemonThread : public sys::parallel::Thread
+{
+public:
+	DaemonThread(CacheDaemon *daemon) : sys::parallel::Thread(), m_daemon(daemon) { }
+
+	void run() {
+		m_daemon->run();
+	}
+
+	CacheDaemon *m_daemon;
+};
+
+// Connects to the daemon, waiting for it to start listening
+int connect(const std::string &path)
+{
+	int fd = -1;
+	for (int i = 0; i < 500 && fd < 0; i++) {
+		fd = CacheDaemon::connect(path);
+		if (fd < 0) {
+			sys::parallel::Thread::msleep(10);
+		}
+	}
+	REQUIRE(fd >= 0);
+	return fd;
+}
+
+// Sends a request and returns the type of the response
+char request(int fd, const std::vector<char> &data)
+{
+	CacheDaemon::send(fd, data);
+	std::vector<char> response;
+	bool received = CacheDaemon::receive(fd, &response);
+	REQUIRE(received);
+	REQUIRE(!response.empty());
+	return response[0];
+}
+
+TEST_CASE("cachedaemon/stalled", "Stalled clients don't block other clients")
+{
+	std::string root;
+	FILE *f = sys::fs::mkstemp(&root);
+	REQUIRE(f != NULL);
+	fclose(f);
+	sys::fs::unlink(root);
+	sys::fs::mkdir(root);
+
+	Options opts;
+	opts.m_options["cache_dir"] = root;
+	CacheDaemon daemon(opts);
+	DaemonThread thread(&daemon);
+	thread.start();
+	std::string path = CacheDaemon::socketPath(opts);
+
+	// A client that stops in the middle of a size prefix
+	int prefix = connect(path);
+	ssize_t n = ::send(prefix, "\0\0", 2, 0);
+	REQUIRE(n == 2);
+
+	// A client that stops in the middle of a message
+	int message = connect(path);
+	n = ::send(message, "\0\0\0\x10" "HELLO", 9, 0);
+	REQUIRE(n == 9);
+
+	// A client that sends requests but never reads the responses, until
+	// the daemon stops reading from it
+	int reader = connect(path);
+	int ret = fcntl(reader, F_SETFL, fcntl(reader, F_GETFL) | O_NONBLOCK);
+	REQUIRE(ret == 0);
+	MOStream lout;
+	lout << (uint32_t)5 << char(CacheDaemon::Lookup) << (uint32_t)0;
+	std::vector<char> lookup(lout.data());
+	size_t sent = 0;
+	for (int i = 0; i < 1000000; i++) {
+		n = ::send(reader, &lookup[0], lookup.size(), 0);
+		if (n < (ssize_t)lookup.size()) {
+			break;
+		}
+		sent += n;
+	}
+	REQUIRE(sent > 0);
+
+	// Another client is still served
+	int client = connect(path);
+	MOStream hello;
+	hello << char(CacheDaemon::Hello) << CacheDaemon::ProtocolVersion << std::string("0123abcd") << std::string("git");
+	REQUIRE(request(client, hello.data()) == CacheDaemon::Ok);
+
+	std::vector<std::string> ids;
+	ids.push_back("deadbeef");
+	MOStream out;
+	out << char(CacheDaemon::Lookup) << ids;
+	CacheDaemon::send(client, out.data());
+	std::vector<char> response;
+	bool received = CacheDaemon::receive(client, &response);
+	REQUIRE(received);
+	VIStream in(response);
+	char type;
+	std::vector<char> found;
+	in >> type >> found;
+	REQUIRE(in.ok());
+	REQUIRE(type == CacheDaemon::Ok);
+	REQUIRE(found.size() == 1);
+	REQUIRE(found[0] == 0);
+
+	::close(prefix);
+	::close(message);
+	::close(reader);
+	::close(client);
+	daemon.stop();
+	thread.wait();
+	sys::fs::unlinkr(root);
+}
+
+} // namespace test_cachedaemon
+
+#endif // TEST_CACHEDAEMON_H
@@ -0,0 +1,199 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: tests/units/test_cacheindex.h
+ * Unit tests for the revision cache index
+ */
+
+
+#ifndef TEST_CACHEINDEX_H
+#define TEST_CACHEINDEX_H
+
+
+#include "bstream.h"
+#include "cacheindex.h"
+#include "strlib.h"
+
+#include "syslib/fs.h"
+
+
+namespace test_cacheindex
+{
+
+// Creates an empty temporary directory
+std::string mkdtemp()
+{
+	std::string path;
+	FILE *f = sys::fs::mkstemp(&path);
+	REQUIRE(f != NULL);
+	fclose(f);
+	sys::fs::unlink(path);
+	sys::fs::mkdir(path);
+	return path;
+}
+
+TEST_CASE("cacheindex/lookup", "CacheIndex lookup, log and merge")
+{
+	std::string dir = mkdtemp();
+	REQUIRE(!CacheIndex::exists(dir));
+
+	std::map<std::string, CacheIndex::Entry> entries;
+	for (uint32_t i = 0; i < 100; i++) {
+		entries[str::itos(i * 7)] = CacheIndex::Entry(i / 10, i * 100, i);
+	}
+
+	CacheIndex index(dir);
+	index.rewrite(entries, 5);
+	REQUIRE(CacheIndex::exists(dir));
+	REQUIRE(index.version() == 5);
+	REQUIRE(index.size() == entries.size());
+
+	CacheIndex::Entry entry;
+	REQUIRE(index.lookup("49", &entry));
+	REQUIRE(entry.segment == 0);
+	REQUIRE(entry.offset == 700);
+	REQUIRE(entry.crc == 7);
+	REQUIRE(!index.lookup("48"));
+	REQUIRE(!index.lookup(""));
+	REQUIRE(!index.lookup("6930"));
+
+	// New entries are kept in the log until merged
+	index.insert("48", CacheIndex::Entry(10, 4, 2), 5);
+	index.insert("49", CacheIndex::Entry(11, 5, 3), 5);
+	index.flush();
+	REQUIRE(sys::fs::fileExists(dir + "/index.log"));
+
+	CacheIndex index2(dir);
+	index2.open();
+	REQUIRE(index2.size() == entries.size() + 1);
+	REQUIRE(index2.lookup("48", &entry));
+	REQUIRE(entry.segment == 10);
+	REQUIRE(index2.lookup("49", &entry));
+	REQUIRE(entry.segment == 11);
+
+	std::vector<std::pair<std::string, CacheIndex::Entry> > all = index2.entries();
+	REQUIRE(all.size() == entries.size() + 1);
+	for (size_t i = 1; i < all.size(); i++) {
+		REQUIRE(CacheIndex::encodeKey(all[i-1].first) < CacheIndex::encodeKey(all[i].first));
+	}
+
+	// Entries appended by other instances are picked up on refresh
+	bool refreshed = index2.refresh();
+	REQUIRE(!refreshed);
+	index.insert("50", CacheIndex::Entry(12, 6, 4), 5);
+	REQUIRE(!index2.lookup("50"));
+	refreshed = index2.refresh();
+	REQUIRE(refreshed);
+	REQUIRE(index2.lookup("50", &entry));
+	REQUIRE(entry.segment == 12);
+	index.flush();
+
+	index2.flush(true);
+	REQUIRE(!sys::fs::fileExists(dir + "/index.log"));
+	REQUIRE(index2.lookup("48", &entry));
+	REQUIRE(entry.offset == 4);
+	REQUIRE(index2.lookup("0", &entry));
+	REQUIRE(entry.offset == 0);
+	REQUIRE(index2.size() == entries.size() + 2);
+
+	index.close();
+	index2.close();
+	sys::fs::unlinkr(dir);
+}
+
+TEST_CASE("cacheindex/keys", "Binary keys for revision IDs")
+{
+	std::string hash = "0123456789abcdef0123456789abcdef01234567";
+	std::string hash2 = "fedcba9876543210fedcba9876543210fedcba98";
+	const char *ids[] = {"0", "7", "4294967295", "4294967296", "007", "-1", "", "tag:v1.0", "0123456789ABCDEF0123456789ABCDEF01234567"};
+	for (size_t i = 0; i < sizeof(ids) / sizeof(ids[0]); i++) {
+		std::string key = CacheIndex::encodeKey(ids[i]);
+		REQUIRE(CacheIndex::decodeKey(key.data(), key.length()) == ids[i]);
+	}
+
+	// Object IDs and revision numbers are stored in binary form
+	std::string key = CacheIndex::encodeKey(hash);
+	REQUIRE(key.length() == 21);
+	REQUIRE(CacheIndex::decodeKey(key.data(), key.length()) == hash);
+	key = CacheIndex::encodeKey(hash + ":" + hash2);
+	REQUIRE(key.length() == 41);
+	REQUIRE(CacheIndex::decodeKey(key.data(), key.length()) == hash + ":" + hash2);
+	REQUIRE(CacheIndex::encodeKey("4294967295").length() == 5);
+	REQUIRE(CacheIndex::encodeKey("9") < CacheIndex::encodeKey("10"));
+	REQUIRE_THROWS(CacheIndex::decodeKey("\x02\x01", 2));
+}
+
+TEST_CASE("cacheindex/plain", "Index files with plain revision IDs are converted")
+{
+	std::string dir = mkdtemp();
+	std::string hash = "0123456789abcdef0123456789abcdef01234567";
+	{
+		// Table of the previous format, sorted by revision ID
+		BOStream out(dir + "/index.bin");
+		out.write("PIDX", 4);
+		out << (uint32_t)1 << (uint32_t)10 << (uint32_t)3;
+		out << (uint32_t)0 << (uint32_t)40 << (uint32_t)1 << (uint32_t)10 << (uint32_t)100;
+		out << (uint32_t)40 << (uint32_t)2 << (uint32_t)1 << (uint32_t)20 << (uint32_t)200;
+		out << (uint32_t)42 << (uint32_t)1 << (uint32_t)1 << (uint32_t)30 << (uint32_t)300;
+		out.write(hash.data(), hash.length());
+		out.write("10", 2);
+		out.write("9", 1);
+	}
+	{
+		BOStream out(dir + "/index.log");
+		out.write("PLOG", 4);
+		out << (uint32_t)1 << (uint32_t)10;
+		out << (uint32_t)1;
+		out.write("9", 1);
+		out << (uint32_t)2 << (uint32_t)40 << (uint32_t)400;
+	}
+
+	CacheIndex index(dir);
+	index.open();
+	REQUIRE(index.version() == 10);
+	REQUIRE(index.size() == 3);
+	CacheIndex::Entry entry;
+	REQUIRE(index.lookup(hash, &entry));
+	REQUIRE(entry.crc == 100);
+	REQUIRE(index.lookup("10", &entry));
+	REQUIRE(entry.crc == 200);
+	REQUIRE(index.lookup("9", &entry));
+	REQUIRE(entry.crc == 400);
+
+	// The previous log format is continued
+	index.insert("11", CacheIndex::Entry(2, 50, 500), 10);
+	CacheIndex index2(dir);
+	index2.open();
+	REQUIRE(index2.lookup("11", &entry));
+	REQUIRE(entry.crc == 500);
+
+	std::vector<std::pair<std::string, CacheIndex::Entry> > all = index2.entries();
+	REQUIRE(all.size() == 4);
+	REQUIRE(all[0].first == "9");
+	REQUIRE(all[1].first == "10");
+	REQUIRE(all[2].first == "11");
+	REQUIRE(all[3].first == hash);
+
+	// Merging writes the current format
+	index2.flush(true);
+	index.close();
+	index2.open();
+	REQUIRE(index2.size() == 4);
+	REQUIRE(index2.lookup("9", &entry));
+	REQUIRE(entry.crc == 400);
+	REQUIRE(index2.lookup(hash, &entry));
+	REQUIRE(entry.crc == 100);
+	REQUIRE(index2.entries().size() == 4);
+
+	index2.close();
+	sys::fs::unlinkr(dir);
+}
+
+} // namespace test_cacheindex
+
+#endif // TEST_CACHEINDEX_H
@@ -0,0 +1,85 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: tests/units/test_checksum.h
+ * Unit tests for the checksum kernels
+ */
+
+
+#ifndef TEST_CHECKSUM_H
+#define TEST_CHECKSUM_H
+
+
+#include <cstdlib>
+
+#include "checksum.h"
+#include "utils.h"
+
+
+namespace test_checksum
+{
+
+TEST_CASE("checksum/crc32", "CRC32 kernels")
+{
+	std::vector<char> data(1024 + 16);
+	for (size_t i = 0; i < data.size(); i++) data[i] = rand() & 0xFF;
+
+	std::vector<checksum::Kernel> kernels = checksum::kernels(checksum::Crc32);
+	for (size_t k = 0; k < kernels.size(); k++) {
+		INFO(kernels[k].name);
+		REQUIRE(kernels[k].function(0, "123456789", 9) == 0xCBF43926);
+
+		// Compare with the reference implementation at various lengths and
+		// alignments
+		for (size_t offset = 0; offset < 16; offset += 3) {
+			for (size_t len = 0; len < 300; len++) {
+				REQUIRE(kernels[k].function(0, &data[offset], len) == utils::crc32(&data[offset], len));
+			}
+			size_t len = data.size() - offset;
+			REQUIRE(kernels[k].function(0, &data[offset], len) == utils::crc32(&data[offset], len));
+		}
+
+		// Checksums can be computed incrementally
+		uint32_t crc = kernels[k].function(0, &data[0], 100);
+		crc = kernels[k].function(crc, &data[100], data.size() - 100);
+		REQUIRE(crc == utils::crc32(data));
+	}
+	REQUIRE(checksum::crc32(data) == utils::crc32(data));
+}
+
+TEST_CASE("checksum/crc32c", "CRC32C kernels")
+{
+	std::vector<char> data(1024 + 16);
+	for (size_t i = 0; i < data.size(); i++) data[i] = rand() & 0xFF;
+
+	std::vector<checksum::Kernel> kernels = checksum::kernels(checksum::Crc32c);
+	checksum::Function table = kernels.back().function;
+	REQUIRE(table(0, "123456789", 9) == 0xE3069283);
+	REQUIRE(table(0, std::vector<char>(32, 0x00).data(), 32) == 0x8A9136AA);
+	REQUIRE(table(0, std::vector<char>(32, 0xFF).data(), 32) == 0x62A8AB43);
+
+	for (size_t k = 0; k < kernels.size(); k++) {
+		INFO(kernels[k].name);
+		REQUIRE(kernels[k].function(0, "123456789", 9) == 0xE3069283);
+		for (size_t offset = 0; offset < 16; offset += 3) {
+			for (size_t len = 0; len < 300; len++) {
+				REQUIRE(kernels[k].function(0, &data[offset], len) == table(0, &data[offset], len));
+			}
+		}
+
+		uint32_t crc = kernels[k].function(0, &data[0], 100);
+		crc = kernels[k].function(crc, &data[100], data.size() - 100);
+		REQUIRE(crc == table(0, &data[0], data.size()));
+	}
+	REQUIRE(checksum::crc32c(data) == table(0, &data[0], data.size()));
+}
+
+} // namespace test_checksum
+
+
+#endif // TEST_CHECKSUM_H
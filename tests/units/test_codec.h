@@ -0,0 +1,97 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: tests/units/test_codec.h
+ * Unit tests for the record compression codecs
+ */
+
+
+#ifndef TEST_CODEC_H
+#define TEST_CODEC_H
+
+
+#include "codec.h"
+#include "utils.h"
+
+
+namespace test_codec
+{
+
+// Returns some compressible test data
+std::vector<char> sample()
+{
+	std::string s;
+	for (int i = 0; i < 200; i++) {
+		s += str::printf("src/file%d.cpp\t%d\t%d\n", i % 17, i * 3, i % 5);
+	}
+	return std::vector<char>(s.begin(), s.end());
+}
+
+TEST_CASE("codec/roundtrip", "Encoding and decoding with all codecs")
+{
+	std::vector<char> data = sample();
+	std::vector<const Codec *> codecs = Codec::all();
+	REQUIRE(!codecs.empty());
+	for (size_t i = 0; i < codecs.size(); i++) {
+		REQUIRE(Codec::get(codecs[i]->id()) == codecs[i]);
+		REQUIRE(Codec::get(codecs[i]->name()) == codecs[i]);
+
+		std::vector<char> enc = Codec::encode(data, codecs[i]);
+		REQUIRE(Codec::decode(enc) == data);
+		if (codecs[i]->id() != Codec::StoreId) {
+			REQUIRE(enc.size() < data.size());
+		}
+	}
+
+	// Incompressible input is stored
+	std::vector<char> noise(64);
+	for (size_t i = 0; i < noise.size(); i++) {
+		noise[i] = (char)((i * 131 + 7) ^ (i >> 1));
+	}
+	std::vector<char> enc = Codec::encode(noise);
+	REQUIRE(enc.size() <= noise.size() + 6);
+	REQUIRE(Codec::decode(enc) == noise);
+
+	std::vector<char> empty;
+	REQUIRE(Codec::decode(Codec::encode(empty)) == empty);
+}
+
+TEST_CASE("codec/legacy", "Decoding of data without a codec header")
+{
+	std::vector<char> data = sample();
+	REQUIRE(Codec::decode(utils::compress(data)) == data);
+}
+
+TEST_CASE("codec/corrupted", "Detection of corrupted data")
+{
+	std::vector<char> data = sample();
+	std::vector<char> enc = Codec::encode(data, Codec::get(Codec::LzId));
+
+	std::vector<std::vector<char> > broken;
+	broken.push_back(std::vector<char>(enc.begin(), enc.begin() + 3));
+	broken.push_back(std::vector<char>(enc.begin(), enc.end() - 10));
+	broken.push_back(enc);
+	broken.back()[1] = 0x7F;
+	broken.push_back(enc);
+	broken.back()[4] ^= 0x10;
+
+	for (size_t i = 0; i < broken.size(); i++) {
+		bool thrown = false;
+		try {
+			Codec::decode(broken[i]);
+		} catch (const PepperException &) {
+			thrown = true;
+		}
+		REQUIRE(thrown);
+	}
+}
+
+} // namespace test_codec
+
+
+#endif // TEST_CODEC_H
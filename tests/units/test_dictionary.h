@@ -0,0 +1,105 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: tests/units/test_dictionary.h
+ * Unit tests for the string dictionaries
+ */
+
+
+#ifndef TEST_DICTIONARY_H
+#define TEST_DICTIONARY_H
+
+
+#include "dictionary.h"
+
+#include "syslib/fs.h"
+
+#include "test_cacheindex.h"
+
+
+namespace test_dictionary
+{
+
+TEST_CASE("dictionary/insert", "Dictionary insertion and lookup")
+{
+	Dictionary dict;
+	REQUIRE(dict.size() == 0);
+	REQUIRE(dict.find("jonas") == Dictionary::None);
+
+	uint32_t id = dict.insert("jonas");
+	REQUIRE(id == 0);
+	REQUIRE(dict.insert("src/main.cpp") == 1);
+	REQUIRE(dict.insert("jonas") == 0);
+	REQUIRE(dict.size() == 2);
+	REQUIRE(dict.find("src/main.cpp") == 1);
+	REQUIRE(dict.at(1) == "src/main.cpp");
+
+	bool thrown = false;
+	try {
+		dict.at(2);
+	} catch (const PepperException &) {
+		thrown = true;
+	}
+	REQUIRE(thrown);
+}
+
+TEST_CASE("dictionary/file", "Cache dictionary file")
+{
+	std::string dir = test_cacheindex::mkdtemp();
+
+	CacheDictionary writer(dir);
+	bool refreshed = writer.refresh();
+	REQUIRE(!refreshed);
+
+	std::vector<std::string> strings;
+	strings.push_back("jonas");
+	strings.push_back("src/main.cpp");
+	strings.push_back("jonas");
+	writer.append(strings);
+	REQUIRE(writer.size() == 2);
+
+	// Strings are picked up by other instances
+	CacheDictionary reader(dir);
+	refreshed = reader.refresh();
+	REQUIRE(refreshed);
+	REQUIRE(reader.size() == 2);
+	REQUIRE(reader.find("src/main.cpp") == 1);
+
+	strings.push_back("README");
+	reader.append(strings);
+	REQUIRE(reader.find("README") == 2);
+	REQUIRE(writer.find("README") == Dictionary::None);
+	refreshed = writer.refresh();
+	REQUIRE(refreshed);
+	REQUIRE(writer.at(2) == "README");
+
+	// Incomplete strings at the end of the file are ignored and
+	// overwritten by the next writer
+	FILE *f = fopen((dir + "/strings").c_str(), "ab");
+	REQUIRE(f != NULL);
+	fwrite("partial", 1, 7, f);
+	fclose(f);
+	refreshed = reader.refresh();
+	REQUIRE(!refreshed);
+	strings.clear();
+	strings.push_back("Makefile");
+	reader.append(strings);
+	REQUIRE(reader.find("Makefile") == 3);
+
+	CacheDictionary fresh(dir);
+	fresh.refresh();
+	REQUIRE(fresh.size() == 4);
+	REQUIRE(fresh.at(3) == "Makefile");
+
+	sys::fs::unlinkr(dir);
+}
+
+} // namespace test_dictionary
+
+
+#endif // TEST_DICTIONARY_H
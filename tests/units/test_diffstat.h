@@ -0,0 +1,149 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: tests/units/test_diffstat.h
+ * Unit tests for the serialization of diffstats and revisions
+ */
+
+
+#ifndef TEST_DIFFSTAT_H
+#define TEST_DIFFSTAT_H
+
+
+#include "bstream.h"
+#include "dictionary.h"
+#include "diffstat.h"
+#include "revision.h"
+
+
+namespace test_diffstat
+{
+
+// Returns a diffstat with similar paths and counters of various sizes
+DiffstatPtr mkstat()
+{
+	DiffstatPtr stat = std::make_shared<Diffstat>();
+	const char *paths[] = {"src/a.cpp", "src/a.h", "src/ab/c.cpp", "src/b.cpp", "tests/x"};
+	for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+		Diffstat::Stat s;
+		s.cadd = i * 1000;
+		s.ladd = i;
+		s.cdel = (i == 3 ? 0x100000000ULL : 0);
+		s.ldel = 2;
+		stat->m_stats[paths[i]] = s;
+	}
+	return stat;
+}
+
+// Compares the paths and counters of two diffstats
+bool equal(const Diffstat &a, const Diffstat &b)
+{
+	if (a.m_stats.size() != b.m_stats.size()) {
+		return false;
+	}
+	std::map<std::string, Diffstat::Stat>::const_iterator it = a.m_stats.begin(), jt = b.m_stats.begin();
+	for (; it != a.m_stats.end(); ++it, ++jt) {
+		if (it->first != jt->first || it->second.cadd != jt->second.cadd || it->second.ladd != jt->second.ladd
+				|| it->second.cdel != jt->second.cdel || it->second.ldel != jt->second.ldel) {
+			return false;
+		}
+	}
+	return true;
+}
+
+TEST_CASE("diffstat/formats", "Fixed and compact diffstats")
+{
+	DiffstatPtr stat = mkstat();
+	Dictionary dict;
+	dict.insert("author");
+	dict.insert("tests/x");
+	std::map<std::string, Diffstat::Stat> stats = stat->stats();
+	for (std::map<std::string, Diffstat::Stat>::const_iterator it = stats.begin(); it != stats.end(); ++it) {
+		dict.insert(it->first);
+	}
+
+	size_t sizes[2][2];
+	for (int f = 0; f < 2; f++) {
+		Diffstat::Format format = (f == 0 ? Diffstat::Fixed : Diffstat::Compact);
+		MOStream out, dout;
+		stat->write(out, format);
+		stat->write(dout, dict, format);
+		std::vector<char> data = out.data(), ddata = dout.data();
+		sizes[f][0] = data.size();
+		sizes[f][1] = ddata.size();
+
+		Diffstat loaded, dloaded;
+		VIStream in(data), din(ddata);
+		bool ok = loaded.load(in, format);
+		REQUIRE(ok);
+		REQUIRE(equal(*stat, loaded));
+		ok = dloaded.load(din, dict, format);
+		REQUIRE(ok);
+		REQUIRE(equal(*stat, dloaded));
+	}
+	REQUIRE(sizes[1][0] < sizes[0][0] / 2);
+	REQUIRE(sizes[1][1] < sizes[0][1] / 2);
+
+	// Invalid IDs and prefix lengths are rejected
+	Dictionary small;
+	small.insert("author");
+	MOStream dout;
+	stat->write(dout, dict, Diffstat::Compact);
+	std::vector<char> ddata = dout.data();
+	VIStream din(ddata);
+	Diffstat invalid;
+	bool ok = invalid.load(din, small, Diffstat::Compact);
+	REQUIRE(!ok);
+
+	MOStream pout;
+	pout.writeVarint(1).writeVarint(3) << std::string("abc");
+	std::vector<char> pdata = pout.data();
+	VIStream pin(pdata);
+	ok = invalid.load(pin, Diffstat::Compact);
+	REQUIRE(!ok);
+}
+
+TEST_CASE("diffstat/revision", "Revisions of older versions can be loaded")
+{
+	Dictionary dict;
+	dict.insert("someone");
+	std::map<std::string, Diffstat::Stat> stats = mkstat()->stats();
+	for (std::map<std::string, Diffstat::Stat>::const_iterator it = stats.begin(); it != stats.end(); ++it) {
+		dict.insert(it->first);
+	}
+	Revision rev("1", -86400, "someone", "message", mkstat());
+
+	// Version 2 with fixed-width integers
+	MOStream v2out;
+	v2out << 'R' << char(2) << (int64_t)-86400 << (uint32_t)0 << std::string("message");
+	rev.diffstat()->write(v2out, dict);
+	v2out << 'V';
+
+	MOStream v3out;
+	rev.write(v3out, dict);
+	std::vector<char> v2 = v2out.data(), v3 = v3out.data();
+	REQUIRE(v3.size() < v2.size());
+	REQUIRE(v3[1] == 3);
+
+	std::vector<char> *versions[] = {&v2, &v3};
+	for (int i = 0; i < 2; i++) {
+		Revision loaded("1");
+		VIStream in(*versions[i]);
+		bool ok = loaded.load(in, dict);
+		REQUIRE(ok);
+		REQUIRE(loaded.date() == -86400);
+		REQUIRE(loaded.author() == "someone");
+		REQUIRE(loaded.message() == "message");
+		REQUIRE(equal(*rev.diffstat(), *loaded.diffstat()));
+	}
+}
+
+} // namespace test_diffstat
+
+
+#endif // TEST_DIFFSTAT_H
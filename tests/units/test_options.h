@@ -159,6 +159,34 @@ TEST_CASE("options/cmdlines", "Command line parsing")
 	rhelp2.options["help"] = "true";
 	tests.push_back(rhelp2);
 
+	data_t memory(defaults);
+	memory.setupArgs(4, "--cache-memory=16", "--cache-size=512", "loc", "/tmp/repo");
+	memory.options["cache_memory"] = "16";
+	memory.options["cache_size"] = "512";
+	memory.options["report"] = "loc";
+	memory.options["repository"] = "/tmp/repo";
+	tests.push_back(memory);
+
+	data_t warm(defaults);
+	warm.setupArgs(5, "-bgit", "--warm-cache", "/tmp/repo", "master", "next");
+	warm.options["backend"] = "git";
+	warm.options["warm_cache"] = "true";
+	warm.options["repository"] = "/tmp/repo";
+	tests.push_back(warm);
+
+	data_t archive(defaults);
+	archive.setupArgs(4, "--export-cache", "cache.pca", "--import-cache=-", "/tmp/repo");
+	archive.options["export_cache"] = "cache.pca";
+	archive.options["import_cache"] = "-";
+	archive.options["repository"] = "/tmp/repo";
+	tests.push_back(archive);
+
+	data_t merge(defaults);
+	merge.setupArgs(5, "--merge-cache", "-q", "/tmp/repo", "/tmp/shard1", "/tmp/shard2");
+	merge.options["merge_cache"] = "true";
+	merge.options["repository"] = "/tmp/repo";
+	tests.push_back(merge);
+
 	// Run tests
 	for (std::vector<data_t>::size_type i = 0;  i < tests.size(); i++) {
 		Options opts;
@@ -167,6 +195,29 @@ TEST_CASE("options/cmdlines", "Command line parsing")
 		REQUIRE(opts.m_options == tests[i].options);
 		REQUIRE(opts.m_reportOptions == tests[i].reportOptions);
 	}
+
+	Options memopts;
+	memopts.parse(memory.nargs, memory.args);
+	REQUIRE(memopts.cacheMemory() == 16 * 1024 * 1024);
+	REQUIRE(memopts.cacheSize() == 512 * 1024 * 1024);
+
+	Options opts;
+	opts.parse(warm.nargs, warm.args);
+	std::vector<std::string> branches = opts.warmCacheBranches();
+	REQUIRE(branches.size() == 2);
+	REQUIRE(branches[1] == "next");
+
+	Options mopts;
+	mopts.parse(merge.nargs, merge.args);
+	std::vector<std::string> dirs = mopts.mergeCacheDirs();
+	REQUIRE(dirs.size() == 2);
+	REQUIRE(dirs[0] == "/tmp/shard1");
+	REQUIRE(mopts.warmCacheBranches().empty());
+
+	Options wmopts;
+	data_t warmMerge(defaults);
+	warmMerge.setupArgs(4, "--warm-cache", "--merge-cache", "/tmp/repo", "/tmp/shard1");
+	REQUIRE_THROWS(wmopts.parse(warmMerge.nargs, warmMerge.args));
 }
 
 } // namespace test_options
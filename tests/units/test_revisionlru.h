@@ -0,0 +1,118 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: tests/units/test_revisionlru.h
+ * Unit tests for the LRU of decoded revisions
+ */
+
+
+#ifndef TEST_REVISIONLRU_H
+#define TEST_REVISIONLRU_H
+
+
+#include "revision.h"
+#include "revisionlru.h"
+#include "strlib.h"
+
+
+namespace test_revisionlru
+{
+
+// Counts how often the message and diffstat are loaded
+struct CountingLoader : public Revision::Loader
+{
+	CountingLoader(int *loads) : loads(loads) { }
+
+	std::string message() { ++*loads; return std::string(1000, 'm'); }
+	DiffstatPtr diffstat() { ++*loads; return std::make_shared<Diffstat>(); }
+
+	int *loads;
+};
+
+TEST_CASE("revisionlru/hits", "Lookups and counters")
+{
+	std::shared_ptr<RevisionLru> lru = std::make_shared<RevisionLru>(1024 * 1024);
+	Revision *rev = lru->get("1");
+	REQUIRE(rev == NULL);
+
+	rev = lru->put(new Revision("1", 42, "author", "message", std::make_shared<Diffstat>()));
+	REQUIRE(rev->id() == "1");
+	REQUIRE(rev->message() == "message");
+	delete rev;
+
+	rev = lru->get("1");
+	REQUIRE(rev != NULL);
+	REQUIRE(rev->date() == 42);
+	REQUIRE(rev->author() == "author");
+	REQUIRE(rev->message() == "message");
+	delete rev;
+
+	REQUIRE(lru->hits() == 1);
+	REQUIRE(lru->misses() == 1);
+	REQUIRE(lru->count() == 1);
+	REQUIRE(lru->contains("1"));
+	REQUIRE(!lru->contains("2"));
+}
+
+TEST_CASE("revisionlru/shared", "Data is loaded once and shared")
+{
+	std::shared_ptr<RevisionLru> lru = std::make_shared<RevisionLru>(1024 * 1024);
+	int loads = 0;
+	delete lru->put(new Revision("1", 0, "author", new CountingLoader(&loads)));
+	size_t size = lru->size();
+	REQUIRE(loads == 0);
+
+	Revision *a = lru->get("1");
+	Revision *b = lru->get("1");
+	REQUIRE(a->message() == b->message());
+	REQUIRE(a->diffstat().get() == b->diffstat().get());
+	REQUIRE(lru->diffstat("1").get() == a->diffstat().get());
+	REQUIRE(loads == 2);
+	delete a;
+	delete b;
+
+	// The loaded message is accounted for
+	REQUIRE(lru->size() >= size + 1000);
+}
+
+TEST_CASE("revisionlru/budget", "Least recently used revisions are evicted")
+{
+	Revision probe("0", 0, "author", std::string(1000, 'm'), std::make_shared<Diffstat>());
+	size_t size = probe.memoryUsage();
+	std::shared_ptr<RevisionLru> lru = std::make_shared<RevisionLru>(10 * size);
+
+	for (int i = 0; i < 10; i++) {
+		delete lru->put(new Revision(str::itos(i), 0, "author", std::string(1000, 'm'), std::make_shared<Diffstat>()));
+	}
+	delete lru->get("0");
+	for (int i = 10; i < 15; i++) {
+		delete lru->put(new Revision(str::itos(i), 0, "author", std::string(1000, 'm'), std::make_shared<Diffstat>()));
+	}
+
+	REQUIRE(lru->size() <= lru->budget());
+	REQUIRE(lru->count() < 15);
+	REQUIRE(lru->contains("0"));
+	REQUIRE(lru->contains("14"));
+	REQUIRE(!lru->contains("1"));
+
+	// Revisions remain valid after eviction
+	Revision *rev = lru->put(new Revision("big", 0, "author", std::string(20 * size, 'm'), std::make_shared<Diffstat>()));
+	REQUIRE(!lru->contains("big"));
+	REQUIRE(rev->message().length() == 20 * size);
+	delete rev;
+
+	// A budget of zero disables caching
+	lru = std::make_shared<RevisionLru>(0);
+	delete lru->put(new Revision("1", 0, "author", "message", std::make_shared<Diffstat>()));
+	REQUIRE(lru->count() == 0);
+}
+
+} // namespace test_revisionlru
+
+
+#endif // TEST_REVISIONLRU_H
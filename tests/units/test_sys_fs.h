@@ -75,6 +75,32 @@ TEST_CASE("sys_fs/dirname", "sys::fs::dirname()")
 	}
 }
 
+TEST_CASE("sys_fs/mappedfile", "sys::fs::MappedFile")
+{
+	std::string path;
+	FILE *f = sys::fs::mkstemp(&path);
+	REQUIRE(f != NULL);
+
+	sys::fs::MappedFile empty(path);
+	REQUIRE(empty.size() == 0);
+	REQUIRE(empty.data() == NULL);
+
+	std::string data("pepper");
+	fwrite(data.data(), 1, data.length(), f);
+	fflush(f);
+	empty.remap();
+	REQUIRE(empty.size() == data.length());
+	REQUIRE(std::string(empty.data(), empty.size()) == data);
+
+	fwrite(data.data(), 1, data.length(), f);
+	fclose(f);
+	sys::fs::MappedFile mf(path);
+	REQUIRE(mf.size() == 2 * data.length());
+	REQUIRE(std::string(mf.data(), mf.size()) == data + data);
+
+	sys::fs::unlink(path);
+}
+
 } // namespace test_sys_fs
 
 #endif // TEST_SYS_FS_H